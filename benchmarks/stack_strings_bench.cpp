@@ -0,0 +1,150 @@
+/**
+ * @file stack_strings_bench.cpp
+ * @brief Stack String Microbenchmark
+ * 
+ * Compares the per-use latency of the two string hiding schemes:
+ * building the literal on the stack from XORed immediates (what the
+ * stack-strings pass emits) against loading an encrypted global and
+ * decrypting it with a byte loop (the string-encryption approach).
+ * 
+ * Build: g++ -std=c++17 -O2 stack_strings_bench.cpp -o stack_strings_bench
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+
+namespace {
+
+constexpr uint64_t kKey = 0x5a17c3e9b2d48f61ULL;
+constexpr unsigned kIterations = 20000000;
+
+static constexpr char kString8[] = "status:";
+static constexpr char kString16[] = "connection lost";
+static constexpr char kString32[] = "failed to open configuration f";
+static constexpr char kString64[] = "license check failed: please contact your vendor for a new key";
+
+/**
+ * @brief Hide a value from the optimizer without touching memory
+ * @param value Value to hide
+ * @return value, unknown to the compiler
+ */
+inline uint64_t opaque(uint64_t value) {
+    asm("" : "+r"(value));
+    return value;
+}
+
+/**
+ * @brief Get an encrypted 8-byte chunk of a literal at compile time
+ * @param s Literal
+ * @param i Chunk index
+ * @return Little-endian chunk XORed with kKey
+ */
+template <size_t N>
+constexpr uint64_t encryptedChunk(const char (&s)[N], size_t i) {
+    uint64_t value = 0;
+    for (size_t b = 0; b < 8 && i * 8 + b < N; b++) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(s[i * 8 + b])) << (8 * b);
+    }
+    return value ^ kKey;
+}
+
+/**
+ * @struct EncryptedGlobal
+ * @brief Byte-wise encrypted copy of a literal, as string-encryption stores it
+ */
+template <size_t N>
+struct EncryptedGlobal {
+    uint8_t bytes[N] = {};
+    
+    constexpr explicit EncryptedGlobal(const char (&s)[N]) {
+        for (size_t i = 0; i < N; i++) {
+            bytes[i] = static_cast<uint8_t>(s[i]) ^ static_cast<uint8_t>(kKey);
+        }
+    }
+};
+
+/**
+ * @brief Consume a string so the construction cannot be dropped
+ * @param s String to consume
+ * @return Length of the string
+ */
+__attribute__((noinline)) size_t consume(const char *s) {
+    size_t length = 0;
+    while (s[length]) {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * @brief Build a literal on the stack from immediates, one store per chunk
+ */
+template <const auto &S, size_t... I>
+size_t useStackString(std::index_sequence<I...>) {
+    alignas(16) uint64_t slot[sizeof...(I)];
+    uint64_t key = opaque(kKey);
+    ((slot[I] = std::integral_constant<uint64_t, encryptedChunk(S, I)>::value ^ key), ...);
+    return consume(reinterpret_cast<const char *>(slot));
+}
+
+/**
+ * @brief Decrypt an encrypted global into a stack buffer, byte by byte
+ */
+template <size_t N>
+size_t useEncryptedGlobal(const EncryptedGlobal<N> &global) {
+    char buffer[N];
+    uint8_t key = static_cast<uint8_t>(opaque(kKey));
+    for (size_t i = 0; i < N; i++) {
+        buffer[i] = static_cast<char>(global.bytes[i] ^ key);
+    }
+    return consume(buffer);
+}
+
+/**
+ * @brief Time a string use and print nanoseconds per use
+ * @param label Row label
+ * @param use Callable performing one use
+ * @return Nanoseconds per use
+ */
+template <typename Use>
+double measure(const char *label, Use use) {
+    size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kIterations; i++) {
+        sink += use();
+    }
+    auto end = std::chrono::steady_clock::now();
+    
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / kIterations;
+    printf("  %-16s %8.2f ns/use  (checksum %zu)\n", label, ns, sink);
+    return ns;
+}
+
+/**
+ * @brief Compare both schemes for one literal
+ */
+template <const auto &S>
+void compare(const char *name) {
+    constexpr size_t size = sizeof(S);
+    static const EncryptedGlobal<size> global(S);
+    
+    printf("%s (%zu bytes, %zu stack bytes):\n", name, size, (size + 7) / 8 * 8);
+    double stack = measure("stack string", [] {
+        return useStackString<S>(std::make_index_sequence<(size + 7) / 8>());
+    });
+    double decrypt = measure("global+decrypt", [] { return useEncryptedGlobal(global); });
+    printf("  speedup          %8.2fx\n", decrypt / stack);
+}
+
+} // anonymous namespace
+
+int main() {
+    compare<kString8>("8-byte literal");
+    compare<kString16>("16-byte literal");
+    compare<kString32>("32-byte literal");
+    compare<kString64>("64-byte literal");
+    return 0;
+}
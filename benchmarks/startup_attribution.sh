@@ -0,0 +1,67 @@
+#!/bin/bash
+# Startup attribution for obfuscated executables
+#
+# Builds a C program plain, with the default pipeline and once per
+# obfuscation pass (that pass alone), then measures every build with
+# startup_bench and its probe. The "vs first" column of a build is
+# what its passes add to the plain program's exec->main, exec->exit,
+# page faults and resident set.
+#
+# Usage: benchmarks/startup_attribution.sh [-n runs] [program.c [pass ...]]
+#   program.c defaults to examples/simple_program.c, the passes to all
+#   of those obfuscator -list-passes prints
+#
+# Environment:
+#   CC           compiler emitting the bitcode and linking (default clang)
+#   CFLAGS       flags for both (default -O2)
+#   INSTALL_DIR  what build_ollvm16.sh installed (default install/)
+#   WORK_DIR     keep the builds there (default a temporary directory)
+
+set -e
+
+PROJECT_ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+INSTALL_DIR="${INSTALL_DIR:-${PROJECT_ROOT}/install}"
+CC="${CC:-clang}"
+CFLAGS="${CFLAGS:--O2}"
+RUNS=200
+
+if [ "$1" = "-n" ]; then
+    RUNS="$2"
+    shift 2
+fi
+PROGRAM="${1:-${PROJECT_ROOT}/examples/simple_program.c}"
+[ $# -gt 0 ] && shift
+PASSES=("$@")
+if [ ${#PASSES[@]} -eq 0 ]; then
+    mapfile -t PASSES < <("${INSTALL_DIR}/bin/obfuscator" -list-passes)
+fi
+
+if [ -z "${WORK_DIR}" ]; then
+    WORK_DIR="$(mktemp -d)"
+    trap 'rm -rf "${WORK_DIR}"' EXIT
+fi
+mkdir -p "${WORK_DIR}"
+
+NAME="$(basename "${PROGRAM}" .c)"
+PLAIN="${WORK_DIR}/${NAME}"
+"${CC}" ${CFLAGS} -c -emit-llvm "${PROGRAM}" -o "${PLAIN}.bc"
+"${CC}" ${CFLAGS} "${PLAIN}.bc" -o "${PLAIN}"
+COMMANDS=("${PLAIN}")
+
+# Obfuscate the plain bitcode and link it with the runtime
+#   $1 name of the build, the rest obfuscator options
+build_variant() {
+    local variant="${PLAIN}.$1"
+    shift
+    "${INSTALL_DIR}/bin/obfuscator" "${PLAIN}.bc" -o "${variant}.bc" "$@" || return 1
+    "${CC}" ${CFLAGS} "${variant}.bc" -o "${variant}" \
+        -L"${INSTALL_DIR}/lib" -lobfuscation_rt -lpthread || return 1
+    COMMANDS+=("${variant}")
+}
+
+build_variant all
+for pass in "${PASSES[@]}"; do
+    build_variant "${pass}" -passes="${pass}" || echo "startup_attribution: skipping ${pass}, build failed" >&2
+done
+
+"${INSTALL_DIR}/bin/startup_bench" -n "${RUNS}" -p "${INSTALL_DIR}/lib/libstartup_probe.so" "${COMMANDS[@]}"
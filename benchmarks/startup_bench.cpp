@@ -0,0 +1,479 @@
+/**
+ * @file startup_bench.cpp
+ * @brief Startup Benchmark
+ * 
+ * Measures the fixed cost of one start of a program: each command is
+ * started many times and every run is measured from its exec. Comparing
+ * the statically linked obfuscator with opt loading libobfuscator.so
+ * shows what the build pays per file for dlopen, relocation and pass
+ * registration; comparing an obfuscated build of a program with the
+ * original shows what obfuscation costs a short-lived program before
+ * and while it runs (startup_attribution.sh builds one per pass).
+ * 
+ * Per run:
+ *   exec->main    exec to the program's main, all constructors run
+ *   exec->exit    exec to the harness seeing the exit
+ *   task clock    CPU time of the process and its children
+ *   page faults   after exec, minor and major
+ *   faults->main  the ones taken up to main, the exec's included
+ *   major faults  the ones that read from disk
+ *   peak rss      ru_maxrss
+ *   main rss      resident set on entering main
+ *   exit rss      resident set once the work is done, at exit
+ * Task clock and page faults come from perf_event_open, counting from
+ * the exec; where perf events are not permitted, from the rusage wait4
+ * returns, less what the child used before its exec. exec->main, faults->main and
+ * the resident sets at main and exit need the probe,
+ * libstartup_probe.so (see startup_probe.c), given with -p; without
+ * it, or for statically linked programs, they are not reported.
+ * 
+ * Build: g++ -std=c++17 -O2 startup_bench.cpp -o startup_bench
+ * 
+ * Usage: startup_bench [-n runs] [-p libstartup_probe.so] "command args..." ...
+ *   e.g. startup_bench -n 500 "obfuscator /dev/null -o /dev/null"
+ *            "opt -load libobfuscator.so -flattening /dev/null -o /dev/null"
+ *        startup_bench -n 500 -p install/lib/libstartup_probe.so ./app ./app.obf
+ * 
+ * Arguments of a command are split on spaces; there is no quoting.
+ * The command's output is discarded. Each metric is printed with its
+ * median's difference from the first command's.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+
+constexpr unsigned kDefaultRuns = 200;
+constexpr unsigned kWarmupRuns = 5;
+
+/// Descriptor number the probe reports to in the child
+constexpr int kProbeFd = 100;
+
+/**
+ * @brief What is measured per run, in the order printed
+ */
+enum Metric {
+    ExecToMain,
+    ExecToExit,
+    TaskClock,
+    PageFaults,
+    MainFaults,
+    MajorFaults,
+    PeakRss,
+    MainRss,
+    ExitRss,
+    NumMetrics
+};
+
+const char *const kMetricNames[NumMetrics] = {
+    "exec->main ms", "exec->exit ms", "task clock ms", "page faults",
+    "faults->main", "major faults", "peak rss kB", "main rss kB", "exit rss kB"
+};
+
+/**
+ * @struct Sample
+ * @brief Metrics of one run; NaN where a metric was not measured
+ */
+struct Sample {
+    double values[NumMetrics];
+    
+    Sample() {
+        std::fill(values, values + NumMetrics, NAN);
+    }
+};
+
+/**
+ * @struct Summary
+ * @brief Statistics of one metric over the runs of a command
+ */
+struct Summary {
+    double min = NAN;
+    double median = NAN;
+    double p95 = NAN;
+    double mean = NAN;
+};
+
+/**
+ * @struct Command
+ * @brief A command ready to be started
+ */
+struct Command {
+    std::vector<std::string> words;
+    std::vector<std::string> environment;
+    std::vector<char*> argv;
+    std::vector<char*> envp;
+};
+
+/// Whether perf events can be opened on the child; cleared on the first failure
+bool perfAvailable = true;
+
+/**
+ * @brief Read the monotonic clock, as the probe does
+ * @return Nanoseconds since an arbitrary point
+ */
+uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000u + static_cast<uint64_t>(time.tv_nsec);
+}
+
+/**
+ * @brief Split a command line on spaces
+ * @param command Command line
+ * @return Program and arguments
+ */
+std::vector<std::string> splitCommand(const std::string &command) {
+    std::vector<std::string> words;
+    std::istringstream stream(command);
+    std::string word;
+    while (stream >> word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+/**
+ * @brief Prepare the arguments and environment of a command
+ * @param line Command line
+ * @param probe Path of the probe, empty for none
+ * @return The command
+ */
+Command prepareCommand(const std::string &line, const std::string &probe) {
+    Command command;
+    command.words = splitCommand(line);
+    for (char **variable = environ; *variable; variable++) {
+        if (strncmp(*variable, "LD_PRELOAD=", 11) != 0) {
+            command.environment.push_back(*variable);
+        }
+    }
+    if (!probe.empty()) {
+        const char *preload = getenv("LD_PRELOAD");
+        command.environment.push_back("LD_PRELOAD=" + probe + (preload ? ":" + std::string(preload) : ""));
+        command.environment.push_back("STARTUP_PROBE_FD=" + std::to_string(kProbeFd));
+    } else if (const char *preload = getenv("LD_PRELOAD")) {
+        command.environment.push_back("LD_PRELOAD=" + std::string(preload));
+    }
+    
+    for (std::string &word : command.words) {
+        command.argv.push_back(const_cast<char*>(word.c_str()));
+    }
+    command.argv.push_back(nullptr);
+    for (std::string &variable : command.environment) {
+        command.envp.push_back(const_cast<char*>(variable.c_str()));
+    }
+    command.envp.push_back(nullptr);
+    return command;
+}
+
+/**
+ * @brief Open a software counter on a process, enabled at its exec
+ * @param pid Process, stopped before its exec
+ * @param config PERF_COUNT_SW_*
+ * @return Descriptor, or -1
+ */
+int openCounter(pid_t pid, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    long fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        // Unprivileged, count what the process does in user mode only
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return static_cast<int>(fd);
+}
+
+/**
+ * @brief Read a counter and close it
+ * @param fd Descriptor from openCounter
+ * @return Its count, or NaN
+ */
+double readCounter(int fd) {
+    uint64_t count;
+    bool read = ::read(fd, &count, sizeof(count)) == sizeof(count);
+    close(fd);
+    return read ? static_cast<double>(count) : NAN;
+}
+
+/**
+ * @brief Parse what the child and the probe reported
+ * @param fd Read end of the report pipe
+ * @param sample Filled with the metrics the probe reports
+ * @param execFaults Set to the page faults the child took before its exec
+ * @return Time of the exec, 0 if the child did not get to it
+ */
+uint64_t readReports(int fd, Sample &sample, long &execFaults) {
+    std::string text;
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        text.append(buffer, length);
+    }
+    
+    std::istringstream lines(text);
+    std::string line;
+    unsigned long long exec = 0;
+    while (std::getline(lines, line)) {
+        unsigned long long time;
+        unsigned long rss;
+        long minor, major;
+        if (sscanf(line.c_str(), "exec %llu %ld", &time, &execFaults) == 2) {
+            exec = time;
+        } else if (sscanf(line.c_str(), "main %llu %lu %ld %ld", &time, &rss, &minor, &major) == 4 && exec) {
+            sample.values[ExecToMain] = (time - exec) / 1e6;
+            sample.values[MainRss] = rss;
+            sample.values[MainFaults] = minor + major - execFaults;
+        } else if (sscanf(line.c_str(), "exit %llu %lu", &time, &rss) == 2) {
+            sample.values[ExitRss] = rss;
+        }
+    }
+    return exec;
+}
+
+/**
+ * @brief Start a command and wait for it
+ * @param command Prepared command
+ * @param sample Set to the metrics of the run
+ * @return false if it could not be started or failed
+ */
+bool runOnce(Command &command, Sample &sample) {
+    int go[2], reports[2];
+    if (pipe2(go, O_CLOEXEC) < 0) {
+        return false;
+    }
+    if (pipe2(reports, O_CLOEXEC | O_NONBLOCK) < 0) {
+        close(go[0]);
+        close(go[1]);
+        return false;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Wait until the counters are attached, then report the time of the exec
+        char byte;
+        if (read(go[0], &byte, 1) != 1) {
+            _exit(127);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        dup2(reports[1], kProbeFd);
+        fcntl(kProbeFd, F_SETFL, 0);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        char line[64];
+        int length = snprintf(line, sizeof(line), "exec %llu %ld\n", static_cast<unsigned long long>(now()),
+                              usage.ru_minflt + usage.ru_majflt);
+        if (write(kProbeFd, line, length) != length) {
+            _exit(127);
+        }
+        execvpe(command.argv[0], command.argv.data(), command.envp.data());
+        _exit(127);
+    }
+    close(go[0]);
+    close(reports[1]);
+    if (pid < 0) {
+        close(go[1]);
+        close(reports[0]);
+        return false;
+    }
+    
+    int taskClock = -1, pageFaults = -1;
+    if (perfAvailable) {
+        taskClock = openCounter(pid, PERF_COUNT_SW_TASK_CLOCK);
+        pageFaults = openCounter(pid, PERF_COUNT_SW_PAGE_FAULTS);
+        if (taskClock < 0 || pageFaults < 0) {
+            close(taskClock);
+            close(pageFaults);
+            taskClock = pageFaults = -1;
+            fprintf(stderr, "startup_bench: perf events not permitted (%s), using rusage\n",
+                    strerror(errno));
+            perfAvailable = false;
+        }
+    }
+    bool started = write(go[1], "g", 1) == 1;
+    close(go[1]);
+    
+    int status;
+    struct rusage usage;
+    pid_t waited = wait4(pid, &status, 0, &usage);
+    uint64_t exited = now();
+    long execFaults = 0;
+    uint64_t exec = readReports(reports[0], sample, execFaults);
+    close(reports[0]);
+    
+    if (taskClock >= 0) {
+        sample.values[TaskClock] = readCounter(taskClock) / 1e6;
+    }
+    if (pageFaults >= 0) {
+        sample.values[PageFaults] = readCounter(pageFaults);
+    }
+    if (!perfAvailable) {
+        sample.values[TaskClock] = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+                                   (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+        sample.values[PageFaults] = usage.ru_minflt + usage.ru_majflt - execFaults;
+    }
+    sample.values[MajorFaults] = usage.ru_majflt;
+    sample.values[PeakRss] = usage.ru_maxrss;
+    sample.values[ExecToExit] = (exited - exec) / 1e6;
+    return exec && started && waited == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Summarize one metric over the runs
+ * @param samples Runs
+ * @param metric Metric
+ * @return Its statistics; NaN if no run measured it
+ */
+Summary summarize(const std::vector<Sample> &samples, Metric metric) {
+    std::vector<double> values;
+    for (const Sample &sample : samples) {
+        if (!std::isnan(sample.values[metric])) {
+            values.push_back(sample.values[metric]);
+        }
+    }
+    Summary summary;
+    if (values.empty()) {
+        return summary;
+    }
+    std::sort(values.begin(), values.end());
+    summary.min = values.front();
+    summary.median = values[values.size() / 2];
+    summary.p95 = values[std::min(values.size() - 1, values.size() * 95 / 100)];
+    double sum = 0;
+    for (double value : values) {
+        sum += value;
+    }
+    summary.mean = sum / values.size();
+    return summary;
+}
+
+/**
+ * @brief Measure a command over many runs
+ * @param line Command line
+ * @param probe Path of the probe, empty for none
+ * @param runs Measured runs (after a short warm-up)
+ * @param summaries Set to the statistics of each metric
+ * @return false if the command could not be run or failed
+ */
+bool measure(const std::string &line, const std::string &probe, unsigned runs, Summary *summaries) {
+    Command command = prepareCommand(line, probe);
+    if (command.words.empty()) {
+        return false;
+    }
+    
+    // Warm the page cache so every run maps the same files
+    for (unsigned i = 0; i < kWarmupRuns; i++) {
+        Sample sample;
+        if (!runOnce(command, sample)) {
+            return false;
+        }
+    }
+    
+    std::vector<Sample> samples(runs);
+    for (Sample &sample : samples) {
+        if (!runOnce(command, sample)) {
+            return false;
+        }
+    }
+    for (int metric = 0; metric < NumMetrics; metric++) {
+        summaries[metric] = summarize(samples, static_cast<Metric>(metric));
+    }
+    return true;
+}
+
+/**
+ * @brief Print a value, or a dash if it was not measured
+ * @param value Value
+ * @param sign Print the sign, for differences
+ */
+void printValue(double value, bool sign = false) {
+    if (std::isnan(value)) {
+        printf(" %10s", "-");
+    } else {
+        printf(sign ? " %+10.2f" : " %10.2f", value);
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    unsigned runs = kDefaultRuns;
+    std::string probe;
+    std::vector<std::string> commands;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            probe = argv[++i];
+        } else {
+            commands.push_back(argv[i]);
+        }
+    }
+    if (commands.empty()) {
+        fprintf(stderr, "usage: startup_bench [-n runs] [-p libstartup_probe.so] \"command args...\" ...\n");
+        return 1;
+    }
+    if (!probe.empty() && access(probe.c_str(), R_OK) != 0) {
+        fprintf(stderr, "startup_bench: cannot read probe '%s'\n", probe.c_str());
+        return 1;
+    }
+    if (!probe.empty() && probe.find('/') == std::string::npos) {
+        probe = "./" + probe;
+    }
+    
+    printf("%u runs per command, measured from exec\n", runs);
+    Summary baseline[NumMetrics];
+    for (size_t i = 0; i < commands.size(); i++) {
+        Summary summaries[NumMetrics];
+        if (!measure(commands[i], probe, runs, summaries)) {
+            fprintf(stderr, "startup_bench: '%s' could not be run or failed\n", commands[i].c_str());
+            return 1;
+        }
+        if (i == 0) {
+            std::copy(summaries, summaries + NumMetrics, baseline);
+        }
+        
+        printf("\n%s\n", commands[i].c_str());
+        printf("  %-14s %10s %10s %10s %10s %10s\n", "", "min", "median", "p95", "mean",
+               i == 0 ? "" : "vs first");
+        for (int metric = 0; metric < NumMetrics; metric++) {
+            const Summary &summary = summaries[metric];
+            printf("  %-14s", kMetricNames[metric]);
+            printValue(summary.min);
+            printValue(summary.median);
+            printValue(summary.p95);
+            printValue(summary.mean);
+            if (i != 0) {
+                printValue(summary.median - baseline[metric].median, true);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file startup_probe.c
+ * @brief Startup Probe for startup_bench
+ * 
+ * Preloaded into the programs startup_bench measures (LD_PRELOAD), so
+ * the obfuscated and the original build are measured unmodified. It
+ * wraps __libc_start_main and hands it a main that first reports the
+ * time, every constructor of the program having run, and the resident
+ * set at that point; an atexit handler reports the resident set again
+ * once the program's work is done. Reports go to the descriptor
+ * startup_bench passes in STARTUP_PROBE_FD, one line each:
+ *   main <monotonic ns> <rss kB> <minor faults> <major faults>
+ *   exit <monotonic ns> <rss kB>
+ * 
+ * The probe removes itself from the environment, so programs the
+ * measured one starts are not reported. Statically linked programs
+ * cannot be preloaded into; they are measured from outside only.
+ * 
+ * Build: gcc -O2 -shared -fPIC startup_probe.c -o libstartup_probe.so -ldl
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef int (*MainFunction)(int, char **, char **);
+typedef int (*StartMainFunction)(MainFunction, int, char **, void (*)(void), void (*)(void),
+                                 void (*)(void), void *);
+
+/// Descriptor the reports go to, -1 when not run by startup_bench
+static int reportFd = -1;
+
+/// The program's own main
+static MainFunction programMain;
+
+/**
+ * @brief Read the monotonic clock, as startup_bench does
+ * @return Nanoseconds since an arbitrary point
+ */
+static uint64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/**
+ * @brief Read the resident set of the process
+ * @return Resident set in kB, 0 if /proc is not mounted
+ */
+static unsigned long residentKilobytes(void) {
+    char buffer[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    unsigned long size, resident;
+    if (sscanf(buffer, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return resident * (unsigned long)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/**
+ * @brief Write one report line in a single write
+ * @param line Report line
+ * @param length Its length
+ */
+static void report(const char *line, int length) {
+    if (length > 0 && write(reportFd, line, (size_t)length) < 0) {
+        reportFd = -1;
+    }
+}
+
+/**
+ * @brief Report the resident set once the program's work is done
+ */
+static void reportExit(void) {
+    char line[96];
+    report(line, snprintf(line, sizeof(line), "exit %llu %lu\n", (unsigned long long)now(),
+                          residentKilobytes()));
+}
+
+/**
+ * @brief Report reaching main, then run the program's main
+ */
+static int probedMain(int argc, char **argv, char **envp) {
+    uint64_t time = now();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char line[128];
+    report(line, snprintf(line, sizeof(line), "main %llu %lu %ld %ld\n", (unsigned long long)time,
+                          residentKilobytes(), usage.ru_minflt, usage.ru_majflt));
+    atexit(reportExit);
+    return programMain(argc, argv, envp);
+}
+
+/**
+ * @brief Start the program through probedMain when run by startup_bench
+ */
+int __libc_start_main(MainFunction main, int argc, char **argv, void (*init)(void),
+                      void (*fini)(void), void (*rtldFini)(void), void *stackEnd) {
+    StartMainFunction start = (StartMainFunction)dlsym(RTLD_NEXT, "__libc_start_main");
+    const char *fd = getenv("STARTUP_PROBE_FD");
+    if (fd) {
+        reportFd = atoi(fd);
+        fcntl(reportFd, F_SETFD, FD_CLOEXEC);
+        unsetenv("STARTUP_PROBE_FD");
+        unsetenv("LD_PRELOAD");
+        programMain = main;
+        main = probedMain;
+    }
+    return start(main, argc, argv, init, fini, rtldFini, stackEnd);
+}
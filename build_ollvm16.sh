@@ -1,6 +1,18 @@
 #!/bin/bash
 # Build script for LLVM Obfuscator with LLVM 16
 # Usage: ./build_ollvm16.sh [clean|debug|release]
+#
+# Options for the obfuscator tool (environment variables):
+#   STATIC_TOOLS=1      link it fully statically against LLVM's static libraries
+#   TOOL_PGO=generate   instrument the passes and tools; run install/bin/obfuscator
+#                       on representative bitcode, then rebuild with
+#   TOOL_PGO=use        optimize with the profile collected in build/pgo
+#   TOOL_BOLT=1         optimize its layout with llvm-bolt, trained on the
+#                       bitcode in TOOL_TRAINING_INPUTS (a glob, e.g. "corpus/*.bc")
+#
+# Options for all native tools:
+#   PROFILE_ALLOCATIONS=1  replace operator new/delete so -obfuscation-profile
+#                          counts heap allocations; profiling builds only
 
 set -e  # Exit on any error
 
@@ -9,6 +21,7 @@ LLVM_VERSION="16"
 BUILD_TYPE="${1:-release}"
 PROJECT_ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 BUILD_DIR="${PROJECT_ROOT}/build"
+PGO_DIR="${BUILD_DIR}/pgo"
 SRC_DIR="${PROJECT_ROOT}/src"
 INCLUDE_DIR="${PROJECT_ROOT}/include"
 
@@ -48,6 +61,7 @@ check_llvm() {
         LLVM_CPPFLAGS=$(llvm-config --cppflags)
         LLVM_LDFLAGS=$(llvm-config --ldflags)
         LLVM_LIBS=$(llvm-config --libs core support)
+        LLVM_TOOL_LIBS=$(llvm-config --libs all)
         
         print_info "LLVM found at: $LLVM_PREFIX"
     else
@@ -58,6 +72,32 @@ check_llvm() {
     fi
 }
 
+# Select profile-guided optimization flags (TOOL_PGO)
+configure_pgo() {
+    PGO_FLAGS=""
+    case "${TOOL_PGO}" in
+        "")
+            ;;
+        generate)
+            print_info "Instrumenting for PGO; profiles go to ${PGO_DIR}"
+            mkdir -p "${PGO_DIR}"
+            PGO_FLAGS="-fprofile-generate=${PGO_DIR} -fprofile-update=atomic"
+            ;;
+        use)
+            if [ ! -d "${PGO_DIR}" ]; then
+                print_error "No profile in ${PGO_DIR}; build with TOOL_PGO=generate and train first"
+                exit 1
+            fi
+            print_info "Optimizing with the PGO profile in ${PGO_DIR}"
+            PGO_FLAGS="-fprofile-use=${PGO_DIR} -fprofile-partial-training -Wno-missing-profile"
+            ;;
+        *)
+            print_error "TOOL_PGO must be 'generate' or 'use'"
+            exit 1
+            ;;
+    esac
+}
+
 # Clean build directory
 clean_build() {
     print_info "Cleaning build directory..."
@@ -71,6 +111,8 @@ create_dirs() {
     mkdir -p "${BUILD_DIR}/passes"
     mkdir -p "${BUILD_DIR}/utils"
     mkdir -p "${BUILD_DIR}/lib"
+    mkdir -p "${BUILD_DIR}/tools"
+    mkdir -p "${BUILD_DIR}/bin"
 }
 
 # Build LLVM passes
@@ -78,7 +120,7 @@ build_passes() {
     print_info "Building LLVM passes..."
     
     # Compiler flags
-    CXX_FLAGS="-std=c++17 -fPIC -O2"
+    CXX_FLAGS="-std=c++17 -fPIC -O2 ${PGO_FLAGS}"
     if [ "$BUILD_TYPE" = "debug" ]; then
         CXX_FLAGS="-std=c++17 -fPIC -g -O0 -DDEBUG"
     fi
@@ -86,6 +128,20 @@ build_passes() {
     # Include directories
     INCLUDE_FLAGS="-I${INCLUDE_DIR} -I${INCLUDE_DIR}/passes -I${INCLUDE_DIR}/utils"
     
+    # Pass Base
+    if [ -f "${SRC_DIR}/passes/obfuscation_pass.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/obfuscation_pass.cpp" \
+            -o "${BUILD_DIR}/passes/obfuscation_pass.o"
+    fi
+    
+    # New pass manager plugin entry point
+    if [ -f "${SRC_DIR}/passes/pass_plugin.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/pass_plugin.cpp" \
+            -o "${BUILD_DIR}/passes/pass_plugin.o"
+    fi
+    
     # Build control flow passes
     print_info "Building control flow obfuscation passes..."
     
@@ -103,6 +159,13 @@ build_passes() {
             -o "${BUILD_DIR}/passes/flattening.o"
     fi
     
+    # Block Splitting Pass
+    if [ -f "${SRC_DIR}/passes/control_flow/block_splitting.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/control_flow/block_splitting.cpp" \
+            -o "${BUILD_DIR}/passes/block_splitting.o"
+    fi
+    
     # Build data obfuscation passes
     print_info "Building data obfuscation passes..."
     
@@ -120,6 +183,27 @@ build_passes() {
             -o "${BUILD_DIR}/passes/variable_substitution.o"
     fi
     
+    # Stack Strings Pass
+    if [ -f "${SRC_DIR}/passes/data/stack_strings.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/data/stack_strings.cpp" \
+            -o "${BUILD_DIR}/passes/stack_strings.o"
+    fi
+    
+    # Struct Layout Pass
+    if [ -f "${SRC_DIR}/passes/data/struct_layout.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/data/struct_layout.cpp" \
+            -o "${BUILD_DIR}/passes/struct_layout.o"
+    fi
+    
+    # Pointer Encoding Pass
+    if [ -f "${SRC_DIR}/passes/data/pointer_encoding.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/data/pointer_encoding.cpp" \
+            -o "${BUILD_DIR}/passes/pointer_encoding.o"
+    fi
+    
     # Build instruction obfuscation passes
     print_info "Building instruction obfuscation passes..."
     
@@ -136,13 +220,20 @@ build_passes() {
             -c "${SRC_DIR}/passes/instruction/opaque_predicates.cpp" \
             -o "${BUILD_DIR}/passes/opaque_predicates.o"
     fi
+    
+    # Machine Instruction Substitution Pass (x86-64 codegen)
+    if [ -f "${SRC_DIR}/passes/instruction/machine_substitution.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/passes/instruction/machine_substitution.cpp" \
+            -o "${BUILD_DIR}/passes/machine_substitution.o"
+    fi
 }
 
 # Build utility libraries
 build_utils() {
     print_info "Building utility libraries..."
     
-    CXX_FLAGS="-std=c++17 -fPIC -O2"
+    CXX_FLAGS="-std=c++17 -fPIC -O2 ${PGO_FLAGS}"
     if [ "$BUILD_TYPE" = "debug" ]; then
         CXX_FLAGS="-std=c++17 -fPIC -g -O0 -DDEBUG"
     fi
@@ -162,14 +253,236 @@ build_utils() {
             -c "${SRC_DIR}/utils/config_parser.cpp" \
             -o "${BUILD_DIR}/utils/config_parser.o"
     fi
+    
+    # Pass Pipeline
+    if [ -f "${SRC_DIR}/utils/pass_pipeline.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/pass_pipeline.cpp" \
+            -o "${BUILD_DIR}/utils/pass_pipeline.o"
+    fi
+    
+    # Pipeline Verifier
+    if [ -f "${SRC_DIR}/utils/pipeline_verifier.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/pipeline_verifier.cpp" \
+            -o "${BUILD_DIR}/utils/pipeline_verifier.o"
+    fi
+    
+    # Code Generation Utilities
+    if [ -f "${SRC_DIR}/utils/codegen_utils.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/codegen_utils.cpp" \
+            -o "${BUILD_DIR}/utils/codegen_utils.o"
+    fi
+    
+    # Struct Escape Analysis
+    if [ -f "${SRC_DIR}/utils/struct_escape_analysis.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/struct_escape_analysis.cpp" \
+            -o "${BUILD_DIR}/utils/struct_escape_analysis.o"
+    fi
+    
+    # Obfuscation Plans
+    if [ -f "${SRC_DIR}/utils/obfuscation_plan.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/obfuscation_plan.cpp" \
+            -o "${BUILD_DIR}/utils/obfuscation_plan.o"
+    fi
+    
+    # Pass Profiler
+    if [ -f "${SRC_DIR}/utils/pass_profiler.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/pass_profiler.cpp" \
+            -o "${BUILD_DIR}/utils/pass_profiler.o"
+    fi
+}
+
+# Build native tools (passes are linked in statically)
+build_tools() {
+    print_info "Building native tools..."
+    
+    CXX_FLAGS="-std=c++17 -O2 ${PGO_FLAGS}"
+    if [ "$BUILD_TYPE" = "debug" ]; then
+        CXX_FLAGS="-std=c++17 -g -O0 -DDEBUG"
+    fi
+    
+    INCLUDE_FLAGS="-I${INCLUDE_DIR} -I${INCLUDE_DIR}/utils"
+    PASS_OBJECTS=$(find "${BUILD_DIR}/passes" "${BUILD_DIR}/utils" -name "*.o" 2>/dev/null || true)
+    
+    # operator new/delete replacement for the profiler's allocation counts;
+    # kept out of utils so the opt plugin does not pick it up, and out of
+    # release tools, which should not pay for counting
+    if [ "${PROFILE_ALLOCATIONS}" = "1" ] && [ -f "${SRC_DIR}/utils/allocation_hook.cpp" ]; then
+        print_info "Linking the allocation hook into the tools"
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/utils/allocation_hook.cpp" \
+            -o "${BUILD_DIR}/tools/allocation_hook.o"
+        PASS_OBJECTS="${BUILD_DIR}/tools/allocation_hook.o ${PASS_OBJECTS}"
+    fi
+    
+    # Static Archive Obfuscator
+    if [ -f "${SRC_DIR}/tools/archive_obfuscator.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/archive_obfuscator.cpp" \
+            -o "${BUILD_DIR}/tools/archive_obfuscator.o"
+        g++ "${BUILD_DIR}/tools/archive_obfuscator.o" ${PASS_OBJECTS} \
+            ${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/archive-obfuscator"
+    fi
+    
+    # Obfuscator (all passes linked in; links named after a pass run only that pass)
+    if [ -f "${SRC_DIR}/tools/obfuscator.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/obfuscator.cpp" \
+            -o "${BUILD_DIR}/tools/obfuscator.o"
+        
+        OBFUSCATOR_LIBS="${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS}"
+        if [ "${STATIC_TOOLS}" = "1" ]; then
+            # Only the components the passes use (not Polly), and no
+            # shared system libraries (distributions list libz3.so)
+            STATIC_SYSTEM_LIBS=$(llvm-config --link-static --system-libs | tr ' ' '\n' | grep -v '\.so$' || true)
+            OBFUSCATOR_LIBS="-static ${LLVM_LDFLAGS} \
+                $(llvm-config --link-static --libs irreader bitwriter passes codegen all-targets) \
+                ${STATIC_SYSTEM_LIBS}"
+        fi
+        # BOLT needs the relocations to move code after linking
+        BOLT_FLAGS=""
+        if [ "${TOOL_BOLT}" = "1" ]; then
+            BOLT_FLAGS="-Wl,--emit-relocs"
+        fi
+        g++ ${PGO_FLAGS} ${BOLT_FLAGS} "${BUILD_DIR}/tools/obfuscator.o" ${PASS_OBJECTS} \
+            ${OBFUSCATOR_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/obfuscator"
+        
+        if [ "${TOOL_BOLT}" = "1" ]; then
+            bolt_obfuscator
+        fi
+        
+        mkdir -p "${BUILD_DIR}/bin/passes"
+        for pass in $("${BUILD_DIR}/bin/obfuscator" -list-passes); do
+            ln -sf ../obfuscator "${BUILD_DIR}/bin/passes/${pass}"
+        done
+    fi
+    
+    # Variant Generator
+    if [ -f "${SRC_DIR}/tools/variant_generator.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/variant_generator.cpp" \
+            -o "${BUILD_DIR}/tools/variant_generator.o"
+        g++ "${BUILD_DIR}/tools/variant_generator.o" ${PASS_OBJECTS} \
+            ${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/variant-generator"
+    fi
+    
+    # Multi-Target Obfuscator
+    if [ -f "${SRC_DIR}/tools/multi_target_obfuscator.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/multi_target_obfuscator.cpp" \
+            -o "${BUILD_DIR}/tools/multi_target_obfuscator.o"
+        g++ "${BUILD_DIR}/tools/multi_target_obfuscator.o" ${PASS_OBJECTS} \
+            ${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/multi-target-obfuscator"
+    fi
+    
+    # Variant Diversity Checker
+    if [ -f "${SRC_DIR}/tools/variant_diversity.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/variant_diversity.cpp" \
+            -o "${BUILD_DIR}/tools/variant_diversity.o"
+        g++ "${BUILD_DIR}/tools/variant_diversity.o" \
+            ${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/variant-diversity"
+    fi
+    
+    # Obfuscation Plan Inspector
+    if [ -f "${SRC_DIR}/tools/obfuscation_plan_dump.cpp" ]; then
+        g++ ${CXX_FLAGS} ${INCLUDE_FLAGS} ${LLVM_CPPFLAGS} \
+            -c "${SRC_DIR}/tools/obfuscation_plan_dump.cpp" \
+            -o "${BUILD_DIR}/tools/obfuscation_plan_dump.o"
+        g++ "${BUILD_DIR}/tools/obfuscation_plan_dump.o" "${BUILD_DIR}/utils/obfuscation_plan.o" \
+            ${LLVM_LDFLAGS} ${LLVM_TOOL_LIBS} -lpthread \
+            -o "${BUILD_DIR}/bin/obfuscation-plan-dump"
+    fi
+}
+
+# Optimize the obfuscator's code layout with BOLT (TOOL_BOLT)
+bolt_obfuscator() {
+    if ! command -v llvm-bolt &> /dev/null; then
+        print_warning "llvm-bolt not found; obfuscator left unoptimized"
+        return
+    fi
+    TRAINING_INPUTS=$(ls ${TOOL_TRAINING_INPUTS} 2>/dev/null || true)
+    if [ -z "${TRAINING_INPUTS}" ]; then
+        print_warning "TOOL_TRAINING_INPUTS matches no files; obfuscator left unoptimized"
+        return
+    fi
+    
+    print_info "Optimizing obfuscator with BOLT..."
+    OBFUSCATOR="${BUILD_DIR}/bin/obfuscator"
+    llvm-bolt "${OBFUSCATOR}" -instrument -instrumentation-file="${BUILD_DIR}/tools/obfuscator.fdata" \
+        -o "${OBFUSCATOR}.instrumented"
+    for input in ${TRAINING_INPUTS}; do
+        "${OBFUSCATOR}.instrumented" "${input}" -o /dev/null 2> /dev/null || true
+    done
+    llvm-bolt "${OBFUSCATOR}" -data="${BUILD_DIR}/tools/obfuscator.fdata" \
+        -reorder-blocks=ext-tsp -reorder-functions=hfsort -split-functions -split-all-cold \
+        -icf=1 -o "${OBFUSCATOR}.bolt"
+    mv "${OBFUSCATOR}.bolt" "${OBFUSCATOR}"
+    rm -f "${OBFUSCATOR}.instrumented"
+}
+
+# Build microbenchmarks (no LLVM dependency)
+build_benchmarks() {
+    print_info "Building microbenchmarks..."
+    
+    BENCH_DIR="${PROJECT_ROOT}/benchmarks"
+    
+    # Stack String Benchmark
+    if [ -f "${BENCH_DIR}/stack_strings_bench.cpp" ]; then
+        g++ -std=c++17 -O2 "${BENCH_DIR}/stack_strings_bench.cpp" \
+            -o "${BUILD_DIR}/bin/stack_strings_bench"
+    fi
+    
+    # Startup Benchmark
+    if [ -f "${BENCH_DIR}/startup_bench.cpp" ]; then
+        g++ -std=c++17 -O2 "${BENCH_DIR}/startup_bench.cpp" \
+            -o "${BUILD_DIR}/bin/startup_bench"
+    fi
+    
+    # Probe startup_bench preloads into the programs it measures
+    if [ -f "${BENCH_DIR}/startup_probe.c" ]; then
+        gcc -O2 -shared -fPIC "${BENCH_DIR}/startup_probe.c" \
+            -o "${BUILD_DIR}/lib/libstartup_probe.so" -ldl
+    fi
+}
+
+# Build the runtime obfuscated programs link (no LLVM dependency)
+build_runtime() {
+    print_info "Building obfuscation runtime..."
+    
+    mkdir -p "${BUILD_DIR}/runtime"
+    RUNTIME_FLAGS="-std=c++17 -O2 -fPIC -fvisibility=hidden -fno-exceptions -fno-rtti"
+    RUNTIME_OBJECTS=""
+    for source in "${SRC_DIR}"/runtime/*.cpp; do
+        [ -f "$source" ] || continue
+        object="${BUILD_DIR}/runtime/$(basename "${source}" .cpp).o"
+        g++ ${RUNTIME_FLAGS} -I${INCLUDE_DIR} -c "${source}" -o "${object}"
+        RUNTIME_OBJECTS="${RUNTIME_OBJECTS} ${object}"
+    done
+    
+    if [ -n "$RUNTIME_OBJECTS" ]; then
+        rm -f "${BUILD_DIR}/lib/libobfuscation_rt.a"
+        ar rcs "${BUILD_DIR}/lib/libobfuscation_rt.a" ${RUNTIME_OBJECTS}
+        print_info "Created runtime library: ${BUILD_DIR}/lib/libobfuscation_rt.a"
+    fi
 }
 
 # Create shared libraries
 create_libraries() {
     print_info "Creating shared libraries..."
     
-    # Find all object files
-    OBJECT_FILES=$(find "${BUILD_DIR}" -name "*.o" 2>/dev/null || true)
+    # Find all pass and utility object files (tools have their own main)
+    OBJECT_FILES=$(find "${BUILD_DIR}/passes" "${BUILD_DIR}/utils" -name "*.o" 2>/dev/null || true)
     
     if [ -z "$OBJECT_FILES" ]; then
         print_warning "No object files found. Creating placeholder libraries..."
@@ -179,7 +492,7 @@ create_libraries() {
     fi
     
     # Create shared library for all passes
-    g++ -shared ${LLVM_LDFLAGS} ${LLVM_LIBS} \
+    g++ -shared ${PGO_FLAGS} ${LLVM_LDFLAGS} ${LLVM_LIBS} \
         ${OBJECT_FILES} \
         -o "${BUILD_DIR}/lib/libobfuscator.so"
     
@@ -200,6 +513,21 @@ install_passes() {
         cp "${BUILD_DIR}/lib/libobfuscator.so" "${INSTALL_DIR}/lib/"
     fi
     
+    # Copy the runtime obfuscated programs link
+    if [ -f "${BUILD_DIR}/lib/libobfuscation_rt.a" ]; then
+        cp "${BUILD_DIR}/lib/libobfuscation_rt.a" "${INSTALL_DIR}/lib/"
+    fi
+    
+    # Copy the startup probe
+    if [ -f "${BUILD_DIR}/lib/libstartup_probe.so" ]; then
+        cp "${BUILD_DIR}/lib/libstartup_probe.so" "${INSTALL_DIR}/lib/"
+    fi
+    
+    # Copy native tools
+    if [ -d "${BUILD_DIR}/bin" ]; then
+        cp -rP "${BUILD_DIR}"/bin/* "${INSTALL_DIR}/bin/" 2>/dev/null || true
+    fi
+    
     # Copy configuration
     cp "${PROJECT_ROOT}/ollvm_config.json" "${INSTALL_DIR}/"
     
@@ -225,6 +553,7 @@ main() {
     
     # Check LLVM installation
     check_llvm
+    configure_pgo
     
     # Create directory structure
     create_dirs
@@ -233,6 +562,9 @@ main() {
     build_utils
     build_passes
     create_libraries
+    build_tools
+    build_benchmarks
+    build_runtime
     install_passes
     
     print_info "Build completed successfully!"
@@ -0,0 +1,35 @@
+/**
+ * @file machine_substitution.h
+ * @brief Machine Instruction Substitution Pass Header
+ * 
+ * Instruction substitution on x86-64 machine code, after register
+ * allocation and prolog/epilog insertion. Register-register ALU
+ * instructions (add, sub, and, or, xor on 32 and 64 bits) become
+ * equivalent sequences that use one scratch register, picked among
+ * the caller-saved registers that are dead at that point; an
+ * instruction is left alone if none is, or if its flags are live.
+ * No register is spilled, and no IR optimization runs afterwards to
+ * fold the sequences back.
+ * 
+ * The pass only runs inside a codegen pipeline: codegen_utils adds it
+ * when -machine-substitution is given. It reads the
+ * "machine_substitution" section of the configuration file and
+ * reports, per function, the bytes and estimated cycles it added.
+ */
+
+#ifndef MACHINE_SUBSTITUTION_H
+#define MACHINE_SUBSTITUTION_H
+
+#include "llvm/CodeGen/MachineFunctionPass.h"
+
+namespace obfuscator {
+
+/**
+ * @brief Create the machine instruction substitution pass
+ * @return New pass; does nothing on targets other than x86-64
+ */
+llvm::MachineFunctionPass *createMachineSubstitutionPass();
+
+} // namespace obfuscator
+
+#endif // MACHINE_SUBSTITUTION_H
@@ -0,0 +1,404 @@
+/**
+ * @file obfuscation_pass.h
+ * @brief Obfuscation Pass Base Header
+ * 
+ * Common skeleton of the obfuscation passes. A pass derives from
+ * ObfuscationPass (one function at a time) or ObfuscationModulePass
+ * and implements transform(); the base takes care of the rest:
+ * 
+ *   config     the pass's section of the -obfuscation-config file
+ *   selection  which functions the pass runs on (shouldTransform())
+ *   rng        the deterministic per-function stream of llvm_utils.h
+ *   plan       recorded or replayed decisions (obfuscation_plan.h)
+ *   budget     how many instructions the pass may add to a function
+ *   remarks    an OptimizationRemarkEmitter for the function
+ *   stats      counters reported with LLVM's -stats
+ *   profile    a PassProfileScope around every run (pass_profiler.h)
+ */
+
+#ifndef OBFUSCATION_PASS_H
+#define OBFUSCATION_PASS_H
+
+#include "utils/obfuscation_plan.h"
+#include "utils/pass_profiler.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace obfuscator {
+
+/**
+ * @class PassConfig
+ * @brief Typed view of one pass's section of the configuration file
+ * 
+ * Settings missing from the file (or every setting, without a file)
+ * return the default the caller passes in.
+ */
+class PassConfig {
+public:
+    /**
+     * @brief Create a view of a pass section
+     * @param values Settings of the pass, keyed by name
+     */
+    explicit PassConfig(std::map<std::string, std::string> values = {});
+    
+    /**
+     * @brief Check if the pass may run
+     * @return false only if the section sets "enabled" to false
+     */
+    bool isEnabled() const;
+    
+    /**
+     * @brief Check if a setting is present
+     * @param key Setting name
+     * @return true if the section sets it
+     */
+    bool has(llvm::StringRef key) const;
+    
+    /**
+     * @brief Get a boolean setting
+     * @param key Setting name
+     * @param defaultValue Value if the setting is missing or not a boolean
+     * @return Setting value
+     */
+    bool getBool(llvm::StringRef key, bool defaultValue) const;
+    
+    /**
+     * @brief Get an integer setting
+     * @param key Setting name
+     * @param defaultValue Value if the setting is missing or not an integer
+     * @return Setting value
+     */
+    int64_t getInt(llvm::StringRef key, int64_t defaultValue) const;
+    
+    /**
+     * @brief Get a numeric setting
+     * @param key Setting name
+     * @param defaultValue Value if the setting is missing or not a number
+     * @return Setting value
+     */
+    double getDouble(llvm::StringRef key, double defaultValue) const;
+    
+    /**
+     * @brief Get a string setting
+     * @param key Setting name
+     * @param defaultValue Value if the setting is missing
+     * @return Setting value
+     */
+    std::string getString(llvm::StringRef key, llvm::StringRef defaultValue) const;
+    
+private:
+    const std::string *find(llvm::StringRef key) const;
+    
+    std::map<std::string, std::string> values_;
+};
+
+/**
+ * @brief Get the configuration of a pass
+ * @param passName Registered pass name (e.g. "bogus-control-flow")
+ * @return Its section of the -obfuscation-config file; empty without one
+ */
+const PassConfig &getPassConfig(llvm::StringRef passName);
+
+/**
+ * @class GrowthBudget
+ * @brief How many instructions a pass may still add to a function
+ * 
+ * The limit is a percentage of the function's size when the pass
+ * starts: the "max_growth_percent" setting of the pass, or else
+ * -obfuscation-max-growth. Zero means no limit. Passes charge each
+ * transformation before making it and skip it if it does not fit.
+ */
+class GrowthBudget {
+public:
+    /**
+     * @brief Create an unlimited budget
+     */
+    GrowthBudget() = default;
+    
+    /**
+     * @brief Create a budget for a function
+     * @param instructions Size of the function
+     * @param maxGrowthPercent Allowed growth; 0 for no limit
+     */
+    GrowthBudget(uint64_t instructions, unsigned maxGrowthPercent);
+    
+    /**
+     * @brief Check if the budget limits growth at all
+     * @return false if any growth is allowed
+     */
+    bool isLimited() const { return limited_; }
+    
+    /**
+     * @brief Charge a transformation against the budget
+     * @param instructions Instructions the transformation adds
+     * @return true if it fits and was charged; false if it must be skipped
+     */
+    bool tryCharge(uint64_t instructions);
+    
+    /**
+     * @brief Get the instructions charged so far
+     * @return Sum of the accepted charges
+     */
+    uint64_t getCharged() const { return charged_; }
+    
+    /**
+     * @brief Get the number of transformations refused
+     * @return Charges that did not fit
+     */
+    uint64_t getRefused() const { return refused_; }
+    
+    /**
+     * @brief Get the limit
+     * @return Instructions the pass may add in total
+     */
+    uint64_t getLimit() const { return limit_; }
+    
+private:
+    bool limited_ = false;
+    uint64_t limit_ = 0;
+    uint64_t charged_ = 0;
+    uint64_t refused_ = 0;
+};
+
+/**
+ * @class ObfuscationPassBase
+ * @brief State and policy shared by the function and module pass bases
+ * 
+ * The per-function state (rng, plan, budget, remarks) exists while a
+ * FunctionScope is open: for the whole of transform() in an
+ * ObfuscationPass, and around each function a module pass opens one
+ * for.
+ */
+class ObfuscationPassBase {
+public:
+    virtual ~ObfuscationPassBase() = default;
+    
+protected:
+    /**
+     * @brief Create the base of a pass
+     * @param passName Registered pass name; also the remark and statistic group
+     * @param displayName Name used in progress messages (e.g. "BogusControlFlowPass")
+     */
+    ObfuscationPassBase(llvm::StringRef passName, llvm::StringRef displayName);
+    
+    /**
+     * @brief Decide whether the pass runs on a function
+     * 
+     * The default skips declarations, functions the configuration
+     * disables the pass for, and nothing else.
+     * 
+     * @param F Candidate function
+     * @return true if the pass should transform F
+     */
+    virtual bool shouldTransform(const llvm::Function &F) const;
+    
+    /**
+     * @brief Get the configuration of the pass
+     * @return Its section of the -obfuscation-config file
+     */
+    const PassConfig &config() const { return *config_; }
+    
+    /**
+     * @brief Get the random stream of the current function (or module)
+     * @return Generator seeded for this pass and scope
+     */
+    std::mt19937_64 &rng() { return rng_; }
+    
+    /**
+     * @brief Draw from the random stream of the current function (or module)
+     * @return Next random value
+     */
+    uint64_t nextRandom() { return rng_(); }
+    
+    /**
+     * @brief Get the decisions of the current function
+     * @return Plan decisions; only valid inside a FunctionScope
+     */
+    PlanDecisions &plan() { return *plan_; }
+    
+    /**
+     * @brief Get the growth budget of the current function
+     * @return Budget; only valid inside a FunctionScope
+     */
+    GrowthBudget &budget() { return *budget_; }
+    
+    /**
+     * @brief Get the remark emitter of the current function
+     * @return Emitter; only valid inside a FunctionScope
+     */
+    llvm::OptimizationRemarkEmitter &remarks() { return *remarks_; }
+    
+    /**
+     * @brief Count an event for -stats
+     * @param name Counter name, a string literal
+     * @param count Amount to add
+     */
+    void addStatistic(const char *name, uint64_t count = 1);
+    
+    /**
+     * @class FunctionScope
+     * @brief Per-function state of one run of the pass
+     * 
+     * Prints the progress message, starts the profile, seeds the
+     * random stream, starts the plan decisions and the budget, and on
+     * destruction reports the statistics and any refused charges.
+     */
+    class FunctionScope {
+    public:
+        /**
+         * @brief Open the state for a function
+         * @param pass Pass running on F
+         * @param F Function being transformed
+         */
+        FunctionScope(ObfuscationPassBase &pass, llvm::Function &F);
+        
+        ~FunctionScope();
+        
+        FunctionScope(const FunctionScope &) = delete;
+        FunctionScope &operator=(const FunctionScope &) = delete;
+    
+    private:
+        ObfuscationPassBase &pass_;
+        llvm::Function &function_;
+        std::optional<PassProfileScope> profile_;
+        PlanDecisions plan_;
+        GrowthBudget budget_;
+        llvm::OptimizationRemarkEmitter remarks_;
+    };
+    
+    /**
+     * @brief Report the statistics counted since the last flush
+     */
+    void flushStatistics();
+    
+    llvm::StringRef passName_;
+    llvm::StringRef displayName_;
+    bool modulePass_ = false;   ///< Runs are profiled per module, not per function
+    
+private:
+    const PassConfig *config_;
+    std::mt19937_64 rng_;
+    PlanDecisions *plan_ = nullptr;
+    GrowthBudget *budget_ = nullptr;
+    llvm::OptimizationRemarkEmitter *remarks_ = nullptr;
+    llvm::SmallVector<std::pair<const char*, uint64_t>, 4> statistics_;
+};
+
+/**
+ * @class ObfuscationPass
+ * @brief Base of the passes that transform one function at a time
+ */
+class ObfuscationPass : public llvm::FunctionPass, public ObfuscationPassBase {
+public:
+    /**
+     * @brief Create the pass
+     * @param ID Pass identification of the derived pass
+     * @param passName Registered pass name
+     * @param displayName Name used in progress messages
+     */
+    ObfuscationPass(char &ID, llvm::StringRef passName, llvm::StringRef displayName)
+        : FunctionPass(ID), ObfuscationPassBase(passName, displayName) {}
+    
+    /**
+     * @brief Run transform() on the function if it is selected
+     * @param F Function to transform
+     * @return true if function was modified
+     */
+    bool runOnFunction(llvm::Function &F) final;
+    
+protected:
+    /**
+     * @brief Transform a selected function
+     * @param F Function to transform
+     * @return true if function was modified
+     */
+    virtual bool transform(llvm::Function &F) = 0;
+};
+
+/**
+ * @class ObfuscationModulePass
+ * @brief Base of the passes that transform a whole module
+ * 
+ * rng() is seeded for the module before transform() runs. Passes that
+ * visit functions select them with shouldTransform() and open a
+ * FunctionScope for each.
+ */
+class ObfuscationModulePass : public llvm::ModulePass, public ObfuscationPassBase {
+public:
+    /**
+     * @brief Create the pass
+     * @param ID Pass identification of the derived pass
+     * @param passName Registered pass name
+     * @param displayName Name used in progress messages
+     */
+    ObfuscationModulePass(char &ID, llvm::StringRef passName, llvm::StringRef displayName)
+        : ModulePass(ID), ObfuscationPassBase(passName, displayName) {
+        modulePass_ = true;
+    }
+    
+    /**
+     * @brief Run transform() on the module if the pass is enabled
+     * @param M Module to transform
+     * @return true if module was modified
+     */
+    bool runOnModule(llvm::Module &M) final;
+    
+protected:
+    /**
+     * @brief Transform the module
+     * @param M Module to transform
+     * @return true if module was modified
+     */
+    virtual bool transform(llvm::Module &M) = 0;
+};
+
+/**
+ * @brief Record the name of a registered obfuscation pass
+ * @param passName Registered pass name
+ */
+void addObfuscationPassName(llvm::StringRef passName);
+
+/**
+ * @brief Get the obfuscation passes linked into the process
+ * @return Registered pass names, sorted
+ */
+std::vector<std::string> getObfuscationPassNames();
+
+/**
+ * @class RegisterObfuscationPass
+ * @brief RegisterPass for obfuscation passes
+ * 
+ * Registers the pass with LLVM and adds it to
+ * getObfuscationPassNames(), which tools use to tell the obfuscation
+ * passes apart from LLVM's own.
+ */
+template <typename PassT>
+class RegisterObfuscationPass : public llvm::RegisterPass<PassT> {
+public:
+    /**
+     * @brief Register the pass
+     * @param passName Command-line name (e.g. "bogus-control-flow")
+     * @param description Description shown by -help
+     */
+    RegisterObfuscationPass(const char *passName, const char *description)
+        : llvm::RegisterPass<PassT>(passName, description, false, false) {
+        addObfuscationPassName(passName);
+    }
+};
+
+} // namespace obfuscator
+
+#endif // OBFUSCATION_PASS_H
@@ -0,0 +1,67 @@
+/**
+ * @file pass_plugin.h
+ * @brief New Pass Manager Support Header
+ * 
+ * The obfuscation passes are legacy passes. ObfuscationPassAdaptor
+ * runs one of them as a module pass of the new pass manager, and
+ * registerObfuscationPasses() makes every obfuscation pass available
+ * to PassBuilder pipelines by its registered name, so
+ * 
+ *   opt -load-pass-plugin libobfuscator.so -passes=bogus-control-flow,flattening
+ * 
+ * works wherever the legacy pass manager is gone from opt.
+ */
+
+#ifndef PASS_PLUGIN_H
+#define PASS_PLUGIN_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include <string>
+
+namespace obfuscator {
+
+/**
+ * @class ObfuscationPassAdaptor
+ * @brief Runs a registered obfuscation pass in the new pass manager
+ * 
+ * The pass gets a legacy pass manager of its own for the module, so
+ * the analyses it asks for (e.g. block frequencies for struct-layout)
+ * come from there.
+ */
+class ObfuscationPassAdaptor : public llvm::PassInfoMixin<ObfuscationPassAdaptor> {
+public:
+    /**
+     * @brief Create the adaptor
+     * @param passName Registered pass name (e.g. "flattening")
+     */
+    explicit ObfuscationPassAdaptor(std::string passName) : passName_(std::move(passName)) {}
+    
+    /**
+     * @brief Run the pass on a module
+     * @param M Module to transform
+     * @param MAM Analysis manager of the module
+     * @return No analyses preserved if the module changed, all otherwise
+     */
+    llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+    
+    /**
+     * @brief Run even on optnone functions, as the legacy passes do
+     */
+    static bool isRequired() { return true; }
+    
+private:
+    std::string passName_;
+};
+
+/**
+ * @brief Make the obfuscation passes available to PassBuilder pipelines
+ * @param PB Pass builder to register with
+ */
+void registerObfuscationPasses(llvm::PassBuilder &PB);
+
+} // namespace obfuscator
+
+#endif // PASS_PLUGIN_H
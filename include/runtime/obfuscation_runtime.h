@@ -0,0 +1,104 @@
+/**
+ * @file obfuscation_runtime.h
+ * @brief Obfuscation Runtime Interface
+ * 
+ * Code the passes emit calls into libobfuscation_rt.a, linked into the
+ * obfuscated program. Components that must do work before their data
+ * is usable (decrypting strings, for one) do not get a global
+ * constructor each; the pass emits an obf_init_task into the
+ * "obf_init" section instead, and the runtime's one constructor runs
+ * the tasks of the whole program in a batch:
+ *   OBF_INIT_EAGER       in the constructor, before main
+ *   OBF_INIT_LAZY        on first use only
+ *   OBF_INIT_BACKGROUND  on a thread the constructor starts, while
+ *                        main runs
+ * Every use is guarded whatever the mode: an acquire load of the
+ * state, and a call to __obf_init_run() while it is not
+ * OBF_INIT_DONE. The first caller runs the task; the others wait for
+ * it. Constructors of other objects that run before ours, and code
+ * the batch has not reached yet, so still see the data initialized.
+ * 
+ * OBF_INIT_REPORT=1 in the environment at startup prints, per component,
+ * the time its tasks took and the resident set before and after them, to
+ * stderr at exit. The variable is read once; setting it later has no
+ * effect.
+ * 
+ * The layouts below are what the passes emit; keep them in sync.
+ */
+
+#ifndef OBFUSCATION_RUNTIME_H
+#define OBFUSCATION_RUNTIME_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief When a task runs */
+enum {
+    OBF_INIT_EAGER = 0,
+    OBF_INIT_LAZY = 1,
+    OBF_INIT_BACKGROUND = 2
+};
+
+/** @brief Progress of a task */
+enum {
+    OBF_INIT_PENDING = 0,
+    OBF_INIT_RUNNING = 1,
+    OBF_INIT_DONE = 2
+};
+
+/**
+ * @struct obf_init_task
+ * @brief One initialization task, placed in the "obf_init" section
+ */
+struct obf_init_task {
+    void (*run)(void *arg);     ///< Does the work
+    void *arg;                  ///< Passed to run
+    const char *component;      ///< Pass that emitted the task, for the report
+    uint32_t mode;              ///< OBF_INIT_EAGER, _LAZY or _BACKGROUND
+    uint32_t state;             ///< OBF_INIT_PENDING, _RUNNING or _DONE; accessed atomically
+    uint64_t nanoseconds;       ///< Time run took, once done
+    uint64_t rss_before;        ///< Resident set in kB before run, with OBF_INIT_REPORT set
+    uint64_t rss_after;         ///< Resident set in kB after run, with OBF_INIT_REPORT set
+};
+
+/**
+ * @struct obf_string_table
+ * @brief Strings a module encrypted in place, the argument of __obf_decrypt_strings()
+ * 
+ * Byte i of string n is XORed with byte i % 8 of keys[n], little end
+ * first. The strings of one table share as few pages as they fit in:
+ * decrypting them dirties those pages and no other.
+ */
+struct obf_string_table {
+    uint64_t count;             ///< Number of strings
+    uint8_t **strings;          ///< Their writable globals
+    const uint64_t *sizes;      ///< Their sizes in bytes
+    const uint64_t *keys;       ///< Their keys
+};
+
+/**
+ * @brief Run a task unless it already ran, and wait for it
+ * @param task Task to run
+ */
+void __obf_init_run(struct obf_init_task *task);
+
+/**
+ * @brief Print, per component, the time its tasks took and the
+ * resident set before and after them, to stderr
+ */
+void __obf_init_report(void);
+
+/**
+ * @brief Decrypt the strings of a module in place
+ * @param table An obf_string_table
+ */
+void __obf_decrypt_strings(void *table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OBFUSCATION_RUNTIME_H
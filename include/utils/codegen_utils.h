@@ -0,0 +1,73 @@
+/**
+ * @file codegen_utils.h
+ * @brief Code Generation Utilities Header
+ * 
+ * Helpers for turning obfuscated modules into object files from
+ * native tools, without going through llc.
+ */
+
+#ifndef CODEGEN_UTILS_H
+#define CODEGEN_UTILS_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <memory>
+#include <string>
+
+namespace obfuscator {
+
+/**
+ * @brief Create a target machine for a module's triple
+ * 
+ * Target machines are not thread-safe; create one per thread.
+ * 
+ * @param M Module to compile; its triple and data layout are used,
+ *          and the default triple is set if it has none
+ * @param errorMessage Set to a description of the failure, if any
+ * @return Target machine, or nullptr on failure
+ */
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(llvm::Module &M,
+                                                         std::string &errorMessage);
+
+/**
+ * @brief Create a target machine for a target triple
+ * @param triple Target triple, e.g. "aarch64-linux-gnu"
+ * @param errorMessage Set to a description of the failure, if any
+ * @return Target machine, or nullptr on failure
+ */
+std::unique_ptr<llvm::TargetMachine> createTargetMachine(const std::string &triple,
+                                                         std::string &errorMessage);
+
+/**
+ * @brief Run the standard optimization pipeline on a module
+ * @param M Module to optimize
+ * @param level Optimization level (0-3)
+ * @param machine Target whose cost model the passes use; nullptr for
+ *                target-independent defaults
+ */
+void optimizeModule(llvm::Module &M, unsigned level, llvm::TargetMachine *machine = nullptr);
+
+/**
+ * @brief Compile a module to an object file
+ * @param M Module to compile
+ * @param path Output file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the object file was written
+ */
+bool emitObjectFile(llvm::Module &M, llvm::StringRef path, std::string &errorMessage);
+
+/**
+ * @brief Compile a module to an object file with a given target machine
+ * @param M Module to compile; its data layout must match machine
+ * @param machine Target machine, used by this thread only
+ * @param path Output file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the object file was written
+ */
+bool emitObjectFile(llvm::Module &M, llvm::TargetMachine &machine, llvm::StringRef path,
+                    std::string &errorMessage);
+
+} // namespace obfuscator
+
+#endif // CODEGEN_UTILS_H
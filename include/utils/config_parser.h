@@ -30,10 +30,15 @@ public:
     
     /**
      * @brief Load configuration from file
+     * 
+     * Nested JSON objects become dotted keys, e.g.
+     * "passes.control_flow.bogus_control_flow.probability".
+     * 
      * @param filename Configuration file path
+     * @param errorMessage Set to a description of the failure, if any
      * @return true if loaded successfully
      */
-    bool loadFromFile(const std::string &filename);
+    bool loadFromFile(const std::string &filename, std::string &errorMessage);
     
     /**
      * @brief Get configuration value
@@ -41,7 +46,7 @@ public:
      * @param defaultValue Default value if key not found
      * @return Configuration value
      */
-    std::string getValue(const std::string &key, const std::string &defaultValue = "");
+    std::string getValue(const std::string &key, const std::string &defaultValue = "") const;
     
     /**
      * @brief Set configuration value
@@ -55,16 +60,27 @@ public:
      * @param passName Name of the pass
      * @return true if pass is enabled
      */
-    bool isPassEnabled(const std::string &passName);
+    bool isPassEnabled(const std::string &passName) const;
     
     /**
      * @brief Get pass configuration
-     * @param passName Name of the pass
-     * @return Map of pass configuration
+     * @param passName Name of the pass; "bogus-control-flow" and
+     *                 "bogus_control_flow" name the same section
+     * @return Map of pass configuration, keyed by setting name
      */
-    std::map<std::string, std::string> getPassConfig(const std::string &passName);
+    std::map<std::string, std::string> getPassConfig(const std::string &passName) const;
 };
 
+/**
+ * @brief Get the configuration named by -obfuscation-config
+ * 
+ * A file that cannot be opened or parsed is a fatal error, reported
+ * on first use; passes never fall back to their defaults silently.
+ * 
+ * @return The loaded configuration; empty if the option is unset
+ */
+const ConfigParser &getObfuscationConfig();
+
 } // namespace obfuscator
 
 #endif // CONFIG_PARSER_H
@@ -13,6 +13,11 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Module.h"
+
+#include <random>
+#include <set>
 
 namespace obfuscator {
 
@@ -24,10 +29,44 @@ namespace obfuscator {
 bool shouldObfuscateFunction(const llvm::Function &F);
 
 /**
- * @brief Get a random number generator seed
- * @return Random seed value
+ * @brief Set the seed behind every random choice the passes make on a module
+ * 
+ * The seed is stored as the "obfuscation.seed" module flag, so it
+ * survives bitcode round trips. The same input and seed always give
+ * the same output; different seeds give diversified variants.
+ * 
+ * @param M Module to tag
+ * @param seed Seed value
+ */
+void setRandomSeed(llvm::Module &M, uint64_t seed);
+
+/**
+ * @brief Get the obfuscation seed of a module
+ * @param M Module to query
+ * @return The module's seed flag, or the -obfuscation-seed option if unset
+ */
+uint64_t getRandomSeed(const llvm::Module &M);
+
+/**
+ * @brief Get the random number generator for one pass on one function
+ * 
+ * The stream depends only on the module seed, the pass and the
+ * function name, so it does not change with the order functions are
+ * visited in or with the threads other modules run on.
+ * 
+ * @param F Function being transformed
+ * @param passName Registered name of the pass
+ * @return Seeded generator
+ */
+std::mt19937_64 getRandomGenerator(const llvm::Function &F, llvm::StringRef passName);
+
+/**
+ * @brief Get the random number generator for a module pass
+ * @param M Module being transformed
+ * @param passName Registered name of the pass
+ * @return Seeded generator
  */
-uint64_t getRandomSeed();
+std::mt19937_64 getRandomGenerator(const llvm::Module &M, llvm::StringRef passName);
 
 /**
  * @brief Create a new basic block with a given name
@@ -37,6 +76,52 @@ uint64_t getRandomSeed();
  */
 llvm::BasicBlock* createBasicBlock(llvm::Function &F, const std::string &name);
 
+/**
+ * @brief Split the PHI nodes and EH pad of a block off into a new block
+ * 
+ * Unlike BasicBlock::splitBasicBlock, the original block keeps its
+ * body, terminator and successors, so the successors' PHI nodes are
+ * not rewritten and the cost does not depend on how many edges join
+ * there (a 10k-case switch merging into one PHI would be quadratic).
+ * The head takes the block's name; the block becomes <name>.body.
+ * A landing pad stays in the head, so unwind edges still reach it.
+ * 
+ * @param BB Block to split; must not be a catchswitch block
+ * @return The new head, in front of BB and ending in a branch to it
+ */
+llvm::BasicBlock* splitBlockHead(llvm::BasicBlock &BB);
+
+/**
+ * @brief Return directly after tail calls that branch to a shared return
+ * 
+ * A tail call only becomes a jump when the return follows it in the
+ * same block. Front ends often end several paths in one return block
+ * with a PHI of the call results; code generation duplicates that
+ * return into the callers' blocks, but only while the pattern is
+ * intact. Passes that reroute branches or add code in front of the
+ * return call this first, so every tail call ends in its own ret.
+ * Return blocks it leaves without predecessors are deleted; those
+ * that had none before are kept.
+ * 
+ * @param F Function to update
+ * @return Number of returns added
+ */
+unsigned duplicateReturnsForTailCalls(llvm::Function &F);
+
+/**
+ * @brief Find the blocks of the loops a profile marks hot
+ * 
+ * A loop is hot when the module has a profile summary, the function
+ * an entry count, and the loop header's count is hot by the summary.
+ * Passes keep stores and calls out of these blocks: one extra store
+ * per iteration of a hot loop costs more than the rest of the
+ * function's obfuscation. Without a profile the set is empty.
+ * 
+ * @param F Function to scan
+ * @return Blocks of the hot loops, including their nested loops
+ */
+std::set<const llvm::BasicBlock*> findHotLoopBlocks(llvm::Function &F);
+
 /**
  * @brief Insert a no-op instruction
  * @param builder IRBuilder for instruction insertion
@@ -46,11 +131,54 @@ llvm::Instruction* insertNoOp(llvm::IRBuilder<> &builder);
 
 /**
  * @brief Check if an instruction is safe to replace
+ * 
+ * PHI nodes and EH pads must stay at the head of their block, and
+ * terminators carry the block's edges, unwind edges included.
+ * 
  * @param inst Instruction to check
  * @return true if instruction can be safely replaced
  */
 bool isSafeToReplace(const llvm::Instruction &inst);
 
+/**
+ * @brief Get the source location for code inserted into a block
+ * @param BB Block receiving the new code
+ * @return Location of the first located instruction in BB, else the
+ *         function's scope line; empty if the function has no debug info
+ */
+llvm::DebugLoc getInsertionDebugLoc(const llvm::BasicBlock &BB);
+
+/**
+ * @brief Get the source location for obfuscation-generated code
+ * 
+ * The result keeps the original line and scope but carries its own
+ * discriminator, so sample profiles attribute samples of the inserted
+ * code separately from the original code on that line.
+ * 
+ * @param DL Location of the original code
+ * @param discriminator Base discriminator from getNextFreeDiscriminator
+ * @return Tagged location, or DL if the discriminator cannot be encoded
+ */
+llvm::DebugLoc getSyntheticDebugLoc(const llvm::DebugLoc &DL, unsigned discriminator);
+
+/**
+ * @brief Find the first base discriminator not used in a function
+ * @param F Function to scan
+ * @return Discriminator greater than all discriminators in F
+ */
+unsigned getNextFreeDiscriminator(const llvm::Function &F);
+
+/**
+ * @brief Attach a location to every instruction in a block that has none
+ * 
+ * Each such instruction takes the location of the next located
+ * instruction in the block (typically its user), or the block's
+ * insertion location if none follows.
+ * 
+ * @param BB Block to update
+ */
+void setMissingDebugLocs(llvm::BasicBlock &BB);
+
 } // namespace obfuscator
 
 #endif // LLVM_UTILS_H
@@ -0,0 +1,197 @@
+/**
+ * @file obfuscation_plan.h
+ * @brief Obfuscation Plan Header
+ * 
+ * Records the random and cost-model decisions the passes make (which
+ * blocks get bogus flow, which state IDs, which keys) separately from
+ * the IR changes they drive, so they can be saved to a compact binary
+ * plan file, inspected, and replayed without recomputing them.
+ * 
+ * Plans are keyed by pass, function name and a structural hash of the
+ * function as the pass sees it; a function that changed since the plan
+ * was recorded is obfuscated afresh rather than with stale decisions.
+ */
+
+#ifndef OBFUSCATION_PLAN_H
+#define OBFUSCATION_PLAN_H
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace obfuscator {
+
+/**
+ * @enum PlanMode
+ * @brief What the passes do with the plan attached to a module
+ */
+enum class PlanMode {
+    Off,     ///< Decide afresh, record nothing
+    Record,  ///< Decide afresh and record every decision
+    Replay   ///< Take decisions from the plan where it matches
+};
+
+/**
+ * @class ObfuscationPlan
+ * @brief Decisions of every pass on every function of a build
+ * 
+ * Thread-safe: passes running on different modules may share a plan.
+ */
+class ObfuscationPlan {
+public:
+    /**
+     * @struct Entry
+     * @brief Decisions of one pass on one function (or module scope)
+     */
+    struct Entry {
+        std::string pass;                ///< Registered pass name
+        std::string scope;               ///< Function name, or module-level scope
+        uint64_t hash = 0;               ///< Structural hash when the pass ran
+        std::vector<uint64_t> decisions; ///< Decisions in the order the pass made them
+    };
+    
+    /**
+     * @brief Read a plan file
+     * @param path Plan file
+     * @param errorMessage Set to a description of the failure, if any
+     * @return true if the plan was read
+     */
+    bool load(llvm::StringRef path, std::string &errorMessage);
+    
+    /**
+     * @brief Write the plan to a file
+     * @param path Plan file
+     * @param errorMessage Set to a description of the failure, if any
+     * @return true if the plan was written
+     */
+    bool save(llvm::StringRef path, std::string &errorMessage) const;
+    
+    /**
+     * @brief Find the decisions recorded for a pass on a function
+     * @param pass Registered pass name
+     * @param scope Function name or module-level scope
+     * @param hash Structural hash of the function now
+     * @return Decisions, or nullptr if none were recorded for this code
+     */
+    const std::vector<uint64_t> *find(llvm::StringRef pass, llvm::StringRef scope,
+                                      uint64_t hash) const;
+    
+    /**
+     * @brief Record the decisions of a pass on a function
+     * @param entry Decisions to store; replaces earlier ones for the same pass and scope
+     */
+    void record(Entry entry);
+    
+    /**
+     * @brief Print the plan in readable form
+     * @param OS Output stream
+     */
+    void dump(llvm::raw_ostream &OS) const;
+    
+    /**
+     * @brief Get the number of recorded entries
+     * @return Number of (pass, scope) entries
+     */
+    size_t size() const;
+    
+private:
+    mutable std::mutex mutex_;
+    std::map<std::pair<std::string, std::string>, Entry> entries_;
+};
+
+/**
+ * @brief Attach a plan to a module for the passes to use
+ * @param M Module the passes will run on
+ * @param plan Plan to record into or replay from; must outlive the passes
+ * @param mode Record or replay
+ */
+void attachPlan(const llvm::Module &M, ObfuscationPlan &plan, PlanMode mode);
+
+/**
+ * @brief Detach the plan attached to a module
+ * @param M Module
+ */
+void detachPlan(const llvm::Module &M);
+
+/**
+ * @brief Compute a structural hash of a function
+ * 
+ * Covers the CFG shape, opcodes, types, constants and callees, but not
+ * value names, so renaming alone does not invalidate a plan.
+ * 
+ * @param F Function to hash
+ * @return 64-bit hash
+ */
+uint64_t getFunctionHash(const llvm::Function &F);
+
+/**
+ * @class PlanDecisions
+ * @brief The decisions one pass makes on one function
+ * 
+ * Passes route every decision through next(). When replaying a
+ * matching plan entry, the recorded value is returned and the decision
+ * callback (with its analyses and cost models) is never run; otherwise
+ * the callback decides and, when recording, the value is stored. The
+ * entry is committed when the object is destroyed.
+ * 
+ * Without an attached plan, the -obfuscation-plan-out and
+ * -obfuscation-plan-in options select a process-wide plan (for opt).
+ */
+class PlanDecisions {
+public:
+    /**
+     * @brief Start the decisions of a function pass
+     * @param F Function being transformed
+     * @param passName Registered pass name
+     */
+    PlanDecisions(const llvm::Function &F, llvm::StringRef passName);
+    
+    /**
+     * @brief Start the decisions of a module pass
+     * @param M Module being transformed
+     * @param passName Registered pass name
+     * @param scope What the decisions are about (e.g. a struct name)
+     * @param hash Hash of what the decisions depend on
+     */
+    PlanDecisions(const llvm::Module &M, llvm::StringRef passName,
+                  llvm::StringRef scope, uint64_t hash);
+    
+    ~PlanDecisions();
+    
+    PlanDecisions(const PlanDecisions &) = delete;
+    PlanDecisions &operator=(const PlanDecisions &) = delete;
+    
+    /**
+     * @brief Check if decisions come from a saved plan
+     * @return true if replaying a matching entry
+     */
+    bool isReplaying() const { return replayed_ != nullptr; }
+    
+    /**
+     * @brief Make the next decision
+     * @param decide Computes the decision when it is not replayed
+     * @return The decision
+     */
+    uint64_t next(llvm::function_ref<uint64_t()> decide);
+    
+private:
+    void init(const llvm::Module &M);
+    
+    ObfuscationPlan *plan_ = nullptr;
+    PlanMode mode_ = PlanMode::Off;
+    ObfuscationPlan::Entry entry_;
+    const std::vector<uint64_t> *replayed_ = nullptr;
+    size_t position_ = 0;
+};
+
+} // namespace obfuscator
+
+#endif // OBFUSCATION_PLAN_H
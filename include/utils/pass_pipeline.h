@@ -0,0 +1,76 @@
+/**
+ * @file pass_pipeline.h
+ * @brief Obfuscation Pass Pipeline Header
+ *
+ * Helpers for running the registered obfuscation passes on a
+ * module from native tools, without going through opt.
+ */
+
+#ifndef PASS_PIPELINE_H
+#define PASS_PIPELINE_H
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace obfuscator {
+
+/**
+ * @brief Get the default obfuscation pipeline
+ * @return Pass names in the order they should run
+ */
+std::vector<std::string> getDefaultPassPipeline();
+
+/**
+ * @brief Run registered obfuscation passes on a module
+ *
+ * The IR is checked after every pass at the level chosen with
+ * -obfuscation-verify (see pipeline_verifier.h).
+ *
+ * @param M Module to transform
+ * @param passNames Registered pass names (e.g. "bogus-control-flow")
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if all passes ran and every check passed
+ */
+bool runObfuscationPasses(llvm::Module &M,
+                          const std::vector<std::string> &passNames,
+                          std::string &errorMessage);
+
+/**
+ * @brief Save the optimization remarks of a context to a file
+ *
+ * Remarks are kept in memory as they are emitted and written by
+ * finishRemarksFile() as one standalone bitstream file, string table
+ * first, which llvm-remark-size-diff, opt-viewer and similar tools
+ * read on any target. The bitstream format keeps the file small on
+ * large builds; until then the remarks cost memory.
+ *
+ * @param context Context whose remarks are saved
+ * @param path Remarks file, conventionally <output>.opt.bitstream
+ * @param passFilter Regex of pass names to keep; empty keeps all
+ * @param errorMessage Set to a description of the failure, if any
+ * @return The open file, to pass to finishRemarksFile(); nullptr on failure
+ */
+std::unique_ptr<llvm::ToolOutputFile> setupRemarksFile(llvm::LLVMContext &context,
+                                                       llvm::StringRef path,
+                                                       llvm::StringRef passFilter,
+                                                       std::string &errorMessage);
+
+/**
+ * @brief Write the saved remarks, stop saving and keep the file
+ *
+ * Must be called before code generation: the ELF and COFF writers
+ * have no remarks section to point at a bitstream file.
+ *
+ * @param context Context passed to setupRemarksFile()
+ * @param file File returned by setupRemarksFile()
+ */
+void finishRemarksFile(llvm::LLVMContext &context, llvm::ToolOutputFile &file);
+
+} // namespace obfuscator
+
+#endif // PASS_PIPELINE_H
@@ -0,0 +1,128 @@
+/**
+ * @file pass_profiler.h
+ * @brief Pass Memory Profiler Header
+ * 
+ * Measures what each obfuscation pass costs in memory: resident set
+ * size, IR size (instructions and other values) and heap allocations,
+ * before and after every run on a function or module, plus the
+ * largest functions each pass touched. Enabled with
+ * -obfuscation-profile=<file.json>; the report is written at exit.
+ * 
+ * Allocation counts need the allocation hook (allocation_hook.cpp),
+ * which the native tools link in; under opt they are reported as null.
+ */
+
+#ifndef PASS_PROFILER_H
+#define PASS_PROFILER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace obfuscator {
+
+/**
+ * @struct AllocationCounters
+ * @brief Heap activity of one thread, as seen by the allocation hook
+ */
+struct AllocationCounters {
+    uint64_t allocations = 0;     ///< Calls to operator new
+    uint64_t allocatedBytes = 0;  ///< Bytes requested from operator new
+    uint64_t frees = 0;           ///< Calls to operator delete
+    uint64_t freedBytes = 0;      ///< Usable bytes returned to operator delete
+};
+
+/**
+ * @brief Count an allocation on the current thread (called by the hook)
+ * @param size Bytes allocated
+ */
+void recordAllocation(size_t size);
+
+/**
+ * @brief Count a free on the current thread (called by the hook)
+ * @param size Bytes freed
+ */
+void recordFree(size_t size);
+
+/**
+ * @brief Mark the allocation hook as linked in (called by the hook)
+ */
+void setAllocationHookInstalled();
+
+/**
+ * @brief Get the heap activity of the current thread so far
+ * @return Counters since the thread started
+ */
+AllocationCounters getThreadAllocationCounters();
+
+/**
+ * @brief Check if pass profiling was requested
+ * @return true if -obfuscation-profile names a file
+ */
+bool isPassProfilingEnabled();
+
+/**
+ * @brief Write the profile collected so far as JSON
+ * @param OS Output stream
+ */
+void writePassProfile(llvm::raw_ostream &OS);
+
+/**
+ * @class PassProfileScope
+ * @brief Measures one run of a pass on a function or module
+ * 
+ * Create at the top of runOnFunction/runOnModule; the run is
+ * measured until the object is destroyed. Costs one branch when
+ * profiling is off.
+ */
+class PassProfileScope {
+public:
+    /**
+     * @brief Start measuring a function pass run
+     * @param F Function being transformed
+     * @param passName Registered pass name
+     */
+    PassProfileScope(const llvm::Function &F, llvm::StringRef passName);
+    
+    /**
+     * @brief Start measuring a module pass run
+     * @param M Module being transformed
+     * @param passName Registered pass name
+     */
+    PassProfileScope(const llvm::Module &M, llvm::StringRef passName);
+    
+    ~PassProfileScope();
+    
+    PassProfileScope(const PassProfileScope &) = delete;
+    PassProfileScope &operator=(const PassProfileScope &) = delete;
+    
+    /**
+     * @struct IRSize
+     * @brief Size of the IR a pass works on
+     */
+    struct IRSize {
+        uint64_t instructions = 0;  ///< Instructions
+        uint64_t values = 0;        ///< Instructions, blocks, arguments and globals
+    };
+    
+private:
+    const llvm::Function *function_ = nullptr;
+    const llvm::Module *module_ = nullptr;
+    llvm::StringRef passName_;
+    bool active_ = false;
+    IRSize sizeBefore_;
+    uint64_t rssBefore_ = 0;
+    uint64_t heapBefore_ = 0;
+    AllocationCounters allocationsBefore_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace obfuscator
+
+#endif // PASS_PROFILER_H
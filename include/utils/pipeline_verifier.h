@@ -0,0 +1,123 @@
+/**
+ * @file pipeline_verifier.h
+ * @brief Tiered IR Verifier Header
+ *
+ * Checks the module after every pass of the obfuscation pipeline, at a
+ * cost chosen with -obfuscation-verify:
+ *
+ *   off         no checks
+ *   structural  cheap checks of every function, inline: terminators,
+ *               PHI placement and incoming blocks, cross-function uses
+ *   final       structural, plus the full verifier once on the module
+ *               the last pass left (the default)
+ *   sampled     structural, plus the full verifier on a deterministic
+ *               sample of functions (-obfuscation-verify-sample percent)
+ *   full        structural, plus the full verifier on the whole module
+ *
+ * For the sampled and full tiers the verifier runs on worker threads,
+ * in parallel with the next pass: the module is snapshotted to bitcode
+ * and read back into a private context, lazily for the sampled tier so
+ * only the sampled functions are materialized. Every verifier in the
+ * process shares one pool of -obfuscation-verify-threads workers, so
+ * tools obfuscating modules in parallel do not start a pool per module.
+ */
+
+#ifndef PIPELINE_VERIFIER_H
+#define PIPELINE_VERIFIER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace obfuscator {
+
+/**
+ * @enum VerifyLevel
+ * @brief How thoroughly the pipeline checks the IR after each pass
+ */
+enum class VerifyLevel {
+    Off,         ///< No checks
+    Structural,  ///< Cheap structural checks of every function
+    Final,       ///< Structural, plus the full verifier on the final module
+    Sampled,     ///< Structural, plus the full verifier on a sample of functions
+    Full         ///< Structural, plus the full verifier on every function
+};
+
+/**
+ * @brief Get the verification level selected on the command line
+ * @return Value of -obfuscation-verify
+ */
+VerifyLevel getVerifyLevel();
+
+/**
+ * @brief Run the cheap structural checks on a function
+ * @param F Function to check
+ * @param errorMessage Set to a description of the first problem found
+ * @return true if no problem was found
+ */
+bool checkFunctionStructure(const llvm::Function &F, std::string &errorMessage);
+
+/**
+ * @class PipelineVerifier
+ * @brief Verifies a module after each pass of a pipeline
+ *
+ * One verifier serves one module. Failures found on worker threads are
+ * reported by finish(), earliest pass first.
+ */
+class PipelineVerifier {
+public:
+    /**
+     * @brief Create a verifier
+     * @param level Verification level
+     */
+    explicit PipelineVerifier(VerifyLevel level = getVerifyLevel());
+
+    ~PipelineVerifier();
+
+    PipelineVerifier(const PipelineVerifier &) = delete;
+    PipelineVerifier &operator=(const PipelineVerifier &) = delete;
+
+    /**
+     * @brief Check a module after a pass ran on it
+     *
+     * Structural checks run now; full verification is queued.
+     *
+     * @param M Module the pass transformed
+     * @param passName Registered name of the pass
+     * @param errorMessage Set to a description of the failure, if any
+     * @return false if the structural checks failed; later passes
+     *         should not run on the module
+     */
+    bool check(const llvm::Module &M, llvm::StringRef passName, std::string &errorMessage);
+
+    /**
+     * @brief Wait for the queued verification
+     *
+     * At VerifyLevel::Final, also runs the full verifier on the module
+     * the last pass left.
+     *
+     * @param errorMessage Set to the failure after the earliest pass, if any
+     * @param M Module after the last pass; nullptr when a check failed
+     * @return true if every check passed
+     */
+    bool finish(std::string &errorMessage, const llvm::Module *M = nullptr);
+
+private:
+    void fail(unsigned checkIndex, std::string message);
+
+    VerifyLevel level_;
+    std::vector<std::shared_future<void>> queued_;
+    std::mutex mutex_;
+    unsigned checks_ = 0;
+    std::string lastPass_;
+    unsigned failedCheck_ = ~0u;
+    std::string failure_;
+};
+
+} // namespace obfuscator
+
+#endif // PIPELINE_VERIFIER_H
@@ -0,0 +1,118 @@
+/**
+ * @file struct_escape_analysis.h
+ * @brief Struct Escape Analysis Header
+ * 
+ * Whole-module analysis that finds struct types whose layout is
+ * private to the module, i.e. every object of the type is created,
+ * accessed and freed by code we can see and rewrite.
+ */
+
+#ifndef STRUCT_ESCAPE_ANALYSIS_H
+#define STRUCT_ESCAPE_ANALYSIS_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace obfuscator {
+
+/**
+ * @struct StructAccesses
+ * @brief Every place a non-escaping struct's layout is relied upon
+ */
+struct StructAccesses {
+    std::vector<llvm::AllocaInst*> allocas;         ///< Stack objects of the type
+    std::vector<llvm::GetElementPtrInst*> geps;     ///< Field and element address computations
+    std::vector<llvm::Instruction*> fieldZeroAccesses; ///< Loads/stores straight through an object pointer
+    std::vector<llvm::Instruction*> fills;          ///< memsets of whole objects and callocs writing every field at once
+};
+
+/**
+ * @class StructEscapeAnalysis
+ * @brief Finds struct types whose layout can be changed module-wide
+ * 
+ * A struct escapes if its layout could be observed by code outside
+ * the module: it appears in a signature, a global, a by-value load or
+ * store, another aggregate, a constant expression, or a pointer to one
+ * of its objects reaches anything other than field accesses, internal
+ * callees, memset of whole objects and free. Loads and stores straight
+ * through an object pointer must have the type of field 0. Object pointers are tracked through SSA,
+ * internal calls, and pointer slots (pointer fields of other
+ * non-escaping structs and local pointer allocas).
+ * 
+ * Requires opaque pointers; with typed pointers every struct escapes.
+ */
+class StructEscapeAnalysis {
+public:
+    /**
+     * @brief Analyze a module
+     * @param M Module to analyze; should be the whole program (LTO)
+     */
+    explicit StructEscapeAnalysis(llvm::Module &M);
+    
+    /**
+     * @brief Get struct types whose layout never escapes the module
+     * @return Non-escaping struct types, in a deterministic order
+     */
+    const std::vector<llvm::StructType*> &getNonEscapingStructs() const { return nonEscaping_; }
+    
+    /**
+     * @brief Check if a struct's layout never escapes the module
+     * @param S Struct type
+     * @return true if S can be rewritten
+     */
+    bool isNonEscaping(llvm::StructType *S) const;
+    
+    /**
+     * @brief Get the accesses that depend on a non-escaping struct's layout
+     * @param S Non-escaping struct type
+     * @return Accesses to rewrite if the layout of S changes
+     */
+    const StructAccesses &getAccesses(llvm::StructType *S) const;
+    
+    /**
+     * @brief Get why a struct escapes
+     * @param S Struct type
+     * @return Human-readable reason, empty if S does not escape
+     */
+    std::string getEscapeReason(llvm::StructType *S) const;
+    
+private:
+    /// A memory location holding object pointers: a (struct, field) pair
+    /// or a local pointer alloca
+    using PointerSlot = std::pair<const void*, unsigned>;
+    
+    void findCandidates(llvm::Module &M);
+    void rejectNestedAndSignatureUses(llvm::Module &M);
+    void collectAccesses(llvm::Module &M);
+    bool trackObjectPointers(llvm::StructType *S);
+    bool checkOrigin(llvm::StructType *S, llvm::Value *P,
+                     std::vector<llvm::Value*> &worklist);
+    bool checkUse(llvm::StructType *S, llvm::Value *P, llvm::User *U,
+                  std::vector<llvm::Value*> &worklist);
+    bool getPointerSlot(llvm::Value *address, PointerSlot &slot) const;
+    bool isTrackedSlot(const PointerSlot &slot) const;
+    size_t countSlotAccesses() const;
+    void rejectTypesIn(llvm::Type *T, const std::string &reason);
+    void reject(llvm::StructType *S, const std::string &reason);
+    
+    const llvm::DataLayout &DL_;
+    llvm::SetVector<llvm::StructType*> candidates_;
+    std::map<llvm::StructType*, std::string> escapeReasons_;
+    std::map<llvm::StructType*, StructAccesses> accesses_;
+    std::map<PointerSlot, std::vector<llvm::LoadInst*>> slotLoads_;
+    std::map<PointerSlot, std::vector<llvm::StoreInst*>> slotStores_;
+    std::vector<llvm::StructType*> nonEscaping_;
+};
+
+} // namespace obfuscator
+
+#endif // STRUCT_ESCAPE_ANALYSIS_H
@@ -0,0 +1,361 @@
+/**
+ * @file block_splitting.cpp
+ * @brief Block Splitting Pass
+ * 
+ * This pass splits large basic blocks into pieces of about
+ * `granularity` instructions before flattening, which turns every
+ * block into a state of the dispatcher. Without it a large block stays
+ * one obvious chunk, and a small function yields a dispatcher with two
+ * or three states.
+ * 
+ * Each piece costs a trip through the dispatcher at run time, plus a
+ * spill and reload for every value live across the cut once flattening
+ * demotes it. A cost model weighs that against how often the block
+ * runs, estimated from the profile or, without one, from static branch
+ * probabilities:
+ *   - blocks running at most once per call are split at full
+ *     granularity, blocks in lukewarm loops at most once, and blocks
+ *     running more often than max_block_frequency times per call, or in
+ *     loops the profile marks hot, not at all;
+ *   - each cut goes where the fewest values are live across it, near
+ *     its ideal position;
+ *   - the cheapest cuts are taken first, until they would add more than
+ *     max_overhead_percent to the instructions the function runs per
+ *     call (but at least kMinDispatchCost instructions).
+ * A compare stays with the branch that uses it, so the code generator
+ * can still fuse them, and a tail call stays with its return.
+ * 
+ * Small functions get a finer granularity, so that flattening gives
+ * them at least min_states states where there are instructions enough.
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+
+#include "llvm/Pass.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "block-splitting"
+
+static cl::opt<unsigned> BlockSplittingGranularity(
+    "block-splitting-granularity", cl::init(8),
+    cl::desc("Instructions per piece when splitting blocks for flattening"));
+
+/// Instructions one trip through the flattened dispatcher takes: the
+/// state store, the branch, and the dispatcher's load and switch
+const double kDispatchCost = 4;
+
+/// Instructions a value live across a cut takes once demoted: a store and a reload
+const double kSpillCost = 2;
+
+/// Instructions per call any function may spend on dispatching its
+/// pieces, however short it runs
+const double kMinDispatchCost = 32;
+
+namespace {
+
+/**
+ * @brief A place to split a block and what it costs
+ */
+struct Cut {
+    BasicBlock *block;
+    Instruction *before;  ///< First instruction of the new piece
+    double cost;          ///< Estimated instructions per call of the function
+};
+
+/**
+ * @class BlockSplittingPass
+ * @brief LLVM pass splitting blocks ahead of flattening
+ */
+class BlockSplittingPass : public obfuscator::ObfuscationPass {
+public:
+    static char ID; // Pass identification
+    
+    BlockSplittingPass() : ObfuscationPass(ID, "block-splitting", "BlockSplittingPass") {}
+    
+protected:
+    /**
+     * @brief Main pass execution
+     * @param F Function to transform
+     * @return true if function was modified
+     */
+    bool transform(Function &F) override {
+        // GC statepoints and their relocations must share a block
+        if (F.hasGC()) {
+            return false;
+        }
+        
+        unsigned granularity = BlockSplittingGranularity.getNumOccurrences()
+                                   ? BlockSplittingGranularity
+                                   : static_cast<unsigned>(config().getInt("granularity",
+                                                                           BlockSplittingGranularity));
+        uint64_t minStates = config().getInt("min_states", 4);
+        double maxFrequency = config().getDouble("max_block_frequency", 4.0);
+        double maxOverhead = config().getDouble("max_overhead_percent", 10.0) / 100;
+        
+        // Small functions split finer
+        if (minStates) {
+            granularity = std::min<uint64_t>(granularity,
+                                             std::max<uint64_t>(2, F.getInstructionCount() / minStates));
+        }
+        granularity = std::max(granularity, 2u);
+        
+        // Most functions have no block large enough; they need no
+        // frequencies
+        bool hasLargeBlock = false;
+        for (auto &BB : F) {
+            hasLargeBlock |= BB.sizeWithoutDebug() > granularity;
+        }
+        if (!hasLargeBlock) {
+            return false;
+        }
+        
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        BranchProbabilityInfo BPI(F, LI);
+        BlockFrequencyInfo BFI(F, BPI, LI);
+        std::set<const BasicBlock*> hotBlocks = obfuscator::findHotLoopBlocks(F);
+        double entryFrequency = static_cast<double>(BFI.getEntryFreq());
+        
+        // Leave out the hot blocks; the instructions run per call set
+        // what the cuts may cost
+        std::vector<std::pair<BasicBlock*, double>> candidates;
+        double instructionsPerCall = 0;
+        for (auto &BB : F) {
+            double frequency = BFI.getBlockFreq(&BB).getFrequency() / entryFrequency;
+            instructionsPerCall += frequency * BB.sizeWithoutDebug();
+            if (BB.sizeWithoutDebug() <= granularity) {
+                continue;
+            }
+            if (hotBlocks.count(&BB) || frequency > maxFrequency) {
+                remarks().emit([&] {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "HotBlock", BB.getTerminator())
+                           << "block not split: it runs "
+                           << ore::NV("Frequency", static_cast<uint64_t>(frequency + 0.5))
+                           << " times per call";
+                });
+                continue;
+            }
+            // Flattening keeps loops with transformation hints whole
+            Loop *L = LI.getLoopFor(&BB);
+            if (!L || !L->getLoopID()) {
+                candidates.push_back({&BB, frequency});
+            }
+        }
+        
+        std::vector<Cut> cuts;
+        for (auto &candidate : candidates) {
+            // A block that may run several times per call gets one cut
+            findCuts(*candidate.first, granularity, candidate.second, candidate.second > 1.0 ? 1 : ~0u, cuts);
+        }
+        
+        // Cheapest first, within the runtime and growth budgets; each
+        // cut adds a branch
+        std::stable_sort(cuts.begin(), cuts.end(),
+                         [](const Cut &a, const Cut &b) { return a.cost < b.cost; });
+        double maxCost = std::max(kMinDispatchCost, maxOverhead * instructionsPerCall);
+        double totalCost = 0;
+        std::vector<Cut> taken;
+        for (const Cut &cut : cuts) {
+            if (totalCost + cut.cost > maxCost) {
+                break;
+            }
+            if (!budget().tryCharge(1)) {
+                break;
+            }
+            totalCost += cut.cost;
+            taken.push_back(cut);
+        }
+        if (taken.empty()) {
+            return false;
+        }
+        
+        // Split each block from its last cut backwards; the pieces are
+        // numbered in order after the block they came from
+        std::map<BasicBlock*, std::vector<Instruction*>> cutsOf;
+        for (const Cut &cut : taken) {
+            cutsOf[cut.block].push_back(cut.before);
+        }
+        for (auto &entry : cutsOf) {
+            BasicBlock *BB = entry.first;
+            std::vector<Instruction*> &points = entry.second;
+            std::sort(points.begin(), points.end(),
+                      [](Instruction *a, Instruction *b) { return a->comesBefore(b); });
+            remarks().emit([&] {
+                OptimizationRemark remark(DEBUG_TYPE, "BlockSplit", BB->getTerminator());
+                remark << "split ";
+                if (BB->hasName()) {
+                    remark << "block " << ore::NV("Block", BB->getName()) << " ";
+                }
+                remark << "into " << ore::NV("Pieces", static_cast<unsigned>(points.size() + 1)) << " pieces";
+                return remark;
+            });
+            for (size_t i = points.size(); i-- > 0;) {
+                BB->splitBasicBlock(points[i], BB->getName() + ".split" + Twine(i + 1));
+            }
+        }
+        addStatistic("BlocksSplit", cutsOf.size());
+        addStatistic("Cuts", taken.size());
+        addStatistic("DispatchCost", static_cast<uint64_t>(totalCost + 0.5));
+        
+        return true;
+    }
+    
+private:
+    /**
+     * @brief Find where a block is cut into pieces
+     * 
+     * Pieces are about granularity instructions long, with their
+     * boundaries moved by up to a quarter of that at random. Each cut
+     * then goes to the place within half a piece of its ideal position
+     * where the fewest values are live across it.
+     * 
+     * @param BB Block to cut
+     * @param granularity Instructions per piece
+     * @param frequency Runs of the block per call of the function
+     * @param maxCuts Most cuts to make in the block
+     * @param cuts Cuts are appended here
+     */
+    void findCuts(BasicBlock &BB, unsigned granularity, double frequency, unsigned maxCuts,
+                  std::vector<Cut> &cuts) {
+        // The instructions a piece may start with: none before the
+        // first insertion point, nor the entry block's allocas
+        BasicBlock::iterator first = BB.getFirstInsertionPt();
+        if (first == BB.end()) {
+            return;
+        }
+        std::vector<Instruction*> body;
+        for (Instruction &I : make_range(first, BB.end())) {
+            if (!isa<DbgInfoIntrinsic>(I) && !(BB.isEntryBlock() && isa<AllocaInst>(I))) {
+                body.push_back(&I);
+            }
+        }
+        if (body.size() <= granularity) {
+            return;
+        }
+        unsigned wanted = std::min<unsigned>(maxCuts, (body.size() - 1) / granularity);
+        
+        // Every piece keeps an instruction; the last one besides the
+        // group ending the block
+        long lastCut = static_cast<long>(findEndGroup(BB, body)) - 1;
+        std::vector<unsigned> live = countLiveAcross(body);
+        long previous = 0;
+        for (unsigned j = 1; j <= wanted; j++) {
+            long jitter = static_cast<long>(plan().next([&] {
+                return nextRandom() % (granularity / 2 + 1);
+            })) - static_cast<long>(granularity / 4);
+            long ideal = static_cast<long>(j * body.size() / (wanted + 1)) + jitter;
+            long low = std::max<long>(previous + 1, ideal - granularity / 2);
+            long high = std::min<long>(lastCut, ideal + granularity / 2);
+            if (low > high) {
+                continue;
+            }
+            long best = low;
+            for (long i = low + 1; i <= high; i++) {
+                if (live[i] < live[best] ||
+                    (live[i] == live[best] && std::labs(i - ideal) < std::labs(best - ideal))) {
+                    best = i;
+                }
+            }
+            cuts.push_back({&BB, body[best], frequency * (kDispatchCost + kSpillCost * live[best])});
+            previous = best;
+        }
+    }
+    
+    /**
+     * @brief Find the group of instructions that ends a block
+     * 
+     * The terminator, back to the compare of a conditional branch, which
+     * x86-64 fuses with the jump, or to the tail call of a return.
+     * 
+     * @param BB Block to scan
+     * @param body Instructions of the block a piece may start with
+     * @return Index in body of the first instruction of the group
+     */
+    size_t findEndGroup(BasicBlock &BB, const std::vector<Instruction*> &body) {
+        Instruction *head = BB.getTerminator();
+        auto *branch = dyn_cast<BranchInst>(head);
+        if (branch && branch->isConditional()) {
+            auto *compare = dyn_cast<CmpInst>(branch->getCondition());
+            if (compare && compare->getParent() == &BB) {
+                head = compare;
+            }
+        } else if (isa<ReturnInst>(head)) {
+            auto *call = dyn_cast_or_null<CallInst>(head->getPrevNonDebugInstruction());
+            if (call && call->isTailCall()) {
+                head = call;
+            }
+        }
+        auto found = std::find(body.begin(), body.end(), head);
+        return found == body.end() ? body.size() - 1 : found - body.begin();
+    }
+    
+    /**
+     * @brief Count the values live across each place a block may be cut
+     * @param body Instructions of the block
+     * @return For each index, the values defined before that instruction
+     *         and used by it or after it within the block
+     */
+    std::vector<unsigned> countLiveAcross(const std::vector<Instruction*> &body) {
+        std::map<const Instruction*, size_t> position;
+        for (size_t i = 0; i < body.size(); i++) {
+            position[body[i]] = i;
+        }
+        
+        // A value defined at i and last used at j is live across the
+        // cuts i+1 .. j
+        std::vector<int> delta(body.size() + 1, 0);
+        for (size_t i = 0; i < body.size(); i++) {
+            size_t lastUse = i;
+            for (User *user : body[i]->users()) {
+                auto found = position.find(dyn_cast<Instruction>(user));
+                if (found != position.end()) {
+                    lastUse = std::max(lastUse, found->second);
+                }
+            }
+            if (lastUse > i) {
+                delta[i + 1]++;
+                delta[lastUse + 1]--;
+            }
+        }
+        std::vector<unsigned> live(body.size(), 0);
+        int running = 0;
+        for (size_t i = 0; i < body.size(); i++) {
+            running += delta[i];
+            live[i] = running;
+        }
+        return live;
+    }
+    
+    /**
+     * @brief Get pass name
+     */
+    StringRef getPassName() const override {
+        return "BlockSplitting";
+    }
+};
+
+} // anonymous namespace
+
+char BlockSplittingPass::ID = 0;
+
+// Register the pass
+static obfuscator::RegisterObfuscationPass<BlockSplittingPass> X("block-splitting",
+                                                                 "Split large blocks ahead of flattening");
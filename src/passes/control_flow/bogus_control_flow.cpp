@@ -6,6 +6,9 @@
  * It inserts bogus basic blocks and branches that never execute.
  */
 
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
@@ -16,45 +19,76 @@
 
 using namespace llvm;
 
+#define DEBUG_TYPE "bogus-control-flow"
+
+/// Instructions one bogus block adds: the head's branch and the bogus block
+const uint64_t kBogusBlockCost = 2;
+
 namespace {
 
 /**
  * @class BogusControlFlowPass
  * @brief LLVM pass for adding bogus control flow
  */
-class BogusControlFlowPass : public FunctionPass {
+class BogusControlFlowPass : public obfuscator::ObfuscationPass {
 public:
     static char ID; // Pass identification
     
-    BogusControlFlowPass() : FunctionPass(ID) {}
-    
+    BogusControlFlowPass()
+        : ObfuscationPass(ID, "bogus-control-flow", "BogusControlFlowPass") {}
+        
+protected:
     /**
      * @brief Main pass execution
      * @param F Function to transform
      * @return true if function was modified
      */
-    bool runOnFunction(Function &F) override {
-        errs() << "BogusControlFlowPass: Processing function " << F.getName() << "\n";
-        
-        // Skip functions that shouldn't be obfuscated
-        if (F.isDeclaration() || F.size() < 2) {
+    bool transform(Function &F) override {
+        if (F.size() < 2) {
             return false;
         }
         
-        bool modified = false;
+        // Tail calls return from their own block, so no fake branch can
+        // come between them and the return
+        bool changed = obfuscator::duplicateReturnsForTailCalls(F) > 0;
         
-        // Process each basic block
+        // Collect targets first; the transform adds blocks to F
+        probabilityPercent = static_cast<unsigned>(config().getDouble("probability", 0.5) * 100);
+        uint64_t maxBlocks = config().getInt("max_bogus_blocks", 0);
+        std::vector<BasicBlock*> targets;
         for (auto &BB : F) {
-            if (shouldAddBogusControlFlow(BB)) {
-                addBogusControlFlow(BB, F);
-                modified = true;
+            if (maxBlocks && targets.size() == maxBlocks) {
+                break;
+            }
+            if (plan().next([&] { return shouldAddBogusControlFlow(BB); }) &&
+                budget().tryCharge(kBogusBlockCost)) {
+                targets.push_back(&BB);
             }
         }
         
-        return modified;
+        // Each bogus block gets its own discriminator so sample profiles
+        // keep it apart from the real code on the same line
+        unsigned discriminator = obfuscator::getNextFreeDiscriminator(F);
+        for (BasicBlock *BB : targets) {
+            remarks().emit([&] {
+                OptimizationRemark remark(DEBUG_TYPE, "BogusFlowAdded",
+                                          obfuscator::getInsertionDebugLoc(*BB), BB);
+                remark << "added bogus control flow";
+                if (BB->hasName()) {
+                    remark << " to block " << ore::NV("Block", BB->getName());
+                }
+                return remark;
+            });
+            addBogusControlFlow(*BB, F, discriminator++);
+        }
+        addStatistic("BogusBlocks", targets.size());
+        
+        return changed || !targets.empty();
     }
     
 private:
+    unsigned probabilityPercent = 50;
+    
     /**
      * @brief Check if bogus control flow should be added to a basic block
      * @param BB Basic block to check
@@ -66,32 +100,50 @@ private:
             return false;
         }
         
-        // Random probability check (50% chance)
-        return (rand() % 100) < 50;
+        // A catchswitch is both the pad and the terminator; no branch
+        // fits in between. Other EH pads stay at the head of the block
+        if (BB.getFirstInsertionPt() == BB.end()) {
+            return false;
+        }
+        
+        // Random probability check (50% unless configured)
+        return (nextRandom() % 100) < probabilityPercent;
     }
     
     /**
      * @brief Add bogus control flow to a basic block
      * @param BB Basic block to modify
      * @param F Function containing the block
+     * @param discriminator Debug discriminator for the inserted code
      */
-    void addBogusControlFlow(BasicBlock &BB, Function &F) {
+    void addBogusControlFlow(BasicBlock &BB, Function &F, unsigned discriminator) {
+        // Split the PHI nodes off so the fake branch can go in front of
+        // the body; BB keeps the body and its edges to the successors
+        BasicBlock *headBB = obfuscator::splitBlockHead(BB);
+        BasicBlock *bodyBB = &BB;
+        DebugLoc bogusLoc = obfuscator::getSyntheticDebugLoc(
+            obfuscator::getInsertionDebugLoc(*bodyBB), discriminator);
+        
         // Create bogus basic block
-        BasicBlock *bogusBB = BasicBlock::Create(F.getContext(), "bogus_" + BB.getName(), &F);
+        BasicBlock *bogusBB = BasicBlock::Create(F.getContext(), "bogus_" + headBB->getName(), &F, bodyBB);
         
         // Add fake instructions to bogus block
         IRBuilder<> builder(bogusBB);
+        builder.SetCurrentDebugLocation(bogusLoc);
         Value *fake1 = builder.CreateAdd(builder.getInt32(0), builder.getInt32(0));
         Value *fake2 = builder.CreateMul(fake1, builder.getInt32(1));
-        builder.CreateBr(&BB);
+        builder.CreateBr(bodyBB);
         
-        // Insert fake branch in original block
-        IRBuilder<> origBuilder(&BB);
+        // Replace the split branch with a fake branch that always takes the body
+        Instruction *splitBranch = headBB->getTerminator();
+        IRBuilder<> origBuilder(splitBranch);
+        origBuilder.SetCurrentDebugLocation(bogusLoc);
         Value *condition = origBuilder.CreateICmpEQ(
             origBuilder.getInt32(0), 
             origBuilder.getInt32(0)
         );
-        origBuilder.CreateCondBr(condition, bogusBB, &BB);
+        origBuilder.CreateCondBr(condition, bodyBB, bogusBB);
+        splitBranch->eraseFromParent();
     }
     
     /**
@@ -107,6 +159,5 @@ private:
 char BogusControlFlowPass::ID = 0;
 
 // Register the pass
-static RegisterPass<BogusControlFlowPass> X("bogus-control-flow", 
-                                          "Add bogus control flow to functions",
-                                          false, false);
+static obfuscator::RegisterObfuscationPass<BogusControlFlowPass> X("bogus-control-flow",
+                                                                   "Add bogus control flow to functions");
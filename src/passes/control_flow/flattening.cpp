@@ -6,37 +6,136 @@
  * to make the program flow harder to follow.
  */
 
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+
 #include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+
+#include <map>
+#include <set>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "flattening"
+
 namespace {
 
+/**
+ * @struct KeptLoops
+ * @brief Loops left intact by flattening, with their preheaders
+ * 
+ * A kept loop is entered from the dispatcher through its preheader
+ * and leaves through exit stubs back to the dispatcher; its own edges,
+ * PHI nodes and llvm.loop metadata are untouched, so the vectorizer
+ * and unroller still see a canonical loop carrying its hints.
+ */
+struct KeptLoops {
+    std::map<BasicBlock*, BasicBlock*> headerOf;  ///< Loop blocks, preheaders and exit stubs to their loop header
+    std::set<BasicBlock*> preheaders;              ///< Preheaders; their branch to the header is kept
+    std::vector<BasicBlock*> exitStubs;            ///< Dedicated exits; they branch to the dispatcher
+    bool mustProgress = false;                     ///< Every loop in the function must make progress
+    
+    /**
+     * @brief Check if a block is a kept loop block or exit stub, which
+     *        the dispatcher never enters
+     */
+    bool isKept(BasicBlock *BB) const {
+        return headerOf.count(BB) && !preheaders.count(BB);
+    }
+};
+
+/**
+ * @brief Check if a loop carries transformation hints
+ * @param L Loop to check
+ * @return true if its llvm.loop metadata has properties other than mustprogress
+ */
+bool hasTransformationHints(const Loop &L) {
+    MDNode *loopID = L.getLoopID();
+    if (!loopID) {
+        return false;
+    }
+    for (const MDOperand &operand : drop_begin(loopID->operands())) {
+        auto *property = dyn_cast<MDNode>(operand);
+        if (!property || property->getNumOperands() == 0) {
+            continue;
+        }
+        auto *name = dyn_cast<MDString>(property->getOperand(0));
+        if (name && name->getString().startswith("llvm.loop.") &&
+            name->getString() != "llvm.loop.mustprogress") {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * @class FlatteningPass
  * @brief LLVM pass for control flow flattening
  */
-class FlatteningPass : public FunctionPass {
+class FlatteningPass : public obfuscator::ObfuscationPass {
 public:
     static char ID; // Pass identification
     
-    FlatteningPass() : FunctionPass(ID) {}
+    FlatteningPass() : ObfuscationPass(ID, "flattening", "FlatteningPass") {}
     
+protected:
     /**
      * @brief Main pass execution
      * @param F Function to transform
      * @return true if function was modified
      */
-    bool runOnFunction(Function &F) override {
-        errs() << "FlatteningPass: Processing function " << F.getName() << "\n";
-        
+    bool transform(Function &F) override {
         if (F.size() <= 1) return false;
         
+        OptimizationRemarkEmitter &ORE = remarks();
+        if (Instruction *blocker = findUnflattenableEdge(F)) {
+            ORE.emit([&] {
+                return OptimizationRemarkMissed(DEBUG_TYPE, "NotFlattened", blocker)
+                       << "not flattened: " << ore::NV("Instruction", blocker->getOpcodeName())
+                       << " edges cannot go through the dispatcher";
+            });
+            return false;
+        }
+        
+        // The whole function or nothing
+        if (!budget().tryCharge(estimateGrowth(F))) {
+            return false;
+        }
+        
+        // Keep only allocas in the entry block; everything else
+        // goes behind the dispatcher
+        BasicBlock &entry = F.getEntryBlock();
+        BasicBlock::iterator firstNonAlloca = entry.begin();
+        while (isa<AllocaInst>(*firstNonAlloca)) {
+            ++firstNonAlloca;
+        }
+        entry.splitBasicBlock(firstNonAlloca, "entry.body");
+        
+        // Returns stay direct; a tail call that branched to a shared
+        // return would otherwise reach it through the dispatcher, with
+        // its result spilled to the stack
+        obfuscator::duplicateReturnsForTailCalls(F);
+        
+        // Loops with vectorize or unroll hints, and hot loops, stay intact
+        KeptLoops kept = findKeptLoops(F, ORE);
+        
+        // Invokes keep both their edges
+        std::set<BasicBlock*> continuations = splitInvokeContinuations(F, kept);
+        
+        // Blocks no longer dominate each other once they are
+        // reached through the dispatcher
+        demoteCrossBlockValues(F, kept);
+        
         // Create state variable
         AllocaInst *stateVar = createStateVariable(F);
         
@@ -44,21 +143,296 @@ public:
         BasicBlock *dispatcher = createDispatcherBlock(F, stateVar);
         
         // Restructure basic blocks
-        restructureBasicBlocks(F, dispatcher, stateVar);
+        unsigned numStates = restructureBasicBlocks(F, dispatcher, stateVar, kept, continuations);
+        ORE.emit([&] {
+            return OptimizationRemark(DEBUG_TYPE, "Flattened", &F)
+                   << "flattened " << ore::NV("Function", &F) << " with "
+                   << ore::NV("States", numStates) << " states";
+        });
+        addStatistic("FunctionsFlattened");
+        addStatistic("States", numStates);
         
         return true;
     }
     
 private:
+    /**
+     * @brief Estimate the instructions flattening adds to a function
+     * 
+     * An upper bound: values that end up staying in registers, such as
+     * those of kept loops, are charged as if they were demoted.
+     * 
+     * @param F Function to flatten
+     * @return Instructions to charge against the budget
+     */
+    uint64_t estimateGrowth(Function &F) {
+        // The state variable, its first store, the branch to the
+        // dispatcher and the dispatcher's load and switch; then a state
+        // store and select per block
+        uint64_t growth = 5 + 2 * F.size();
+        
+        // A demoted PHI gets a slot, a store per incoming edge and a
+        // reload. A value used in other blocks, the PHI's reload
+        // included, gets a slot, a store and a reload per such use
+        // (uses in PHIs become the PHI's stores)
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                if (auto *phi = dyn_cast<PHINode>(&I)) {
+                    growth += 2 + phi->getNumIncomingValues();
+                }
+                uint64_t reloads = 0;
+                for (User *user : I.users()) {
+                    auto *userInst = cast<Instruction>(user);
+                    reloads += userInst->getParent() != &BB && !isa<PHINode>(userInst);
+                }
+                if (reloads) {
+                    growth += 2 + reloads;
+                }
+            }
+        }
+        return growth;
+    }
+    
+    /**
+     * @brief Find what keeps a function from being flattened
+     * @param F Function to check
+     * @return First instruction with an edge the dispatcher cannot express,
+     *         or nullptr if the function can be flattened
+     */
+    Instruction* findUnflattenableEdge(Function &F) {
+        for (auto &BB : F) {
+            // Landing pads are reached straight from their invokes, but
+            // funclet pads (catchswitch, catchpad, cleanuppad) and
+            // indirect edges cannot be routed through the switch
+            if (BB.isEHPad() && !BB.isLandingPad()) {
+                return BB.getFirstNonPHI();
+            }
+            if (isa<IndirectBrInst>(BB.getTerminator()) ||
+                isa<CallBrInst>(BB.getTerminator())) {
+                return BB.getTerminator();
+            }
+        }
+        return nullptr;
+    }
+    
+    /**
+     * @brief Find the loops to leave intact and give each a preheader and exit stubs
+     * 
+     * Loops with transformation hints are kept for the optimizer, and
+     * loops the profile marks hot so no state store lands in them.
+     * 
+     * @param F Function to scan
+     * @param ORE Remark emitter for the kept loops
+     * @return Kept loops; empty if F has neither loop metadata nor hot loops
+     */
+    KeptLoops findKeptLoops(Function &F, OptimizationRemarkEmitter &ORE) {
+        KeptLoops kept;
+        
+        // Only hints and profiles need the loop analyses; most
+        // functions have neither
+        std::set<const BasicBlock*> hotBlocks = obfuscator::findHotLoopBlocks(F);
+        bool hasLoopMetadata = !hotBlocks.empty();
+        for (auto &BB : F) {
+            if (BB.getTerminator()->hasMetadata(LLVMContext::MD_loop)) {
+                hasLoopMetadata = true;
+                break;
+            }
+        }
+        if (!hasLoopMetadata) {
+            return kept;
+        }
+        
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        std::vector<Loop*> hinted;
+        std::set<Loop*> hot;
+        kept.mustProgress = true;
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            kept.mustProgress &= isMustProgress(L);
+            
+            // Outermost hinted loops only; inner ones come with them
+            bool insideHinted = false;
+            for (Loop *outer : hinted) {
+                insideHinted |= outer->contains(L);
+            }
+            if (!insideHinted && hasTransformationHints(*L)) {
+                hinted.push_back(L);
+            } else if (!insideHinted && hotBlocks.count(L->getHeader())) {
+                hinted.push_back(L);
+                hot.insert(L);
+            }
+        }
+        
+        std::vector<BasicBlock*> headers;
+        for (Loop *L : hinted) {
+            BasicBlock *preheader = L->getLoopPreheader();
+            if (!preheader) {
+                preheader = InsertPreheaderForLoop(L, &DT, &LI, nullptr, false);
+            }
+            if (!preheader) {
+                continue;
+            }
+            BasicBlock *header = L->getHeader();
+            for (BasicBlock *BB : L->blocks()) {
+                kept.headerOf[BB] = header;
+            }
+            kept.headerOf[preheader] = header;
+            kept.preheaders.insert(preheader);
+            headers.push_back(header);
+            
+            ORE.emit([&] {
+                return OptimizationRemarkAnalysis(DEBUG_TYPE, "LoopKept", L->getStartLoc(), header)
+                       << (hot.count(L) ? "loop not flattened: it is hot in the profile"
+                                        : "loop not flattened: it carries transformation hints");
+            });
+        }
+        if (headers.empty()) {
+            return kept;
+        }
+        
+        // Give every exit edge a stub of its own: the stubs enter the
+        // state machine, so the loop blocks keep their terminators
+        std::vector<BasicBlock*> loopBlocks;
+        for (auto &BB : F) {
+            if (kept.isKept(&BB)) {
+                loopBlocks.push_back(&BB);
+            }
+        }
+        for (BasicBlock *BB : loopBlocks) {
+            Instruction *terminator = BB->getTerminator();
+            std::map<BasicBlock*, BasicBlock*> stubFor;
+            for (unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
+                BasicBlock *successor = terminator->getSuccessor(i);
+                auto region = kept.headerOf.find(successor);
+                if (region != kept.headerOf.end() && region->second == kept.headerOf[BB] &&
+                    !kept.preheaders.count(successor)) {
+                    continue;
+                }
+                // Unwind edges must lead straight to the landing pad
+                if (successor->isEHPad()) {
+                    continue;
+                }
+                BasicBlock *&stub = stubFor[successor];
+                if (!stub) {
+                    stub = BasicBlock::Create(F.getContext(), BB->getName() + ".exit", &F, successor);
+                    BranchInst::Create(successor, stub)->setDebugLoc(terminator->getDebugLoc());
+                    for (PHINode &phi : successor->phis()) {
+                        Value *incoming = phi.getIncomingValueForBlock(BB);
+                        while (phi.getBasicBlockIndex(BB) >= 0) {
+                            phi.removeIncomingValue(BB, false);
+                        }
+                        phi.addIncoming(incoming, stub);
+                    }
+                    kept.headerOf[stub] = kept.headerOf[BB];
+                    kept.exitStubs.push_back(stub);
+                }
+                terminator->setSuccessor(i, stub);
+            }
+        }
+        
+        // Values leaving a loop pass through PHIs in its stubs, so they
+        // are spilled on the way out rather than on every iteration
+        DominatorTree exitDT(F);
+        LoopInfo exitLI(exitDT);
+        for (BasicBlock *header : headers) {
+            formLCSSA(*exitLI.getLoopFor(header), exitDT, &exitLI, nullptr);
+        }
+        return kept;
+    }
+    
+    /**
+     * @brief Give the normal edge of every invoke a block of its own
+     * 
+     * An invoke result only exists on the normal edge, so neither the
+     * dispatcher nor a stack slot written in front of the invoke can
+     * carry it. The continuation block is entered straight from the
+     * invoke, where the result is stored, and then goes on through the
+     * dispatcher like a landing pad does.
+     * 
+     * @param F Function to update
+     * @param kept Loops whose invokes stay as they are
+     * @return Continuation blocks of the invokes outside kept loops
+     */
+    std::set<BasicBlock*> splitInvokeContinuations(Function &F, const KeptLoops &kept) {
+        std::vector<InvokeInst*> invokes;
+        for (auto &BB : F) {
+            auto *invoke = dyn_cast<InvokeInst>(BB.getTerminator());
+            if (invoke && !kept.isKept(&BB)) {
+                invokes.push_back(invoke);
+            }
+        }
+        
+        std::set<BasicBlock*> continuations;
+        for (InvokeInst *invoke : invokes) {
+            BasicBlock *normal = invoke->getNormalDest();
+            if (!normal->getSinglePredecessor() || !normal->phis().empty()) {
+                normal = SplitEdge(invoke->getParent(), normal);
+            }
+            continuations.insert(normal);
+        }
+        return continuations;
+    }
+    
+    /**
+     * @brief Move values used across blocks to the stack
+     * @param F Function to update
+     * @param kept Loops whose own values stay in registers
+     */
+    void demoteCrossBlockValues(Function &F, const KeptLoops &kept) {
+        Instruction *allocaPoint = F.getEntryBlock().getTerminator();
+        
+        // Within a kept loop and its preheader, definitions still
+        // dominate their uses
+        auto staysInKeptLoop = [&](Instruction &I) {
+            auto region = kept.headerOf.find(I.getParent());
+            if (region == kept.headerOf.end()) {
+                return false;
+            }
+            for (User *user : I.users()) {
+                auto userRegion = kept.headerOf.find(cast<Instruction>(user)->getParent());
+                if (userRegion == kept.headerOf.end() || userRegion->second != region->second) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        
+        // PHIs first: their reloads may themselves be used in other blocks
+        std::vector<PHINode*> phis;
+        for (auto &BB : F) {
+            if (kept.isKept(&BB)) {
+                continue;
+            }
+            for (auto &phi : BB.phis()) {
+                phis.push_back(&phi);
+            }
+        }
+        for (PHINode *phi : phis) {
+            DemotePHIToStack(phi, allocaPoint);
+        }
+        
+        std::vector<Instruction*> values;
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                if (!(isa<AllocaInst>(I) && &BB == &F.getEntryBlock()) &&
+                    I.isUsedOutsideOfBlock(&BB) && !staysInKeptLoop(I)) {
+                    values.push_back(&I);
+                }
+            }
+        }
+        for (Instruction *I : values) {
+            DemoteRegToStack(*I, false, allocaPoint);
+        }
+    }
+    
     /**
      * @brief Create state variable for control flow flattening
      * @param F Function to add state variable to
      * @return Pointer to the state variable
      */
     AllocaInst* createStateVariable(Function &F) {
-        IRBuilder<> builder(&F.getEntryBlock());
-        AllocaInst *stateVar = builder.CreateAlloca(builder.getInt32Ty());
-        builder.CreateStore(builder.getInt32(0), stateVar);
+        IRBuilder<> builder(F.getEntryBlock().getTerminator());
+        AllocaInst *stateVar = builder.CreateAlloca(builder.getInt32Ty(), nullptr, "state");
         return stateVar;
     }
     
@@ -69,13 +443,21 @@ private:
      * @return Pointer to the dispatcher block
      */
     BasicBlock* createDispatcherBlock(Function &F, AllocaInst *stateVar) {
-        BasicBlock *dispatcher = BasicBlock::Create(F.getContext(), "dispatcher", &F);
+        BasicBlock *entry = &F.getEntryBlock();
+        BasicBlock *dispatcher = BasicBlock::Create(F.getContext(), "dispatcher", &F,
+                                                    entry->getNextNode());
         
+        // The dispatcher has no source line of its own; tie it to the
+        // function's line with a discriminator of its own
         IRBuilder<> builder(dispatcher);
-        LoadInst *state = builder.CreateLoad(builder.getInt32Ty(), stateVar);
+        builder.SetCurrentDebugLocation(obfuscator::getSyntheticDebugLoc(
+            obfuscator::getInsertionDebugLoc(*entry),
+            obfuscator::getNextFreeDiscriminator(F)));
+        LoadInst *state = builder.CreateLoad(builder.getInt32Ty(), stateVar, "state.value");
         
-        // Create switch instruction
-        SwitchInst *switchInst = builder.CreateSwitch(state, nullptr, F.size());
+        // Create switch instruction; the default is filled in with the
+        // first state once the blocks are numbered
+        builder.CreateSwitch(state, entry->getSingleSuccessor(), F.size());
         
         return dispatcher;
     }
@@ -85,34 +467,120 @@ private:
      * @param F Function to restructure
      * @param dispatcher Dispatcher block
      * @param stateVar State variable
+     * @param kept Loops left intact
+     * @param continuations Normal destinations of invokes
+     * @return Number of states in the dispatcher
      */
-    void restructureBasicBlocks(Function &F, BasicBlock *dispatcher, AllocaInst *stateVar) {
-        // Collect all basic blocks except entry and dispatcher
+    unsigned restructureBasicBlocks(Function &F, BasicBlock *dispatcher, AllocaInst *stateVar,
+                                const KeptLoops &kept,
+                                const std::set<BasicBlock*> &continuations) {
+        // Collect all basic blocks except entry and dispatcher; kept
+        // loops are only entered through their preheader, landing pads
+        // and invoke continuations straight from their invoke
         std::vector<BasicBlock*> blocks;
+        std::vector<BasicBlock*> invokeTargets;
         for (auto &BB : F) {
-            if (&BB != &F.getEntryBlock() && &BB != dispatcher) {
+            if (kept.isKept(&BB) || &BB == &F.getEntryBlock() || &BB == dispatcher) {
+                continue;
+            }
+            if (BB.isLandingPad() || continuations.count(&BB)) {
+                invokeTargets.push_back(&BB);
+            } else {
                 blocks.push_back(&BB);
             }
         }
         
-        // Assign state numbers to blocks
-        for (unsigned i = 0; i < blocks.size(); i++) {
-            BasicBlock *BB = blocks[i];
+        // Assign distinct random state numbers to blocks, so each seed
+        // gives a different dispatcher; the plan was started against
+        // the unmodified function
+        std::set<uint32_t> usedStates;
+        std::map<BasicBlock*, ConstantInt*> stateOf;
+        for (BasicBlock *BB : blocks) {
+            uint32_t state = static_cast<uint32_t>(plan().next([&] {
+                uint32_t fresh = static_cast<uint32_t>(nextRandom());
+                while (usedStates.count(fresh)) {
+                    fresh = static_cast<uint32_t>(nextRandom());
+                }
+                return fresh;
+            }));
+            // A replayed plan is only trusted this far: a state it gives
+            // twice would make two switch cases alike
+            if (!usedStates.insert(state).second) {
+                remarks().emit([&] {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "PlanStateReused", &BB->front())
+                           << "state " << ore::NV("State", state)
+                           << " of the plan already taken, drew a fresh one";
+                });
+                do {
+                    state = static_cast<uint32_t>(nextRandom());
+                } while (!usedStates.insert(state).second);
+            }
+            stateOf[BB] = ConstantInt::get(Type::getInt32Ty(F.getContext()), state);
+        }
+        
+        // Enter the state machine at the old entry successor
+        BasicBlock *entry = &F.getEntryBlock();
+        BranchInst *entryBranch = cast<BranchInst>(entry->getTerminator());
+        IRBuilder<> entryBuilder(entryBranch);
+        entryBuilder.CreateStore(stateOf[entryBranch->getSuccessor(0)], stateVar);
+        entryBranch->setSuccessor(0, dispatcher);
+        
+        // The dispatcher loop takes over the back edges of every flattened
+        // loop; it inherits mustprogress if all loops in F had it. Not with
+        // kept loops: once their exit stubs are empty, SimplifyCFG would
+        // move this ID onto their latches in place of their own
+        MDNode *dispatcherLoopID = nullptr;
+        if (kept.mustProgress && kept.headerOf.empty() && !F.mustProgress()) {
+            LLVMContext &context = F.getContext();
+            MDNode *mustProgress = MDNode::get(context, MDString::get(context, "llvm.loop.mustprogress"));
+            dispatcherLoopID = MDNode::getDistinct(context, {nullptr, mustProgress});
+            dispatcherLoopID->replaceOperandWith(0, dispatcherLoopID);
+        }
+        
+        // Exit stubs of kept loops and invoke targets leave through the
+        // dispatcher too
+        std::vector<BasicBlock*> branching = blocks;
+        branching.insert(branching.end(), kept.exitStubs.begin(), kept.exitStubs.end());
+        branching.insert(branching.end(), invokeTargets.begin(), invokeTargets.end());
+        
+        unsigned discriminator = obfuscator::getNextFreeDiscriminator(F);
+        for (BasicBlock *BB : branching) {
+            // Only branches are rewritten; returns, resumes, switches,
+            // invokes and unreachable keep their terminator, preheaders
+            // their branch into the kept loop
+            auto *branch = dyn_cast<BranchInst>(BB->getTerminator());
+            if (!branch || kept.preheaders.count(BB)) {
+                continue;
+            }
             
-            // Add state transition at end of block
-            IRBuilder<> builder(BB->getTerminator());
-            builder.CreateStore(builder.getInt32(i + 1), stateVar);
-            builder.CreateBr(dispatcher);
+            // Add state transition at end of block, attributed to the
+            // original branch's line
+            IRBuilder<> builder(branch);
+            builder.SetCurrentDebugLocation(
+                obfuscator::getSyntheticDebugLoc(branch->getDebugLoc(), discriminator++));
+            Value *nextState = stateOf[branch->getSuccessor(0)];
+            if (branch->isConditional()) {
+                nextState = builder.CreateSelect(branch->getCondition(), nextState,
+                                                 stateOf[branch->getSuccessor(1)]);
+            }
+            builder.CreateStore(nextState, stateVar);
+            builder.CreateBr(dispatcher)->setMetadata(LLVMContext::MD_loop, dispatcherLoopID);
             
             // Remove original terminator
-            BB->getTerminator()->eraseFromParent();
+            branch->eraseFromParent();
         }
         
         // Update dispatcher switch
         SwitchInst *switchInst = cast<SwitchInst>(dispatcher->getTerminator());
-        for (unsigned i = 0; i < blocks.size(); i++) {
-            switchInst->addCase(ConstantInt::get(switchInst->getContext(), APInt(32, i + 1)), blocks[i]);
+        for (BasicBlock *BB : blocks) {
+            switchInst->addCase(stateOf[BB], BB);
+        }
+        
+        // Give the stack reloads and spills from demotion a source line
+        for (BasicBlock *BB : branching) {
+            obfuscator::setMissingDebugLocs(*BB);
         }
+        return blocks.size();
     }
     
     /**
@@ -128,6 +596,5 @@ private:
 char FlatteningPass::ID = 0;
 
 // Register the pass
-static RegisterPass<FlatteningPass> X("flattening", 
-                                    "Flatten control flow using state machine",
-                                    false, false);
+static obfuscator::RegisterObfuscationPass<FlatteningPass> X("flattening",
+                                                             "Flatten control flow using state machine");
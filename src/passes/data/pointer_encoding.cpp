@@ -0,0 +1,759 @@
+/**
+ * @file pointer_encoding.cpp
+ * @brief Pointer Encoding Pass
+ * 
+ * This pass keeps selected pointers encoded in memory: the pointer
+ * fields of structs whose layout never leaves the module, and internal
+ * pointer globals only ever loaded and stored. Stores write
+ * rotl(p ^ key, r) as an integer; loads read it back and decode it, so
+ * a heap dump no longer shows which objects point at which.
+ * 
+ * Every access to a slot is visible, so a slot is encoded everywhere
+ * or nowhere. Before decoding, redundant loads of a slot are merged
+ * and loads whose address scalar evolution proves loop-invariant are
+ * hoisted to the preheader, leaving one decode per loaded value: a
+ * pointer-chasing loop decodes each node's link once and nothing else.
+ * The keys are immediates, so the decode is pure ALU work the code
+ * generator keeps in registers.
+ * 
+ * Run struct-layout first: decoded pointers come from inttoptr, which
+ * the escape analysis cannot follow.
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+#include "utils/struct_escape_analysis.h"
+
+#include "llvm/Pass.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "pointer-encoding"
+
+static cl::opt<bool> PointerEncodingGlobals(
+    "pointer-encoding-globals", cl::init(true),
+    cl::desc("Also encode internal pointer globals"));
+
+static cl::opt<bool> PointerEncodingHoist(
+    "pointer-encoding-hoist", cl::init(true),
+    cl::desc("Merge redundant loads of encoded pointers and hoist "
+             "loop-invariant ones before decoding"));
+
+namespace {
+
+/**
+ * @struct EncodedSlot
+ * @brief A memory location whose pointers are kept encoded
+ */
+struct EncodedSlot {
+    std::string name;                   ///< Struct field or global, for messages
+    std::vector<LoadInst*> loads;       ///< Every load of the slot
+    std::vector<StoreInst*> stores;     ///< Every store to the slot
+    GlobalVariable *global = nullptr;   ///< The global, for global slots
+    StructType *type = nullptr;         ///< The struct, for field slots
+    unsigned field = 0;                 ///< The field, for field slots
+    std::vector<Instruction*> fills;    ///< Zero fills of one object, followed by a store of encoded null
+    bool nullable = false;              ///< Zero filled where no store can follow; decodes check for null
+    bool encoded = true;                ///< Still selected for encoding
+    uint64_t key = 0;                   ///< XOR key
+    unsigned rotation = 0;              ///< Left rotation after the XOR, 1-63
+};
+
+/**
+ * @class PointerEncodingPass
+ * @brief LLVM pass for keeping pointers encoded in memory
+ */
+class PointerEncodingPass : public obfuscator::ObfuscationModulePass {
+public:
+    static char ID; // Pass identification
+    
+    PointerEncodingPass() : ObfuscationModulePass(ID, "pointer-encoding", "PointerEncodingPass") {
+        // Only opt registers these up front; the native tools rely on this
+        PassRegistry &registry = *PassRegistry::getPassRegistry();
+        initializeAAResultsWrapperPassPass(registry);
+        initializeDominatorTreeWrapperPassPass(registry);
+        initializeLoopInfoWrapperPassPass(registry);
+        initializeScalarEvolutionWrapperPassPass(registry);
+    }
+    
+    /**
+     * @brief Declare the analyses used for decode placement
+     * @param AU Analysis usage to fill in
+     */
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<AAResultsWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
+        AU.addRequired<ScalarEvolutionWrapperPass>();
+    }
+    
+protected:
+    /**
+     * @brief Main pass execution
+     * @param M Module to transform
+     * @return true if module was modified
+     */
+    bool transform(Module &M) override {
+        // Explicit options win over the configuration file
+        encodeGlobals = PointerEncodingGlobals.getNumOccurrences()
+                            ? PointerEncodingGlobals
+                            : config().getBool("encode_globals", PointerEncodingGlobals);
+        hoistDecodes = PointerEncodingHoist.getNumOccurrences()
+                           ? PointerEncodingHoist
+                           : config().getBool("hoist_decodes", PointerEncodingHoist);
+        if (M.getContext().supportsTypedPointers()) {
+            LLVM_DEBUG(dbgs() << "PointerEncodingPass: module uses typed pointers, nothing encoded\n");
+            for (Function &F : M) {
+                if (F.isDeclaration()) {
+                    continue;
+                }
+                OptimizationRemarkEmitter ORE(&F);
+                ORE.emit([&] {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "TypedPointers", F.getSubprogram(),
+                                                    &F.getEntryBlock())
+                           << "no pointers encoded: the module uses typed pointers";
+                });
+                break;
+            }
+            return false;
+        }
+        
+        std::vector<EncodedSlot> slots;
+        collectStructSlots(M, slots);
+        if (encodeGlobals) {
+            collectGlobalSlots(M, slots);
+        }
+        if (slots.empty()) {
+            return false;
+        }
+        
+        // Keys come from the module's stream, before any FunctionScope
+        // reseeds it. Their top bit is set, so no user-space pointer
+        // equals one and only null encodes to zero
+        for (EncodedSlot &slot : slots) {
+            obfuscator::PlanDecisions plan(M, "pointer-encoding", slot.name, xxHash64(slot.name));
+            slot.key = plan.next([&] { return nextRandom() | (1ull << 63); });
+            slot.rotation = static_cast<unsigned>(plan.next([&] { return 1 + nextRandom() % 63; }));
+            if (slot.key == 0 || slot.rotation == 0 || slot.rotation > 63) {
+                LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << slot.name << ": plan key is not usable\n");
+                slot.encoded = false;
+                Instruction *site = remarkSite(slot);
+                OptimizationRemarkEmitter ORE(site->getFunction());
+                ORE.emit([&] {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "PlanKeyUnusable", site)
+                           << "pointers in " << ore::NV("Slot", slot.name)
+                           << " left plain: the plan's key is not usable";
+                });
+            }
+        }
+        
+        chargeSlots(M, slots);
+        
+        std::map<const Instruction*, EncodedSlot*> slotOf;
+        std::map<const Instruction*, std::vector<EncodedSlot*>> fillSlots;
+        bool modified = false;
+        for (EncodedSlot &slot : slots) {
+            if (!slot.encoded) {
+                continue;
+            }
+            for (LoadInst *load : slot.loads) {
+                slotOf[load] = &slot;
+            }
+            for (StoreInst *store : slot.stores) {
+                slotOf[store] = &slot;
+            }
+            for (Instruction *fill : slot.fills) {
+                fillSlots[fill].push_back(&slot);
+            }
+            if (slot.global) {
+                // A null initializer becomes the encoding of null
+                Type *intPtrType = M.getDataLayout().getIntPtrType(slot.global->getValueType());
+                APInt null(intPtrType->getIntegerBitWidth(), 0);
+                slot.global->setInitializer(ConstantExpr::getIntToPtr(
+                    ConstantInt::get(intPtrType, encodeConstant(slot, null)), slot.global->getValueType()));
+            }
+            Instruction *site = remarkSite(slot);
+            OptimizationRemarkEmitter ORE(site->getFunction());
+            ORE.emit([&] {
+                return OptimizationRemark(DEBUG_TYPE, "Encoded", site)
+                       << "pointers in " << ore::NV("Slot", slot.name) << " kept encoded ("
+                       << ore::NV("Stores", static_cast<unsigned>(slot.stores.size())) << " stores, "
+                       << ore::NV("Loads", static_cast<unsigned>(slot.loads.size())) << " loads)";
+            });
+            addStatistic("SlotsEncoded");
+            modified = true;
+        }
+        
+        for (Function &F : M) {
+            if (!F.isDeclaration()) {
+                rewriteFunction(F, slotOf, fillSlots);
+            }
+        }
+        return modified;
+    }
+    
+private:
+    bool encodeGlobals = true;
+    bool hoistDecodes = true;
+    
+    /**
+     * @brief Pick the access remarks about a slot point at
+     * @param slot Slot with at least one load or store
+     * @return Its first store, or its first load if it has none
+     */
+    static Instruction *remarkSite(const EncodedSlot &slot) {
+        return slot.stores.empty() ? static_cast<Instruction*>(slot.loads.front())
+                                   : static_cast<Instruction*>(slot.stores.front());
+    }
+    
+    /**
+     * @brief Find the pointer fields of structs that do not escape
+     * @param M Module being transformed
+     * @param slots Encodable fields are appended here
+     */
+    void collectStructSlots(Module &M, std::vector<EncodedSlot> &slots) {
+        obfuscator::StructEscapeAnalysis analysis(M);
+        for (StructType *S : M.getIdentifiedStructTypes()) {
+            std::string reason = analysis.getEscapeReason(S);
+            bool hasPointers = std::any_of(S->element_begin(), S->element_end(),
+                                           [](Type *T) { return T->isPointerTy(); });
+            if (!reason.empty() && hasPointers) {
+                LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << S->getName() << " kept: " << reason << "\n");
+            }
+        }
+        for (StructType *S : analysis.getNonEscapingStructs()) {
+            const obfuscator::StructAccesses &accesses = analysis.getAccesses(S);
+            for (unsigned field = 0; field < S->getNumElements(); field++) {
+                if (!S->getElementType(field)->isPointerTy() ||
+                    S->getElementType(field)->getPointerAddressSpace() != 0) {
+                    continue;
+                }
+                EncodedSlot slot;
+                slot.name = S->getName().str() + "." + std::to_string(field);
+                slot.type = S;
+                slot.field = field;
+                
+                // Zeroed memory reads back as null only if the fill of
+                // each object is followed by storing encoded null
+                for (Instruction *fill : accesses.fills) {
+                    if (isSingleObjectFill(fill, S)) {
+                        slot.fills.push_back(fill);
+                    } else {
+                        slot.nullable = true;
+                    }
+                }
+                if (slot.nullable) {
+                    slot.fills.clear();
+                }
+                
+                std::string reason;
+                for (GetElementPtrInst *gep : accesses.geps) {
+                    if (gep->getNumIndices() == 2 &&
+                        cast<ConstantInt>(gep->getOperand(2))->getZExtValue() == field) {
+                        for (User *U : gep->users()) {
+                            if (!addAccess(slot, U, gep)) {
+                                reason = "field address escapes";
+                            }
+                        }
+                    }
+                }
+                if (field == 0) {
+                    for (Instruction *I : accesses.fieldZeroAccesses) {
+                        if (!addAccess(slot, I, getLoadStorePointerOperand(I))) {
+                            reason = "field read or written as another type";
+                        }
+                    }
+                }
+                
+                if (!reason.empty()) {
+                    LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << slot.name << " kept: " << reason << "\n");
+                } else if (!slot.loads.empty() || !slot.stores.empty()) {
+                    slots.push_back(std::move(slot));
+                }
+            }
+        }
+    }
+    
+    /**
+     * @brief Check if a fill zeroes exactly one object
+     * @param fill memset or calloc reaching objects of S
+     * @param S Struct type
+     * @return true for memset(p, 0, sizeof(S)) and calloc of sizeof(S) bytes
+     */
+    bool isSingleObjectFill(Instruction *fill, StructType *S) {
+        uint64_t size = fill->getModule()->getDataLayout().getTypeAllocSize(S);
+        if (auto *memset = dyn_cast<MemSetInst>(fill)) {
+            auto *value = dyn_cast<ConstantInt>(memset->getValue());
+            auto *length = dyn_cast<ConstantInt>(memset->getLength());
+            return value && value->isZero() && length && length->getZExtValue() == size;
+        }
+        auto *call = dyn_cast<CallInst>(fill);
+        if (!call || call->arg_size() != 2) {
+            return false;
+        }
+        auto *count = dyn_cast<ConstantInt>(call->getArgOperand(0));
+        auto *elementSize = dyn_cast<ConstantInt>(call->getArgOperand(1));
+        return count && elementSize && count->getZExtValue() * elementSize->getZExtValue() == size;
+    }
+    
+    /**
+     * @brief Find internal pointer globals that are only loaded and stored
+     * @param M Module being transformed
+     * @param slots Encodable globals are appended here
+     */
+    void collectGlobalSlots(Module &M, std::vector<EncodedSlot> &slots) {
+        for (GlobalVariable &G : M.globals()) {
+            if (!G.hasLocalLinkage() || !G.hasInitializer() || G.isConstant() ||
+                G.isExternallyInitialized() || !G.getValueType()->isPointerTy() ||
+                G.getValueType()->getPointerAddressSpace() != 0) {
+                continue;
+            }
+            EncodedSlot slot;
+            slot.name = G.getName().str();
+            slot.global = &G;
+            
+            // A relocated initializer cannot be encoded at link time
+            Constant *init = G.getInitializer();
+            bool usable = init->isNullValue() || isa<UndefValue>(init);
+            for (User *U : G.users()) {
+                usable &= addAccess(slot, U, &G);
+            }
+            if (!usable) {
+                LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << slot.name
+                                  << " kept: initialized or used other than by loads and stores\n");
+            } else if (!slot.loads.empty() || !slot.stores.empty()) {
+                slots.push_back(std::move(slot));
+            }
+        }
+    }
+    
+    /**
+     * @brief Record one access to a slot
+     * @param slot Slot being collected
+     * @param U User of the slot's address
+     * @param address Address of the slot
+     * @return false if U is not a plain pointer load or store of the slot
+     */
+    bool addAccess(EncodedSlot &slot, User *U, Value *address) {
+        if (auto *load = dyn_cast<LoadInst>(U)) {
+            if (load->isSimple() && load->getPointerOperand() == address &&
+                load->getType()->isPointerTy() && load->getType()->getPointerAddressSpace() == 0) {
+                slot.loads.push_back(load);
+                return true;
+            }
+        } else if (auto *store = dyn_cast<StoreInst>(U)) {
+            Type *valueType = store->getValueOperand()->getType();
+            if (store->isSimple() && store->getPointerOperand() == address &&
+                store->getValueOperand() != address &&
+                valueType->isPointerTy() && valueType->getPointerAddressSpace() == 0) {
+                slot.stores.push_back(store);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    /**
+     * @brief Charge every function for the slots it accesses
+     * 
+     * A slot refused anywhere is encoded nowhere; what the other
+     * functions were charged for it is not given back, which only
+     * makes the budget stricter.
+     * 
+     * @param M Module being transformed
+     * @param slots Slots; refused ones are deselected
+     */
+    void chargeSlots(Module &M, std::vector<EncodedSlot> &slots) {
+        // Instructions added per access: ptrtoint or inttoptr, xor and
+        // rotate, plus a compare and select for slots that must keep null.
+        // Per fill: the field address and store, plus the null check
+        // and branch after calloc
+        std::map<Function*, std::vector<std::pair<EncodedSlot*, uint64_t>>> costs;
+        for (EncodedSlot &slot : slots) {
+            uint64_t perAccess = slot.nullable ? 5 : 3;
+            std::map<Function*, uint64_t> accesses;
+            for (LoadInst *load : slot.loads) {
+                accesses[load->getFunction()] += perAccess;
+            }
+            for (StoreInst *store : slot.stores) {
+                accesses[store->getFunction()] += perAccess;
+            }
+            for (Instruction *fill : slot.fills) {
+                accesses[fill->getFunction()] += isa<MemSetInst>(fill) ? 2 : 4;
+            }
+            for (auto &entry : accesses) {
+                costs[entry.first].push_back({&slot, entry.second});
+            }
+        }
+        
+        for (Function &F : M) {
+            auto it = costs.find(&F);
+            if (it == costs.end()) {
+                continue;
+            }
+            if (!shouldTransform(F)) {
+                for (auto &entry : it->second) {
+                    if (entry.first->encoded) {
+                        LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << entry.first->name
+                                          << " kept: accessed in " << F.getName()
+                                          << ", which is excluded\n");
+                        entry.first->encoded = false;
+                    }
+                }
+                continue;
+            }
+            
+            FunctionScope scope(*this, F);
+            for (auto &entry : it->second) {
+                EncodedSlot &slot = *entry.first;
+                if (slot.encoded && !budget().tryCharge(entry.second)) {
+                    LLVM_DEBUG(dbgs() << "PointerEncodingPass: " << slot.name
+                                      << " kept: over the growth budget of " << F.getName() << "\n");
+                    slot.encoded = false;
+                }
+            }
+        }
+    }
+    
+    /**
+     * @brief Place the loads of encoded slots, then encode and decode
+     * @param F Function to rewrite
+     * @param slotOf Slot of every encoded load and store
+     * @param fillSlots Slots to store encoded null to after each fill
+     */
+    void rewriteFunction(Function &F, const std::map<const Instruction*, EncodedSlot*> &slotOf,
+                         const std::map<const Instruction*, std::vector<EncodedSlot*>> &fillSlots) {
+        std::vector<LoadInst*> loads;
+        std::vector<StoreInst*> stores;
+        std::vector<Instruction*> fills;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                if (fillSlots.count(&I)) {
+                    fills.push_back(&I);
+                }
+                if (!slotOf.count(&I)) {
+                    continue;
+                }
+                if (auto *load = dyn_cast<LoadInst>(&I)) {
+                    loads.push_back(load);
+                } else {
+                    stores.push_back(cast<StoreInst>(&I));
+                }
+            }
+        }
+        if (loads.empty() && stores.empty() && fills.empty()) {
+            return;
+        }
+        
+        OptimizationRemarkEmitter ORE(&F);
+        if (hoistDecodes && !loads.empty()) {
+            placeLoads(F, loads, slotOf, ORE);
+        }
+        
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        for (StoreInst *store : stores) {
+            EncodedSlot &slot = *slotOf.at(store);
+            IRBuilder<> builder(store);
+            builder.SetCurrentDebugLocation(store->getDebugLoc());
+            Value *pointer = store->getValueOperand();
+            Type *intPtrType = DL.getIntPtrType(pointer->getType());
+            Value *encoded;
+            if (isa<ConstantPointerNull>(pointer)) {
+                APInt null(intPtrType->getIntegerBitWidth(), 0);
+                encoded = ConstantInt::get(intPtrType, slot.nullable ? null : encodeConstant(slot, null));
+            } else {
+                encoded = builder.CreateXor(builder.CreatePtrToInt(pointer, intPtrType),
+                                            ConstantInt::get(intPtrType, slot.key));
+                encoded = builder.CreateIntrinsic(Intrinsic::fshl, {intPtrType},
+                                                  {encoded, encoded, ConstantInt::get(intPtrType, slot.rotation)});
+                if (slot.nullable) {
+                    encoded = builder.CreateSelect(builder.CreateIsNull(pointer),
+                                                   ConstantInt::get(intPtrType, 0), encoded);
+                }
+            }
+            StoreInst *replacement = builder.CreateAlignedStore(encoded, store->getPointerOperand(),
+                                                                store->getAlign());
+            replacement->setAAMetadata(store->getAAMetadata());
+            store->eraseFromParent();
+        }
+        
+        for (LoadInst *load : loads) {
+            EncodedSlot &slot = *slotOf.at(load);
+            IRBuilder<> builder(load);
+            builder.SetCurrentDebugLocation(load->getDebugLoc());
+            Type *intPtrType = DL.getIntPtrType(load->getType());
+            LoadInst *raw = builder.CreateAlignedLoad(intPtrType, load->getPointerOperand(),
+                                                      load->getAlign(), load->getName() + ".enc");
+            raw->setAAMetadata(load->getAAMetadata());
+            Value *decoded = builder.CreateIntrinsic(Intrinsic::fshr, {intPtrType},
+                                                     {raw, raw, ConstantInt::get(intPtrType, slot.rotation)});
+            decoded = builder.CreateXor(decoded, ConstantInt::get(intPtrType, slot.key));
+            decoded = builder.CreateIntToPtr(decoded, load->getType());
+            if (slot.nullable) {
+                decoded = builder.CreateSelect(builder.CreateIsNull(raw),
+                                               ConstantPointerNull::get(cast<PointerType>(load->getType())),
+                                               decoded);
+            }
+            decoded->takeName(load);
+            load->replaceAllUsesWith(decoded);
+            load->eraseFromParent();
+        }
+        
+        // Last: the null checks after calloc split blocks
+        for (Instruction *fill : fills) {
+            Value *object = fill;
+            Instruction *insertPoint = fill->getNextNode();
+            if (auto *memset = dyn_cast<MemSetInst>(fill)) {
+                object = memset->getDest();
+            } else {
+                insertPoint = SplitBlockAndInsertIfThen(new ICmpInst(insertPoint, ICmpInst::ICMP_NE, fill,
+                                                                     ConstantPointerNull::get(
+                                                                         cast<PointerType>(fill->getType()))),
+                                                        insertPoint, false);
+            }
+            IRBuilder<> builder(insertPoint);
+            builder.SetCurrentDebugLocation(fill->getDebugLoc());
+            for (EncodedSlot *slot : fillSlots.at(fill)) {
+                Type *intPtrType = DL.getIntPtrType(object->getType());
+                Value *field = builder.CreateStructGEP(slot->type, object, slot->field);
+                APInt null(intPtrType->getIntegerBitWidth(), 0);
+                builder.CreateAlignedStore(ConstantInt::get(intPtrType, encodeConstant(*slot, null)), field,
+                                           DL.getABITypeAlign(intPtrType));
+            }
+        }
+        addStatistic("StoresEncoded", stores.size());
+        addStatistic("LoadsDecoded", loads.size());
+    }
+    
+    /**
+     * @brief Leave one load per value of an encoded slot
+     * 
+     * Loads of the same address (by scalar evolution) in one block
+     * with nothing in between that may write it are merged, and loads
+     * whose address is invariant in a loop that never writes it are
+     * hoisted to the preheader, as far out as they go.
+     * 
+     * @param F Function being rewritten
+     * @param loads Loads of encoded slots; merged loads are removed
+     * @param slotOf Slot of every encoded load and store
+     * @param ORE Remark emitter of F
+     */
+    void placeLoads(Function &F, std::vector<LoadInst*> &loads,
+                    const std::map<const Instruction*, EncodedSlot*> &slotOf,
+                    OptimizationRemarkEmitter &ORE) {
+        // Fetching an analysis reruns all of them on F, so results are
+        // taken from the wrappers only once every one is fetched
+        auto &treeWrapper = getAnalysis<DominatorTreeWrapperPass>(F);
+        auto &loopWrapper = getAnalysis<LoopInfoWrapperPass>(F);
+        auto &evolutionWrapper = getAnalysis<ScalarEvolutionWrapperPass>(F);
+        auto &aliasWrapper = getAnalysis<AAResultsWrapperPass>(F);
+        DominatorTree &DT = treeWrapper.getDomTree();
+        LoopInfo &LI = loopWrapper.getLoopInfo();
+        ScalarEvolution &SE = evolutionWrapper.getSE();
+        AAResults &AA = aliasWrapper.getAAResults();
+        
+        std::vector<std::pair<LoadInst*, LoadInst*>> merges;
+        std::set<LoadInst*> merged;
+        for (BasicBlock &BB : F) {
+            std::vector<LoadInst*> available;
+            for (Instruction &I : BB) {
+                auto *load = dyn_cast<LoadInst>(&I);
+                if (load && slotOf.count(load)) {
+                    const SCEV *address = SE.getSCEV(load->getPointerOperand());
+                    auto earlier = std::find_if(available.begin(), available.end(), [&](LoadInst *other) {
+                        return slotOf.at(other) == slotOf.at(load) &&
+                               SE.getSCEV(other->getPointerOperand()) == address;
+                    });
+                    if (earlier != available.end()) {
+                        merges.push_back({load, *earlier});
+                        merged.insert(load);
+                    } else {
+                        available.push_back(load);
+                    }
+                } else if (I.mayWriteToMemory()) {
+                    available.erase(std::remove_if(available.begin(), available.end(), [&](LoadInst *other) {
+                        return isModSet(AA.getModRefInfo(&I, MemoryLocation::get(other)));
+                    }), available.end());
+                }
+            }
+        }
+        
+        for (auto &merge : merges) {
+            LoadInst *load = merge.first;
+            ORE.emit([&] {
+                return OptimizationRemark(DEBUG_TYPE, "DecodeMerged", load)
+                       << "load of " << ore::NV("Slot", slotOf.at(load)->name)
+                       << " merged with an earlier one";
+            });
+            SE.forgetValue(load);
+            load->replaceAllUsesWith(merge.second);
+            load->eraseFromParent();
+        }
+        loads.erase(std::remove_if(loads.begin(), loads.end(),
+                                   [&](LoadInst *load) { return merged.count(load) != 0; }),
+                    loads.end());
+        addStatistic("DecodesMerged", merges.size());
+        
+        for (LoadInst *load : loads) {
+            unsigned levels = 0;
+            while (Loop *L = LI.getLoopFor(load->getParent())) {
+                if (!hoistOutOfLoop(load, L, AA, DT, SE)) {
+                    break;
+                }
+                levels++;
+            }
+            if (levels) {
+                ORE.emit([&] {
+                    return OptimizationRemark(DEBUG_TYPE, "DecodeHoisted", load)
+                           << "load of " << ore::NV("Slot", slotOf.at(load)->name)
+                           << " hoisted out of " << ore::NV("Loops", levels) << " loops";
+                });
+                addStatistic("DecodesHoisted");
+            }
+        }
+    }
+    
+    /**
+     * @brief Move a loop-invariant load to the loop preheader
+     * @param load Load of an encoded slot
+     * @param L Innermost loop containing the load
+     * @param AA Alias analysis of the function
+     * @param DT Dominator tree of the function
+     * @param SE Scalar evolution of the function
+     * @return true if the load was hoisted
+     */
+    bool hoistOutOfLoop(LoadInst *load, Loop *L, AAResults &AA, DominatorTree &DT, ScalarEvolution &SE) {
+        BasicBlock *preheader = L->getLoopPreheader();
+        if (!preheader || !executesWhenLoopRuns(load, L, DT)) {
+            return false;
+        }
+        MemoryLocation location = MemoryLocation::get(load);
+        for (BasicBlock *BB : L->blocks()) {
+            for (Instruction &I : *BB) {
+                if (I.mayWriteToMemory() && isModSet(AA.getModRefInfo(&I, location))) {
+                    return false;
+                }
+            }
+        }
+        
+        // Hoist the address computation along when it is made of
+        // invariant operands; otherwise look for an existing value with
+        // the same address outside the loop
+        Value *address = load->getPointerOperand();
+        Instruction *insertPoint = preheader->getTerminator();
+        bool changed = false;
+        if (!L->makeLoopInvariant(address, changed, insertPoint)) {
+            const SCEV *expression = SE.getSCEV(address);
+            if (!SE.isLoopInvariant(expression, L)) {
+                return false;
+            }
+            SCEVExpander expander(SE, load->getModule()->getDataLayout(), "ptrenc");
+#if LLVM_VERSION_MAJOR >= 15
+            bool safe = expander.isSafeToExpandAt(expression, insertPoint);
+#else
+            bool safe = isSafeToExpandAt(expression, insertPoint, SE);
+#endif
+            if (!safe) {
+                return false;
+            }
+            SCEVExpanderCleaner cleaner(expander);
+            Value *existing = expander.expandCodeFor(expression, address->getType(), insertPoint);
+            if (!expander.getAllInsertedInstructions().empty()) {
+                return false;
+            }
+            cleaner.markResultUsed();
+            load->setOperand(load->getPointerOperandIndex(), existing);
+            RecursivelyDeleteTriviallyDeadInstructions(address);
+        }
+        
+        load->moveBefore(insertPoint);
+        SE.forgetValue(load);
+        return true;
+    }
+    
+    /**
+     * @brief Check if a load in a loop runs whenever the loop is entered
+     * @param load Load in L
+     * @param L Loop
+     * @param DT Dominator tree of the function
+     * @return true if hoisting the load cannot add a fault
+     */
+    bool executesWhenLoopRuns(LoadInst *load, Loop *L, DominatorTree &DT) {
+        if (isSafeToSpeculativelyExecute(load)) {
+            return true;
+        }
+        SmallVector<BasicBlock*, 4> exiting;
+        L->getExitingBlocks(exiting);
+        if (exiting.empty()) {
+            return false;
+        }
+        for (BasicBlock *BB : exiting) {
+            if (!DT.dominates(load->getParent(), BB)) {
+                return false;
+            }
+        }
+        for (BasicBlock *BB : L->blocks()) {
+            for (Instruction &I : *BB) {
+                if (!isGuaranteedToTransferExecutionToSuccessor(&I)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+    /**
+     * @brief Encode a constant pointer value
+     * @param slot Slot the value is stored in
+     * @param value Pointer value as an integer of pointer width
+     * @return rotl(value ^ key, rotation), as the rewritten stores compute it
+     */
+    APInt encodeConstant(const EncodedSlot &slot, APInt value) {
+        return (value ^ APInt(value.getBitWidth(), slot.key))
+            .rotl(slot.rotation);
+    }
+    
+    /**
+     * @brief Get pass name
+     */
+    StringRef getPassName() const override {
+        return "PointerEncoding";
+    }
+};
+
+} // anonymous namespace
+
+char PointerEncodingPass::ID = 0;
+
+// Register the pass
+static obfuscator::RegisterObfuscationPass<PointerEncodingPass> X("pointer-encoding",
+                                                                  "Keep pointer fields and globals encoded in memory");
@@ -0,0 +1,295 @@
+/**
+ * @file stack_strings.cpp
+ * @brief Stack String Construction Pass
+ * 
+ * This pass removes short string literals from read-only data. Each
+ * use site rebuilds the string on the stack from 8-byte immediates
+ * XORed with a per-site key, using 16/32-byte vector stores where the
+ * slot is aligned for them.
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SwapByteOrder.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <set>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "stack-strings"
+
+static cl::opt<unsigned> MaxStackStringLength(
+    "stack-strings-max-length", cl::init(64),
+    cl::desc("Largest literal (in bytes) built on the stack"));
+
+namespace {
+
+/**
+ * @class StackStringsPass
+ * @brief LLVM pass for building string literals on the stack
+ */
+class StackStringsPass : public obfuscator::ObfuscationModulePass {
+public:
+    static char ID; // Pass identification
+    
+    StackStringsPass() : ObfuscationModulePass(ID, "stack-strings", "StackStringsPass") {}
+    
+protected:
+    /**
+     * @brief Main pass execution
+     * @param M Module to transform
+     * @return true if module was modified
+     */
+    bool transform(Module &M) override {
+        // An explicit option wins over the configuration file
+        maxLength = MaxStackStringLength.getNumOccurrences()
+                        ? MaxStackStringLength
+                        : static_cast<unsigned>(config().getInt("max_length", MaxStackStringLength));
+        bool modified = false;
+        std::set<GlobalVariable*> literals;
+        
+        for (auto &F : M) {
+            if (!shouldTransform(F)) {
+                continue;
+            }
+            FunctionScope scope(*this, F);
+            
+            // Collect sites first; rewriting changes operand lists
+            std::vector<std::pair<CallBase*, unsigned>> sites;
+            for (auto &BB : F) {
+                for (auto &I : BB) {
+                    if (auto *call = dyn_cast<CallBase>(&I)) {
+                        for (unsigned i = 0; i < call->arg_size(); i++) {
+                            if (isStackStringCandidate(call, i)) {
+                                sites.push_back({call, i});
+                            }
+                        }
+                    }
+                }
+            }
+            
+            // Building a string is a run of stores; in a hot loop they
+            // would repeat on every iteration
+            std::set<const BasicBlock*> hotBlocks = obfuscator::findHotLoopBlocks(F);
+            
+            for (auto &site : sites) {
+                CallBase *call = site.first;
+                if (hotBlocks.count(call->getParent())) {
+                    remarks().emit([&] {
+                        return OptimizationRemarkMissed(DEBUG_TYPE, "HotLoop", call)
+                               << "string left in place: the call is in a hot loop";
+                    });
+                    continue;
+                }
+                
+                // Per 8-byte chunk at most: its XOR, barrier and vector
+                // lane, and a share of the address, cast and store; plus
+                // the slot, the key barrier and the pointer cast
+                uint64_t bytes = getShortLiteral(call->getArgOperand(site.second))
+                                     ->getInitializer()->getType()->getArrayNumElements();
+                if (!budget().tryCharge(5 * ((bytes + 7) / 8) + 3)) {
+                    continue;
+                }
+                uint64_t key = plan().next([&] { return nextRandom(); });
+                literals.insert(buildStringOnStack(F, site.first, site.second, key, remarks()));
+                addStatistic("StringsOnStack");
+                modified = true;
+            }
+        }
+        
+        // Drop literals no longer referenced so they leave .rodata
+        for (GlobalVariable *gv : literals) {
+            gv->removeDeadConstantUsers();
+            if (gv->use_empty()) {
+                gv->eraseFromParent();
+            }
+        }
+        
+        return modified;
+    }
+    
+private:
+    unsigned maxLength = 64;
+    
+    /**
+     * @brief Get the literal a call argument points to
+     * @param arg Argument value
+     * @return The literal's global, or nullptr if arg is not a short literal
+     */
+    GlobalVariable* getShortLiteral(Value *arg) {
+        auto *gv = dyn_cast<GlobalVariable>(arg->stripPointerCasts());
+        if (!gv || !gv->isConstant() || !gv->hasInitializer() || !gv->hasLocalLinkage()) {
+            return nullptr;
+        }
+        
+        // Only a pointer to the first character is rebuilt on the stack
+        if (auto *expr = dyn_cast<ConstantExpr>(arg)) {
+            if (expr->getOpcode() == Instruction::GetElementPtr &&
+                !cast<GEPOperator>(expr)->hasAllZeroIndices()) {
+                return nullptr;
+            }
+        }
+        
+        auto *data = dyn_cast<ConstantDataArray>(gv->getInitializer());
+        if (!data || !data->getElementType()->isIntegerTy(8) ||
+            data->getNumElements() > maxLength) {
+            return nullptr;
+        }
+        return gv;
+    }
+    
+    /**
+     * @brief Check if a call argument can be replaced by a stack copy
+     * @param call Call instruction
+     * @param argIndex Index of the argument
+     * @return true if the argument is a short literal the callee does not keep
+     */
+    bool isStackStringCandidate(CallBase *call, unsigned argIndex) {
+        if (!getShortLiteral(call->getArgOperand(argIndex))) {
+            return false;
+        }
+        
+        // The stack copy dies with the frame, so the callee must not
+        // hold on to the pointer
+        if (call->doesNotCapture(argIndex)) {
+            return true;
+        }
+        Function *callee = call->getCalledFunction();
+        if (!callee) {
+            return false;
+        }
+        StringRef name = callee->getName();
+        return name == "printf" || name == "puts" || name == "strlen" ||
+               name == "strcpy" || name == "strcmp";
+    }
+    
+    /**
+     * @brief Hide a value from the optimizer without touching memory
+     * @param builder Builder at the use site
+     * @param value Value to hide
+     * @return Value equal to value that later passes cannot constant fold
+     */
+    Value* createOpaqueValue(IRBuilder<> &builder, Value *value) {
+        FunctionType *type = FunctionType::get(value->getType(), {value->getType()}, false);
+        InlineAsm *barrier = InlineAsm::get(type, "", "=r,0", /*hasSideEffects=*/false);
+        return builder.CreateCall(barrier, {value});
+    }
+    
+    /**
+     * @brief Check if 32-byte vector stores are native for a function
+     * @param F Function to check
+     * @return true if the function is compiled with AVX
+     */
+    bool hasWideVectors(Function &F) {
+        return F.getFnAttribute("target-features").getValueAsString().contains("+avx");
+    }
+    
+    /**
+     * @brief Replace a literal argument with a copy built on the stack
+     * @param F Function containing the call
+     * @param call Call instruction
+     * @param argIndex Index of the literal argument
+     * @param key Per-site key
+     * @param ORE Remark emitter for F
+     * @return The literal that was replaced
+     */
+    GlobalVariable* buildStringOnStack(Function &F, CallBase *call, unsigned argIndex, uint64_t key,
+                                       OptimizationRemarkEmitter &ORE) {
+        Value *arg = call->getArgOperand(argIndex);
+        GlobalVariable *gv = getShortLiteral(arg);
+        StringRef bytes = cast<ConstantDataArray>(gv->getInitializer())->getRawDataValues();
+        
+        // Round the slot up to whole 8-byte chunks; padding is zero
+        unsigned numChunks = (bytes.size() + 7) / 8;
+        LLVMContext &context = F.getContext();
+        Type *chunkTy = Type::getInt64Ty(context);
+        
+        IRBuilder<> entryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+        AllocaInst *slot = entryBuilder.CreateAlloca(ArrayType::get(chunkTy, numChunks),
+                                                     nullptr, gv->getName() + ".stack");
+        slot->setAlignment(Align(hasWideVectors(F) ? 32 : 16));
+        
+        // Keep the key in a register, out of reach of constant folding
+        IRBuilder<> builder(call);
+        Value *keyValue = createOpaqueValue(builder, builder.getInt64(key));
+        
+        std::vector<Value*> chunks;
+        for (unsigned i = 0; i < numChunks; i++) {
+            uint64_t plain = 0;
+            for (unsigned b = 0; b < 8 && i * 8 + b < bytes.size(); b++) {
+                plain |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i * 8 + b])) << (8 * b);
+            }
+            if (F.getParent()->getDataLayout().isBigEndian()) {
+                plain = sys::getSwappedBytes(plain);
+            }
+            chunks.push_back(builder.CreateXor(builder.getInt64(plain ^ key), keyValue));
+        }
+        
+        // Widest store that fits at each offset. Vectors are assembled from
+        // the scalar chunks; each lane goes through the barrier so the
+        // optimizer cannot fold them back into a constant-pool load.
+        unsigned maxWidth = hasWideVectors(F) ? 4 : 2;
+        unsigned vectorStores = 0;
+        unsigned offset = 0;
+        while (offset < numChunks) {
+            unsigned width = 1;
+            if (maxWidth >= 4 && numChunks - offset >= 4 && offset % 4 == 0) {
+                width = 4;
+            } else if (numChunks - offset >= 2 && offset % 2 == 0) {
+                width = 2;
+            }
+            
+            Value *address = builder.CreateConstInBoundsGEP2_32(slot->getAllocatedType(),
+                                                                slot, 0, offset);
+            if (width == 1) {
+                builder.CreateAlignedStore(chunks[offset], address, Align(8));
+            } else {
+                auto *vectorTy = FixedVectorType::get(chunkTy, width);
+                Value *vector = UndefValue::get(vectorTy);
+                for (unsigned lane = 0; lane < width; lane++) {
+                    vector = builder.CreateInsertElement(
+                        vector, createOpaqueValue(builder, chunks[offset + lane]), lane);
+                }
+                Value *vectorAddress = builder.CreateBitCast(address, vectorTy->getPointerTo());
+                builder.CreateAlignedStore(vector, vectorAddress, Align(width * 8));
+                vectorStores++;
+            }
+            offset += width;
+        }
+        
+        call->setArgOperand(argIndex, builder.CreatePointerCast(slot, arg->getType()));
+        
+        ORE.emit([&] {
+            return OptimizationRemark(DEBUG_TYPE, "BuiltOnStack", call)
+                   << "built string " << ore::NV("Literal", gv) << " on the stack ("
+                   << ore::NV("Bytes", numChunks * 8) << " bytes, "
+                   << ore::NV("VectorStores", vectorStores) << " vector stores)";
+        });
+        return gv;
+    }
+    
+    /**
+     * @brief Get pass name
+     */
+    StringRef getPassName() const override {
+        return "StackStrings";
+    }
+};
+
+} // anonymous namespace
+
+char StackStringsPass::ID = 0;
+
+// Register the pass
+static obfuscator::RegisterObfuscationPass<StackStringsPass> X("stack-strings",
+                                                               "Build short string literals on the stack");
@@ -4,49 +4,108 @@
  * 
  * This pass encrypts string literals and adds decryption code
  * to make string analysis more difficult.
+ * 
+ * The literals passed to string functions are XORed with a key per
+ * literal and made writable. The runtime decrypts them in place, with
+ * no second copy, in init tasks the pass registers with the runtime's
+ * scheduler (see runtime/obfuscation_runtime.h) rather than in a
+ * constructor of its own. init_mode picks when the tasks run: "lazy"
+ * (the default) on first use, "eager" before main, or "background" on
+ * a thread while main runs.
+ * 
+ * The ciphertext goes in a section of its own, "obf_strings" on ELF,
+ * laid out in pages of page_size bytes (-string-encryption-page-size,
+ * 4096 by default) with one task each: decrypting the literals a
+ * function uses dirties their pages only, and the pages no code
+ * reaches stay clean and shared with the file. Page size 0 packs the
+ * literals without padding and decrypts them all at once. Each
+ * function using a literal checks that the task of its page is done
+ * first, once per page, where the check dominates all the uses and
+ * outside loops.
+ * 
+ * Programs obfuscated with this pass link libobfuscation_rt.a.
  */
 
+#include "passes/obfuscation_pass.h"
+#include "runtime/obfuscation_runtime.h"
+
 #include "llvm/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/EHPersonalities.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "string-encryption"
+
+static cl::opt<unsigned> StringEncryptionPageSize(
+    "string-encryption-page-size", cl::init(4096),
+    cl::desc("Bytes of encrypted literals decrypted together (0: a module's at once)"));
+
 namespace {
 
+/// Section the runtime finds the init tasks in
+const char *const kInitSection = "obf_init";
+
+/// Section of the encrypted literals, writable and apart from other data
+const char *const kStringSection = "obf_strings";
+
+/// Instructions of the check before the first use: load, compare,
+/// branch, call and branch back
+const uint64_t kGuardCost = 5;
+
 /**
  * @class StringEncryptionPass
  * @brief LLVM pass for string encryption
  */
-class StringEncryptionPass : public FunctionPass {
+class StringEncryptionPass : public obfuscator::ObfuscationModulePass {
 public:
     static char ID; // Pass identification
     
-    StringEncryptionPass() : FunctionPass(ID) {}
-    
+    StringEncryptionPass()
+        : ObfuscationModulePass(ID, "string-encryption", "StringEncryptionPass") {}
+        
+protected:
     /**
      * @brief Main pass execution
-     * @param F Function to transform
-     * @return true if function was modified
+     * @param M Module to transform
+     * @return true if module was modified
      */
-    bool runOnFunction(Function &F) override {
-        errs() << "StringEncryptionPass: Processing function " << F.getName() << "\n";
-        
-        bool modified = false;
-        
-        // Find all string literals in the function
-        for (auto &BB : F) {
-            for (auto &I : BB) {
-                if (auto *call = dyn_cast<CallInst>(&I)) {
-                    if (isStringFunction(call)) {
-                        // Encrypt string arguments
-                        for (unsigned i = 0; i < call->getNumArgOperands(); i++) {
-                            if (isStringLiteral(call->getArgOperand(i))) {
-                                encryptStringArgument(call, i);
-                                modified = true;
+    bool transform(Module &M) override {
+        // Literals passed to string functions, in the order found
+        std::vector<GlobalVariable*> literals;
+        DenseSet<GlobalVariable*> seen;
+        for (auto &F : M) {
+            for (auto &BB : F) {
+                for (auto &I : BB) {
+                    if (auto *call = dyn_cast<CallInst>(&I)) {
+                        if (isStringFunction(call)) {
+                            for (unsigned i = 0; i < call->arg_size(); i++) {
+                                GlobalVariable *gv = getStringLiteral(call->getArgOperand(i));
+                                if (gv && seen.insert(gv).second) {
+                                    literals.push_back(gv);
+                                }
                             }
                         }
                     }
@@ -54,7 +113,128 @@ public:
             }
         }
         
-        return modified;
+        // A literal is encrypted only if every use can be guarded
+        DenseMap<Function*, std::vector<std::pair<Instruction*, GlobalVariable*>>> usesIn;
+        std::vector<GlobalVariable*> candidates;
+        std::vector<Instruction*> uses;
+        for (GlobalVariable *gv : literals) {
+            uses.clear();
+            if (!findUses(gv, uses)) {
+                continue;
+            }
+            candidates.push_back(gv);
+            for (Instruction *use : uses) {
+                usesIn[use->getFunction()].push_back({use, gv});
+            }
+        }
+        if (candidates.empty()) {
+            return false;
+        }
+        
+        // Pages are aligned, so a power of two
+        uint64_t pageSize = PowerOf2Ceil(StringEncryptionPageSize.getNumOccurrences()
+                                             ? StringEncryptionPageSize
+                                             : std::max<int64_t>(0, config().getInt("page_size",
+                                                                                    StringEncryptionPageSize)));
+        DenseMap<GlobalVariable*, unsigned> pageOf;
+        unsigned pages = assignPages(M, candidates, pageSize, pageOf);
+        
+        // Charge each function a check per page it uses and draw the
+        // keys; a function without room for its checks keeps its
+        // literals in plain text
+        DenseMap<GlobalVariable*, uint64_t> keys;
+        keys.reserve(candidates.size());
+        std::vector<GlobalVariable*> refused;
+        for (auto &F : M) {
+            auto found = usesIn.find(&F);
+            if (found == usesIn.end()) {
+                continue;
+            }
+            FunctionScope scope(*this, F);
+            SmallDenseSet<unsigned, 4> used;
+            for (auto &use : found->second) {
+                used.insert(pageOf.lookup(use.second));
+            }
+            bool guarded = budget().tryCharge(kGuardCost * used.size());
+            for (auto &use : found->second) {
+                if (!guarded) {
+                    refused.push_back(use.second);
+                } else if (!keys.count(use.second)) {
+                    keys[use.second] = plan().next([&] { return nextRandom(); });
+                }
+            }
+        }
+        for (GlobalVariable *gv : refused) {
+            keys.erase(gv);
+        }
+        std::vector<GlobalVariable*> &encrypted = candidates;
+        encrypted.erase(std::remove_if(encrypted.begin(), encrypted.end(),
+                                       [&](GlobalVariable *gv) { return !keys.count(gv); }),
+                        encrypted.end());
+        if (encrypted.empty()) {
+            return false;
+        }
+        
+        // One task per page still holding a literal, in page order
+        std::vector<std::vector<GlobalVariable*>> groups(pages);
+        for (GlobalVariable *gv : encrypted) {
+            groups[pageOf.lookup(gv)].push_back(gv);
+        }
+        bool elf = Triple(M.getTargetTriple()).isOSBinFormatELF();
+        Constant *component = IRBuilder<>(M.getContext()).CreateGlobalStringPtr(passName_, "obf.component", 0, &M);
+        std::vector<GlobalVariable*> tasks(pages, nullptr);
+        for (unsigned page = 0; page < pages; page++) {
+            if (groups[page].empty()) {
+                continue;
+            }
+            layOutPage(M, groups[page], elf, pageSize);
+            tasks[page] = createInitTask(M, groups[page], keys, component);
+        }
+        
+        std::vector<std::pair<Instruction*, GlobalVariable*>> pageUses;
+        for (auto &F : M) {
+            auto found = usesIn.find(&F);
+            if (found == usesIn.end()) {
+                continue;
+            }
+            std::vector<unsigned> usedPages;
+            for (auto &use : found->second) {
+                if (keys.count(use.second)) {
+                    usedPages.push_back(pageOf.lookup(use.second));
+                }
+            }
+            if (usedPages.empty()) {
+                continue;
+            }
+            std::sort(usedPages.begin(), usedPages.end());
+            usedPages.erase(std::unique(usedPages.begin(), usedPages.end()), usedPages.end());
+            for (unsigned page : usedPages) {
+                pageUses.clear();
+                for (auto &use : found->second) {
+                    if (keys.count(use.second) && pageOf.lookup(use.second) == page) {
+                        pageUses.push_back(use);
+                    }
+                }
+                if (insertGuard(F, pageUses, tasks[page])) {
+                    addStatistic("Guards");
+                }
+            }
+            
+            OptimizationRemarkEmitter ORE(&F);
+            for (auto &use : found->second) {
+                auto *call = dyn_cast<CallInst>(use.first);
+                if (call && isStringFunction(call) && keys.count(use.second)) {
+                    ORE.emit([&] {
+                        return OptimizationRemark(DEBUG_TYPE, "Encrypted", call)
+                               << "encrypted string " << ore::NV("Literal", use.second);
+                    });
+                }
+            }
+        }
+        addStatistic("StringsEncrypted", encrypted.size());
+        addStatistic("Pages", std::count_if(tasks.begin(), tasks.end(),
+                                            [](GlobalVariable *task) { return task != nullptr; }));
+        return true;
     }
     
 private:
@@ -68,62 +248,289 @@ private:
         if (!func) return false;
         
         StringRef name = func->getName();
-        return name == "printf" || name == "puts" || name == "strlen" || 
+        return name == "printf" || name == "puts" || name == "strlen" ||
                name == "strcpy" || name == "strcmp";
     }
     
     /**
-     * @brief Check if a value is a string literal
+     * @brief Get the string literal a value points into
+     * 
+     * Only literals of this module qualify: another one would read the
+     * encrypted bytes without the check.
+     * 
      * @param val Value to check
-     * @return true if it's a string literal
+     * @return The literal's global, or nullptr if val does not point into one
      */
-    bool isStringLiteral(Value *val) {
-        if (auto *gep = dyn_cast<GetElementPtrInst>(val)) {
-            if (auto *gv = dyn_cast<GlobalVariable>(gep->getPointerOperand())) {
-                return gv->isConstant() && gv->hasInitializer();
+    GlobalVariable* getStringLiteral(Value *val) {
+        auto *gv = dyn_cast<GlobalVariable>(getUnderlyingObject(val));
+        if (!gv || !gv->isConstant() || !gv->hasInitializer() || !gv->hasLocalLinkage() ||
+            gv->hasSection()) {
+            return nullptr;
+        }
+        auto *data = dyn_cast<ConstantDataArray>(gv->getInitializer());
+        return data && data->getElementType()->isIntegerTy(8) ? gv : nullptr;
+    }
+    
+    /**
+     * @brief Find the instructions using a literal
+     * @param gv Literal
+     * @param uses Set to the instructions, directly or through constant expressions
+     * @return false if it has a use the pass cannot guard
+     */
+    bool findUses(GlobalVariable *gv, std::vector<Instruction*> &uses) {
+        SmallVector<User*, 8> worklist(gv->user_begin(), gv->user_end());
+        while (!worklist.empty()) {
+            User *user = worklist.back();
+            worklist.pop_back();
+            if (auto *I = dyn_cast<Instruction>(user)) {
+                if (!shouldTransform(*I->getFunction())) {
+                    return false;
+                }
+                uses.push_back(I);
+            } else if (isa<ConstantExpr>(user)) {
+                worklist.append(user->user_begin(), user->user_end());
+            } else {
+                // An initializer, which no check can precede
+                return false;
             }
         }
-        return false;
+        return true;
     }
     
     /**
-     * @brief Encrypt a string argument in a call instruction
-     * @param call Call instruction
-     * @param argIndex Index of the argument to encrypt
+     * @brief Give each literal a page
+     * 
+     * Literals fill a page in the order found; one larger than a page
+     * gets pages of its own.
+     * 
+     * @param M Module
+     * @param literals Literals
+     * @param pageSize Bytes per page; 0 puts every literal on page 0
+     * @param pageOf Set to the page of each literal
+     * @return Number of pages
      */
-    void encryptStringArgument(CallInst *call, unsigned argIndex) {
-        // Get the string literal
-        Value *arg = call->getArgOperand(argIndex);
-        if (auto *gep = dyn_cast<GetElementPtrInst>(arg)) {
-            if (auto *gv = dyn_cast<GlobalVariable>(gep->getPointerOperand())) {
-                // Create encrypted version
-                Constant *original = gv->getInitializer();
-                Constant *encrypted = createEncryptedString(original);
-                
-                // Replace the global variable
-                gv->setInitializer(encrypted);
+    unsigned assignPages(Module &M, const std::vector<GlobalVariable*> &literals, uint64_t pageSize,
+                         DenseMap<GlobalVariable*, unsigned> &pageOf) {
+        const DataLayout &DL = M.getDataLayout();
+        pageOf.reserve(literals.size());
+        unsigned page = 0;
+        uint64_t used = 0;
+        for (GlobalVariable *gv : literals) {
+            uint64_t size = DL.getTypeAllocSize(gv->getValueType());
+            if (pageSize && used && used + size > pageSize) {
+                page++;
+                used = 0;
             }
+            used += size;
+            pageOf[gv] = page;
         }
+        return page + 1;
     }
     
     /**
-     * @brief Create an encrypted version of a string constant
-     * @param original Original string constant
-     * @return Encrypted string constant
+     * @brief Place the literals of a page together in the string section
+     * 
+     * The linker keeps the order of a section's globals, so moving them
+     * to the end of the module and aligning the first to the page keeps
+     * the page to itself.
+     * 
+     * @param M Module
+     * @param literals Literals of the page
+     * @param elf Whether the target is ELF; elsewhere they stay in the data section
+     * @param pageSize Bytes per page, 0 for no alignment
      */
-    Constant* createEncryptedString(Constant *original) {
-        if (auto *array = dyn_cast<ConstantDataArray>(original)) {
-            // Simple XOR encryption
-            std::vector<uint8_t> data;
-            for (unsigned i = 0; i < array->getNumElements(); i++) {
-                uint8_t byte = array->getElementAsInteger(i);
-                data.push_back(byte ^ 0x42); // XOR with key 0x42
+    void layOutPage(Module &M, const std::vector<GlobalVariable*> &literals, bool elf, uint64_t pageSize) {
+        for (GlobalVariable *gv : literals) {
+            gv->removeFromParent();
+            M.getGlobalList().push_back(gv);
+            if (elf) {
+                gv->setSection(kStringSection);
             }
-            
-            // Create new constant array
-            return ConstantDataArray::get(original->getContext(), data);
         }
-        return original;
+        GlobalVariable *first = literals.front();
+        if (pageSize && first->getAlign().valueOrOne().value() < pageSize) {
+            first->setAlignment(Align(pageSize));
+        }
+    }
+    
+    /**
+     * @brief Encrypt the literals and create the task decrypting them
+     * @param M Module
+     * @param encrypted Literals to encrypt
+     * @param keys Key of each literal
+     * @param component Name of the pass, for the runtime's report
+     * @return The obf_init_task
+     */
+    GlobalVariable* createInitTask(Module &M, const std::vector<GlobalVariable*> &encrypted,
+                                   const DenseMap<GlobalVariable*, uint64_t> &keys, Constant *component) {
+        LLVMContext &context = M.getContext();
+        IRBuilder<> builder(context);
+        Type *bytePtr = builder.getInt8PtrTy();
+        
+        std::vector<Constant*> strings;
+        std::vector<uint64_t> sizes;
+        std::vector<uint64_t> keyValues;
+        strings.reserve(encrypted.size());
+        sizes.reserve(encrypted.size());
+        keyValues.reserve(encrypted.size());
+        std::vector<uint8_t> bytes;
+        for (GlobalVariable *gv : encrypted) {
+            uint64_t key = keys.lookup(gv);
+            StringRef data = cast<ConstantDataArray>(gv->getInitializer())->getRawDataValues();
+            bytes.assign(data.begin(), data.end());
+            for (size_t i = 0; i < bytes.size(); i++) {
+                bytes[i] ^= static_cast<uint8_t>(key >> (8 * (i % 8)));
+            }
+            gv->setInitializer(ConstantDataArray::get(context, bytes));
+            gv->setConstant(false);
+            strings.push_back(ConstantExpr::getPointerCast(gv, bytePtr));
+            sizes.push_back(bytes.size());
+            keyValues.push_back(key);
+        }
+        
+        // struct obf_string_table
+        auto addTable = [&](Constant *init, const char *name) {
+            return ConstantExpr::getPointerCast(
+                new GlobalVariable(M, init->getType(), true, GlobalValue::PrivateLinkage, init, name),
+                bytePtr);
+        };
+        Constant *table = ConstantStruct::getAnon({
+            builder.getInt64(encrypted.size()),
+            addTable(ConstantArray::get(ArrayType::get(bytePtr, strings.size()), strings), "obf.strings"),
+            addTable(ConstantDataArray::get(context, sizes), "obf.strings.sizes"),
+            addTable(ConstantDataArray::get(context, keyValues), "obf.strings.keys")});
+        
+        // The runtime only finds tasks in ELF sections; elsewhere every
+        // task is lazy
+        bool elf = Triple(M.getTargetTriple()).isOSBinFormatELF();
+        std::string modeName = config().getString("init_mode", "lazy");
+        uint32_t mode = OBF_INIT_LAZY;
+        if (elf && modeName == "eager") {
+            mode = OBF_INIT_EAGER;
+        } else if (elf && modeName == "background") {
+            mode = OBF_INIT_BACKGROUND;
+        }
+        
+        // struct obf_init_task
+        FunctionCallee decrypt = M.getOrInsertFunction(
+            "__obf_decrypt_strings", FunctionType::get(builder.getVoidTy(), {bytePtr}, false));
+        Constant *init = ConstantStruct::get(getTaskType(context), {
+            ConstantExpr::getPointerCast(cast<Constant>(decrypt.getCallee()), bytePtr),
+            addTable(table, "obf.strings.table"),
+            ConstantExpr::getPointerCast(component, bytePtr),
+            builder.getInt32(mode),
+            builder.getInt32(OBF_INIT_PENDING),
+            builder.getInt64(0),
+            builder.getInt64(0),
+            builder.getInt64(0)});
+        auto *task = new GlobalVariable(M, init->getType(), false, GlobalValue::PrivateLinkage, init,
+                                        "obf.strings.init");
+        task->setAlignment(Align(8));
+        if (elf) {
+            task->setSection(kInitSection);
+        }
+        appendToUsed(M, {task});
+        return task;
+    }
+    
+    /**
+     * @brief Get the type of struct obf_init_task
+     * @param context Context of the module
+     * @return { run, arg, component, mode, state, nanoseconds, rss_before, rss_after }
+     */
+    StructType* getTaskType(LLVMContext &context) {
+        Type *bytePtr = Type::getInt8PtrTy(context);
+        Type *i32 = Type::getInt32Ty(context);
+        Type *i64 = Type::getInt64Ty(context);
+        return StructType::get(context, {bytePtr, bytePtr, bytePtr, i32, i32, i64, i64, i64});
+    }
+    
+    /**
+     * @brief Make a function run an init task before it uses a literal of its page
+     * 
+     * The check goes where it dominates all the uses, hoisted out of
+     * loops; in a function with funclets, in the entry block.
+     * 
+     * @param F Function
+     * @param uses Instructions using literals of the page, with the literal each uses
+     * @param task The obf_init_task of the page
+     * @return false if no use is reachable, so none needs the check
+     */
+    bool insertGuard(Function &F, const std::vector<std::pair<Instruction*, GlobalVariable*>> &uses,
+                     GlobalVariable *task) {
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        std::vector<Instruction*> points;
+        for (auto &entry : uses) {
+            Instruction *use = entry.first;
+            if (auto *phi = dyn_cast<PHINode>(use)) {
+                for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+                    if (isa<Constant>(phi->getIncomingValue(i))) {
+                        points.push_back(phi->getIncomingBlock(i)->getTerminator());
+                    }
+                }
+            } else {
+                points.push_back(use);
+            }
+        }
+        // Blocks the entry does not reach never run and have no dominators
+        points.erase(std::remove_if(points.begin(), points.end(),
+                                    [&](Instruction *point) {
+                                        return !DT.isReachableFromEntry(point->getParent());
+                                    }),
+                     points.end());
+        if (points.empty()) {
+            return false;
+        }
+        
+        BasicBlock *block = points.front()->getParent();
+        for (Instruction *point : points) {
+            block = DT.findNearestCommonDominator(block, point->getParent());
+        }
+        Instruction *at = block->getTerminator();
+        for (Instruction *point : points) {
+            if (point->getParent() == block && point->comesBefore(at)) {
+                at = point;
+            }
+        }
+        if (Loop *L = LI.getLoopFor(block)) {
+            // The dominator of the outermost header is outside every loop
+            while (L->getParentLoop()) {
+                L = L->getParentLoop();
+            }
+            at = DT.getNode(L->getHeader())->getIDom()->getBlock()->getTerminator();
+        }
+        bool funclets = F.hasPersonalityFn() &&
+                        isFuncletEHPersonality(classifyEHPersonality(F.getPersonalityFn()));
+        if (funclets || at->getParent()->isEHPad()) {
+            at = &*F.getEntryBlock().getFirstInsertionPt();
+        }
+        
+        // Static allocas must stay in the entry block, ahead of the split
+        if (at->getParent() == &F.getEntryBlock()) {
+            for (Instruction &I : make_early_inc_range(F.getEntryBlock())) {
+                if (isa<AllocaInst>(I) && at->comesBefore(&I)) {
+                    I.moveBefore(at);
+                }
+            }
+        }
+        
+        LLVMContext &context = F.getContext();
+        IRBuilder<> builder(at);
+        Value *stateAddress = builder.CreateStructGEP(getTaskType(context), task, 4);
+        LoadInst *state = builder.CreateAlignedLoad(builder.getInt32Ty(), stateAddress, Align(4),
+                                                    "init.state");
+        state->setAtomic(AtomicOrdering::Acquire);
+        Value *pending = builder.CreateICmpNE(state, builder.getInt32(OBF_INIT_DONE), "init.pending");
+        Instruction *then = SplitBlockAndInsertIfThen(pending, at, false,
+                                                      MDBuilder(context).createBranchWeights(1, 1 << 20));
+        then->getParent()->setName("init.run");
+        at->getParent()->setName("init.done");
+        builder.SetInsertPoint(then);
+        FunctionCallee run = F.getParent()->getOrInsertFunction(
+            "__obf_init_run", FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()}, false));
+        builder.CreateCall(run, {builder.CreatePointerCast(task, builder.getInt8PtrTy())});
+        return true;
     }
     
     /**
@@ -139,6 +546,5 @@ private:
 char StringEncryptionPass::ID = 0;
 
 // Register the pass
-static RegisterPass<StringEncryptionPass> X("string-encryption", 
-                                           "Encrypt string literals",
-                                           false, false);
+static obfuscator::RegisterObfuscationPass<StringEncryptionPass> X("string-encryption",
+                                                                   "Encrypt string literals");
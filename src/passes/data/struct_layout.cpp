@@ -0,0 +1,453 @@
+/**
+ * @file struct_layout.cpp
+ * @brief Struct Layout Obfuscation Pass
+ * 
+ * This pass permutes the fields of structs whose layout never leaves
+ * the module, so field offsets no longer match the source. Hot fields
+ * stay on the cache line they were on and the struct never grows, so
+ * the data cache behaves as it did before.
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+#include "utils/struct_escape_analysis.h"
+
+#include "llvm/Pass.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "struct-layout"
+
+static cl::opt<unsigned> StructLayoutAttempts(
+    "struct-layout-attempts", cl::init(32),
+    cl::desc("Random field orders to try per struct before giving up"));
+
+static cl::opt<unsigned> StructLayoutHotPercent(
+    "struct-layout-hot-percent", cl::init(10),
+    cl::desc("Fields accessed at least this percentage as often as the "
+             "hottest field keep their cache line"));
+
+namespace {
+
+constexpr uint64_t kCacheLineSize = 64;
+
+/**
+ * @class StructLayoutPass
+ * @brief LLVM pass for cache-line-aware struct field reordering
+ */
+class StructLayoutPass : public obfuscator::ObfuscationModulePass {
+public:
+    static char ID; // Pass identification
+    
+    StructLayoutPass() : ObfuscationModulePass(ID, "struct-layout", "StructLayoutPass") {
+        // opt registers every analysis; the tools and tests do not
+        initializeBlockFrequencyInfoWrapperPassPass(*PassRegistry::getPassRegistry());
+    }
+    
+    /**
+     * @brief Declare the analyses used for field heat
+     * @param AU Analysis usage to fill in
+     */
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    }
+    
+protected:
+    /**
+     * @brief Main pass execution
+     * @param M Module to transform
+     * @return true if module was modified
+     */
+    bool transform(Module &M) override {
+        // Explicit options win over the configuration file
+        attempts = StructLayoutAttempts.getNumOccurrences()
+                       ? StructLayoutAttempts
+                       : static_cast<unsigned>(config().getInt("attempts", StructLayoutAttempts));
+        hotPercent = StructLayoutHotPercent.getNumOccurrences()
+                         ? StructLayoutHotPercent
+                         : static_cast<unsigned>(config().getInt("hot_percent", StructLayoutHotPercent));
+        obfuscator::StructEscapeAnalysis analysis(M);
+        haveBlockCounts = false;
+        
+        for (StructType *S : M.getIdentifiedStructTypes()) {
+            std::string reason = analysis.getEscapeReason(S);
+            if (!reason.empty()) {
+                LLVM_DEBUG(dbgs() << "StructLayoutPass: " << S->getName() << " kept: " << reason << "\n");
+            }
+        }
+        
+        bool modified = false;
+        for (StructType *S : analysis.getNonEscapingStructs()) {
+            const obfuscator::StructAccesses &accesses = analysis.getAccesses(S);
+            if (accesses.allocas.empty() && accesses.geps.empty()) {
+                continue;
+            }
+            modified |= reorderFields(M, S, accesses, analysis);
+        }
+        return modified;
+    }
+    
+private:
+    unsigned attempts = 32;
+    unsigned hotPercent = 10;
+    std::map<const BasicBlock*, uint64_t> blockCounts;
+    bool haveBlockCounts = false;
+    
+    /**
+     * @brief Record execution counts of blocks that access rewritable structs
+     * @param analysis Escape analysis of the module
+     */
+    void computeBlockCounts(obfuscator::StructEscapeAnalysis &analysis) {
+        std::set<Function*> functions;
+        for (StructType *S : analysis.getNonEscapingStructs()) {
+            const obfuscator::StructAccesses &accesses = analysis.getAccesses(S);
+            for (GetElementPtrInst *gep : accesses.geps) {
+                functions.insert(gep->getFunction());
+            }
+            for (Instruction *I : accesses.fieldZeroAccesses) {
+                functions.insert(I->getFunction());
+            }
+        }
+        
+        // Profile counts when the module has them, static estimates otherwise
+        for (Function *F : functions) {
+            BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>(*F).getBFI();
+            for (BasicBlock &BB : *F) {
+                Optional<uint64_t> count = BFI.getBlockProfileCount(&BB);
+                blockCounts[&BB] = count ? *count : BFI.getBlockFreq(&BB).getFrequency();
+            }
+        }
+    }
+    
+    /**
+     * @brief Estimate how often each field of a struct is accessed
+     * @param S Struct type
+     * @param accesses Accesses to S
+     * @return Access weight per field
+     */
+    std::vector<uint64_t> computeFieldHeat(StructType *S,
+                                           const obfuscator::StructAccesses &accesses) {
+        std::vector<uint64_t> heat(S->getNumElements(), 0);
+        for (GetElementPtrInst *gep : accesses.geps) {
+            if (gep->getNumIndices() >= 2) {
+                unsigned field = cast<ConstantInt>(gep->getOperand(2))->getZExtValue();
+                heat[field] += blockCounts[gep->getParent()];
+            }
+        }
+        for (Instruction *I : accesses.fieldZeroAccesses) {
+            heat[0] += blockCounts[I->getParent()];
+        }
+        return heat;
+    }
+    
+    /**
+     * @brief Count the cache lines a set of fields touches
+     * @param layout Struct layout
+     * @param fields Field indices in that layout
+     * @return Number of distinct cache lines
+     */
+    unsigned countCacheLines(const StructLayout *layout, const std::vector<unsigned> &fields) {
+        std::set<uint64_t> lines;
+        for (unsigned field : fields) {
+            lines.insert(layout->getElementOffset(field) / kCacheLineSize);
+        }
+        return lines.size();
+    }
+    
+    /**
+     * @brief Draw a random field order that keeps hot fields on their line
+     * @param S Struct type
+     * @param DL Data layout of the module
+     * @param hot Whether each field is hot
+     * @param order Set to the new order: order[newIndex] = oldIndex
+     * @return true if a valid, non-identity order was found
+     */
+    bool findFieldOrder(StructType *S, const DataLayout &DL, const std::vector<bool> &hot,
+                        std::vector<unsigned> &order) {
+        const StructLayout *oldLayout = DL.getStructLayout(S);
+        unsigned numFields = S->getNumElements();
+        
+        for (unsigned attempt = 0; attempt < attempts; attempt++) {
+            // Shuffle within each original cache line, then let cold
+            // fields trade places across lines
+            order.resize(numFields);
+            for (unsigned i = 0; i < numFields; i++) {
+                order[i] = i;
+            }
+            unsigned lineStart = 0;
+            while (lineStart < numFields) {
+                unsigned lineEnd = lineStart + 1;
+                uint64_t line = oldLayout->getElementOffset(lineStart) / kCacheLineSize;
+                while (lineEnd < numFields &&
+                       oldLayout->getElementOffset(lineEnd) / kCacheLineSize == line) {
+                    lineEnd++;
+                }
+                for (unsigned i = lineEnd - 1; i > lineStart; i--) {
+                    std::swap(order[i], order[lineStart + nextRandom() % (i - lineStart + 1)]);
+                }
+                lineStart = lineEnd;
+            }
+            std::vector<unsigned> coldSlots;
+            for (unsigned i = 0; i < numFields; i++) {
+                if (!hot[order[i]]) {
+                    coldSlots.push_back(i);
+                }
+            }
+            for (unsigned i = coldSlots.size(); i > 1; i--) {
+                std::swap(order[coldSlots[i - 1]], order[coldSlots[nextRandom() % i]]);
+            }
+            
+            std::vector<Type*> elements;
+            for (unsigned oldIndex : order) {
+                elements.push_back(S->getElementType(oldIndex));
+            }
+            StructType *candidate = StructType::get(S->getContext(), elements);
+            const StructLayout *newLayout = DL.getStructLayout(candidate);
+            if (newLayout->getSizeInBytes() > oldLayout->getSizeInBytes()) {
+                continue;
+            }
+            
+            bool valid = false;
+            for (unsigned i = 0; i < numFields; i++) {
+                unsigned oldIndex = order[i];
+                valid |= oldIndex != i;
+                if (hot[oldIndex] &&
+                    newLayout->getElementOffset(i) / kCacheLineSize !=
+                    oldLayout->getElementOffset(oldIndex) / kCacheLineSize) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (valid) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    /**
+     * @brief Reorder the fields of a non-escaping struct
+     * @param M Module being transformed
+     * @param S Struct type
+     * @param accesses Every access relying on the layout of S
+     * @param analysis Escape analysis of the module
+     * @return true if the struct was rewritten
+     */
+    bool reorderFields(Module &M, StructType *S, const obfuscator::StructAccesses &accesses,
+                       obfuscator::StructEscapeAnalysis &analysis) {
+        const DataLayout &DL = M.getDataLayout();
+        unsigned numFields = S->getNumElements();
+        
+        // A replayed order skips the profile and the search entirely
+        obfuscator::PlanDecisions plan(M, "struct-layout", S->getName(), hashLayout(S, DL));
+        std::vector<unsigned> hotFields;
+        std::vector<unsigned> order;
+        bool reorder = plan.next([&] {
+            if (!haveBlockCounts) {
+                computeBlockCounts(analysis);
+                haveBlockCounts = true;
+            }
+            std::vector<uint64_t> heat = computeFieldHeat(S, accesses);
+            uint64_t maxHeat = *std::max_element(heat.begin(), heat.end());
+            std::vector<bool> hot(numFields, false);
+            for (unsigned i = 0; i < numFields; i++) {
+                hot[i] = maxHeat > 0 && heat[i] * 100 >= maxHeat * hotPercent;
+                if (hot[i]) {
+                    hotFields.push_back(i);
+                }
+            }
+            return findFieldOrder(S, DL, hot, order);
+        });
+        Instruction *site = accesses.allocas.empty()
+            ? static_cast<Instruction*>(accesses.geps.front())
+            : static_cast<Instruction*>(accesses.allocas.front());
+        OptimizationRemarkEmitter ORE(site->getFunction());
+        if (!reorder) {
+            ORE.emit([&] {
+                return OptimizationRemarkMissed(DEBUG_TYPE, "NoFieldOrder", site)
+                       << "kept the layout of " << ore::NV("Struct", S->getName())
+                       << ": no field order keeps the hot fields in place";
+            });
+            return false;
+        }
+        
+        order.resize(numFields);
+        std::vector<bool> placed(numFields, false);
+        for (unsigned i = 0; i < numFields; i++) {
+            order[i] = static_cast<unsigned>(plan.next([&] { return order[i]; }));
+            if (order[i] >= numFields || placed[order[i]]) {
+                LLVM_DEBUG(dbgs() << "StructLayoutPass: " << S->getName() << ": plan order is not a permutation\n");
+                return false;
+            }
+            placed[order[i]] = true;
+        }
+        
+        std::vector<unsigned> newIndexOf(numFields);
+        std::vector<Type*> elements;
+        for (unsigned i = 0; i < numFields; i++) {
+            newIndexOf[order[i]] = i;
+            elements.push_back(S->getElementType(order[i]));
+        }
+        
+        // The new type takes over the name so the IR still reads naturally
+        std::string name = S->getName().str();
+        S->setName(name + ".orig");
+        StructType *newType = StructType::create(M.getContext(), elements, name);
+        const StructLayout *oldLayout = DL.getStructLayout(S);
+        const StructLayout *newLayout = DL.getStructLayout(newType);
+        
+        for (AllocaInst *alloca : accesses.allocas) {
+            alloca->setAllocatedType(newType);
+        }
+        
+        for (GetElementPtrInst *gep : accesses.geps) {
+            gep->setSourceElementType(newType);
+            if (gep->getNumIndices() < 2) {
+                gep->setResultElementType(newType);
+                continue;
+            }
+            
+            unsigned oldIndex = cast<ConstantInt>(gep->getOperand(2))->getZExtValue();
+            gep->setOperand(2, ConstantInt::get(gep->getOperand(2)->getType(), newIndexOf[oldIndex]));
+            std::vector<Value*> indices(gep->idx_begin(), gep->idx_end());
+            gep->setResultElementType(GetElementPtrInst::getIndexedType(newType, indices));
+            
+            // Alignment the frontend derived from the old offset may no longer hold
+            limitAccessAlignment(gep, commonAlignment(newLayout->getAlignment(),
+                                                      newLayout->getElementOffset(newIndexOf[oldIndex])));
+        }
+        
+        // Accesses straight through an object pointer target field 0,
+        // which now lives elsewhere
+        for (Instruction *I : accesses.fieldZeroAccesses) {
+            if (newIndexOf[0] == 0) {
+                break;
+            }
+            IRBuilder<> builder(I);
+            builder.SetCurrentDebugLocation(I->getDebugLoc());
+            Value *pointer = getLoadStorePointerOperand(I);
+            Value *field = builder.CreateStructGEP(newType, pointer, newIndexOf[0]);
+            I->replaceUsesOfWith(pointer, field);
+            limitAccessAlignment(field, commonAlignment(newLayout->getAlignment(),
+                                                        newLayout->getElementOffset(newIndexOf[0])));
+        }
+        
+        // memsets cover whole objects; they cover as many of the new size
+        for (Instruction *I : accesses.fills) {
+            if (auto *fill = dyn_cast<MemSetInst>(I)) {
+                uint64_t objects = cast<ConstantInt>(fill->getLength())->getZExtValue() /
+                                   oldLayout->getSizeInBytes();
+                fill->setLength(ConstantInt::get(fill->getLength()->getType(),
+                                                 objects * newLayout->getSizeInBytes()));
+            }
+        }
+        
+        // The cache lines of the whole struct and of its hot fields; a
+        // replayed order has no profile, so no hot fields to count
+        auto lines = [](uint64_t size) { return (size + kCacheLineSize - 1) / kCacheLineSize; };
+        uint64_t oldLines = lines(oldLayout->getSizeInBytes());
+        uint64_t newLines = lines(newLayout->getSizeInBytes());
+        std::vector<unsigned> newHotFields;
+        for (unsigned field : hotFields) {
+            newHotFields.push_back(newIndexOf[field]);
+        }
+        unsigned oldHotLines = countCacheLines(oldLayout, hotFields);
+        unsigned newHotLines = countCacheLines(newLayout, newHotFields);
+        LLVM_DEBUG({
+            dbgs() << "StructLayoutPass: " << name << ": "
+                   << oldLayout->getSizeInBytes() << " -> " << newLayout->getSizeInBytes() << " bytes, "
+                   << oldLines << " -> " << newLines << " cache lines";
+            if (plan.isReplaying()) {
+                dbgs() << ", order replayed\n";
+            } else {
+                dbgs() << ", " << hotFields.size() << " hot fields on "
+                       << oldHotLines << " -> " << newHotLines << " lines\n";
+            }
+        });
+        ORE.emit([&] {
+            OptimizationRemark remark(DEBUG_TYPE, "Reordered", site);
+            remark << "reordered the fields of " << ore::NV("Struct", name) << " ("
+                   << ore::NV("OldSize", oldLayout->getSizeInBytes()) << " -> "
+                   << ore::NV("NewSize", newLayout->getSizeInBytes()) << " bytes, "
+                   << ore::NV("OldLines", oldLines) << " -> " << ore::NV("NewLines", newLines)
+                   << " cache lines";
+            if (plan.isReplaying()) {
+                remark << ", order replayed)";
+            } else {
+                remark << ", " << ore::NV("HotFields", static_cast<unsigned>(hotFields.size()))
+                       << " hot fields on " << ore::NV("OldHotLines", oldHotLines) << " -> "
+                       << ore::NV("NewHotLines", newHotLines) << " lines)";
+            }
+            return remark;
+        });
+        addStatistic("StructsReordered");
+        return true;
+    }
+    
+    /**
+     * @brief Hash what a field order depends on
+     * @param S Struct type
+     * @param DL Data layout of the module
+     * @return Hash of the element types and the data layout
+     */
+    uint64_t hashLayout(StructType *S, const DataLayout &DL) {
+        std::string description = DL.getStringRepresentation();
+        raw_string_ostream OS(description);
+        for (Type *element : S->elements()) {
+            OS << ";" << *element;
+        }
+        return xxHash64(OS.str());
+    }
+    
+    /**
+     * @brief Lower the alignment of loads and stores through a field address
+     * @param address Field address
+     * @param alignment Alignment the address is known to have
+     */
+    void limitAccessAlignment(Value *address, Align alignment) {
+        for (User *U : address->users()) {
+            if (auto *load = dyn_cast<LoadInst>(U)) {
+                if (load->getAlign() > alignment) {
+                    load->setAlignment(alignment);
+                }
+            } else if (auto *store = dyn_cast<StoreInst>(U)) {
+                if (store->getPointerOperand() == address && store->getAlign() > alignment) {
+                    store->setAlignment(alignment);
+                }
+            }
+        }
+    }
+    
+    /**
+     * @brief Get pass name
+     */
+    StringRef getPassName() const override {
+        return "StructLayout";
+    }
+};
+
+} // anonymous namespace
+
+char StructLayoutPass::ID = 0;
+
+// Register the pass
+static obfuscator::RegisterObfuscationPass<StructLayoutPass> X("struct-layout",
+                                                               "Reorder struct fields, keeping hot fields on their cache line");
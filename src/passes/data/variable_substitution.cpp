@@ -6,6 +6,8 @@
  * to make variable analysis more difficult.
  */
 
+#include "passes/obfuscation_pass.h"
+
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
@@ -20,21 +22,21 @@ namespace {
  * @class VariableSubstitutionPass
  * @brief LLVM pass for variable substitution
  */
-class VariableSubstitutionPass : public FunctionPass {
+class VariableSubstitutionPass : public obfuscator::ObfuscationPass {
 public:
     static char ID; // Pass identification
     
-    VariableSubstitutionPass() : FunctionPass(ID) {}
-    
+    VariableSubstitutionPass()
+        : ObfuscationPass(ID, "variable-substitution", "VariableSubstitutionPass") {}
+        
+protected:
     /**
      * @brief Main pass execution
      * @param F Function to transform
      * @return true if function was modified
      */
-    bool runOnFunction(Function &F) override {
+    bool transform(Function &F) override {
         // TODO: Implement variable substitution
-        errs() << "VariableSubstitutionPass: Processing function " << F.getName() << "\n";
-        
         // Placeholder implementation
         // 1. Identify substitution candidates
         // 2. Generate substitution expressions
@@ -57,6 +59,5 @@ public:
 char VariableSubstitutionPass::ID = 0;
 
 // Register the pass
-static RegisterPass<VariableSubstitutionPass> X("variable-substitution", 
-                                               "Substitute variables with complex expressions",
-                                               false, false);
+static obfuscator::RegisterObfuscationPass<VariableSubstitutionPass> X("variable-substitution",
+                                                                       "Substitute variables with complex expressions");
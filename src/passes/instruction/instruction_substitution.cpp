@@ -6,13 +6,19 @@
  * equivalent sequences to make analysis more difficult.
  */
 
+#include "passes/obfuscation_pass.h"
+
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
+using namespace llvm::PatternMatch;
+
+#define DEBUG_TYPE "instruction-substitution"
 
 namespace {
 
@@ -20,34 +26,44 @@ namespace {
  * @class InstructionSubstitutionPass
  * @brief LLVM pass for instruction substitution
  */
-class InstructionSubstitutionPass : public FunctionPass {
+class InstructionSubstitutionPass : public obfuscator::ObfuscationPass {
 public:
     static char ID; // Pass identification
     
-    InstructionSubstitutionPass() : FunctionPass(ID) {}
-    
+    InstructionSubstitutionPass()
+        : ObfuscationPass(ID, "instruction-substitution", "InstructionSubstitutionPass") {}
+        
+protected:
     /**
      * @brief Main pass execution
      * @param F Function to transform
      * @return true if function was modified
      */
-    bool runOnFunction(Function &F) override {
-        errs() << "InstructionSubstitutionPass: Processing function " << F.getName() << "\n";
-        
-        bool modified = false;
+    bool transform(Function &F) override {
+        // Each substitution adds one instruction (the negation or shift)
+        unsigned ratePercent = static_cast<unsigned>(config().getDouble("substitution_rate", 1.0) * 100);
+        unsigned substituted = 0;
         
         for (auto &BB : F) {
-            for (auto it = BB.begin(); it != BB.end(); ++it) {
-                Instruction *I = &*it;
+            // Early-increment: substitution erases the current instruction
+            for (Instruction &inst : make_early_inc_range(BB)) {
+                Instruction *I = &inst;
                 
-                if (shouldSubstitute(I)) {
+                if (shouldSubstitute(I) &&
+                    plan().next([&] { return ratePercent >= 100 || nextRandom() % 100 < ratePercent; }) &&
+                    budget().tryCharge(1)) {
+                    remarks().emit([&] {
+                        return OptimizationRemark(DEBUG_TYPE, "Substituted", I)
+                               << "substituted " << ore::NV("Opcode", I->getOpcodeName());
+                    });
                     substituteInstruction(I, BB);
-                    modified = true;
+                    substituted++;
                 }
             }
         }
+        addStatistic("Substitutions", substituted);
         
-        return modified;
+        return substituted != 0;
     }
     
 private:
@@ -57,8 +73,17 @@ private:
      * @return true if instruction should be substituted
      */
     bool shouldSubstitute(Instruction *I) {
-        // Substitute simple arithmetic operations
-        return isa<AddInst>(I) || isa<SubInst>(I) || isa<MulInst>(I) || isa<DivInst>(I);
+        // Substitute simple integer arithmetic operations
+        switch (I->getOpcode()) {
+        case Instruction::Add:
+        case Instruction::Sub:
+            return true;
+        case Instruction::Mul:
+            // Only the multiply-by-3 rewrite below is implemented
+            return match(I->getOperand(1), m_SpecificInt(3));
+        default:
+            return false;
+        }
     }
     
     /**
@@ -67,27 +92,33 @@ private:
      * @param BB Basic block containing the instruction
      */
     void substituteInstruction(Instruction *I, BasicBlock &BB) {
-        if (auto *add = dyn_cast<AddInst>(I)) {
+        // The builder picks up I's debug location, so the replacement
+        // sequence is attributed to the original source line
+        if (I->getOpcode() == Instruction::Add) {
             // Substitute: a + b = a - (-b)
+            BinaryOperator *add = cast<BinaryOperator>(I);
             IRBuilder<> builder(I);
             Value *negB = builder.CreateNeg(add->getOperand(1));
             Value *result = builder.CreateSub(add->getOperand(0), negB);
             I->replaceAllUsesWith(result);
             I->eraseFromParent();
         }
-        else if (auto *sub = dyn_cast<SubInst>(I)) {
+        else if (I->getOpcode() == Instruction::Sub) {
             // Substitute: a - b = a + (-b)
+            BinaryOperator *sub = cast<BinaryOperator>(I);
             IRBuilder<> builder(I);
             Value *negB = builder.CreateNeg(sub->getOperand(1));
             Value *result = builder.CreateAdd(sub->getOperand(0), negB);
             I->replaceAllUsesWith(result);
             I->eraseFromParent();
         }
-        else if (auto *mul = dyn_cast<MulInst>(I)) {
+        else if (I->getOpcode() == Instruction::Mul) {
             // Substitute: a * b = (a << 1) + a (for b = 3)
             // This is a simplified example
+            BinaryOperator *mul = cast<BinaryOperator>(I);
             IRBuilder<> builder(I);
-            Value *shifted = builder.CreateShl(mul->getOperand(0), builder.getInt32(1));
+            Value *shifted = builder.CreateShl(mul->getOperand(0),
+                                               ConstantInt::get(mul->getType(), 1));
             Value *result = builder.CreateAdd(shifted, mul->getOperand(0));
             I->replaceAllUsesWith(result);
             I->eraseFromParent();
@@ -107,6 +138,5 @@ private:
 char InstructionSubstitutionPass::ID = 0;
 
 // Register the pass
-static RegisterPass<InstructionSubstitutionPass> X("instruction-substitution", 
-                                                  "Substitute instructions with complex sequences",
-                                                  false, false);
+static obfuscator::RegisterObfuscationPass<InstructionSubstitutionPass> X("instruction-substitution",
+                                                                          "Substitute instructions with complex sequences");
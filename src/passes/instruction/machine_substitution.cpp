@@ -0,0 +1,389 @@
+/**
+ * @file machine_substitution.cpp
+ * @brief Machine Instruction Substitution Pass
+ * 
+ * Rewrites x86-64 register-register ALU instructions into equivalent
+ * sequences after register allocation. Done on IR, the same rewrites
+ * are mostly folded back by instruction selection and lengthen live
+ * ranges before allocation; here they use a scratch register that is
+ * dead anyway and nothing runs afterwards that could fold them.
+ * 
+ * The target's instruction and register enums are not installed with
+ * LLVM, so opcodes and register classes are looked up by name.
+ */
+
+#include "passes/machine_substitution.h"
+#include "passes/obfuscation_pass.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/LivePhysRegs.h"
+#include "llvm/CodeGen/MachineBasicBlock.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/CodeGen/TargetInstrInfo.h"
+#include "llvm/CodeGen/TargetRegisterInfo.h"
+#include "llvm/CodeGen/TargetSchedule.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "machine-substitution"
+
+namespace {
+
+/// ALU operation of a substitutable instruction
+enum class AluOp { Add, Sub, And, Or, Xor };
+
+/**
+ * @struct X86Opcodes
+ * @brief Opcodes and registers the pass needs, found by name
+ */
+struct X86Opcodes {
+    StringMap<std::pair<AluOp, bool>> alu;  ///< Opcode name -> operation, 64-bit
+    unsigned addOp[2] = {};                 ///< ADD32rr, ADD64rr
+    unsigned subOp[2] = {};
+    unsigned andOp[2] = {};
+    unsigned orOp[2] = {};
+    unsigned xorOp[2] = {};
+    unsigned movOp[2] = {};                 ///< MOV32rr, MOV64rr
+    unsigned negOp[2] = {};                 ///< NEG32r, NEG64r
+    const TargetRegisterClass *gr32 = nullptr;
+    const TargetRegisterClass *gr64 = nullptr;
+    MCRegister eflags;
+    
+    /**
+     * @brief Look the opcodes and registers up in the target
+     * @param TII Instruction info of the x86-64 subtarget
+     * @param TRI Register info of the x86-64 subtarget
+     * @return false if any is missing
+     */
+    bool init(const TargetInstrInfo &TII, const TargetRegisterInfo &TRI) {
+        StringMap<unsigned> opcodes;
+        for (unsigned opcode = 0; opcode < TII.getNumOpcodes(); opcode++) {
+            opcodes[TII.getName(opcode)] = opcode;
+        }
+        struct { const char *name; unsigned *opcode; } wanted[] = {
+            {"ADD32rr", &addOp[0]}, {"ADD64rr", &addOp[1]},
+            {"SUB32rr", &subOp[0]}, {"SUB64rr", &subOp[1]},
+            {"AND32rr", &andOp[0]}, {"AND64rr", &andOp[1]},
+            {"OR32rr", &orOp[0]}, {"OR64rr", &orOp[1]},
+            {"XOR32rr", &xorOp[0]}, {"XOR64rr", &xorOp[1]},
+            {"MOV32rr", &movOp[0]}, {"MOV64rr", &movOp[1]},
+            {"NEG32r", &negOp[0]}, {"NEG64r", &negOp[1]},
+        };
+        for (auto &entry : wanted) {
+            auto found = opcodes.find(entry.name);
+            if (found == opcodes.end()) {
+                return false;
+            }
+            *entry.opcode = found->second;
+        }
+        for (bool is64 : {false, true}) {
+            alu[TII.getName(addOp[is64])] = {AluOp::Add, is64};
+            alu[TII.getName(subOp[is64])] = {AluOp::Sub, is64};
+            alu[TII.getName(andOp[is64])] = {AluOp::And, is64};
+            alu[TII.getName(orOp[is64])] = {AluOp::Or, is64};
+            alu[TII.getName(xorOp[is64])] = {AluOp::Xor, is64};
+        }
+        
+        for (const TargetRegisterClass *RC : TRI.regclasses()) {
+            StringRef name = TRI.getRegClassName(RC);
+            if (name == "GR32") {
+                gr32 = RC;
+            } else if (name == "GR64") {
+                gr64 = RC;
+            }
+        }
+        for (unsigned reg = 1; reg < TRI.getNumRegs(); reg++) {
+            if (StringRef(TRI.getName(reg)) == "EFLAGS") {
+                eflags = reg;
+            }
+        }
+        return gr32 && gr64 && eflags;
+    }
+};
+
+/**
+ * @class MachineSubstitutionPass
+ * @brief Post-RA substitution of x86-64 ALU instructions
+ */
+class MachineSubstitutionPass : public MachineFunctionPass, public obfuscator::ObfuscationPassBase {
+public:
+    static char ID; // Pass identification
+    
+    MachineSubstitutionPass()
+        : MachineFunctionPass(ID),
+          ObfuscationPassBase("machine-substitution", "MachineSubstitutionPass") {}
+    
+    /**
+     * @brief Main pass execution
+     * @param MF Machine function to transform
+     * @return true if function was modified
+     */
+    bool runOnMachineFunction(MachineFunction &MF) override {
+        Function &F = MF.getFunction();
+        if (MF.getTarget().getTargetTriple().getArch() != Triple::x86_64 ||
+            !MF.getProperties().hasProperty(MachineFunctionProperties::Property::TracksLiveness) ||
+            !shouldTransform(F)) {
+            return false;
+        }
+        const TargetSubtargetInfo &STI = MF.getSubtarget();
+        TII = STI.getInstrInfo();
+        TRI = STI.getRegisterInfo();
+        if (!opcodesReady && !(opcodesReady = opcodes.init(*TII, *TRI))) {
+            return false;
+        }
+        schedModel.init(&STI);
+        
+        FunctionScope scope(*this, F);
+        unsigned ratePercent = static_cast<unsigned>(config().getDouble("substitution_rate", 1.0) * 100);
+        std::vector<MCRegister> scratch = getScratchRegisters(MF);
+        Report report;
+        
+        for (MachineBasicBlock &MBB : MF) {
+            // Liveness is tracked from the end of the block backwards;
+            // at each instruction it holds what is live right after it
+            LivePhysRegs live(*TRI);
+            live.addLiveOuts(MBB);
+            for (MachineInstr &MI : make_early_inc_range(reverse(MBB))) {
+                bool replaced = !MI.isDebugInstr() && substitute(MI, live, scratch, ratePercent, report);
+                // The sequence reads and writes what MI did, plus a
+                // register dead on both sides
+                live.stepBackward(MI);
+                if (replaced) {
+                    MI.eraseFromParent();
+                }
+            }
+        }
+        
+        if (report.substitutions) {
+            remarks().emit([&] {
+                return OptimizationRemark(DEBUG_TYPE, "Substituted", F.getSubprogram(), &F.getEntryBlock())
+                       << "substituted " << ore::NV("Substitutions", report.substitutions)
+                       << " machine instructions: +" << ore::NV("Bytes", report.bytes)
+                       << " bytes, about +" << ore::NV("Cycles", report.cycles) << " cycles";
+            });
+        }
+        addStatistic("Substitutions", report.substitutions);
+        addStatistic("BytesAdded", report.bytes);
+        return report.substitutions != 0;
+    }
+    
+    /**
+     * @brief Get pass name
+     */
+    StringRef getPassName() const override {
+        return "MachineSubstitution";
+    }
+    
+private:
+    /**
+     * @struct Report
+     * @brief What the substitutions in one function cost
+     */
+    struct Report {
+        uint64_t substitutions = 0;
+        uint64_t bytes = 0;      ///< Encoded bytes added
+        int64_t cycles = 0;      ///< Latency added along the rewritten chains
+    };
+    
+    X86Opcodes opcodes;
+    bool opcodesReady = false;
+    const TargetInstrInfo *TII = nullptr;
+    const TargetRegisterInfo *TRI = nullptr;
+    TargetSchedModel schedModel;
+    
+    /**
+     * @brief Get the registers a substitution may clobber
+     * 
+     * Caller-saved general purpose registers only: a callee-saved one
+     * that the function does not save already would need saving.
+     * 
+     * @param MF Machine function
+     * @return 64-bit registers, in allocation order
+     */
+    std::vector<MCRegister> getScratchRegisters(MachineFunction &MF) {
+        const MachineRegisterInfo &MRI = MF.getRegInfo();
+        std::vector<MCRegister> registers;
+        for (MCPhysReg reg : *opcodes.gr64) {
+            bool calleeSaved = false;
+            for (const MCPhysReg *saved = TRI->getCalleeSavedRegs(&MF); *saved; saved++) {
+                calleeSaved |= TRI->regsOverlap(reg, *saved);
+            }
+            if (!calleeSaved && !MRI.isReserved(reg) && get32BitRegister(reg)) {
+                registers.push_back(reg);
+            }
+        }
+        return registers;
+    }
+    
+    /**
+     * @brief Get the low 32 bits of a 64-bit register
+     * @param reg64 64-bit register
+     * @return Its 32-bit subregister, or 0 if it has none
+     */
+    MCRegister get32BitRegister(MCRegister reg64) {
+        for (MCSubRegIterator sub(reg64, TRI); sub.isValid(); ++sub) {
+            if (opcodes.gr32->contains(*sub)) {
+                return *sub;
+            }
+        }
+        return MCRegister();
+    }
+    
+    /**
+     * @brief Insert a substitute before an instruction if it qualifies
+     * @param MI Candidate instruction; the caller erases it if replaced
+     * @param live Registers live right after MI
+     * @param scratch Registers a substitution may clobber
+     * @param ratePercent Share of the candidates to substitute
+     * @param report Updated with the cost of the substitution
+     * @return true if a sequence replacing MI was inserted
+     */
+    bool substitute(MachineInstr &MI, const LivePhysRegs &live, const std::vector<MCRegister> &scratch,
+                    unsigned ratePercent, Report &report) {
+        auto found = opcodes.alu.find(TII->getName(MI.getOpcode()));
+        if (found == opcodes.alu.end() || MI.getNumExplicitOperands() != 3) {
+            return false;
+        }
+        AluOp op = found->second.first;
+        bool is64 = found->second.second;
+        Register dst = MI.getOperand(0).getReg();
+        Register src = MI.getOperand(2).getReg();
+        
+        // "xor r, r" and friends are idioms; the flags may be read later
+        const MachineRegisterInfo &MRI = MI.getMF()->getRegInfo();
+        if (TRI->regsOverlap(dst, src) || live.contains(opcodes.eflags)) {
+            return false;
+        }
+        
+        // A scratch register dead across MI and not one of its operands
+        std::vector<MCRegister> free;
+        for (MCRegister reg : scratch) {
+            bool operand = false;
+            for (const MachineOperand &MO : MI.operands()) {
+                operand |= MO.isReg() && MO.getReg() && TRI->regsOverlap(MO.getReg(), reg);
+            }
+            if (!operand && live.available(MRI, reg)) {
+                free.push_back(reg);
+            }
+        }
+        if (free.empty()) {
+            return false;
+        }
+        
+        if (!plan().next([&] { return ratePercent >= 100 || nextRandom() % 100 < ratePercent; })) {
+            return false;
+        }
+        MCRegister temp = free[plan().next([&] { return nextRandom(); }) % free.size()];
+        if (!is64) {
+            temp = get32BitRegister(temp);
+        }
+        
+        // Every sequence replaces one instruction with three or four
+        unsigned length = op == AluOp::Add || op == AluOp::Sub ? 3 : 4;
+        if (!budget().tryCharge(length - 1)) {
+            return false;
+        }
+        
+        MachineBasicBlock &MBB = *MI.getParent();
+        const DebugLoc &DL = MI.getDebugLoc();
+        std::vector<MachineInstr*> added;
+        auto emit = [&](unsigned opcode, Register def, Register use1, Register use2) {
+            MachineInstrBuilder builder = BuildMI(MBB, MI, DL, TII->get(opcode), def);
+            if (use1) {
+                builder.addReg(use1);
+            }
+            if (use2) {
+                builder.addReg(use2);
+            }
+            builder->addRegisterDead(opcodes.eflags, TRI);
+            added.push_back(builder);
+        };
+        unsigned w = is64;
+        switch (op) {
+        case AluOp::Add:
+            // a + b = a - (-b)
+            emit(opcodes.movOp[w], temp, src, Register());
+            emit(opcodes.negOp[w], temp, temp, Register());
+            emit(opcodes.subOp[w], dst, dst, temp);
+            break;
+        case AluOp::Sub:
+            // a - b = a + (-b)
+            emit(opcodes.movOp[w], temp, src, Register());
+            emit(opcodes.negOp[w], temp, temp, Register());
+            emit(opcodes.addOp[w], dst, dst, temp);
+            break;
+        case AluOp::And:
+            // a & b = (a | b) ^ (a ^ b)
+            emit(opcodes.movOp[w], temp, dst, Register());
+            emit(opcodes.xorOp[w], temp, temp, src);
+            emit(opcodes.orOp[w], dst, dst, src);
+            emit(opcodes.xorOp[w], dst, dst, temp);
+            break;
+        case AluOp::Or:
+            // a | b = (a ^ b) + (a & b)
+            emit(opcodes.movOp[w], temp, dst, Register());
+            emit(opcodes.andOp[w], temp, temp, src);
+            emit(opcodes.xorOp[w], dst, dst, src);
+            emit(opcodes.addOp[w], dst, dst, temp);
+            break;
+        case AluOp::Xor:
+            // a ^ b = (a | b) - (a & b)
+            emit(opcodes.movOp[w], temp, dst, Register());
+            emit(opcodes.andOp[w], temp, temp, src);
+            emit(opcodes.orOp[w], dst, dst, src);
+            emit(opcodes.subOp[w], dst, dst, temp);
+            break;
+        }
+        
+        report.substitutions++;
+        for (MachineInstr *I : added) {
+            report.bytes += getEncodedSize(*I, is64);
+            report.cycles += schedModel.computeInstrLatency(I);
+        }
+        report.bytes -= getEncodedSize(MI, is64);
+        report.cycles -= schedModel.computeInstrLatency(&MI);
+        return true;
+    }
+    
+    /**
+     * @brief Get the encoded size of a register-register instruction
+     * 
+     * Opcode and ModRM byte, plus a REX prefix for 64-bit operands or
+     * for r8-r15.
+     * 
+     * @param MI Instruction of the forms this pass handles
+     * @param is64 Whether the operands are 64-bit
+     * @return Size in bytes
+     */
+    unsigned getEncodedSize(const MachineInstr &MI, bool is64) {
+        bool rex = is64;
+        for (const MachineOperand &MO : MI.explicit_operands()) {
+            rex |= MO.isReg() && (TRI->getEncodingValue(MO.getReg()) & 8);
+        }
+        return 2 + rex;
+    }
+};
+
+} // anonymous namespace
+
+char MachineSubstitutionPass::ID = 0;
+
+namespace obfuscator {
+
+/**
+ * @brief Create the machine instruction substitution pass
+ * @return New pass
+ */
+MachineFunctionPass *createMachineSubstitutionPass() {
+    return new MachineSubstitutionPass();
+}
+
+} // namespace obfuscator
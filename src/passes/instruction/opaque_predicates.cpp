@@ -4,9 +4,30 @@
  * 
  * This pass adds opaque predicates (always true/false conditions)
  * to make control flow analysis more difficult.
+ * 
+ * A constant condition such as 42 == 42 folds away at once, and one
+ * read from memory costs a load per branch. The predicates here test
+ * arithmetic invariants instead: the entry block derives a few values
+ * from a seed the optimizer cannot see (an argument, or the address of
+ * a stack slot), and every predicate of the function tests a fact
+ * about them that holds for any seed. Each value alone varies from
+ * call to call; the predicates comparing two of them form a correlated
+ * set whose joint truth is fixed. The values stay in registers, so a
+ * predicate costs one or two ALU ops and a branch, and the known-bits
+ * analysis of -O2 proves none of them. The impossible edge returns a
+ * value computed from the invariants, so it does not fold into the
+ * real one either.
+ * 
+ * predicate_complexity picks the forms: "low" uses only the single
+ * test forms, "medium" (the default) also the correlated ones outside
+ * hot loops, "high" the correlated ones everywhere.
  */
 
+#include "passes/obfuscation_pass.h"
+#include "utils/llvm_utils.h"
+
 #include "llvm/Pass.h"
+#include "llvm/Analysis/EHPersonalities.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
@@ -15,37 +36,149 @@
 
 using namespace llvm;
 
+#define DEBUG_TYPE "opaque-predicates"
+
+/// Instructions of the invariants, without the seed: u, v and o
+const uint64_t kInvariantCost = 8;
+
 namespace {
 
+/**
+ * @brief Forms of predicate, each true for every seed
+ * 
+ * With u = s * (s + 1), v = (s + d) * (s + d + 1) for d = 2 mod 4,
+ * and o = t * t for odd t:
+ */
+enum class PredicateKind {
+    OddSquare,  ///< (o & 6) == 0: odd squares are 1 mod 8
+    Pronic,     ///< (u & 1) == 0: the product of two neighbours is even
+    Neighbours, ///< ((u ^ v) & 2) != 0: v = u + 2 mod 4
+    Parity      ///< ((u + o) & 1) != 0: even plus odd
+};
+
+/**
+ * @brief Check if a form tests a single invariant
+ * @param kind Predicate form
+ * @return true if the predicate is one test and branch
+ */
+bool isSingleTest(PredicateKind kind) {
+    return kind == PredicateKind::OddSquare || kind == PredicateKind::Pronic;
+}
+
+/**
+ * @brief Values the predicates of one function test
+ */
+struct Invariants {
+    Value *u = nullptr; ///< s * (s + 1)
+    Value *v = nullptr; ///< (s + d) * (s + d + 1)
+    Value *o = nullptr; ///< ((s ^ c) | 1) squared
+};
+
+/**
+ * @brief A block to guard and the form of its predicate
+ */
+struct PredicateSite {
+    BasicBlock *block;
+    PredicateKind kind;
+    bool inverted;    ///< Test the negation and swap the edges
+    bool hot;         ///< The block is in a hot loop
+};
+
 /**
  * @class OpaquePredicatesPass
  * @brief LLVM pass for opaque predicates
  */
-class OpaquePredicatesPass : public FunctionPass {
+class OpaquePredicatesPass : public obfuscator::ObfuscationPass {
 public:
     static char ID; // Pass identification
     
-    OpaquePredicatesPass() : FunctionPass(ID) {}
-    
+    OpaquePredicatesPass()
+        : ObfuscationPass(ID, "opaque-predicates", "OpaquePredicatesPass") {}
+        
+protected:
     /**
      * @brief Main pass execution
      * @param F Function to transform
      * @return true if function was modified
      */
-    bool runOnFunction(Function &F) override {
-        errs() << "OpaquePredicatesPass: Processing function " << F.getName() << "\n";
+    bool transform(Function &F) override {
+        // The impossible edge returns; in a function that never does,
+        // the optimizer would take it for unreachable and fold the
+        // predicate
+        if (F.doesNotReturn()) {
+            return false;
+        }
         
-        bool modified = false;
+        // Tail calls return from their own block, so no predicate can
+        // come between them and the return
+        bool changed = obfuscator::duplicateReturnsForTailCalls(F) > 0;
+        
+        std::string complexity = config().getString("predicate_complexity", "medium");
+        std::set<const BasicBlock*> hotBlocks = obfuscator::findHotLoopBlocks(F);
+        
+        // A funclet cannot return; only blocks of the function body
+        // get a predicate
+        DenseMap<BasicBlock*, ColorVector> funclets;
+        if (F.hasPersonalityFn() &&
+            isFuncletEHPersonality(classifyEHPersonality(F.getPersonalityFn()))) {
+            funclets = colorEHFunclets(F);
+        }
         
-        // Process each basic block
+        // Collect targets first; the transform adds blocks to F. The
+        // invariants are charged with the first one
+        Value *seedSource = findSeedSource(F);
+        uint64_t invariantCost = kInvariantCost + getSeedCost(seedSource);
+        std::vector<PredicateSite> targets;
         for (auto &BB : F) {
-            if (shouldAddOpaquePredicate(BB)) {
-                addOpaquePredicate(BB, F);
-                modified = true;
+            if (!funclets.empty() &&
+                (funclets[&BB].size() != 1 || funclets[&BB].front() != &F.getEntryBlock())) {
+                continue;
             }
+            if (!plan().next([&] { return shouldAddOpaquePredicate(BB); })) {
+                continue;
+            }
+            PredicateSite site;
+            site.block = &BB;
+            site.hot = hotBlocks.count(&BB) > 0;
+            site.kind = chooseKind(complexity == "low" || (complexity != "high" && site.hot));
+            site.inverted = plan().next([&] { return nextRandom(); }) % 2;
+            uint64_t cost = getPredicateCost(site.kind, F) + (targets.empty() ? invariantCost : 0);
+            if (budget().tryCharge(cost)) {
+                targets.push_back(site);
+            }
+        }
+        if (targets.empty()) {
+            return changed;
         }
         
-        return modified;
+        Invariants invariants = buildInvariants(F, seedSource);
+        addStatistic("InvariantInstructions", invariantCost);
+        
+        unsigned discriminator = obfuscator::getNextFreeDiscriminator(F);
+        uint64_t hotInstructions = 0;
+        for (const PredicateSite &site : targets) {
+            unsigned pathInstructions = getPathCost(site.kind);
+            remarks().emit([&] {
+                OptimizationRemark remark(DEBUG_TYPE, "PredicateAdded",
+                                          obfuscator::getInsertionDebugLoc(*site.block), site.block);
+                remark << "added an opaque predicate";
+                if (site.block->hasName()) {
+                    remark << " to block " << ore::NV("Block", site.block->getName());
+                }
+                remark << " (" << ore::NV("Instructions", pathInstructions) << " instructions on the path"
+                       << (site.hot ? ", hot loop)" : ")");
+                return remark;
+            });
+            addOpaquePredicate(site, F, invariants, discriminator++);
+            if (site.hot) {
+                hotInstructions += pathInstructions;
+            }
+            addStatistic("PathInstructions", pathInstructions);
+        }
+        addStatistic("Predicates", targets.size());
+        addStatistic("HotLoopInstructions", hotInstructions);
+        
+        return true;
     }
     
 private:
@@ -55,38 +188,236 @@ private:
      * @return true if opaque predicate should be added
      */
     bool shouldAddOpaquePredicate(BasicBlock &BB) {
-        // Don't add to entry block or blocks with less than 2 instructions
+        // Don't add to entry block or blocks with less than 2 instructions;
+        // the entry block computes the invariants
         if (BB.isEntryBlock() || BB.size() < 2) {
             return false;
         }
         
+        // A catchswitch is both the pad and the terminator; no branch
+        // fits in between
+        if (BB.getFirstInsertionPt() == BB.end()) {
+            return false;
+        }
+        
         // Random probability check (30% chance)
-        return (rand() % 100) < 30;
+        return (nextRandom() % 100) < 30;
+    }
+    
+    /**
+     * @brief Pick the form of a predicate
+     * @param singleTest Whether only the single test forms may be used
+     * @return Predicate form
+     */
+    PredicateKind chooseKind(bool singleTest) {
+        // Reduced after the plan, so a replayed plan cannot pick a form
+        // that does not exist
+        uint64_t choice = plan().next([&] { return nextRandom(); });
+        if (singleTest) {
+            return choice % 2 ? PredicateKind::OddSquare : PredicateKind::Pronic;
+        }
+        return static_cast<PredicateKind>(choice % 4);
+    }
+    
+    /**
+     * @brief Find the value the invariants derive from
+     * 
+     * The widest integer argument, else a pointer argument. A function
+     * without either uses the address of a stack slot.
+     * 
+     * @param F Function to scan
+     * @return Argument, or nullptr for a stack slot
+     */
+    Value *findSeedSource(Function &F) {
+        Argument *best = nullptr;
+        for (Argument &arg : F.args()) {
+            Type *type = arg.getType();
+            if (type->isIntegerTy() && type->getIntegerBitWidth() >= 8 &&
+                (!best || !best->getType()->isIntegerTy() ||
+                 type->getIntegerBitWidth() > best->getType()->getIntegerBitWidth())) {
+                best = &arg;
+            } else if (type->isPointerTy() && !best) {
+                best = &arg;
+            }
+        }
+        return best;
+    }
+    
+    /**
+     * @brief Count the instructions that turn a seed source into an i32
+     * @param source Argument, or nullptr for a stack slot
+     * @return Instructions buildSeed adds
+     */
+    uint64_t getSeedCost(Value *source) {
+        if (!source) {
+            return 6; // alloca, ptrtoint, shift, two truncs, xor
+        }
+        if (source->getType()->isPointerTy()) {
+            return 6; // freeze, ptrtoint, shift, two truncs, xor
+        }
+        return source->getType()->getIntegerBitWidth() == 32 ? 1 : 2;
+    }
+    
+    /**
+     * @brief Build the 32-bit seed in the entry block
+     * 
+     * Arguments are frozen: each use of an undefined value may differ,
+     * which would break the invariants. Pointers fold their high half
+     * into the low one, so that alignment, which the optimizer knows,
+     * does not leave the low bits of the seed known zero.
+     * 
+     * @param builder Builder at the top of the entry block
+     * @param source Argument, or nullptr for a stack slot
+     * @return Seed
+     */
+    Value *buildSeed(IRBuilder<> &builder, Value *source) {
+        Value *seed = source;
+        if (!seed) {
+            seed = builder.CreateAlloca(builder.getInt8Ty(), nullptr, "opaque.slot");
+        } else {
+            seed = builder.CreateFreeze(seed, "opaque.seed");
+        }
+        if (seed->getType()->isPointerTy()) {
+            Value *address = builder.CreatePtrToInt(seed, builder.getInt64Ty());
+            Value *high = builder.CreateTrunc(builder.CreateLShr(address, 32), builder.getInt32Ty());
+            return builder.CreateXor(builder.CreateTrunc(address, builder.getInt32Ty()), high);
+        }
+        return builder.CreateZExtOrTrunc(seed, builder.getInt32Ty());
+    }
+    
+    /**
+     * @brief Compute the invariants at the top of the function
+     * @param F Function to transform
+     * @param source Argument, or nullptr for a stack slot
+     * @return Invariants
+     */
+    Invariants buildInvariants(Function &F, Value *source) {
+        BasicBlock &entry = F.getEntryBlock();
+        BasicBlock::iterator insertPoint = entry.getFirstInsertionPt();
+        while (isa<AllocaInst>(*insertPoint)) {
+            ++insertPoint;
+        }
+        IRBuilder<> builder(&entry, insertPoint);
+        builder.SetCurrentDebugLocation(obfuscator::getInsertionDebugLoc(entry));
+        Value *s = buildSeed(builder, source);
+        
+        // d = 2 mod 4 and c nonzero, per function
+        uint32_t d = 2 + 4 * static_cast<uint32_t>(plan().next([&] { return nextRandom(); }) % 64);
+        uint32_t c = static_cast<uint32_t>(plan().next([&] { return nextRandom(); })) | 0x100;
+        
+        Invariants invariants;
+        invariants.u = builder.CreateMul(s, builder.CreateAdd(s, builder.getInt32(1)), "opaque.u");
+        invariants.v = builder.CreateMul(builder.CreateAdd(s, builder.getInt32(d)),
+                                         builder.CreateAdd(s, builder.getInt32(d + 1)), "opaque.v");
+        Value *odd = builder.CreateOr(builder.CreateXor(s, builder.getInt32(c)), builder.getInt32(1));
+        invariants.o = builder.CreateMul(odd, odd, "opaque.o");
+        return invariants;
+    }
+    
+    /**
+     * @brief Count the instructions a predicate adds to the real path
+     * 
+     * The test, its compare and the branch; on x86-64 the compare and
+     * the branch fuse, so a single test costs one ALU op.
+     * 
+     * @param kind Predicate form
+     * @return Instructions on the path through the block
+     */
+    unsigned getPathCost(PredicateKind kind) {
+        return isSingleTest(kind) ? 3 : 4;
+    }
+    
+    /**
+     * @brief Count the instructions a predicate adds
+     * @param kind Predicate form
+     * @param F Function the impossible edge returns from
+     * @return The path through the block and the impossible block
+     */
+    uint64_t getPredicateCost(PredicateKind kind, Function &F) {
+        uint64_t cost = getPathCost(kind) + 1;
+        Type *returnType = F.getReturnType();
+        if (returnType->isIntegerTy()) {
+            cost += returnType->getIntegerBitWidth() == 32 ? 1 : 2;
+        }
+        return cost;
+    }
+    
+    /**
+     * @brief Build the condition of a predicate
+     * @param builder Builder in front of the branch
+     * @param kind Predicate form
+     * @param inverted Whether to build the negation
+     * @param invariants Values to test
+     * @return Condition, always true unless inverted
+     */
+    Value *buildCondition(IRBuilder<> &builder, PredicateKind kind, bool inverted,
+                          const Invariants &invariants) {
+        Value *bits = nullptr;
+        bool zero = true; // whether the tested bits are zero
+        switch (kind) {
+        case PredicateKind::OddSquare:
+            bits = builder.CreateAnd(invariants.o, builder.getInt32(6));
+            break;
+        case PredicateKind::Pronic:
+            bits = builder.CreateAnd(invariants.u, builder.getInt32(1));
+            break;
+        case PredicateKind::Neighbours:
+            bits = builder.CreateAnd(builder.CreateXor(invariants.u, invariants.v), builder.getInt32(2));
+            zero = false;
+            break;
+        case PredicateKind::Parity:
+            bits = builder.CreateAnd(builder.CreateAdd(invariants.u, invariants.o), builder.getInt32(1));
+            zero = false;
+            break;
+        }
+        return zero != inverted ? builder.CreateICmpEQ(bits, builder.getInt32(0))
+                                : builder.CreateICmpNE(bits, builder.getInt32(0));
     }
     
     /**
      * @brief Add opaque predicate to a basic block
-     * @param BB Basic block to modify
+     * @param site Block to guard and the form of its predicate
      * @param F Function containing the block
+     * @param invariants Values the predicate tests
+     * @param discriminator Debug discriminator for the inserted code
      */
-    void addOpaquePredicate(BasicBlock &BB, Function &F) {
-        // Create fake basic block
-        BasicBlock *fakeBB = BasicBlock::Create(F.getContext(), "fake_" + BB.getName(), &F);
+    void addOpaquePredicate(const PredicateSite &site, Function &F,
+                                const Invariants &invariants, unsigned discriminator) {
+        // Split the PHI nodes off so the predicate can guard the body;
+        // the block keeps the body and its edges to the successors
+        BasicBlock *headBB = obfuscator::splitBlockHead(*site.block);
+        BasicBlock *bodyBB = site.block;
+        DebugLoc fakeLoc = obfuscator::getSyntheticDebugLoc(
+            obfuscator::getInsertionDebugLoc(*bodyBB), discriminator);
         
-        // Add fake instructions to fake block
+        // The impossible edge leaves the function with a value derived
+        // from the invariants
+        BasicBlock *fakeBB = BasicBlock::Create(F.getContext(), "fake_" + headBB->getName(), &F, bodyBB);
         IRBuilder<> builder(fakeBB);
-        Value *fake1 = builder.CreateAdd(builder.getInt32(0), builder.getInt32(0));
-        Value *fake2 = builder.CreateMul(fake1, builder.getInt32(1));
-        builder.CreateBr(&BB);
-        
-        // Create opaque predicate (always true)
-        IRBuilder<> origBuilder(&BB);
-        Value *x = origBuilder.getInt32(42);
-        Value *y = origBuilder.getInt32(42);
-        Value *condition = origBuilder.CreateICmpEQ(x, y); // Always true
+        builder.SetCurrentDebugLocation(fakeLoc);
+        Type *returnType = F.getReturnType();
+        if (returnType->isVoidTy()) {
+            builder.CreateRetVoid();
+        } else if (returnType->isIntegerTy()) {
+            Value *junk = plan().next([&] { return nextRandom(); }) % 2
+                              ? builder.CreateSub(invariants.v, invariants.o)
+                              : builder.CreateXor(invariants.u, invariants.o);
+            builder.CreateRet(builder.CreateZExtOrTrunc(junk, returnType));
+        } else {
+            builder.CreateRet(Constant::getNullValue(returnType));
+        }
         
-        // Insert conditional branch
-        origBuilder.CreateCondBr(condition, &BB, fakeBB);
+        // Replace the split branch with the conditional branch
+        Instruction *splitBranch = headBB->getTerminator();
+        IRBuilder<> origBuilder(splitBranch);
+        origBuilder.SetCurrentDebugLocation(fakeLoc);
+        Value *condition = buildCondition(origBuilder, site.kind, site.inverted, invariants);
+        if (site.inverted) {
+            origBuilder.CreateCondBr(condition, fakeBB, bodyBB);
+        } else {
+            origBuilder.CreateCondBr(condition, bodyBB, fakeBB);
+        }
+        splitBranch->eraseFromParent();
     }
     
     /**
@@ -102,6 +433,5 @@ private:
 char OpaquePredicatesPass::ID = 0;
 
 // Register the pass
-static RegisterPass<OpaquePredicatesPass> X("opaque-predicates", 
-                                           "Add opaque predicates to control flow",
-                                           false, false);
+static obfuscator::RegisterObfuscationPass<OpaquePredicatesPass> X("opaque-predicates",
+                                                                   "Add opaque predicates to control flow");
@@ -0,0 +1,337 @@
+/**
+ * @file obfuscation_pass.cpp
+ * @brief Obfuscation Pass Base
+ * 
+ * Configuration, selection, budget and statistics shared by every
+ * obfuscation pass.
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/config_parser.h"
+#include "utils/llvm_utils.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+using namespace llvm;
+
+static cl::opt<unsigned> MaxGrowthPercent(
+    "obfuscation-max-growth", cl::init(0),
+    cl::desc("Largest growth, in percent of its instructions, a pass may "
+             "cause in a function (0 = no limit)"));
+
+namespace obfuscator {
+
+namespace {
+
+/// Smallest budget: tiny functions still get a few transformations
+const uint64_t kMinimumBudget = 16;
+
+/**
+ * @brief Get the LLVM statistic behind a counter
+ * @param group Registered pass name
+ * @param name Counter name
+ * @return Statistic, created on first use
+ */
+TrackingStatistic &getStatistic(StringRef group, StringRef name) {
+    // LLVM keeps pointers to registered statistics until it prints them
+    // at exit, so they are never freed
+    static std::mutex mutex;
+    static auto *statistics = new std::map<std::pair<std::string, std::string>,
+                                           std::unique_ptr<TrackingStatistic>>();
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = statistics->find({group.str(), name.str()});
+    if (found == statistics->end()) {
+        found = statistics->emplace(std::make_pair(group.str(), name.str()), nullptr).first;
+        const char *groupName = found->first.first.c_str();
+        const char *counterName = found->first.second.c_str();
+        found->second = std::make_unique<TrackingStatistic>(groupName, counterName, counterName);
+    }
+    return *found->second;
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Create a view of a pass section
+ * @param values Settings of the pass, keyed by name
+ */
+PassConfig::PassConfig(std::map<std::string, std::string> values) : values_(std::move(values)) {}
+
+/**
+ * @brief Look up a setting
+ * @param key Setting name
+ * @return Its value, or nullptr if missing
+ */
+const std::string *PassConfig::find(StringRef key) const {
+    auto found = values_.find(key.str());
+    return found == values_.end() ? nullptr : &found->second;
+}
+
+/**
+ * @brief Check if the pass may run
+ * @return false only if the section sets "enabled" to false
+ */
+bool PassConfig::isEnabled() const {
+    return getBool("enabled", true);
+}
+
+/**
+ * @brief Check if a setting is present
+ * @param key Setting name
+ * @return true if the section sets it
+ */
+bool PassConfig::has(StringRef key) const {
+    return find(key) != nullptr;
+}
+
+/**
+ * @brief Get a boolean setting
+ * @param key Setting name
+ * @param defaultValue Value if the setting is missing or not a boolean
+ * @return Setting value
+ */
+bool PassConfig::getBool(StringRef key, bool defaultValue) const {
+    const std::string *value = find(key);
+    if (value && (*value == "true" || *value == "false")) {
+        return *value == "true";
+    }
+    return defaultValue;
+}
+
+/**
+ * @brief Get an integer setting
+ * @param key Setting name
+ * @param defaultValue Value if the setting is missing or not an integer
+ * @return Setting value
+ */
+int64_t PassConfig::getInt(StringRef key, int64_t defaultValue) const {
+    const std::string *value = find(key);
+    int64_t result;
+    if (value && !StringRef(*value).getAsInteger(10, result)) {
+        return result;
+    }
+    return defaultValue;
+}
+
+/**
+ * @brief Get a numeric setting
+ * @param key Setting name
+ * @param defaultValue Value if the setting is missing or not a number
+ * @return Setting value
+ */
+double PassConfig::getDouble(StringRef key, double defaultValue) const {
+    const std::string *value = find(key);
+    double result;
+    if (value && to_float(*value, result)) {
+        return result;
+    }
+    return defaultValue;
+}
+
+/**
+ * @brief Get a string setting
+ * @param key Setting name
+ * @param defaultValue Value if the setting is missing
+ * @return Setting value
+ */
+std::string PassConfig::getString(StringRef key, StringRef defaultValue) const {
+    const std::string *value = find(key);
+    return value ? *value : defaultValue.str();
+}
+
+/**
+ * @brief Get the configuration of a pass
+ * @param passName Registered pass name (e.g. "bogus-control-flow")
+ * @return Its section of the -obfuscation-config file; empty without one
+ */
+const PassConfig &getPassConfig(StringRef passName) {
+    static std::mutex mutex;
+    static StringMap<std::unique_ptr<PassConfig>> sections;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<PassConfig> &section = sections[passName];
+    if (!section) {
+        section = std::make_unique<PassConfig>(getObfuscationConfig().getPassConfig(passName.str()));
+    }
+    return *section;
+}
+
+/**
+ * @brief Get the names recorded by RegisterObfuscationPass
+ * @return Mutable list; filled during static initialization
+ */
+static std::vector<std::string> &getPassNameList() {
+    static std::vector<std::string> names;
+    return names;
+}
+
+/**
+ * @brief Record the name of a registered obfuscation pass
+ * @param passName Registered pass name
+ */
+void addObfuscationPassName(StringRef passName) {
+    getPassNameList().push_back(passName.str());
+}
+
+/**
+ * @brief Get the obfuscation passes linked into the process
+ * @return Registered pass names, sorted
+ */
+std::vector<std::string> getObfuscationPassNames() {
+    std::vector<std::string> names = getPassNameList();
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/**
+ * @brief Create a budget for a function
+ * @param instructions Size of the function
+ * @param maxGrowthPercent Allowed growth; 0 for no limit
+ */
+GrowthBudget::GrowthBudget(uint64_t instructions, unsigned maxGrowthPercent)
+    : limited_(maxGrowthPercent != 0),
+      limit_(std::max(kMinimumBudget, instructions * maxGrowthPercent / 100)) {}
+
+/**
+ * @brief Charge a transformation against the budget
+ * @param instructions Instructions the transformation adds
+ * @return true if it fits and was charged; false if it must be skipped
+ */
+bool GrowthBudget::tryCharge(uint64_t instructions) {
+    if (limited_ && charged_ + instructions > limit_) {
+        refused_++;
+        return false;
+    }
+    charged_ += instructions;
+    return true;
+}
+
+/**
+ * @brief Create the base of a pass
+ * @param passName Registered pass name; also the remark and statistic group
+ * @param displayName Name used in progress messages
+ */
+ObfuscationPassBase::ObfuscationPassBase(StringRef passName, StringRef displayName)
+    : passName_(passName), displayName_(displayName), config_(&getPassConfig(passName)) {}
+
+/**
+ * @brief Decide whether the pass runs on a function
+ * @param F Candidate function
+ * @return true if the pass should transform F
+ */
+bool ObfuscationPassBase::shouldTransform(const Function &F) const {
+    return !F.isDeclaration() && config().isEnabled();
+}
+
+/**
+ * @brief Count an event for -stats
+ * @param name Counter name, a string literal
+ * @param count Amount to add
+ */
+void ObfuscationPassBase::addStatistic(const char *name, uint64_t count) {
+    // Summed locally; the shared counters are touched once per run
+    for (auto &statistic : statistics_) {
+        if (statistic.first == name) {
+            statistic.second += count;
+            return;
+        }
+    }
+    statistics_.push_back({name, count});
+}
+
+/**
+ * @brief Report the statistics counted since the last flush
+ */
+void ObfuscationPassBase::flushStatistics() {
+    if (AreStatisticsEnabled()) {
+        for (auto &statistic : statistics_) {
+            getStatistic(passName_, statistic.first) += statistic.second;
+        }
+    }
+    statistics_.clear();
+}
+
+/**
+ * @brief Open the state for a function
+ * @param pass Pass running on F
+ * @param F Function being transformed
+ */
+ObfuscationPassBase::FunctionScope::FunctionScope(ObfuscationPassBase &pass, Function &F)
+    : pass_(pass), function_(F), plan_(F, pass.passName_),
+      budget_(F.getInstructionCount(),
+              static_cast<unsigned>(pass.config().getInt("max_growth_percent", MaxGrowthPercent))),
+      remarks_(&F) {
+    // Under the pass's own debug type, so -debug-only=<pass> selects it
+    DEBUG_WITH_TYPE(pass.passName_.data(),
+                    dbgs() << pass.displayName_ << ": Processing function " << F.getName() << "\n");
+    if (!pass.modulePass_) {
+        profile_.emplace(F, pass.passName_);
+    }
+    pass.rng_ = getRandomGenerator(F, pass.passName_);
+    pass.plan_ = &plan_;
+    pass.budget_ = &budget_;
+    pass.remarks_ = &remarks_;
+}
+
+ObfuscationPassBase::FunctionScope::~FunctionScope() {
+    if (budget_.getRefused()) {
+        pass_.addStatistic("BudgetRefusals", budget_.getRefused());
+        remarks_.emit([&] {
+            // passName_ points at the string literal the pass registered
+            return OptimizationRemarkMissed(pass_.passName_.data(), "BudgetExhausted",
+                                            function_.getSubprogram(), &function_.getEntryBlock())
+                   << "growth budget of " << ore::NV("Budget", budget_.getLimit())
+                   << " instructions exhausted; "
+                   << ore::NV("Skipped", budget_.getRefused()) << " transformations skipped";
+        });
+    }
+    pass_.addStatistic("InstructionsAdded", budget_.getCharged());
+    pass_.flushStatistics();
+    pass_.plan_ = nullptr;
+    pass_.budget_ = nullptr;
+    pass_.remarks_ = nullptr;
+}
+
+/**
+ * @brief Run transform() on the function if it is selected
+ * @param F Function to transform
+ * @return true if function was modified
+ */
+bool ObfuscationPass::runOnFunction(Function &F) {
+    if (!shouldTransform(F)) {
+        return false;
+    }
+    FunctionScope scope(*this, F);
+    return transform(F);
+}
+
+/**
+ * @brief Run transform() on the module if the pass is enabled
+ * @param M Module to transform
+ * @return true if module was modified
+ */
+bool ObfuscationModulePass::runOnModule(Module &M) {
+    if (!config().isEnabled()) {
+        return false;
+    }
+    DEBUG_WITH_TYPE(passName_.data(),
+                    dbgs() << displayName_ << ": Processing module " << M.getName() << "\n");
+    PassProfileScope profile(M, passName_);
+    rng() = getRandomGenerator(M, passName_);
+    bool modified = transform(M);
+    flushStatistics();
+    return modified;
+}
+
+} // namespace obfuscator
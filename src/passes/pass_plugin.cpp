@@ -0,0 +1,75 @@
+/**
+ * @file pass_plugin.cpp
+ * @brief New Pass Manager Support
+ * 
+ * Adaptor running the obfuscation passes in the new pass manager,
+ * and the entry point opt's -load-pass-plugin looks for.
+ */
+
+#include "passes/pass_plugin.h"
+#include "passes/obfuscation_pass.h"
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+namespace obfuscator {
+
+/**
+ * @brief Run the pass on a module
+ * @param M Module to transform
+ * @param MAM Analysis manager of the module (unused: the legacy pass
+ *            manager computes what the pass asks for)
+ * @return No analyses preserved if the module changed, all otherwise
+ */
+PreservedAnalyses ObfuscationPassAdaptor::run(Module &M, ModuleAnalysisManager &/*MAM*/) {
+    const PassInfo *info = PassRegistry::getPassRegistry()->getPassInfo(passName_);
+    if (!info || !info->getNormalCtor()) {
+        errs() << "ObfuscationPassAdaptor: unknown obfuscation pass '" << passName_ << "'\n";
+        return PreservedAnalyses::all();
+    }
+    
+    // run() is true when the pass reported a change, which every
+    // obfuscation pass does exactly when it touched the IR; the new
+    // pass manager then invalidates the cached analyses of the module
+    legacy::PassManager PM;
+    PM.add(info->createPass());
+    bool changed = PM.run(M);
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
+
+/**
+ * @brief Make the obfuscation passes available to PassBuilder pipelines
+ * @param PB Pass builder to register with
+ */
+void registerObfuscationPasses(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+            std::vector<std::string> passes = getObfuscationPassNames();
+            if (std::find(passes.begin(), passes.end(), name) == passes.end()) {
+                return false;
+            }
+            MPM.addPass(ObfuscationPassAdaptor(name.str()));
+            return true;
+        });
+}
+
+} // namespace obfuscator
+
+/**
+ * @brief Entry point of the plugin for opt -load-pass-plugin
+ * @return Plugin description with the registration callback
+ */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "Obfuscator", LLVM_VERSION_STRING,
+            [](PassBuilder &PB) { obfuscator::registerObfuscationPasses(PB); }};
+}
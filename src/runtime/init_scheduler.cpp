@@ -0,0 +1,275 @@
+/**
+ * @file init_scheduler.cpp
+ * @brief Obfuscation Runtime Init Scheduler
+ * 
+ * Runs the obf_init_task entries every obfuscated module of the
+ * program (or shared library) placed in the "obf_init" section, from
+ * one constructor, as obfuscation_runtime.h describes. The linker
+ * defines __start_obf_init and __stop_obf_init around the section;
+ * the symbols are hidden, so a shared library linking the runtime
+ * schedules its own tasks.
+ * 
+ * Plain C and pthreads only: the runtime is linked into C programs
+ * too, and may run before other constructors.
+ */
+
+#include "runtime/obfuscation_runtime.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OBF_HIDDEN __attribute__((visibility("hidden")))
+
+extern "C" {
+// Weak: a program without any task has no section
+extern struct obf_init_task __start_obf_init[] __attribute__((weak)) OBF_HIDDEN;
+extern struct obf_init_task __stop_obf_init[] __attribute__((weak)) OBF_HIDDEN;
+}
+
+namespace {
+
+/// Time the constructor took, thread start included
+uint64_t startupNanoseconds;
+
+/// OBF_INIT_REPORT as first read: -1 before, then 0 or 1
+int reportRequested = -1;
+
+/// Resident set in kB when the first measured task started, 0 before
+uint64_t firstTaskKilobytes;
+
+/// Resident set in kB when the last measured task finished
+uint64_t lastTaskKilobytes;
+
+/// Components the report sums separately; the rest share a line
+const int kMaxReportedComponents = 32;
+
+/**
+ * @brief Read the monotonic clock
+ * @return Nanoseconds since an arbitrary point
+ */
+uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000u + static_cast<uint64_t>(time.tv_nsec);
+}
+
+/**
+ * @brief Check if the report is asked for
+ * 
+ * The environment is read once, by the first task or our constructor,
+ * whichever runs first: every task then is measured if and only if
+ * the report is printed at exit. Setting the variable later has no
+ * effect.
+ * 
+ * @return true if OBF_INIT_REPORT was set
+ */
+bool reporting() {
+    int requested = __atomic_load_n(&reportRequested, __ATOMIC_ACQUIRE);
+    if (requested < 0) {
+        // Threads racing here read the same environment
+        const char *report = getenv("OBF_INIT_REPORT");
+        requested = report && *report && *report != '0';
+        __atomic_store_n(&reportRequested, requested, __ATOMIC_RELEASE);
+    }
+    return requested != 0;
+}
+
+/**
+ * @brief Read the resident set of the process
+ * @return Resident set in kB, 0 if /proc is not mounted
+ */
+uint64_t residentKilobytes() {
+    char buffer[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    unsigned long size, resident;
+    if (sscanf(buffer, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/**
+ * @brief Run the tasks of one mode
+ * @param mode OBF_INIT_EAGER or OBF_INIT_BACKGROUND
+ */
+void runTasks(uint32_t mode) {
+    for (struct obf_init_task *task = __start_obf_init; task != __stop_obf_init; task++) {
+        if (task->mode == mode) {
+            __obf_init_run(task);
+        }
+    }
+}
+
+/**
+ * @brief Body of the background thread
+ * @return Nothing
+ */
+void *runBackgroundTasks(void *) {
+    runTasks(OBF_INIT_BACKGROUND);
+    return nullptr;
+}
+
+/**
+ * @brief Run the eager tasks and start the background ones
+ * 
+ * One constructor for all components, so the program pays for one
+ * entry in .init_array however many modules were obfuscated.
+ */
+__attribute__((constructor)) void runStartupTasks() {
+    struct obf_init_task *first = __start_obf_init;
+    if (!first || first == __stop_obf_init) {
+        return;
+    }
+    uint64_t start = now();
+    if (reporting()) {
+        atexit(__obf_init_report);
+    }
+    runTasks(OBF_INIT_EAGER);
+    
+    bool background = false;
+    for (struct obf_init_task *task = __start_obf_init; task != __stop_obf_init; task++) {
+        background |= task->mode == OBF_INIT_BACKGROUND;
+    }
+    pthread_t thread;
+    if (background && pthread_create(&thread, nullptr, runBackgroundTasks, nullptr) == 0) {
+        pthread_detach(thread);
+    }
+    // Without a thread, the guards at the uses still run the tasks
+    startupNanoseconds = now() - start;
+}
+
+} // anonymous namespace
+
+extern "C" {
+
+/**
+ * @brief Run a task unless it already ran, and wait for it
+ * @param task Task to run
+ */
+OBF_HIDDEN void __obf_init_run(struct obf_init_task *task) {
+    uint32_t expected = OBF_INIT_PENDING;
+    if (__atomic_compare_exchange_n(&task->state, &expected, OBF_INIT_RUNNING, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        bool report = reporting();
+        if (report) {
+            task->rss_before = residentKilobytes();
+            uint64_t unset = 0;
+            __atomic_compare_exchange_n(&firstTaskKilobytes, &unset, task->rss_before, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        uint64_t start = now();
+        task->run(task->arg);
+        task->nanoseconds = now() - start;
+        if (report) {
+            task->rss_after = residentKilobytes();
+            __atomic_store_n(&lastTaskKilobytes, task->rss_after, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&task->state, OBF_INIT_DONE, __ATOMIC_RELEASE);
+        return;
+    }
+    // Another thread runs it; tasks are short
+    while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != OBF_INIT_DONE) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Print, per component, the time its tasks took and the
+ * resident set around them, to stderr
+ * 
+ * The resident set is the process's: a component's lowest reading
+ * before and highest after its tasks, and the sum of what each task
+ * added. Lazy and background tasks share the process with other
+ * threads, so their sum is marked approximate.
+ */
+OBF_HIDDEN void __obf_init_report(void) {
+    static const char *const modes[] = {"eager", "lazy", "background", "mixed"};
+    struct Component {
+        const char *name;
+        uint32_t mode;          ///< Mode of its tasks, 3 if they differ
+        unsigned tasks;
+        unsigned done;
+        uint64_t nanoseconds;
+        uint64_t before;        ///< Lowest resident set a measured task started at
+        uint64_t after;         ///< Highest resident set a measured task finished at
+        int64_t kilobytes;      ///< Resident set added by the tasks measured
+        bool measured;
+    };
+    Component components[kMaxReportedComponents];
+    Component other = {"(other components)", 0, 0, 0, 0, 0, 0, 0, false};
+    int count = 0;
+    
+    // Pages and modules give a component many tasks; sum them
+    for (struct obf_init_task *task = __start_obf_init; task != __stop_obf_init; task++) {
+        Component *component = &other;
+        for (int index = 0; index < count; index++) {
+            if (strcmp(components[index].name, task->component) == 0) {
+                component = &components[index];
+                break;
+            }
+        }
+        if (component == &other && count < kMaxReportedComponents) {
+            component = &components[count++];
+            *component = {task->component, 0, 0, 0, 0, 0, 0, 0, false};
+        }
+        component->mode = component->tasks == 0 || component->mode == task->mode ? task->mode : 3;
+        component->tasks++;
+        if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != OBF_INIT_DONE) {
+            continue;
+        }
+        component->done++;
+        component->nanoseconds += task->nanoseconds;
+        if (task->rss_after) {
+            if (!component->measured || task->rss_before < component->before) {
+                component->before = task->rss_before;
+            }
+            if (task->rss_after > component->after) {
+                component->after = task->rss_after;
+            }
+            component->kilobytes += static_cast<int64_t>(task->rss_after - task->rss_before);
+            component->measured = true;
+        }
+    }
+    
+    fprintf(stderr, "obf_init: %.1f us before main\n", startupNanoseconds / 1000.0);
+    uint64_t firstKilobytes = __atomic_load_n(&firstTaskKilobytes, __ATOMIC_RELAXED);
+    if (firstKilobytes) {
+        fprintf(stderr, "obf_init: resident %llu kB at the first task, %llu kB after the last\n",
+                static_cast<unsigned long long>(firstKilobytes),
+                static_cast<unsigned long long>(__atomic_load_n(&lastTaskKilobytes, __ATOMIC_RELAXED)));
+    }
+    for (int index = 0; index <= count; index++) {
+        const Component &component = index < count ? components[index] : other;
+        if (!component.tasks) {
+            continue;
+        }
+        fprintf(stderr, "obf_init: %-24s %-10s %5u/%-5u run %10.1f us", component.name,
+                modes[component.mode < 4 ? component.mode : 3], component.done, component.tasks,
+                component.nanoseconds / 1000.0);
+        if (component.measured) {
+            fprintf(stderr, " %8llu -> %8llu kB, %+8lld kB%s",
+                    static_cast<unsigned long long>(component.before),
+                    static_cast<unsigned long long>(component.after),
+                    static_cast<long long>(component.kilobytes),
+                    component.mode == OBF_INIT_EAGER ? "" : " approx.");
+        }
+        fputc('\n', stderr);
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,28 @@
+/**
+ * @file string_decryption.cpp
+ * @brief Obfuscation Runtime String Decryption
+ * 
+ * The init task string-encryption emits for each module: decrypts the
+ * module's literals where they are, once, before their first use.
+ */
+
+#include "runtime/obfuscation_runtime.h"
+
+extern "C" {
+
+/**
+ * @brief Decrypt the strings of a module in place
+ * @param table An obf_string_table
+ */
+__attribute__((visibility("hidden"))) void __obf_decrypt_strings(void *table) {
+    const struct obf_string_table *strings = static_cast<const struct obf_string_table*>(table);
+    for (uint64_t n = 0; n < strings->count; n++) {
+        uint8_t *bytes = strings->strings[n];
+        uint64_t key = strings->keys[n];
+        for (uint64_t i = 0; i < strings->sizes[n]; i++) {
+            bytes[i] ^= static_cast<uint8_t>(key >> (8 * (i % 8)));
+        }
+    }
+}
+
+} // extern "C"
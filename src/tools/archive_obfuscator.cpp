@@ -0,0 +1,245 @@
+/**
+ * @file archive_obfuscator.cpp
+ * @brief Static Archive Obfuscation Tool
+ *
+ * Obfuscates every bitcode member of a static archive (.a) in
+ * parallel and writes a new archive with a rebuilt symbol table.
+ * The input archive is memory-mapped and members are read in
+ * place, so nothing is extracted to temporary files.
+ *
+ * Usage: archive-obfuscator input.a -o output.a [-passes=a,b] [-j N]
+ *                           [-save-remarks [-remarks-filter=regex]]
+ */
+
+#include "utils/pass_pipeline.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/Archive.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::opt<std::string> InputArchive(cl::Positional, cl::Required,
+                                  cl::desc("<input archive>"));
+
+cl::opt<std::string> OutputArchive("o", cl::Required,
+                                   cl::desc("Output archive"),
+                                   cl::value_desc("filename"));
+
+cl::list<std::string> PassNames("passes", cl::CommaSeparated,
+                                cl::desc("Obfuscation passes to run (default: standard pipeline)"));
+
+cl::opt<unsigned> Jobs("j", cl::init(0),
+                       cl::desc("Worker threads (default: all cores)"));
+
+cl::opt<bool> SaveRemarks("save-remarks", cl::init(false),
+                          cl::desc("Write each member's optimization remarks to "
+                                   "<output>.remarks/NNNN-<member>.opt.bitstream"));
+
+cl::opt<std::string> RemarksFilter("remarks-filter", cl::init(""),
+                                   cl::desc("Only save remarks from passes matching this regex"),
+                                   cl::value_desc("regex"));
+
+/**
+ * @struct ArchiveMember
+ * @brief One member of the input archive and its obfuscated output
+ */
+struct ArchiveMember {
+    object::Archive::Child child;     ///< Member in the mapped input
+    MemoryBufferRef input;            ///< Member contents (points into the mapping)
+    bool isBitcode = false;           ///< Only bitcode members are transformed
+    SmallVector<char, 0> output;      ///< Obfuscated bitcode
+    std::string error;                ///< Set if obfuscation failed
+
+    ArchiveMember(const object::Archive::Child &C, MemoryBufferRef Buf)
+        : child(C), input(Buf) {}
+};
+
+/**
+ * @brief Print an error with the tool prefix
+ * @param message Error message
+ * @return Process exit code
+ */
+int reportError(const Twine &message) {
+    errs() << "archive-obfuscator: error: " << message << "\n";
+    return 1;
+}
+
+/**
+ * @brief Get the remarks path of a member
+ * @param index Member number; members of an archive may share a name
+ * @param member Member
+ * @return <output>.remarks/NNNN-<member>.opt.bitstream
+ */
+std::string getRemarksPath(unsigned index, const ArchiveMember &member) {
+    SmallString<128> path(OutputArchive + ".remarks");
+    sys::path::append(path, formatv("{0:d4}-{1}.opt.bitstream", index,
+                                    sys::path::filename(member.input.getBufferIdentifier())).str());
+    return std::string(path.str());
+}
+
+/**
+ * @brief Obfuscate a single bitcode member
+ * @param member Member to transform; output or error is filled in
+ * @param index Member number
+ * @param passes Passes to run
+ *
+ * Each call uses its own LLVMContext so members can be processed
+ * on different threads without sharing IR state.
+ */
+void obfuscateMember(ArchiveMember &member, unsigned index, const std::vector<std::string> &passes) {
+    LLVMContext context;
+    std::unique_ptr<ToolOutputFile> remarks;
+    if (SaveRemarks) {
+        remarks = obfuscator::setupRemarksFile(context, getRemarksPath(index, member),
+                                               RemarksFilter, member.error);
+        if (!remarks) {
+            return;
+        }
+    }
+
+    Expected<std::unique_ptr<Module>> module = parseBitcodeFile(member.input, context);
+    if (!module) {
+        member.error = toString(module.takeError());
+        return;
+    }
+
+    if (!obfuscator::runObfuscationPasses(**module, passes, member.error)) {
+        return;
+    }
+
+    raw_svector_ostream outputStream(member.output);
+    WriteBitcodeToFile(**module, outputStream);
+    if (remarks) {
+        obfuscator::finishRemarksFile(context, *remarks);
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator for static archives\n");
+
+    // Needed to build the symbol table of bitcode members
+    InitializeAllTargetInfos();
+    InitializeAllTargetMCs();
+    InitializeAllAsmParsers();
+
+    // Map the archive rather than reading it; members are used in place
+    ErrorOr<std::unique_ptr<MemoryBuffer>> inputBuffer =
+        MemoryBuffer::getFile(InputArchive, /*IsText=*/false,
+                              /*RequiresNullTerminator=*/false);
+    if (std::error_code ec = inputBuffer.getError()) {
+        return reportError("cannot open '" + InputArchive + "': " + ec.message());
+    }
+
+    Expected<std::unique_ptr<object::Archive>> archive =
+        object::Archive::create((*inputBuffer)->getMemBufferRef());
+    if (!archive) {
+        return reportError(InputArchive + ": " + toString(archive.takeError()));
+    }
+    if ((*archive)->isThin()) {
+        return reportError(InputArchive + ": thin archives are not supported");
+    }
+
+    // Collect members up front so workers can index them
+    std::vector<ArchiveMember> members;
+    Error childError = Error::success();
+    for (const object::Archive::Child &child : (*archive)->children(childError)) {
+        Expected<MemoryBufferRef> buffer = child.getMemoryBufferRef();
+        if (!buffer) {
+            consumeError(std::move(childError));
+            return reportError(InputArchive + ": " + toString(buffer.takeError()));
+        }
+        members.emplace_back(child, *buffer);
+        members.back().isBitcode =
+            identify_magic(buffer->getBuffer()) == file_magic::bitcode;
+    }
+    if (childError) {
+        return reportError(InputArchive + ": " + toString(std::move(childError)));
+    }
+
+    std::vector<std::string> passes(PassNames.begin(), PassNames.end());
+    if (passes.empty()) {
+        passes = obfuscator::getDefaultPassPipeline();
+    }
+
+    if (SaveRemarks) {
+        if (std::error_code ec = sys::fs::create_directories(OutputArchive + ".remarks")) {
+            return reportError("cannot create '" + OutputArchive + ".remarks': " + ec.message());
+        }
+    }
+
+    // Obfuscate bitcode members concurrently; object members pass through
+    ThreadPoolStrategy strategy = Jobs ? hardware_concurrency(Jobs) : hardware_concurrency();
+    ThreadPool pool(strategy);
+    unsigned bitcodeMembers = 0;
+    for (unsigned i = 0; i < members.size(); i++) {
+        if (members[i].isBitcode) {
+            pool.async([&members, &passes, i] { obfuscateMember(members[i], i, passes); });
+            bitcodeMembers++;
+        }
+    }
+    pool.wait();
+
+    // Assemble the output archive; unchanged members still point into the mapping
+    std::vector<NewArchiveMember> newMembers;
+    newMembers.reserve(members.size());
+    for (ArchiveMember &member : members) {
+        Expected<NewArchiveMember> newMember =
+            NewArchiveMember::getOldMember(member.child, /*Deterministic=*/true);
+        if (!newMember) {
+            return reportError(InputArchive + ": " + toString(newMember.takeError()));
+        }
+
+        if (member.isBitcode) {
+            if (!member.error.empty()) {
+                return reportError(newMember->MemberName + ": " + member.error);
+            }
+            // MemberName refers to the old buffer's identifier, so re-point
+            // it at the replacement buffer
+            newMember->Buf = MemoryBuffer::getMemBuffer(
+                StringRef(member.output.data(), member.output.size()),
+                newMember->MemberName, /*RequiresNullTerminator=*/false);
+            newMember->MemberName = newMember->Buf->getBufferIdentifier();
+        }
+        newMembers.push_back(std::move(*newMember));
+    }
+
+    // writeArchive builds the whole archive, symbol table included, and
+    // writes it out in one go
+    if (Error error = writeArchive(OutputArchive, newMembers, /*WriteSymtab=*/true,
+                                   (*archive)->kind(), /*Deterministic=*/true,
+                                   /*Thin=*/false)) {
+        return reportError(OutputArchive + ": " + toString(std::move(error)));
+    }
+
+    errs() << "archive-obfuscator: obfuscated " << bitcodeMembers << " of "
+           << members.size() << " members using " << pool.getThreadCount()
+           << " threads\n";
+    return 0;
+}
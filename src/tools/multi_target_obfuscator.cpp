@@ -0,0 +1,269 @@
+/**
+ * @file multi_target_obfuscator.cpp
+ * @brief Multi-Target Obfuscation Tool
+ * 
+ * Obfuscates a module once and compiles it for several targets. The
+ * target-independent obfuscation passes run a single time; the result
+ * is snapshotted as in-memory bitcode and each target re-reads it on
+ * its own thread, then runs the target-dependent stages: passes that
+ * depend on the data layout or target features, the optimization
+ * pipeline with that target's cost model, and codegen.
+ * 
+ * The input must be portable between the targets (e.g. the same C
+ * ABI, as x86-64 and AArch64 Linux share); the IR is not re-lowered.
+ * 
+ * Usage: multi-target-obfuscator input.bc -o outdir
+ *            -targets=x86_64-linux-gnu,aarch64-linux-gnu
+ *            [-passes=a,b] [-target-passes=c,d] [-O2] [-j N]
+ *            [-save-remarks [-remarks-filter=regex]]
+ */
+
+#include "utils/codegen_utils.h"
+#include "utils/pass_pipeline.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::opt<std::string> InputFile(cl::Positional, cl::Required,
+                               cl::desc("<input bitcode or IR>"));
+
+cl::opt<std::string> OutputDirectory("o", cl::Required,
+                                     cl::desc("Output directory"),
+                                     cl::value_desc("directory"));
+
+cl::list<std::string> TargetTriples("targets", cl::CommaSeparated, cl::OneOrMore,
+                                    cl::desc("Target triples to compile for"));
+
+cl::list<std::string> PassNames("passes", cl::CommaSeparated,
+                                cl::desc("Target-independent obfuscation passes, run once "
+                                         "(default: standard pipeline)"));
+
+cl::list<std::string> TargetPassNames("target-passes", cl::CommaSeparated,
+                                      cl::desc("Obfuscation passes that depend on the target "
+                                               "(e.g. stack-strings, struct-layout), run per target"));
+
+cl::opt<unsigned> OptLevel("O", cl::init(2), cl::Prefix,
+                           cl::desc("Optimization level run per target after obfuscation (0-3)"));
+
+cl::opt<unsigned> Jobs("j", cl::init(0),
+                       cl::desc("Worker threads (default: all cores)"));
+
+cl::opt<bool> SaveRemarks("save-remarks", cl::init(false),
+                          cl::desc("Write optimization remarks to <stem>.opt.bitstream (shared "
+                                   "stage) and <stem>.<triple>.opt.bitstream (per target)"));
+
+cl::opt<std::string> RemarksFilter("remarks-filter", cl::init(""),
+                                   cl::desc("Only save remarks from passes matching this regex"),
+                                   cl::value_desc("regex"));
+
+/**
+ * @brief Print an error with the tool prefix
+ * @param message Error message
+ * @return Process exit code
+ */
+int reportError(const Twine &message) {
+    errs() << "multi-target-obfuscator: error: " << message << "\n";
+    return 1;
+}
+
+/**
+ * @brief Get the output path for one target
+ * @param triple Target triple
+ * @return <outdir>/<input stem>.<triple>.o
+ */
+std::string getOutputPath(const std::string &triple) {
+    SmallString<128> path(OutputDirectory);
+    sys::path::append(path, sys::path::stem(InputFile) + "." + triple + ".o");
+    return std::string(path.str());
+}
+
+/**
+ * @brief Get the remarks path of a stage
+ * @param triple Target triple, or empty for the shared stage
+ * @return <outdir>/<input stem>[.<triple>].opt.bitstream
+ */
+std::string getRemarksPath(const std::string &triple) {
+    SmallString<128> path(OutputDirectory);
+    sys::path::append(path, sys::path::stem(InputFile) + (triple.empty() ? "" : "." + triple) +
+                            ".opt.bitstream");
+    return std::string(path.str());
+}
+
+/**
+ * @brief Retarget a module to another triple
+ * @param M Module to update
+ * @param triple New target triple
+ * @param error Set to a description of the failure, if any
+ * @return Target machine for the triple, or nullptr on failure
+ */
+std::unique_ptr<TargetMachine> retargetModule(Module &M, const std::string &triple,
+                                              std::string &error) {
+    std::unique_ptr<TargetMachine> machine = obfuscator::createTargetMachine(triple, error);
+    if (!machine) {
+        return nullptr;
+    }
+    M.setTargetTriple(triple);
+    M.setDataLayout(machine->createDataLayout());
+    
+    // CPU and feature attributes name the input's target and would be
+    // rejected (or misread) by another backend
+    for (Function &F : M) {
+        F.removeFnAttr("target-cpu");
+        F.removeFnAttr("target-features");
+        F.removeFnAttr("tune-cpu");
+    }
+    return machine;
+}
+
+/**
+ * @brief Run the target-dependent stages for one target
+ * @param snapshot Obfuscated bitcode shared by all targets
+ * @param triple Target triple
+ * @param targetPasses Target-dependent obfuscation passes
+ * @param error Set to a description of the failure, if any
+ * 
+ * Each call uses its own LLVMContext so targets can be compiled on
+ * different threads without sharing IR state.
+ */
+void compileForTarget(MemoryBufferRef snapshot, const std::string &triple,
+                      const std::vector<std::string> &targetPasses, std::string &error) {
+    LLVMContext context;
+    std::unique_ptr<ToolOutputFile> remarks;
+    if (SaveRemarks) {
+        remarks = obfuscator::setupRemarksFile(context, getRemarksPath(triple), RemarksFilter, error);
+        if (!remarks) {
+            return;
+        }
+    }
+    
+    Expected<std::unique_ptr<Module>> module = parseBitcodeFile(snapshot, context);
+    if (!module) {
+        error = toString(module.takeError());
+        return;
+    }
+    
+    std::unique_ptr<TargetMachine> machine = retargetModule(**module, triple, error);
+    if (!machine) {
+        return;
+    }
+    if (!targetPasses.empty() &&
+        !obfuscator::runObfuscationPasses(**module, targetPasses, error)) {
+        return;
+    }
+    
+    obfuscator::optimizeModule(**module, OptLevel, machine.get());
+    if (remarks) {
+        obfuscator::finishRemarksFile(context, *remarks);
+    }
+    obfuscator::emitObjectFile(**module, *machine, getOutputPath(triple), error);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator for multiple targets\n");
+    
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+    
+    if (std::error_code ec = sys::fs::create_directories(OutputDirectory)) {
+        return reportError("cannot create '" + OutputDirectory + "': " + ec.message());
+    }
+    
+    std::vector<std::string> passes(PassNames.begin(), PassNames.end());
+    if (passes.empty()) {
+        passes = obfuscator::getDefaultPassPipeline();
+    }
+    std::vector<std::string> targetPasses(TargetPassNames.begin(), TargetPassNames.end());
+    
+    // Shared stage: target-independent obfuscation, once
+    auto sharedStart = std::chrono::steady_clock::now();
+    SmallVector<char, 0> snapshot;
+    {
+        LLVMContext context;
+        std::string error;
+        std::unique_ptr<ToolOutputFile> remarks;
+        if (SaveRemarks) {
+            remarks = obfuscator::setupRemarksFile(context, getRemarksPath(""), RemarksFilter, error);
+            if (!remarks) {
+                return reportError(error);
+            }
+        }
+        
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> module = parseIRFile(InputFile, diagnostic, context);
+        if (!module) {
+            diagnostic.print("multi-target-obfuscator", errs());
+            return 1;
+        }
+        
+        if (!obfuscator::runObfuscationPasses(*module, passes, error)) {
+            return reportError(InputFile + ": " + error);
+        }
+        if (remarks) {
+            obfuscator::finishRemarksFile(context, *remarks);
+        }
+        
+        raw_svector_ostream snapshotStream(snapshot);
+        WriteBitcodeToFile(*module, snapshotStream);
+    }
+    auto sharedEnd = std::chrono::steady_clock::now();
+    MemoryBufferRef snapshotRef(StringRef(snapshot.data(), snapshot.size()), InputFile);
+    
+    // Per-target stage: one thread per triple
+    std::vector<std::string> errors(TargetTriples.size());
+    ThreadPoolStrategy strategy = Jobs ? hardware_concurrency(Jobs) : hardware_concurrency();
+    ThreadPool pool(strategy);
+    for (unsigned i = 0; i < TargetTriples.size(); i++) {
+        pool.async([&, i] {
+            compileForTarget(snapshotRef, TargetTriples[i], targetPasses, errors[i]);
+        });
+    }
+    pool.wait();
+    auto targetsEnd = std::chrono::steady_clock::now();
+    
+    int status = 0;
+    for (unsigned i = 0; i < TargetTriples.size(); i++) {
+        if (!errors[i].empty()) {
+            status = reportError(TargetTriples[i] + ": " + errors[i]);
+        } else {
+            errs() << "multi-target-obfuscator: wrote " << getOutputPath(TargetTriples[i]) << "\n";
+        }
+    }
+    
+    errs() << "multi-target-obfuscator: " << TargetTriples.size() << " targets using "
+           << pool.getThreadCount() << " threads; obfuscation "
+           << format("%.3f", std::chrono::duration<double>(sharedEnd - sharedStart).count())
+           << "s once, per-target stages "
+           << format("%.3f", std::chrono::duration<double>(targetsEnd - sharedEnd).count())
+           << "s\n";
+    return status;
+}
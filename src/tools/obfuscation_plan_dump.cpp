@@ -0,0 +1,63 @@
+/**
+ * @file obfuscation_plan_dump.cpp
+ * @brief Obfuscation Plan Inspection Tool
+ * 
+ * Prints the decisions stored in plan files written with
+ * -obfuscation-plan-out or variant-generator -record-plans, so a build
+ * can be examined without rerunning the obfuscation.
+ * 
+ * Usage: obfuscation-plan-dump plan... [-summary]
+ */
+
+#include "utils/obfuscation_plan.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                 cl::desc("<plan files>"));
+
+cl::opt<bool> Summary("summary", cl::init(false),
+                      cl::desc("Print entry counts instead of the decisions"));
+
+/**
+ * @brief Print an error with the tool prefix
+ * @param message Error message
+ * @return Process exit code
+ */
+int reportError(const Twine &message) {
+    errs() << "obfuscation-plan-dump: error: " << message << "\n";
+    return 1;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator plan inspector\n");
+    
+    int status = 0;
+    for (const std::string &path : InputFiles) {
+        obfuscator::ObfuscationPlan plan;
+        std::string error;
+        if (!plan.load(path, error)) {
+            status = reportError(error);
+            continue;
+        }
+        
+        if (InputFiles.size() > 1 || Summary) {
+            outs() << path << ": " << plan.size() << " entries\n";
+        }
+        if (!Summary) {
+            plan.dump(outs());
+        }
+    }
+    return status;
+}
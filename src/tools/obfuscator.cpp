@@ -0,0 +1,127 @@
+/**
+ * @file obfuscator.cpp
+ * @brief Standalone Obfuscation Tool
+ * 
+ * Runs the obfuscation passes on one module without opt. Every pass is
+ * linked in, so an invocation pays neither the dlopen of
+ * libobfuscator.so nor the symbol resolution and pass registration
+ * that come with it; built with STATIC_TOOLS=1 (see build_ollvm16.sh)
+ * the binary needs no shared libraries at all.
+ * 
+ * Multi-call: started through a link named after a pass (e.g.
+ * install/bin/flattening -> obfuscator), it runs just that pass.
+ * 
+ * Usage: obfuscator input.bc -o output.bc [-passes=a,b] [-S]
+ *        obfuscator -list-passes
+ *        flattening input.bc -o output.bc
+ */
+
+#include "passes/obfuscation_pass.h"
+#include "utils/pass_pipeline.h"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::opt<std::string> InputFile(cl::Positional, cl::init("-"),
+                               cl::desc("<input bitcode or IR>"));
+
+cl::opt<std::string> OutputFile("o", cl::init("-"),
+                                cl::desc("Output file"),
+                                cl::value_desc("filename"));
+
+cl::list<std::string> PassNames("passes", cl::CommaSeparated,
+                                cl::desc("Obfuscation passes to run (default: standard pipeline)"));
+
+cl::opt<bool> OutputAssembly("S", cl::init(false),
+                             cl::desc("Write textual IR instead of bitcode"));
+
+cl::opt<bool> ListPasses("list-passes", cl::init(false),
+                         cl::desc("List the obfuscation passes and exit"));
+
+/// Name the tool was started as; a pass name when run through a link
+std::string ToolName = "obfuscator";
+
+/**
+ * @brief Print an error with the tool prefix
+ * @param message Error message
+ * @return Process exit code
+ */
+int reportError(const Twine &message) {
+    errs() << ToolName << ": error: " << message << "\n";
+    return 1;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    
+    // A link named after a pass runs that pass alone
+    ToolName = sys::path::stem(argv[0]).str();
+    std::vector<std::string> passes;
+    std::vector<std::string> available = obfuscator::getObfuscationPassNames();
+    if (std::count(available.begin(), available.end(), ToolName)) {
+        passes.push_back(ToolName);
+    }
+    
+    cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator\n");
+    
+    if (ListPasses) {
+        for (const std::string &name : available) {
+            outs() << name << "\n";
+        }
+        return 0;
+    }
+    
+    if (!PassNames.empty()) {
+        passes.assign(PassNames.begin(), PassNames.end());
+    } else if (passes.empty()) {
+        passes = obfuscator::getDefaultPassPipeline();
+    }
+    
+    // No targets are initialized: the passes only need the IR, and
+    // registering every backend would be most of the startup time
+    LLVMContext context;
+    SMDiagnostic diagnostic;
+    std::unique_ptr<Module> module = parseIRFile(InputFile, diagnostic, context);
+    if (!module) {
+        diagnostic.print(ToolName.c_str(), errs());
+        return 1;
+    }
+    
+    std::string error;
+    if (!obfuscator::runObfuscationPasses(*module, passes, error)) {
+        return reportError(InputFile + ": " + error);
+    }
+    
+    std::error_code ec;
+    ToolOutputFile output(OutputFile, ec, OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+    if (ec) {
+        return reportError("cannot write '" + OutputFile + "': " + ec.message());
+    }
+    if (OutputAssembly) {
+        module->print(output.os(), nullptr);
+    } else {
+        WriteBitcodeToFile(*module, output.os());
+    }
+    output.keep();
+    return 0;
+}
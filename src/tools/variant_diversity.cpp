@@ -0,0 +1,580 @@
+/**
+ * @file variant_diversity.cpp
+ * @brief Variant Diversity Measurement Tool
+ * 
+ * Checks that individualized builds differ at the machine-code level.
+ * Every input binary is memory-mapped and disassembled in place; each
+ * function gets a MinHash and a SimHash signature over n-grams of its
+ * instructions. Pairwise similarity of all variants is then computed
+ * from the signatures alone, in parallel.
+ * 
+ * Instructions are reduced to their opcode and operand kinds, so
+ * register renaming and changed constants do not count as diversity;
+ * only a different instruction stream does.
+ * 
+ * Usage: variant-diversity variant-*.o [-ngram N] [-threshold T] [-j N]
+ */
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/MCTargetOptions.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                 cl::desc("<variant binaries>"));
+
+cl::opt<unsigned> NGramLength("ngram", cl::init(4),
+                              cl::desc("Instructions per n-gram"));
+
+cl::opt<double> Threshold("threshold", cl::init(0.9),
+                          cl::desc("Report variant pairs at least this similar"));
+
+cl::opt<unsigned> TopFunctions("top", cl::init(20),
+                               cl::desc("Least diversified functions to list"));
+
+cl::opt<unsigned> Jobs("j", cl::init(0),
+                       cl::desc("Worker threads (default: all cores)"));
+
+/// MinHash lanes per signature; a multiple of the vector width
+constexpr unsigned kNumHashes = 64;
+
+/**
+ * @struct Signature
+ * @brief Similarity sketch of one function or binary
+ */
+struct Signature {
+    std::array<uint32_t, kNumHashes> minHash;  ///< Minimum of each hash over all n-grams
+    std::array<int32_t, 64> simHashCounts{};  ///< Per-bit votes of all n-gram hashes
+    uint64_t simHash = 0;                     ///< Sign of each vote
+    uint64_t numInstructions = 0;             ///< Instructions seen
+    
+    Signature() { minHash.fill(std::numeric_limits<uint32_t>::max()); }
+};
+
+/**
+ * @struct BinarySignature
+ * @brief Signatures of every function in one input binary
+ */
+struct BinarySignature {
+    std::string path;                       ///< Input file
+    Signature whole;                        ///< Union of all functions
+    std::map<std::string, Signature> functions; ///< Per-function signatures by symbol name
+    std::string error;                      ///< Set if the binary could not be read
+};
+
+/**
+ * @struct MinHashSeeds
+ * @brief Per-lane constants: the MinHash family h_i(x) = mix((x ^ a_i) * b_i)
+ *        and the SimHash bit masks
+ */
+struct MinHashSeeds {
+    alignas(64) uint32_t xorKeys[kNumHashes];
+    alignas(64) uint32_t multipliers[kNumHashes];
+    alignas(64) uint32_t bitMasks[32];   ///< 1 << b, for branch-free SimHash votes
+    
+    MinHashSeeds() {
+        for (unsigned b = 0; b < 32; b++) {
+            bitMasks[b] = uint32_t(1) << b;
+        }
+        // Fixed seeds so signatures are comparable between runs
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (unsigned i = 0; i < kNumHashes; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            xorKeys[i] = static_cast<uint32_t>(state >> 32);
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            multipliers[i] = static_cast<uint32_t>(state >> 32) | 1;
+        }
+    }
+};
+
+const MinHashSeeds Seeds;
+
+/**
+ * @brief Finalize a 64-bit hash (splitmix64)
+ * @param x Value to mix
+ * @return Well-distributed hash of x
+ */
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Add one n-gram hash to a signature
+ * @param signature Signature to update
+ * @param shingle Hash of the n-gram
+ * 
+ * Both loops are branch-free over fixed-size lane arrays, so the
+ * compiler turns them into SIMD min/multiply and add/compare.
+ */
+inline void addShingle(Signature &signature, uint64_t shingle) {
+    uint32_t x = static_cast<uint32_t>(shingle ^ (shingle >> 32));
+    uint32_t *mins = signature.minHash.data();
+    for (unsigned i = 0; i < kNumHashes; i++) {
+        uint32_t h = (x ^ Seeds.xorKeys[i]) * Seeds.multipliers[i];
+        h ^= h >> 16;
+        mins[i] = h < mins[i] ? h : mins[i];
+    }
+    
+    // Mask-and-compare rather than a variable shift per lane, which
+    // plain SSE2 cannot vectorize
+    int32_t *counts = signature.simHashCounts.data();
+    uint32_t halves[2] = {static_cast<uint32_t>(shingle), static_cast<uint32_t>(shingle >> 32)};
+    for (unsigned half = 0; half < 2; half++) {
+        for (unsigned b = 0; b < 32; b++) {
+            counts[half * 32 + b] += (halves[half] & Seeds.bitMasks[b]) ? 1 : -1;
+        }
+    }
+}
+
+/**
+ * @brief Finish a signature once all n-grams are added
+ * @param signature Signature to finalize
+ */
+void finalizeSignature(Signature &signature) {
+    signature.simHash = 0;
+    for (unsigned b = 0; b < 64; b++) {
+        if (signature.simHashCounts[b] > 0) {
+            signature.simHash |= uint64_t(1) << b;
+        }
+    }
+}
+
+/**
+ * @brief Merge a function signature into a binary-wide one
+ * @param whole Binary signature
+ * @param part Function signature
+ * 
+ * The MinHash of a union is the lane-wise minimum, and SimHash votes
+ * add up, so the binary signature needs no second pass over the code.
+ */
+void mergeSignature(Signature &whole, const Signature &part) {
+    for (unsigned i = 0; i < kNumHashes; i++) {
+        whole.minHash[i] = std::min(whole.minHash[i], part.minHash[i]);
+    }
+    for (unsigned b = 0; b < 64; b++) {
+        whole.simHashCounts[b] += part.simHashCounts[b];
+    }
+    whole.numInstructions += part.numInstructions;
+}
+
+/**
+ * @brief Estimate the Jaccard similarity of two n-gram sets
+ * @param a First signature
+ * @param b Second signature
+ * @return Fraction of MinHash lanes that agree
+ */
+double minHashSimilarity(const Signature &a, const Signature &b) {
+    unsigned equal = 0;
+    for (unsigned i = 0; i < kNumHashes; i++) {
+        equal += a.minHash[i] == b.minHash[i];
+    }
+    return static_cast<double>(equal) / kNumHashes;
+}
+
+/**
+ * @brief Estimate the cosine-like similarity of two n-gram multisets
+ * @param a First signature
+ * @param b Second signature
+ * @return 1 minus the fraction of differing SimHash bits
+ */
+double simHashSimilarity(const Signature &a, const Signature &b) {
+    return 1.0 - static_cast<double>(countPopulation(a.simHash ^ b.simHash)) / 64;
+}
+
+/**
+ * @class FunctionDisassembler
+ * @brief MC disassembler for one object file's target
+ * 
+ * MC objects are not thread-safe, so each worker builds its own.
+ */
+class FunctionDisassembler {
+public:
+    /**
+     * @brief Set up the disassembler for an object's target
+     * @param object Object file to disassemble
+     * @param error Set to a description of the failure, if any
+     */
+    FunctionDisassembler(const object::ObjectFile &object, std::string &error) {
+        Triple triple = object.makeTriple();
+        const Target *target = TargetRegistry::lookupTarget(triple.getTriple(), error);
+        if (!target) {
+            return;
+        }
+        
+        registerInfo.reset(target->createMCRegInfo(triple.getTriple()));
+        asmInfo.reset(target->createMCAsmInfo(*registerInfo, triple.getTriple(), MCTargetOptions()));
+        subtargetInfo.reset(target->createMCSubtargetInfo(triple.getTriple(), "", ""));
+        if (!registerInfo || !asmInfo || !subtargetInfo) {
+            error = "no MC support for " + triple.getTriple();
+            return;
+        }
+        context = std::make_unique<MCContext>(triple, asmInfo.get(), registerInfo.get(),
+                                              subtargetInfo.get());
+        disassembler.reset(target->createMCDisassembler(*subtargetInfo, *context));
+        if (!disassembler) {
+            error = "no disassembler for " + triple.getTriple();
+        }
+    }
+    
+    /**
+     * @brief Compute the signature of one function's code
+     * @param bytes Machine code of the function (inside the mapping)
+     * @param address Address of the first byte
+     * @return Signature over instruction n-grams
+     */
+    Signature computeSignature(ArrayRef<uint8_t> bytes, uint64_t address) {
+        Signature signature;
+        std::vector<uint64_t> window(NGramLength, 0);
+        uint64_t offset = 0;
+        while (offset < bytes.size()) {
+            MCInst inst;
+            uint64_t size = 0;
+            uint64_t token;
+            if (disassembler->getInstruction(inst, size, bytes.slice(offset), address + offset,
+                                             nulls()) == MCDisassembler::Success) {
+                token = getInstructionToken(inst);
+            } else {
+                // Undecodable bytes (padding, data in code) form their own token
+                token = ~uint64_t(0);
+                size = 1;
+            }
+            offset += std::max<uint64_t>(size, 1);
+            
+            window[signature.numInstructions % NGramLength] = token;
+            signature.numInstructions++;
+            if (signature.numInstructions >= NGramLength) {
+                uint64_t shingle = 0;
+                for (unsigned i = 0; i < NGramLength; i++) {
+                    uint64_t slot = window[(signature.numInstructions + i) % NGramLength];
+                    shingle = mix64(shingle ^ slot);
+                }
+                addShingle(signature, shingle);
+            }
+        }
+        
+        // Functions shorter than an n-gram still get one shingle
+        if (signature.numInstructions > 0 && signature.numInstructions < NGramLength) {
+            uint64_t shingle = 0;
+            for (unsigned i = 0; i < signature.numInstructions; i++) {
+                shingle = mix64(shingle ^ window[i]);
+            }
+            addShingle(signature, shingle);
+        }
+        finalizeSignature(signature);
+        return signature;
+    }
+    
+private:
+    std::unique_ptr<MCRegisterInfo> registerInfo;
+    std::unique_ptr<MCAsmInfo> asmInfo;
+    std::unique_ptr<MCSubtargetInfo> subtargetInfo;
+    std::unique_ptr<MCContext> context;
+    std::unique_ptr<MCDisassembler> disassembler;
+    
+    /**
+     * @brief Reduce an instruction to its opcode and operand kinds
+     * @param inst Decoded instruction
+     * @return Token for n-gram hashing
+     */
+    uint64_t getInstructionToken(const MCInst &inst) {
+        uint64_t token = inst.getOpcode();
+        for (const MCOperand &operand : inst) {
+            unsigned kind = operand.isReg() ? 1 : operand.isImm() ? 2 : operand.isExpr() ? 3 : 4;
+            token = token * 5 + kind;
+        }
+        return token;
+    }
+};
+
+/**
+ * @struct FunctionRange
+ * @brief Code of one function inside a section
+ */
+struct FunctionRange {
+    std::string name;
+    uint64_t address;
+    uint64_t size;
+};
+
+/**
+ * @brief Find the functions of an executable section
+ * @param object Object file
+ * @param section Executable section
+ * @return Functions sorted by address; the whole section if it has no symbols
+ */
+std::vector<FunctionRange> findFunctions(const object::ObjectFile &object,
+                                         const object::SectionRef &section) {
+    std::vector<FunctionRange> functions;
+    for (const object::SymbolRef &symbol : object.symbols()) {
+        Expected<object::SymbolRef::Type> type = symbol.getType();
+        Expected<object::section_iterator> symbolSection = symbol.getSection();
+        Expected<uint64_t> address = symbol.getAddress();
+        Expected<StringRef> name = symbol.getName();
+        if (!type || !symbolSection || !address || !name) {
+            consumeError(type.takeError());
+            consumeError(symbolSection.takeError());
+            consumeError(address.takeError());
+            consumeError(name.takeError());
+            continue;
+        }
+        if (*type != object::SymbolRef::ST_Function || *symbolSection != section) {
+            continue;
+        }
+        
+        uint64_t size = 0;
+        if (object.isELF()) {
+            size = object::ELFSymbolRef(symbol).getSize();
+        }
+        functions.push_back({name->str(), *address, size});
+    }
+    
+    std::sort(functions.begin(), functions.end(),
+              [](const FunctionRange &a, const FunctionRange &b) { return a.address < b.address; });
+    
+    // Formats without symbol sizes: a function runs to the next one
+    uint64_t sectionEnd = section.getAddress() + section.getSize();
+    for (size_t i = 0; i < functions.size(); i++) {
+        uint64_t next = i + 1 < functions.size() ? functions[i + 1].address : sectionEnd;
+        if (functions[i].size == 0 || functions[i].address + functions[i].size > sectionEnd) {
+            functions[i].size = next - functions[i].address;
+        }
+    }
+    
+    if (functions.empty()) {
+        Expected<StringRef> name = section.getName();
+        functions.push_back({name ? name->str() : "<section>", section.getAddress(), section.getSize()});
+        if (!name) {
+            consumeError(name.takeError());
+        }
+    }
+    return functions;
+}
+
+/**
+ * @brief Compute the signatures of one binary
+ * @param binary Binary to process; path is set, the rest is filled in
+ */
+void computeBinarySignature(BinarySignature &binary) {
+    // Map the file; section contents are used in place
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+        MemoryBuffer::getFile(binary.path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (std::error_code ec = buffer.getError()) {
+        binary.error = ec.message();
+        return;
+    }
+    
+    Expected<std::unique_ptr<object::ObjectFile>> object =
+        object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+    if (!object) {
+        binary.error = toString(object.takeError());
+        return;
+    }
+    
+    FunctionDisassembler disassembler(**object, binary.error);
+    if (!binary.error.empty()) {
+        return;
+    }
+    
+    for (const object::SectionRef &section : (*object)->sections()) {
+        if (!section.isText() || section.getSize() == 0) {
+            continue;
+        }
+        Expected<StringRef> contents = section.getContents();
+        if (!contents) {
+            binary.error = toString(contents.takeError());
+            return;
+        }
+        ArrayRef<uint8_t> bytes(reinterpret_cast<const uint8_t*>(contents->data()), contents->size());
+        
+        for (const FunctionRange &function : findFunctions(**object, section)) {
+            uint64_t start = function.address - section.getAddress();
+            if (start >= bytes.size()) {
+                continue;
+            }
+            ArrayRef<uint8_t> code = bytes.slice(start, std::min(function.size, bytes.size() - start));
+            Signature signature = disassembler.computeSignature(code, function.address);
+            mergeSignature(binary.whole, signature);
+            binary.functions[function.name] = signature;
+        }
+    }
+    finalizeSignature(binary.whole);
+}
+
+/**
+ * @struct PairStats
+ * @brief Pairwise similarity of one variant against all later ones
+ */
+struct PairStats {
+    double sum = 0;
+    double min = 1;
+    double max = 0;
+    uint64_t count = 0;
+    std::array<uint64_t, 10> histogram{};
+    std::vector<std::pair<unsigned, double>> similarPairs; ///< Later variants above the threshold
+};
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "Machine-code diversity of obfuscated variants\n");
+    
+    InitializeAllTargetInfos();
+    InitializeAllTargetMCs();
+    InitializeAllDisassemblers();
+    
+    if (NGramLength == 0) {
+        errs() << "variant-diversity: error: -ngram must be at least 1\n";
+        return 1;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    ThreadPoolStrategy strategy = Jobs ? hardware_concurrency(Jobs) : hardware_concurrency();
+    ThreadPool pool(strategy);
+    
+    // Signatures, one task per binary
+    std::vector<BinarySignature> binaries(InputFiles.size());
+    for (unsigned i = 0; i < binaries.size(); i++) {
+        binaries[i].path = InputFiles[i];
+        pool.async([&binaries, i] { computeBinarySignature(binaries[i]); });
+    }
+    pool.wait();
+    for (const BinarySignature &binary : binaries) {
+        if (!binary.error.empty()) {
+            errs() << "variant-diversity: error: " << binary.path << ": " << binary.error << "\n";
+            return 1;
+        }
+    }
+    auto signaturesDone = std::chrono::steady_clock::now();
+    
+    // Pairwise similarity, one task per row of the upper triangle
+    std::vector<PairStats> rows(binaries.size());
+    for (unsigned i = 0; i < binaries.size(); i++) {
+        pool.async([&binaries, &rows, i] {
+            PairStats &row = rows[i];
+            for (unsigned j = i + 1; j < binaries.size(); j++) {
+                double similarity = minHashSimilarity(binaries[i].whole, binaries[j].whole);
+                row.sum += similarity;
+                row.min = std::min(row.min, similarity);
+                row.max = std::max(row.max, similarity);
+                row.count++;
+                row.histogram[std::min(static_cast<unsigned>(similarity * 10), 9u)]++;
+                if (similarity >= Threshold) {
+                    row.similarPairs.push_back({j, similarity});
+                }
+            }
+        });
+    }
+    pool.wait();
+    auto compared = std::chrono::steady_clock::now();
+    
+    PairStats total;
+    for (const PairStats &row : rows) {
+        total.sum += row.sum;
+        total.count += row.count;
+        if (row.count) {
+            total.min = std::min(total.min, row.min);
+            total.max = std::max(total.max, row.max);
+        }
+        for (unsigned b = 0; b < total.histogram.size(); b++) {
+            total.histogram[b] += row.histogram[b];
+        }
+    }
+    
+    outs() << "Variants: " << binaries.size() << ", pairs: " << total.count
+           << ", n-gram length: " << NGramLength << ", hashes: " << kNumHashes << "\n";
+    if (total.count) {
+        outs() << format("Pairwise n-gram similarity: min %.3f  mean %.3f  max %.3f\n",
+                         total.min, total.sum / total.count, total.max);
+        outs() << "Histogram:\n";
+        for (unsigned b = 0; b < total.histogram.size(); b++) {
+            outs() << format("  [%.1f, %.1f%c %10llu\n", b / 10.0, (b + 1) / 10.0,
+                             b == 9 ? ']' : ')', static_cast<unsigned long long>(total.histogram[b]));
+        }
+    }
+    
+    for (unsigned i = 0; i < rows.size(); i++) {
+        for (auto &pair : rows[i].similarPairs) {
+            outs() << format("Too similar (%.3f): ", pair.second) << binaries[i].path
+                   << " " << binaries[pair.first].path << "\n";
+        }
+    }
+    
+    // Per-function diversity against the first variant; linear in the
+    // number of variants, unlike a per-function pairwise matrix
+    struct FunctionStats {
+        std::string name;
+        uint64_t instructions;
+        double meanMinHash;
+        double meanSimHash;
+    };
+    std::vector<FunctionStats> functions;
+    for (auto &entry : binaries[0].functions) {
+        double minHashSum = 0, simHashSum = 0;
+        unsigned count = 0;
+        for (unsigned j = 1; j < binaries.size(); j++) {
+            auto it = binaries[j].functions.find(entry.first);
+            if (it != binaries[j].functions.end()) {
+                minHashSum += minHashSimilarity(entry.second, it->second);
+                simHashSum += simHashSimilarity(entry.second, it->second);
+                count++;
+            }
+        }
+        if (count) {
+            functions.push_back({entry.first, entry.second.numInstructions,
+                                 minHashSum / count, simHashSum / count});
+        }
+    }
+    std::sort(functions.begin(), functions.end(), [](const FunctionStats &a, const FunctionStats &b) {
+        return a.meanMinHash != b.meanMinHash ? a.meanMinHash > b.meanMinHash : a.name < b.name;
+    });
+    
+    if (!functions.empty()) {
+        outs() << "Least diversified functions (vs " << binaries[0].path << "):\n";
+        outs() << "  " << left_justify("function", 40) << "    insts  minhash  simhash\n";
+        for (unsigned i = 0; i < functions.size() && i < TopFunctions; i++) {
+            outs() << format("  %-40s %8llu %8.3f %8.3f\n", functions[i].name.c_str(),
+                             static_cast<unsigned long long>(functions[i].instructions),
+                             functions[i].meanMinHash, functions[i].meanSimHash);
+        }
+    }
+    
+    auto seconds = [](auto from, auto to) { return std::chrono::duration<double>(to - from).count(); };
+    errs() << format("variant-diversity: signatures %.3fs, pairwise %.3fs using %u threads\n",
+                     seconds(start, signaturesDone), seconds(signaturesDone, compared), pool.getThreadCount());
+    return 0;
+}
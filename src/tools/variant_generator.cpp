@@ -0,0 +1,266 @@
+/**
+ * @file variant_generator.cpp
+ * @brief Polymorphic Variant Generation Tool
+ * 
+ * Builds N individualized object files from one input module. The
+ * deterministic part of the build (parsing and the optimization
+ * pipeline) runs once and is snapshotted as in-memory bitcode; each
+ * variant then re-reads the snapshot, is obfuscated with its own seed
+ * and code-generated, with variants running in parallel. The cost of
+ * N variants is close to N times obfuscation plus codegen.
+ * 
+ * Usage: variant-generator input.bc -o outdir -n N [-seed S] [-O2]
+ *                          [-passes=a,b] [-emit-bitcode] [-j N]
+ *                          [-record-plans | -replay-plans=dir]
+ *                          [-save-remarks [-remarks-filter=regex]]
+ * 
+ * -record-plans writes each variant's decisions to variant-NNNN.plan;
+ * -replay-plans rebuilds variants from such plans without rerunning
+ * the passes' analyses and cost models.
+ */
+
+#include "utils/codegen_utils.h"
+#include "utils/llvm_utils.h"
+#include "utils/obfuscation_plan.h"
+#include "utils/pass_pipeline.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+cl::opt<std::string> InputFile(cl::Positional, cl::Required,
+                               cl::desc("<input bitcode or IR>"));
+
+cl::opt<std::string> OutputDirectory("o", cl::Required,
+                                     cl::desc("Output directory"),
+                                     cl::value_desc("directory"));
+
+cl::opt<unsigned> NumVariants("n", cl::init(1),
+                              cl::desc("Number of variants to generate"));
+
+cl::opt<uint64_t> BaseSeed("seed", cl::init(0),
+                           cl::desc("Seed of the first variant; variant i uses seed + i"));
+
+cl::opt<unsigned> OptLevel("O", cl::init(2), cl::Prefix,
+                           cl::desc("Optimization level run once before obfuscation (0-3)"));
+
+cl::list<std::string> PassNames("passes", cl::CommaSeparated,
+                                cl::desc("Obfuscation passes to run (default: standard pipeline)"));
+
+cl::opt<bool> EmitBitcode("emit-bitcode", cl::init(false),
+                          cl::desc("Write obfuscated bitcode instead of object files"));
+
+cl::opt<bool> RecordPlans("record-plans", cl::init(false),
+                          cl::desc("Write each variant's decisions to variant-NNNN.plan"));
+
+cl::opt<std::string> ReplayPlans("replay-plans", cl::init(""),
+                                 cl::desc("Take each variant's decisions from variant-NNNN.plan "
+                                          "in this directory"),
+                                 cl::value_desc("directory"));
+
+cl::opt<bool> SaveRemarks("save-remarks", cl::init(false),
+                          cl::desc("Write each variant's optimization remarks to "
+                                   "variant-NNNN.opt.bitstream"));
+
+cl::opt<std::string> RemarksFilter("remarks-filter", cl::init(""),
+                                   cl::desc("Only save remarks from passes matching this regex"),
+                                   cl::value_desc("regex"));
+
+cl::opt<unsigned> Jobs("j", cl::init(0),
+                       cl::desc("Worker threads (default: all cores)"));
+
+/**
+ * @brief Print an error with the tool prefix
+ * @param message Error message
+ * @return Process exit code
+ */
+int reportError(const Twine &message) {
+    errs() << "variant-generator: error: " << message << "\n";
+    return 1;
+}
+
+/**
+ * @brief Get the output path of a variant
+ * @param index Variant number
+ * @return Path inside the output directory
+ */
+std::string getVariantPath(unsigned index) {
+    SmallString<128> path(OutputDirectory);
+    sys::path::append(path, formatv("variant-{0:d4}{1}", index,
+                                    EmitBitcode ? ".bc" : ".o").str());
+    return std::string(path.str());
+}
+
+/**
+ * @brief Get the plan or remarks path of a variant
+ * @param directory Directory holding the files
+ * @param index Variant number
+ * @param extension File extension, e.g. ".plan"
+ * @return <directory>/variant-NNNN<extension>
+ */
+std::string getSidecarPath(StringRef directory, unsigned index, StringRef extension) {
+    SmallString<128> path(directory);
+    sys::path::append(path, formatv("variant-{0:d4}{1}", index, extension).str());
+    return std::string(path.str());
+}
+
+/**
+ * @brief Generate one variant from the optimized snapshot
+ * @param snapshot Optimized bitcode shared by all variants
+ * @param index Variant number
+ * @param passes Passes to run
+ * @param error Set to a description of the failure, if any
+ * 
+ * Each call uses its own LLVMContext so variants can be generated
+ * on different threads without sharing IR state.
+ */
+void generateVariant(MemoryBufferRef snapshot, unsigned index,
+                     const std::vector<std::string> &passes, std::string &error) {
+    LLVMContext context;
+    std::unique_ptr<ToolOutputFile> remarks;
+    if (SaveRemarks) {
+        remarks = obfuscator::setupRemarksFile(
+            context, getSidecarPath(OutputDirectory, index, ".opt.bitstream"), RemarksFilter, error);
+        if (!remarks) {
+            return;
+        }
+    }
+    
+    Expected<std::unique_ptr<Module>> module = parseBitcodeFile(snapshot, context);
+    if (!module) {
+        error = toString(module.takeError());
+        return;
+    }
+    
+    obfuscator::setRandomSeed(**module, BaseSeed + index);
+    obfuscator::ObfuscationPlan plan;
+    if (!ReplayPlans.empty()) {
+        if (!plan.load(getSidecarPath(ReplayPlans, index, ".plan"), error)) {
+            return;
+        }
+        obfuscator::attachPlan(**module, plan, obfuscator::PlanMode::Replay);
+    } else if (RecordPlans) {
+        obfuscator::attachPlan(**module, plan, obfuscator::PlanMode::Record);
+    }
+    bool obfuscated = obfuscator::runObfuscationPasses(**module, passes, error);
+    obfuscator::detachPlan(**module);
+    if (!obfuscated) {
+        return;
+    }
+    if (RecordPlans && !plan.save(getSidecarPath(OutputDirectory, index, ".plan"), error)) {
+        return;
+    }
+    
+    if (remarks) {
+        obfuscator::finishRemarksFile(context, *remarks);
+    }
+    
+    std::string path = getVariantPath(index);
+    if (!EmitBitcode) {
+        obfuscator::emitObjectFile(**module, path, error);
+        return;
+    }
+    
+    std::error_code ec;
+    ToolOutputFile output(path, ec, sys::fs::OF_None);
+    if (ec) {
+        error = "cannot open '" + path + "': " + ec.message();
+        return;
+    }
+    WriteBitcodeToFile(**module, output.os());
+    output.keep();
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator variant generator\n");
+    
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+    
+    if (std::error_code ec = sys::fs::create_directories(OutputDirectory)) {
+        return reportError("cannot create '" + OutputDirectory + "': " + ec.message());
+    }
+    
+    // Shared stage: parse and optimize once, then snapshot. Variants
+    // start from the snapshot, so none of this work is repeated.
+    auto sharedStart = std::chrono::steady_clock::now();
+    SmallVector<char, 0> snapshot;
+    {
+        LLVMContext context;
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> module = parseIRFile(InputFile, diagnostic, context);
+        if (!module) {
+            diagnostic.print("variant-generator", errs());
+            return 1;
+        }
+        obfuscator::optimizeModule(*module, OptLevel);
+        
+        raw_svector_ostream snapshotStream(snapshot);
+        WriteBitcodeToFile(*module, snapshotStream);
+    }
+    auto sharedEnd = std::chrono::steady_clock::now();
+    MemoryBufferRef snapshotRef(StringRef(snapshot.data(), snapshot.size()), InputFile);
+    
+    std::vector<std::string> passes(PassNames.begin(), PassNames.end());
+    if (passes.empty()) {
+        passes = obfuscator::getDefaultPassPipeline();
+    }
+    
+    // Per-variant stage: obfuscate and code-generate concurrently
+    std::vector<std::string> errors(NumVariants);
+    ThreadPoolStrategy strategy = Jobs ? hardware_concurrency(Jobs) : hardware_concurrency();
+    ThreadPool pool(strategy);
+    for (unsigned i = 0; i < NumVariants; i++) {
+        pool.async([&, i] { generateVariant(snapshotRef, i, passes, errors[i]); });
+    }
+    pool.wait();
+    auto variantEnd = std::chrono::steady_clock::now();
+    
+    int status = 0;
+    for (unsigned i = 0; i < NumVariants; i++) {
+        if (!errors[i].empty()) {
+            status = reportError(getVariantPath(i) + ": " + errors[i]);
+        }
+    }
+    
+    double sharedSeconds = std::chrono::duration<double>(sharedEnd - sharedStart).count();
+    double variantSeconds = std::chrono::duration<double>(variantEnd - sharedEnd).count();
+    errs() << "variant-generator: " << NumVariants << " variants using "
+           << pool.getThreadCount() << " threads; shared stage "
+           << format("%.3f", sharedSeconds) << "s once, variants "
+           << format("%.3f", variantSeconds) << "s ("
+           << format("%.3f", NumVariants ? variantSeconds / NumVariants : 0.0)
+           << "s each)\n";
+    return status;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file allocation_hook.cpp
+ * @brief Allocation Counting Hook
+ * 
+ * Replaces the global operator new and operator delete so the pass
+ * profiler can count heap allocations per thread. Linked into the
+ * native tools of profiling builds only (PROFILE_ALLOCATIONS=1): a
+ * replacement inside the opt plugin would not see opt's own
+ * allocations, and release tools should not pay for counting.
+ * 
+ * The array and nothrow forms forward to these by default. Both sides
+ * count the size of the block malloc handed out where the C library
+ * can tell it, so allocated and freed bytes balance.
+ */
+
+#include "utils/pass_profiler.h"
+
+#include <cstdlib>
+#include <new>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace {
+
+/**
+ * @brief Measure an allocated block the same way on allocation and free
+ * @param memory Block returned by malloc
+ * @param requested Bytes requested, used where malloc cannot tell
+ * @return Bytes counted for the block
+ */
+size_t blockSize(void *memory, size_t requested) {
+#if defined(__GLIBC__)
+    (void)requested;
+    return malloc_usable_size(memory);
+#else
+    (void)memory;
+    return requested;
+#endif
+}
+
+/**
+ * @brief Allocate and count, following the operator new protocol
+ * @param size Bytes requested
+ * @return Allocated memory
+ */
+void* countedAllocate(size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    void *memory;
+    while (!(memory = std::malloc(size))) {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    obfuscator::recordAllocation(blockSize(memory, size));
+    return memory;
+}
+
+const bool installed = (obfuscator::setAllocationHookInstalled(), true);
+
+} // anonymous namespace
+
+void* operator new(size_t size) {
+    return countedAllocate(size);
+}
+
+void operator delete(void *memory) noexcept {
+    if (!memory) {
+        return;
+    }
+    // Without the requested size, only glibc can measure the block
+    obfuscator::recordFree(blockSize(memory, 0));
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t size) noexcept {
+    if (!memory) {
+        return;
+    }
+    obfuscator::recordFree(blockSize(memory, size));
+    std::free(memory);
+}
@@ -0,0 +1,169 @@
+/**
+ * @file codegen_utils.cpp
+ * @brief Code Generation Utilities
+ * 
+ * Helpers for turning obfuscated modules into object files from
+ * native tools, without going through llc.
+ */
+
+#include "utils/codegen_utils.h"
+#include "passes/machine_substitution.h"
+
+#include "llvm/CodeGen/Passes.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<bool> MachineSubstitution(
+    "machine-substitution", cl::init(false),
+    cl::desc("Substitute x86-64 ALU instructions after register allocation "
+             "when emitting object files"));
+
+namespace {
+
+/**
+ * @class CodegenPassManager
+ * @brief Pass manager that adds the obfuscator's machine passes
+ * 
+ * The target builds its codegen pipeline through add(); the machine
+ * substitution pass goes in right after prolog/epilog insertion, when
+ * the callee-saved registers are saved and physical register
+ * liveness is final.
+ */
+class CodegenPassManager : public legacy::PassManager {
+public:
+    void add(Pass *P) override {
+        legacy::PassManager::add(P);
+        if (MachineSubstitution && P->getPassID() == &PrologEpilogCodeInserterID) {
+            legacy::PassManager::add(obfuscator::createMachineSubstitutionPass());
+        }
+    }
+};
+
+} // anonymous namespace
+
+namespace obfuscator {
+
+/**
+ * @brief Create a target machine for a module's triple
+ * @param M Module to compile
+ * @param errorMessage Set to a description of the failure, if any
+ * @return Target machine, or nullptr on failure
+ */
+std::unique_ptr<TargetMachine> createTargetMachine(Module &M, std::string &errorMessage) {
+    if (M.getTargetTriple().empty()) {
+        M.setTargetTriple(sys::getDefaultTargetTriple());
+    }
+    
+    std::unique_ptr<TargetMachine> machine = createTargetMachine(M.getTargetTriple(), errorMessage);
+    if (machine) {
+        M.setDataLayout(machine->createDataLayout());
+    }
+    return machine;
+}
+
+/**
+ * @brief Create a target machine for a target triple
+ * @param triple Target triple
+ * @param errorMessage Set to a description of the failure, if any
+ * @return Target machine, or nullptr on failure
+ */
+std::unique_ptr<TargetMachine> createTargetMachine(const std::string &triple,
+                                                   std::string &errorMessage) {
+    const Target *target = TargetRegistry::lookupTarget(triple, errorMessage);
+    if (!target) {
+        return nullptr;
+    }
+    
+    // PIC so the objects can go into shared libraries and PIEs alike
+    std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+        triple, "", "", TargetOptions(), Reloc::PIC_));
+    if (!machine) {
+        errorMessage = "no target machine for " + triple;
+    }
+    return machine;
+}
+
+/**
+ * @brief Run the standard optimization pipeline on a module
+ * @param M Module to optimize
+ * @param level Optimization level (0-3)
+ * @param machine Target whose cost model the passes use, or nullptr
+ */
+void optimizeModule(Module &M, unsigned level, TargetMachine *machine) {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    
+    // With a target machine, TTI-driven passes (vectorizers, unrolling,
+    // inlining costs) use that target's cost model
+    PassBuilder PB(machine);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    
+    static const OptimizationLevel levels[] = {
+        OptimizationLevel::O0, OptimizationLevel::O1,
+        OptimizationLevel::O2, OptimizationLevel::O3};
+    ModulePassManager MPM = level == 0
+        ? PB.buildO0DefaultPipeline(OptimizationLevel::O0)
+        : PB.buildPerModuleDefaultPipeline(levels[std::min(level, 3u)]);
+    MPM.run(M, MAM);
+}
+
+/**
+ * @brief Compile a module to an object file
+ * @param M Module to compile
+ * @param path Output file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the object file was written
+ */
+bool emitObjectFile(Module &M, StringRef path, std::string &errorMessage) {
+    std::unique_ptr<TargetMachine> machine = createTargetMachine(M, errorMessage);
+    if (!machine) {
+        return false;
+    }
+    return emitObjectFile(M, *machine, path, errorMessage);
+}
+
+/**
+ * @brief Compile a module to an object file with a given target machine
+ * @param M Module to compile
+ * @param machine Target machine, used by this thread only
+ * @param path Output file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the object file was written
+ */
+bool emitObjectFile(Module &M, TargetMachine &machine, StringRef path,
+                    std::string &errorMessage) {
+    std::error_code ec;
+    ToolOutputFile output(path, ec, sys::fs::OF_None);
+    if (ec) {
+        errorMessage = "cannot open '" + path.str() + "': " + ec.message();
+        return false;
+    }
+    
+    CodegenPassManager PM;
+    if (machine.addPassesToEmitFile(PM, output.os(), nullptr, CGFT_ObjectFile)) {
+        errorMessage = "target cannot emit object files";
+        return false;
+    }
+    PM.run(M);
+    
+    output.keep();
+    return true;
+}
+
+} // namespace obfuscator
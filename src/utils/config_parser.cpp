@@ -6,90 +6,167 @@
  * configuration settings.
  */
 
-#include <string>
-#include <map>
-#include <fstream>
-#include <iostream>
+#include "utils/config_parser.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<std::string> ConfigFile(
+    "obfuscation-config", cl::value_desc("file"),
+    cl::desc("Obfuscation configuration (ollvm_config.json) read by the passes"));
 
 namespace obfuscator {
 
+namespace {
+
 /**
- * @class ConfigParser
- * @brief Configuration parser for obfuscation settings
+ * @brief Store a JSON value under dotted keys
+ * @param value Value to store
+ * @param key Key of the value; objects add ".<member>" per level
+ * @param config Map to store into
  */
-class ConfigParser {
-private:
-    std::map<std::string, std::string> config_;
-    
-public:
-    /**
-     * @brief Constructor
-     */
-    ConfigParser() = default;
-    
-    /**
-     * @brief Load configuration from file
-     * @param filename Configuration file path
-     * @return true if loaded successfully
-     */
-    bool loadFromFile(const std::string &filename) {
-        // TODO: Implement JSON configuration parsing
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Error: Could not open config file: " << filename << std::endl;
-            return false;
+void flatten(const json::Value &value, const std::string &key,
+             std::map<std::string, std::string> &config) {
+    if (const json::Object *object = value.getAsObject()) {
+        for (const auto &member : *object) {
+            std::string memberKey = key.empty() ? member.first.str() : key + "." + member.first.str();
+            flatten(member.second, memberKey, config);
         }
-        
-        // Placeholder implementation
-        std::cout << "Loading configuration from: " << filename << std::endl;
-        
-        file.close();
-        return true;
+    } else if (auto string = value.getAsString()) {
+        config[key] = string->str();
+    } else if (auto boolean = value.getAsBoolean()) {
+        config[key] = *boolean ? "true" : "false";
+    } else if (auto integer = value.getAsInteger()) {
+        config[key] = std::to_string(*integer);
+    } else if (auto number = value.getAsNumber()) {
+        std::string text;
+        raw_string_ostream(text) << *number;
+        config[key] = text;
     }
-    
-    /**
-     * @brief Get configuration value
-     * @param key Configuration key
-     * @param defaultValue Default value if key not found
-     * @return Configuration value
-     */
-    std::string getValue(const std::string &key, const std::string &defaultValue = "") {
-        auto it = config_.find(key);
-        if (it != config_.end()) {
-            return it->second;
-        }
-        return defaultValue;
+    // Arrays and nulls have no scalar value
+}
+
+/**
+ * @brief Get the section name of a pass
+ * @param passName Registered pass name (e.g. "bogus-control-flow")
+ * @return Name of its section in the file (e.g. "bogus_control_flow")
+ */
+std::string getSectionName(const std::string &passName) {
+    std::string section = passName;
+    std::replace(section.begin(), section.end(), '-', '_');
+    return section;
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Load configuration from file
+ * @param filename Configuration file path
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if loaded successfully
+ */
+bool ConfigParser::loadFromFile(const std::string &filename, std::string &errorMessage) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(filename);
+    if (!buffer) {
+        errorMessage = "cannot open '" + filename + "': " + buffer.getError().message();
+        return false;
     }
     
-    /**
-     * @brief Set configuration value
-     * @param key Configuration key
-     * @param value Configuration value
-     */
-    void setValue(const std::string &key, const std::string &value) {
-        config_[key] = value;
+    Expected<json::Value> root = json::parse((*buffer)->getBuffer());
+    if (!root) {
+        errorMessage = filename + ": " + toString(root.takeError());
+        return false;
     }
-    
-    /**
-     * @brief Check if a pass is enabled
-     * @param passName Name of the pass
-     * @return true if pass is enabled
-     */
-    bool isPassEnabled(const std::string &passName) {
-        // TODO: Implement proper pass enablement checking
-        return getValue(passName + ".enabled", "false") == "true";
+    if (!root->getAsObject()) {
+        errorMessage = filename + ": not a JSON object";
+        return false;
     }
     
-    /**
-     * @brief Get pass configuration
-     * @param passName Name of the pass
-     * @return Map of pass configuration
-     */
-    std::map<std::string, std::string> getPassConfig(const std::string &passName) {
-        // TODO: Implement pass-specific configuration retrieval
-        std::map<std::string, std::string> passConfig;
-        return passConfig;
+    config_.clear();
+    flatten(*root, "", config_);
+    return true;
+}
+
+/**
+ * @brief Get configuration value
+ * @param key Configuration key
+ * @param defaultValue Default value if key not found
+ * @return Configuration value
+ */
+std::string ConfigParser::getValue(const std::string &key, const std::string &defaultValue) const {
+    auto it = config_.find(key);
+    if (it != config_.end()) {
+        return it->second;
+    }
+    return defaultValue;
+}
+
+/**
+ * @brief Set configuration value
+ * @param key Configuration key
+ * @param value Configuration value
+ */
+void ConfigParser::setValue(const std::string &key, const std::string &value) {
+    config_[key] = value;
+}
+
+/**
+ * @brief Check if a pass is enabled
+ * @param passName Name of the pass
+ * @return true if pass is enabled
+ */
+bool ConfigParser::isPassEnabled(const std::string &passName) const {
+    std::map<std::string, std::string> passConfig = getPassConfig(passName);
+    auto enabled = passConfig.find("enabled");
+    return enabled != passConfig.end() && enabled->second == "true";
+}
+
+/**
+ * @brief Get pass configuration
+ * @param passName Name of the pass
+ * @return Map of pass configuration
+ */
+std::map<std::string, std::string> ConfigParser::getPassConfig(const std::string &passName) const {
+    // Passes are grouped by category: passes.<category>.<pass>.<setting>
+    std::string section = "." + getSectionName(passName) + ".";
+    std::map<std::string, std::string> passConfig;
+    for (const auto &entry : config_) {
+        StringRef key = entry.first;
+        if (!key.consume_front("passes.")) {
+            continue;
+        }
+        size_t position = key.find(section);
+        if (position != StringRef::npos && key.find('.') == position) {
+            passConfig[key.substr(position + section.size()).str()] = entry.second;
+        }
     }
-};
+    return passConfig;
+}
+
+/**
+ * @brief Get the configuration named by -obfuscation-config
+ * @return The loaded configuration; empty if the option is unset
+ */
+const ConfigParser &getObfuscationConfig() {
+    // Loaded once per process; passes may run on several threads
+    static const ConfigParser config = [] {
+        ConfigParser parser;
+        std::string error;
+        if (!ConfigFile.empty() && !parser.loadFromFile(ConfigFile, error)) {
+            // The defaults are not what was asked for; output built with
+            // them would look right and be obfuscated differently
+            report_fatal_error(Twine("obfuscation config: ") + error, /*gen_crash_diag=*/false);
+        }
+        return parser;
+    }();
+    return config;
+}
 
 } // namespace obfuscator
@@ -6,17 +6,37 @@
  * and obfuscation operations.
  */
 
+#include "utils/llvm_utils.h"
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 using namespace llvm;
 
+static cl::opt<uint64_t> ObfuscationSeed(
+    "obfuscation-seed", cl::init(0),
+    cl::desc("Seed for modules without an obfuscation.seed module flag"));
+
 namespace obfuscator {
 
+/// Module flag holding the obfuscation seed
+static const char *const kSeedFlag = "obfuscation.seed";
+
 /**
  * @brief Check if a function is suitable for obfuscation
  * @param F Function to check
@@ -39,12 +59,64 @@ bool shouldObfuscateFunction(const Function &F) {
 }
 
 /**
- * @brief Get a random number generator seed
- * @return Random seed value
+ * @brief Set the seed behind every random choice the passes make on a module
+ * @param M Module to tag
+ * @param seed Seed value
+ */
+void setRandomSeed(Module &M, uint64_t seed) {
+    M.setModuleFlag(Module::Override, kSeedFlag,
+                    ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(M.getContext()), seed)));
+}
+
+/**
+ * @brief Get the obfuscation seed of a module
+ * @param M Module to query
+ * @return The module's seed flag, or the -obfuscation-seed option if unset
+ */
+uint64_t getRandomSeed(const Module &M) {
+    if (auto *seed = mdconst::extract_or_null<ConstantInt>(M.getModuleFlag(kSeedFlag))) {
+        return seed->getZExtValue();
+    }
+    return ObfuscationSeed;
+}
+
+/**
+ * @brief Derive a generator from the module seed and a stream name
+ * @param M Module being transformed
+ * @param passName Registered name of the pass
+ * @param scope Function name, empty for module passes
+ * @return Seeded generator
+ */
+static std::mt19937_64 createGenerator(const Module &M, StringRef passName, StringRef scope) {
+    // xxHash is stable across hosts and releases, unlike hash_combine;
+    // the seed goes in little-endian whatever the host's byte order
+    char seed[sizeof(uint64_t)];
+    support::endian::write64le(seed, getRandomSeed(M));
+    std::string key(seed, sizeof(seed));
+    key += passName;
+    key += '\0';
+    key += scope;
+    return std::mt19937_64(xxHash64(key));
+}
+
+/**
+ * @brief Get the random number generator for one pass on one function
+ * @param F Function being transformed
+ * @param passName Registered name of the pass
+ * @return Seeded generator
+ */
+std::mt19937_64 getRandomGenerator(const Function &F, StringRef passName) {
+    return createGenerator(*F.getParent(), passName, F.getName());
+}
+
+/**
+ * @brief Get the random number generator for a module pass
+ * @param M Module being transformed
+ * @param passName Registered name of the pass
+ * @return Seeded generator
  */
-uint64_t getRandomSeed() {
-    // TODO: Implement proper random seed generation
-    return 0x12345678;
+std::mt19937_64 getRandomGenerator(const Module &M, StringRef passName) {
+    return createGenerator(M, passName, "");
 }
 
 /**
@@ -57,6 +129,116 @@ BasicBlock* createBasicBlock(Function &F, const std::string &name) {
     return BasicBlock::Create(F.getContext(), name, &F);
 }
 
+/**
+ * @brief Split the PHI nodes and EH pad of a block off into a new block
+ * @param BB Block to split
+ * @return The new head, in front of BB and ending in a branch to it
+ */
+BasicBlock* splitBlockHead(BasicBlock &BB) {
+    BasicBlock *head = BasicBlock::Create(BB.getContext(), "", BB.getParent(), &BB);
+    head->takeName(&BB);
+    BB.setName(head->getName() + ".body");
+    
+    // Predecessors now branch to the head. Not replaceAllUsesWith: for a
+    // block that also rewrites the successors' PHI nodes, which must keep
+    // BB as their incoming block
+    BB.replaceUsesWithIf(head, [](Use &) { return true; });
+    
+    Instruction *firstBody = &*BB.getFirstInsertionPt();
+    while (&BB.front() != firstBody) {
+        BB.front().moveBefore(*head, head->end());
+    }
+    BranchInst::Create(&BB, head);
+    return head;
+}
+
+/**
+ * @brief Return directly after tail calls that branch to a shared return
+ * @param F Function to update
+ * @return Number of returns added
+ */
+unsigned duplicateReturnsForTailCalls(Function &F) {
+    unsigned added = 0;
+    std::vector<BasicBlock*> emptied;
+    for (BasicBlock &BB : F) {
+        // Only a bare return, optionally of a PHI of the returned values
+        auto *ret = dyn_cast<ReturnInst>(BB.getTerminator());
+        if (!ret || BB.isEntryBlock()) {
+            continue;
+        }
+        Value *retValue = ret->getReturnValue();
+        auto *phi = dyn_cast_or_null<PHINode>(retValue);
+        if (phi && phi->getParent() != &BB) {
+            phi = nullptr;
+        }
+        unsigned numPHIs = std::distance(BB.phis().begin(), BB.phis().end());
+        if (BB.getFirstNonPHIOrDbg() != ret || numPHIs > (phi ? 1u : 0u)) {
+            continue;
+        }
+        
+        // Dead returns from before are not ours to delete
+        unsigned addedBefore = added;
+        std::vector<BasicBlock*> predecessors(pred_begin(&BB), pred_end(&BB));
+        for (BasicBlock *pred : predecessors) {
+            auto *branch = dyn_cast<BranchInst>(pred->getTerminator());
+            if (!branch || branch->isConditional()) {
+                continue;
+            }
+            auto *call = dyn_cast_or_null<CallInst>(branch->getPrevNonDebugInstruction());
+            if (!call || !call->isTailCall()) {
+                continue;
+            }
+            Value *returned = phi ? phi->getIncomingValueForBlock(pred) : retValue;
+            if (retValue && returned != call) {
+                continue;
+            }
+            
+            ReturnInst::Create(F.getContext(), retValue ? call : nullptr, branch)
+                ->setDebugLoc(ret->getDebugLoc());
+            branch->eraseFromParent();
+            BB.removePredecessor(pred, true);
+            added++;
+        }
+        if (added > addedBefore && pred_empty(&BB)) {
+            emptied.push_back(&BB);
+        }
+    }
+    for (BasicBlock *BB : emptied) {
+        DeleteDeadBlock(BB);
+    }
+    return added;
+}
+
+/**
+ * @brief Find the blocks of the loops a profile marks hot
+ * @param F Function to scan
+ * @return Blocks of the hot loops, including their nested loops
+ */
+std::set<const BasicBlock*> findHotLoopBlocks(Function &F) {
+    std::set<const BasicBlock*> hot;
+    if (F.isDeclaration() || !F.getEntryCount()) {
+        return hot;
+    }
+    ProfileSummaryInfo PSI(*F.getParent());
+    if (!PSI.hasProfileSummary()) {
+        return hot;
+    }
+    
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    if (LI.empty()) {
+        return hot;
+    }
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (!hot.count(L->getHeader()) && PSI.isHotBlock(L->getHeader(), &BFI)) {
+            hot.insert(L->block_begin(), L->block_end());
+        }
+    }
+    return hot;
+}
+
 /**
  * @brief Insert a no-op instruction
  * @param builder IRBuilder for instruction insertion
@@ -64,9 +246,10 @@ BasicBlock* createBasicBlock(Function &F, const std::string &name) {
  */
 Instruction* insertNoOp(IRBuilder<> &builder) {
     // TODO: Implement proper no-op insertion
-    // For now, return a simple add with zero
+    // For now, return a simple add with zero. Insert it directly so
+    // the builder does not constant fold it away.
     Value *zero = builder.getInt32(0);
-    return builder.CreateAdd(zero, zero);
+    return builder.Insert(BinaryOperator::CreateAdd(zero, zero));
 }
 
 /**
@@ -76,7 +259,7 @@ Instruction* insertNoOp(IRBuilder<> &builder) {
  */
 bool isSafeToReplace(const Instruction &inst) {
     // Skip certain types of instructions
-    if (isa<PHINode>(inst) || isa<LandingPadInst>(inst)) {
+    if (isa<PHINode>(inst) || inst.isEHPad() || inst.isTerminator()) {
         return false;
     }
     
@@ -84,4 +267,82 @@ bool isSafeToReplace(const Instruction &inst) {
     return true;
 }
 
+/**
+ * @brief Get the source location for code inserted into a block
+ * @param BB Block receiving the new code
+ * @return Location of the first located instruction in BB, else the
+ *         function's scope line; empty if the function has no debug info
+ */
+DebugLoc getInsertionDebugLoc(const BasicBlock &BB) {
+    const DISubprogram *SP = BB.getParent()->getSubprogram();
+    if (!SP) {
+        return DebugLoc();
+    }
+    
+    for (const Instruction &I : BB) {
+        if (const DebugLoc &DL = I.getDebugLoc()) {
+            // Line 0 means "no line"; keep looking for a real one
+            if (DL.getLine() != 0) {
+                return DL;
+            }
+        }
+    }
+    
+    return DILocation::get(SP->getContext(), SP->getScopeLine(), 0,
+                           const_cast<DISubprogram *>(SP));
+}
+
+/**
+ * @brief Get the source location for obfuscation-generated code
+ * @param DL Location of the original code
+ * @param discriminator Base discriminator from getNextFreeDiscriminator
+ * @return Tagged location, or DL if the discriminator cannot be encoded
+ */
+DebugLoc getSyntheticDebugLoc(const DebugLoc &DL, unsigned discriminator) {
+    if (!DL) {
+        return DL;
+    }
+    if (auto tagged = DL->cloneWithBaseDiscriminator(discriminator)) {
+        return DebugLoc(*tagged);
+    }
+    return DL;
+}
+
+/**
+ * @brief Find the first base discriminator not used in a function
+ * @param F Function to scan
+ * @return Discriminator greater than all discriminators in F
+ */
+unsigned getNextFreeDiscriminator(const Function &F) {
+    unsigned maxDiscriminator = 0;
+    for (const BasicBlock &BB : F) {
+        for (const Instruction &I : BB) {
+            if (const DILocation *loc = I.getDebugLoc().get()) {
+                maxDiscriminator = std::max(maxDiscriminator, loc->getBaseDiscriminator());
+            }
+        }
+    }
+    return maxDiscriminator + 1;
+}
+
+/**
+ * @brief Attach a location to every instruction in a block that has none
+ * @param BB Block to update
+ */
+void setMissingDebugLocs(BasicBlock &BB) {
+    DebugLoc nextLoc = getInsertionDebugLoc(BB);
+    if (!nextLoc) {
+        return;
+    }
+    
+    // Walk backwards so each instruction sees the location that follows it
+    for (Instruction &I : make_range(BB.rbegin(), BB.rend())) {
+        if (I.getDebugLoc()) {
+            nextLoc = I.getDebugLoc();
+        } else if (!isa<PHINode>(I)) {
+            I.setDebugLoc(nextLoc);
+        }
+    }
+}
+
 } // namespace obfuscator
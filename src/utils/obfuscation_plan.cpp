@@ -0,0 +1,449 @@
+/**
+ * @file obfuscation_plan.cpp
+ * @brief Obfuscation Plan
+ * 
+ * Plan file format (all integers ULEB128 unless noted):
+ *   "OBFPLAN1"                          8-byte magic
+ *   numStrings, {length, bytes}*        pass and scope names
+ *   numEntries, {pass, scope, hash, numDecisions, decision*}*
+ * where pass and scope index the string table and hash is a
+ * little-endian 64-bit value.
+ */
+
+#include "utils/obfuscation_plan.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/xxhash.h"
+
+#include <cstring>
+
+using namespace llvm;
+
+static cl::opt<std::string> PlanOutput(
+    "obfuscation-plan-out", cl::init(""),
+    cl::desc("Record the obfuscation decisions to this plan file"));
+
+static cl::opt<std::string> PlanInput(
+    "obfuscation-plan-in", cl::init(""),
+    cl::desc("Replay the obfuscation decisions from this plan file"));
+
+namespace obfuscator {
+
+namespace {
+
+const char kPlanMagic[8] = {'O', 'B', 'F', 'P', 'L', 'A', 'N', '1'};
+
+/**
+ * @struct AttachedPlan
+ * @brief A plan and what the passes do with it
+ */
+struct AttachedPlan {
+    ObfuscationPlan *plan = nullptr;
+    PlanMode mode = PlanMode::Off;
+};
+
+std::mutex registryMutex;
+std::map<const Module*, AttachedPlan> attachedPlans;
+
+/**
+ * @struct CommandLinePlan
+ * @brief Process-wide plan selected by -obfuscation-plan-in/-out
+ * 
+ * Loaded on first use and, when recording, saved at exit; defined
+ * after the options so it is destroyed before them.
+ */
+struct CommandLinePlan {
+    ObfuscationPlan plan;
+    AttachedPlan attached;
+    bool initialized = false;
+    
+    ~CommandLinePlan() {
+        std::string error;
+        if (attached.mode == PlanMode::Record && !plan.save(PlanOutput, error)) {
+            errs() << "obfuscation plan: " << error << "\n";
+        }
+    }
+} commandLinePlan;
+
+/**
+ * @brief Get the plan the passes should use for a module
+ * @param M Module being transformed
+ * @return Attached plan, else the command-line plan, else none
+ */
+AttachedPlan getPlan(const Module &M) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto it = attachedPlans.find(&M);
+    if (it != attachedPlans.end()) {
+        return it->second;
+    }
+    
+    if (!commandLinePlan.initialized) {
+        commandLinePlan.initialized = true;
+        if (!PlanInput.empty()) {
+            std::string error;
+            if (commandLinePlan.plan.load(PlanInput, error)) {
+                commandLinePlan.attached = {&commandLinePlan.plan, PlanMode::Replay};
+            } else {
+                errs() << "obfuscation plan: " << error << "; deciding afresh\n";
+            }
+        } else if (!PlanOutput.empty()) {
+            commandLinePlan.attached = {&commandLinePlan.plan, PlanMode::Record};
+        }
+    }
+    return commandLinePlan.attached;
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Read a plan file
+ * @param path Plan file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the plan was read
+ */
+bool ObfuscationPlan::load(StringRef path, std::string &errorMessage) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+        MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (std::error_code ec = buffer.getError()) {
+        errorMessage = "cannot open '" + path.str() + "': " + ec.message();
+        return false;
+    }
+    
+    const uint8_t *cursor = reinterpret_cast<const uint8_t*>((*buffer)->getBufferStart());
+    const uint8_t *end = reinterpret_cast<const uint8_t*>((*buffer)->getBufferEnd());
+    if (end - cursor < 8 || memcmp(cursor, kPlanMagic, 8) != 0) {
+        errorMessage = path.str() + ": not an obfuscation plan";
+        return false;
+    }
+    cursor += 8;
+    
+    const char *decodeError = nullptr;
+    auto readNumber = [&]() -> uint64_t {
+        unsigned length = 0;
+        uint64_t value = decodeULEB128(cursor, &length, end, &decodeError);
+        cursor += length;
+        return value;
+    };
+    auto truncated = [&](uint64_t bytes) {
+        if (!decodeError && static_cast<uint64_t>(end - cursor) < bytes) {
+            decodeError = "truncated file";
+        }
+        return decodeError != nullptr;
+    };
+    
+    // Every string and decision takes at least a byte, so a count the
+    // rest of the file cannot hold is corrupt; check before allocating
+    uint64_t numStrings = readNumber();
+    std::vector<std::string> strings;
+    if (!truncated(numStrings)) {
+        strings.resize(numStrings);
+    }
+    for (std::string &string : strings) {
+        uint64_t length = readNumber();
+        if (truncated(length)) {
+            break;
+        }
+        string.assign(reinterpret_cast<const char*>(cursor), length);
+        cursor += length;
+    }
+    
+    std::map<std::pair<std::string, std::string>, Entry> entries;
+    uint64_t numEntries = decodeError ? 0 : readNumber();
+    for (uint64_t i = 0; i < numEntries && !decodeError; i++) {
+        Entry entry;
+        uint64_t pass = readNumber();
+        uint64_t scope = readNumber();
+        if (truncated(8)) {
+            break;
+        }
+        if (pass >= strings.size() || scope >= strings.size()) {
+            decodeError = "bad string index";
+            break;
+        }
+        entry.pass = strings[pass];
+        entry.scope = strings[scope];
+        entry.hash = support::endian::read64le(cursor);
+        cursor += 8;
+        
+        uint64_t numDecisions = readNumber();
+        if (truncated(numDecisions)) {
+            break;
+        }
+        entry.decisions.reserve(numDecisions);
+        for (uint64_t d = 0; d < numDecisions && !decodeError; d++) {
+            entry.decisions.push_back(readNumber());
+        }
+        auto key = std::make_pair(entry.pass, entry.scope);
+        entries[key] = std::move(entry);
+    }
+    if (decodeError) {
+        errorMessage = path.str() + ": " + decodeError;
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_ = std::move(entries);
+    return true;
+}
+
+/**
+ * @brief Write the plan to a file
+ * @param path Plan file
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if the plan was written
+ */
+bool ObfuscationPlan::save(StringRef path, std::string &errorMessage) const {
+    std::error_code ec;
+    ToolOutputFile output(path, ec, sys::fs::OF_None);
+    if (ec) {
+        errorMessage = "cannot open '" + path.str() + "': " + ec.message();
+        return false;
+    }
+    raw_ostream &OS = output.os();
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    // Pass names repeat on every entry; intern them with the scopes
+    StringMap<unsigned> stringIndex;
+    std::vector<StringRef> strings;
+    auto intern = [&](StringRef string) {
+        auto inserted = stringIndex.try_emplace(string, strings.size());
+        if (inserted.second) {
+            strings.push_back(inserted.first->getKey());
+        }
+        return inserted.first->second;
+    };
+    for (auto &item : entries_) {
+        intern(item.second.pass);
+        intern(item.second.scope);
+    }
+    
+    OS.write(kPlanMagic, sizeof(kPlanMagic));
+    encodeULEB128(strings.size(), OS);
+    for (StringRef string : strings) {
+        encodeULEB128(string.size(), OS);
+        OS << string;
+    }
+    
+    encodeULEB128(entries_.size(), OS);
+    for (auto &item : entries_) {
+        const Entry &entry = item.second;
+        encodeULEB128(stringIndex[entry.pass], OS);
+        encodeULEB128(stringIndex[entry.scope], OS);
+        char hash[8];
+        support::endian::write64le(hash, entry.hash);
+        OS.write(hash, sizeof(hash));
+        encodeULEB128(entry.decisions.size(), OS);
+        for (uint64_t decision : entry.decisions) {
+            encodeULEB128(decision, OS);
+        }
+    }
+    
+    output.keep();
+    return true;
+}
+
+/**
+ * @brief Find the decisions recorded for a pass on a function
+ * @param pass Registered pass name
+ * @param scope Function name or module-level scope
+ * @param hash Structural hash of the function now
+ * @return Decisions, or nullptr if none were recorded for this code
+ */
+const std::vector<uint64_t> *ObfuscationPlan::find(StringRef pass, StringRef scope,
+                                                   uint64_t hash) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(std::make_pair(pass.str(), scope.str()));
+    if (it == entries_.end() || it->second.hash != hash) {
+        return nullptr;
+    }
+    // Entries are never erased while replaying, so the pointer stays valid
+    return &it->second.decisions;
+}
+
+/**
+ * @brief Record the decisions of a pass on a function
+ * @param entry Decisions to store
+ */
+void ObfuscationPlan::record(Entry entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = std::make_pair(entry.pass, entry.scope);
+    entries_[key] = std::move(entry);
+}
+
+/**
+ * @brief Print the plan in readable form
+ * @param OS Output stream
+ */
+void ObfuscationPlan::dump(raw_ostream &OS) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &item : entries_) {
+        const Entry &entry = item.second;
+        OS << entry.pass << " " << entry.scope << " hash=";
+        OS.write_hex(entry.hash);
+        OS << " decisions=" << entry.decisions.size() << ":";
+        for (uint64_t decision : entry.decisions) {
+            OS << " " << decision;
+        }
+        OS << "\n";
+    }
+}
+
+/**
+ * @brief Get the number of recorded entries
+ * @return Number of (pass, scope) entries
+ */
+size_t ObfuscationPlan::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+/**
+ * @brief Attach a plan to a module for the passes to use
+ * @param M Module the passes will run on
+ * @param plan Plan to record into or replay from
+ * @param mode Record or replay
+ */
+void attachPlan(const Module &M, ObfuscationPlan &plan, PlanMode mode) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    attachedPlans[&M] = {&plan, mode};
+}
+
+/**
+ * @brief Detach the plan attached to a module
+ * @param M Module
+ */
+void detachPlan(const Module &M) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    attachedPlans.erase(&M);
+}
+
+/**
+ * @brief Compute a structural hash of a function
+ * @param F Function to hash
+ * @return 64-bit hash
+ */
+uint64_t getFunctionHash(const Function &F) {
+    std::vector<uint64_t> words;
+    auto addType = [&words](Type *T) {
+        words.push_back(T->getTypeID());
+        if (T->isIntegerTy()) {
+            words.push_back(T->getIntegerBitWidth());
+        }
+    };
+    
+    DenseMap<const BasicBlock*, unsigned> blockIndex;
+    for (const BasicBlock &BB : F) {
+        blockIndex[&BB] = blockIndex.size();
+    }
+    
+    words.push_back(F.arg_size());
+    addType(F.getReturnType());
+    for (const BasicBlock &BB : F) {
+        words.push_back(0xb10cb10cULL);
+        for (const Instruction &I : BB) {
+            // Debug intrinsics do not change the code
+            if (isa<DbgInfoIntrinsic>(I)) {
+                continue;
+            }
+            words.push_back(I.getOpcode());
+            addType(I.getType());
+            words.push_back(I.getNumOperands());
+            for (const Value *operand : I.operands()) {
+                if (auto *constant = dyn_cast<ConstantInt>(operand)) {
+                    words.push_back(constant->getLimitedValue());
+                } else if (auto *block = dyn_cast<BasicBlock>(operand)) {
+                    words.push_back(blockIndex.lookup(block));
+                } else if (auto *function = dyn_cast<Function>(operand)) {
+                    words.push_back(xxHash64(function->getName()));
+                } else {
+                    words.push_back(operand->getValueID());
+                }
+            }
+        }
+    }
+    
+    return xxHash64(StringRef(reinterpret_cast<const char*>(words.data()),
+                              words.size() * sizeof(uint64_t)));
+}
+
+/**
+ * @brief Start the decisions of a function pass
+ * @param F Function being transformed
+ * @param passName Registered pass name
+ */
+PlanDecisions::PlanDecisions(const Function &F, StringRef passName) {
+    entry_.pass = passName.str();
+    entry_.scope = F.getName().str();
+    init(*F.getParent());
+    if (mode_ != PlanMode::Off) {
+        entry_.hash = getFunctionHash(F);
+    }
+    if (mode_ == PlanMode::Replay) {
+        replayed_ = plan_->find(entry_.pass, entry_.scope, entry_.hash);
+    }
+}
+
+/**
+ * @brief Start the decisions of a module pass
+ * @param M Module being transformed
+ * @param passName Registered pass name
+ * @param scope What the decisions are about
+ * @param hash Hash of what the decisions depend on
+ */
+PlanDecisions::PlanDecisions(const Module &M, StringRef passName, StringRef scope, uint64_t hash) {
+    entry_.pass = passName.str();
+    entry_.scope = scope.str();
+    entry_.hash = hash;
+    init(M);
+    if (mode_ == PlanMode::Replay) {
+        replayed_ = plan_->find(entry_.pass, entry_.scope, entry_.hash);
+    }
+}
+
+/**
+ * @brief Commit recorded decisions to the plan
+ */
+PlanDecisions::~PlanDecisions() {
+    if (mode_ == PlanMode::Record) {
+        plan_->record(std::move(entry_));
+    }
+}
+
+/**
+ * @brief Look up the plan for a module
+ * @param M Module being transformed
+ */
+void PlanDecisions::init(const Module &M) {
+    AttachedPlan attached = getPlan(M);
+    plan_ = attached.plan;
+    mode_ = attached.plan ? attached.mode : PlanMode::Off;
+}
+
+/**
+ * @brief Make the next decision
+ * @param decide Computes the decision when it is not replayed
+ * @return The decision
+ */
+uint64_t PlanDecisions::next(function_ref<uint64_t()> decide) {
+    if (replayed_ && position_ < replayed_->size()) {
+        return (*replayed_)[position_++];
+    }
+    uint64_t decision = decide();
+    if (mode_ == PlanMode::Record) {
+        entry_.decisions.push_back(decision);
+    }
+    return decision;
+}
+
+} // namespace obfuscator
@@ -0,0 +1,188 @@
+/**
+ * @file pass_pipeline.cpp
+ * @brief Obfuscation Pass Pipeline
+ *
+ * Runs the obfuscation passes registered through RegisterPass
+ * on a module. Used by the native tools that link the passes
+ * statically instead of loading them into opt.
+ */
+
+#include "pass_pipeline.h"
+#include "pipeline_verifier.h"
+
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Remarks/BitstreamRemarkSerializer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <vector>
+
+using namespace llvm;
+
+namespace obfuscator {
+
+namespace {
+
+/**
+ * @class BufferedRemarkSerializer
+ * @brief Collects remarks and writes them as one standalone bitstream file
+ *
+ * LLVM's streaming bitstream serializer leaves the string table to a
+ * section of the object file, which only Mach-O has. Buffering lets
+ * the table go at the front of the remarks file instead, so the file
+ * is readable on its own for every target.
+ */
+class BufferedRemarkSerializer : public remarks::RemarkSerializer {
+public:
+    explicit BufferedRemarkSerializer(raw_ostream &OS)
+        : RemarkSerializer(remarks::Format::Bitstream, OS, remarks::SerializerMode::Standalone) {}
+
+    /**
+     * @brief Keep a remark for finish()
+     * @param remark Remark; its strings are copied into the string table
+     */
+    void emit(const remarks::Remark &remark) override {
+        remarks.push_back(remark.clone());
+        strings.internalize(remarks.back());
+    }
+
+#if LLVM_VERSION_MAJOR >= 16
+    std::unique_ptr<remarks::MetaSerializer>
+    metaSerializer(raw_ostream &, std::optional<StringRef>) override {
+#else
+    std::unique_ptr<remarks::MetaSerializer>
+    metaSerializer(raw_ostream &, Optional<StringRef>) override {
+#endif
+        // Standalone files carry their own metadata
+        return nullptr;
+    }
+
+    /**
+     * @brief Write every remark kept so far
+     */
+    void finish() {
+        remarks::BitstreamRemarkSerializer serializer(OS, remarks::SerializerMode::Standalone,
+                                                      std::move(strings));
+        for (const remarks::Remark &remark : remarks) {
+            serializer.emit(remark);
+        }
+        remarks.clear();
+        strings = remarks::StringTable();
+    }
+
+private:
+    std::vector<remarks::Remark> remarks;
+    remarks::StringTable strings;
+};
+
+} // anonymous namespace
+
+/**
+ * @brief Get the default obfuscation pipeline
+ * @return Pass names in the order they should run
+ */
+std::vector<std::string> getDefaultPassPipeline() {
+    // Data passes first so later control flow passes also
+    // scramble the code they insert; blocks are split right before
+    // flattening turns them into states
+    return {
+        "string-encryption",
+        "instruction-substitution",
+        "bogus-control-flow",
+        "block-splitting",
+        "flattening"
+    };
+}
+
+/**
+ * @brief Run registered obfuscation passes on a module
+ * @param M Module to transform
+ * @param passNames Registered pass names (e.g. "bogus-control-flow")
+ * @param errorMessage Set to a description of the failure, if any
+ * @return true if all passes ran and every check passed
+ */
+bool runObfuscationPasses(Module &M,
+                          const std::vector<std::string> &passNames,
+                          std::string &errorMessage) {
+    PassRegistry *registry = PassRegistry::getPassRegistry();
+    std::vector<const PassInfo*> passes;
+
+    for (const std::string &name : passNames) {
+        const PassInfo *info = registry->getPassInfo(name);
+        if (!info || !info->getNormalCtor()) {
+            errorMessage = "unknown obfuscation pass '" + name + "'";
+            return false;
+        }
+        passes.push_back(info);
+    }
+
+    // One pass manager per pass, so the IR can be checked between them;
+    // catch broken IR here rather than in the code generator
+    PipelineVerifier verifier;
+    for (const PassInfo *info : passes) {
+        legacy::PassManager PM;
+        PM.add(info->createPass());
+        PM.run(M);
+        if (!verifier.check(M, info->getPassArgument(), errorMessage)) {
+            // A queued check of an earlier pass may have failed too; report that one
+            verifier.finish(errorMessage);
+            return false;
+        }
+    }
+    return verifier.finish(errorMessage, &M);
+}
+
+/**
+ * @brief Save the optimization remarks of a context to a file
+ * @param context Context whose remarks are saved
+ * @param path Remarks file, conventionally <output>.opt.bitstream
+ * @param passFilter Regex of pass names to keep; empty keeps all
+ * @param errorMessage Set to a description of the failure, if any
+ * @return The open file, to pass to finishRemarksFile(); nullptr on failure
+ */
+std::unique_ptr<ToolOutputFile> setupRemarksFile(LLVMContext &context, StringRef path,
+                                                 StringRef passFilter,
+                                                 std::string &errorMessage) {
+    std::error_code ec;
+    auto file = std::make_unique<ToolOutputFile>(path, ec, sys::fs::OF_None);
+    if (ec) {
+        errorMessage = "cannot open '" + path.str() + "': " + ec.message();
+        return nullptr;
+    }
+
+    auto streamer = std::make_unique<remarks::RemarkStreamer>(
+        std::make_unique<BufferedRemarkSerializer>(file->os()), path);
+    if (!passFilter.empty()) {
+        if (Error error = streamer->setFilter(passFilter)) {
+            errorMessage = toString(std::move(error));
+            return nullptr;
+        }
+    }
+    context.setMainRemarkStreamer(std::move(streamer));
+    context.setLLVMRemarkStreamer(
+        std::make_unique<LLVMRemarkStreamer>(*context.getMainRemarkStreamer()));
+    return file;
+}
+
+/**
+ * @brief Write the saved remarks, stop saving and keep the file
+ * @param context Context passed to setupRemarksFile()
+ * @param file File returned by setupRemarksFile()
+ */
+void finishRemarksFile(LLVMContext &context, ToolOutputFile &file) {
+    static_cast<BufferedRemarkSerializer&>(
+        context.getMainRemarkStreamer()->getSerializer()).finish();
+
+    // The LLVM streamer refers to the main one; drop it first
+    context.setLLVMRemarkStreamer(nullptr);
+    context.setMainRemarkStreamer(nullptr);
+    file.keep();
+}
+
+} // namespace obfuscator
@@ -0,0 +1,394 @@
+/**
+ * @file pass_profiler.cpp
+ * @brief Pass Memory Profiler
+ * 
+ * Each run is measured against the thread it runs on: allocation
+ * counters are thread-local, so passes running in parallel in the
+ * native tools are told apart. RSS and malloc usage are process-wide
+ * and only attribute exactly with one thread (-j 1).
+ */
+
+#include "utils/pass_profiler.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ToolOutputFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#if defined(__unix__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace llvm;
+
+static cl::opt<std::string> ProfileOutput(
+    "obfuscation-profile", cl::init(""),
+    cl::desc("Write per-pass memory and allocation statistics to this JSON file"));
+
+static cl::opt<unsigned> ProfileFunctions(
+    "obfuscation-profile-functions", cl::init(10),
+    cl::desc("Number of largest functions reported for each pass"));
+
+namespace obfuscator {
+
+namespace {
+
+thread_local AllocationCounters threadAllocations;
+std::atomic<bool> allocationHookInstalled(false);
+
+/**
+ * @struct FunctionProfile
+ * @brief One pass run on one function
+ */
+struct FunctionProfile {
+    std::string name;
+    PassProfileScope::IRSize before;
+    PassProfileScope::IRSize after;
+    AllocationCounters allocations;
+    double seconds = 0;
+};
+
+/**
+ * @struct PassProfile
+ * @brief Totals of every run of one pass
+ */
+struct PassProfile {
+    std::string name;
+    uint64_t runs = 0;
+    double seconds = 0;
+    PassProfileScope::IRSize before;
+    PassProfileScope::IRSize after;
+    AllocationCounters allocations;
+    int64_t heapGrowthBytes = 0;
+    int64_t rssGrowthBytes = 0;
+    uint64_t peakRssBytes = 0;
+    std::vector<FunctionProfile> largestFunctions;  ///< Largest after the pass, biggest first
+};
+
+/**
+ * @struct Profile
+ * @brief Profiles of every pass, written at exit
+ */
+struct Profile {
+    std::mutex mutex;
+    std::vector<PassProfile> passes;  ///< In order of first run
+    StringMap<size_t> passIndex;
+    
+    ~Profile() {
+        if (ProfileOutput.empty()) {
+            return;
+        }
+        std::error_code ec;
+        ToolOutputFile output(ProfileOutput, ec, sys::fs::OF_Text);
+        if (ec) {
+            errs() << "obfuscation profile: cannot open '" << ProfileOutput << "': "
+                   << ec.message() << "\n";
+            return;
+        }
+        writePassProfile(output.os());
+        output.keep();
+    }
+} profile;
+
+/**
+ * @brief Get the resident set size of the process
+ * @return Bytes, or 0 where unknown
+ */
+uint64_t getResidentBytes() {
+#if defined(__linux__)
+    // Second field of statm is the resident page count
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    unsigned long long size = 0, resident = 0;
+    int fields = fscanf(statm, "%llu %llu", &size, &resident);
+    fclose(statm);
+    return fields == 2 ? resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Get the peak resident set size of the process
+ * @return Bytes, or 0 where unknown
+ */
+uint64_t getPeakResidentBytes() {
+#if defined(__unix__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // Kilobytes on Linux
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Measure the IR of a function
+ * @param F Function
+ * @return Its size
+ */
+PassProfileScope::IRSize measure(const Function &F) {
+    PassProfileScope::IRSize size;
+    size.instructions = F.getInstructionCount();
+    size.values = size.instructions + F.size() + F.arg_size();
+    return size;
+}
+
+/**
+ * @brief Measure the IR of a module
+ * @param M Module
+ * @return Its size, globals included
+ */
+PassProfileScope::IRSize measure(const Module &M) {
+    PassProfileScope::IRSize size;
+    for (const Function &F : M) {
+        PassProfileScope::IRSize function = measure(F);
+        size.instructions += function.instructions;
+        size.values += function.values + 1;
+    }
+    size.values += M.global_size() + M.alias_size() + M.ifunc_size();
+    return size;
+}
+
+/**
+ * @brief Get the counters accumulated between two readings
+ * @param before Earlier reading
+ * @param after Later reading
+ * @return after - before
+ */
+AllocationCounters difference(const AllocationCounters &before, const AllocationCounters &after) {
+    AllocationCounters delta;
+    delta.allocations = after.allocations - before.allocations;
+    delta.allocatedBytes = after.allocatedBytes - before.allocatedBytes;
+    delta.frees = after.frees - before.frees;
+    delta.freedBytes = after.freedBytes - before.freedBytes;
+    return delta;
+}
+
+/**
+ * @brief Add counters to a total
+ * @param total Total to update
+ * @param delta Counters to add
+ */
+void accumulate(AllocationCounters &total, const AllocationCounters &delta) {
+    total.allocations += delta.allocations;
+    total.allocatedBytes += delta.allocatedBytes;
+    total.frees += delta.frees;
+    total.freedBytes += delta.freedBytes;
+}
+
+/**
+ * @brief Write IR sizes as JSON attributes
+ * @param J JSON stream inside an object
+ * @param before Size before the pass
+ * @param after Size after the pass
+ */
+void writeSizes(json::OStream &J, const PassProfileScope::IRSize &before,
+                const PassProfileScope::IRSize &after) {
+    J.attribute("instructionsBefore", static_cast<int64_t>(before.instructions));
+    J.attribute("instructionsAfter", static_cast<int64_t>(after.instructions));
+    J.attribute("valuesBefore", static_cast<int64_t>(before.values));
+    J.attribute("valuesAfter", static_cast<int64_t>(after.values));
+}
+
+/**
+ * @brief Write allocation counters as JSON attributes
+ * @param J JSON stream inside an object
+ * @param counters Counters; null without the allocation hook
+ */
+void writeAllocations(json::OStream &J, const AllocationCounters &counters) {
+    if (!allocationHookInstalled) {
+        J.attribute("allocations", nullptr);
+        J.attribute("allocatedBytes", nullptr);
+        J.attribute("freedBytes", nullptr);
+        return;
+    }
+    J.attribute("allocations", static_cast<int64_t>(counters.allocations));
+    J.attribute("allocatedBytes", static_cast<int64_t>(counters.allocatedBytes));
+    J.attribute("freedBytes", static_cast<int64_t>(counters.freedBytes));
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Count an allocation on the current thread
+ * @param size Bytes allocated
+ */
+void recordAllocation(size_t size) {
+    threadAllocations.allocations++;
+    threadAllocations.allocatedBytes += size;
+}
+
+/**
+ * @brief Count a free on the current thread
+ * @param size Bytes freed
+ */
+void recordFree(size_t size) {
+    threadAllocations.frees++;
+    threadAllocations.freedBytes += size;
+}
+
+/**
+ * @brief Mark the allocation hook as linked in
+ */
+void setAllocationHookInstalled() {
+    allocationHookInstalled = true;
+}
+
+/**
+ * @brief Get the heap activity of the current thread so far
+ * @return Counters since the thread started
+ */
+AllocationCounters getThreadAllocationCounters() {
+    return threadAllocations;
+}
+
+/**
+ * @brief Check if pass profiling was requested
+ * @return true if -obfuscation-profile names a file
+ */
+bool isPassProfilingEnabled() {
+    return !ProfileOutput.empty();
+}
+
+/**
+ * @brief Write the profile collected so far as JSON
+ * @param OS Output stream
+ */
+void writePassProfile(raw_ostream &OS) {
+    std::lock_guard<std::mutex> lock(profile.mutex);
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attribute("allocationHook", allocationHookInstalled.load());
+        J.attribute("peakRssBytes", static_cast<int64_t>(getPeakResidentBytes()));
+        J.attributeArray("passes", [&] {
+            for (const PassProfile &pass : profile.passes) {
+                J.object([&] {
+                    J.attribute("name", pass.name);
+                    J.attribute("runs", static_cast<int64_t>(pass.runs));
+                    J.attribute("seconds", pass.seconds);
+                    writeSizes(J, pass.before, pass.after);
+                    writeAllocations(J, pass.allocations);
+                    J.attribute("heapGrowthBytes", pass.heapGrowthBytes);
+                    J.attribute("rssGrowthBytes", pass.rssGrowthBytes);
+                    J.attribute("peakRssBytes", static_cast<int64_t>(pass.peakRssBytes));
+                    J.attributeArray("largestFunctions", [&] {
+                        for (const FunctionProfile &function : pass.largestFunctions) {
+                            J.object([&] {
+                                J.attribute("name", function.name);
+                                J.attribute("seconds", function.seconds);
+                                writeSizes(J, function.before, function.after);
+                                writeAllocations(J, function.allocations);
+                            });
+                        }
+                    });
+                });
+            }
+        });
+    });
+    OS << "\n";
+}
+
+/**
+ * @brief Start measuring a function pass run
+ * @param F Function being transformed
+ * @param passName Registered pass name
+ */
+PassProfileScope::PassProfileScope(const Function &F, StringRef passName)
+    : function_(&F), module_(F.getParent()), passName_(passName) {
+    active_ = isPassProfilingEnabled();
+    if (active_) {
+        sizeBefore_ = measure(F);
+        rssBefore_ = getResidentBytes();
+        heapBefore_ = sys::Process::GetMallocUsage();
+        allocationsBefore_ = getThreadAllocationCounters();
+        start_ = std::chrono::steady_clock::now();
+    }
+}
+
+/**
+ * @brief Start measuring a module pass run
+ * @param M Module being transformed
+ * @param passName Registered pass name
+ */
+PassProfileScope::PassProfileScope(const Module &M, StringRef passName)
+    : module_(&M), passName_(passName) {
+    active_ = isPassProfilingEnabled();
+    if (active_) {
+        sizeBefore_ = measure(M);
+        rssBefore_ = getResidentBytes();
+        heapBefore_ = sys::Process::GetMallocUsage();
+        allocationsBefore_ = getThreadAllocationCounters();
+        start_ = std::chrono::steady_clock::now();
+    }
+}
+
+/**
+ * @brief Finish measuring and add the run to the profile
+ */
+PassProfileScope::~PassProfileScope() {
+    if (!active_) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    AllocationCounters allocations = difference(allocationsBefore_, getThreadAllocationCounters());
+    int64_t heapGrowth = static_cast<int64_t>(sys::Process::GetMallocUsage()) -
+                         static_cast<int64_t>(heapBefore_);
+    int64_t rssGrowth = static_cast<int64_t>(getResidentBytes()) - static_cast<int64_t>(rssBefore_);
+    uint64_t peakRss = getPeakResidentBytes();
+    IRSize sizeAfter = function_ ? measure(*function_) : measure(*module_);
+    
+    std::lock_guard<std::mutex> lock(profile.mutex);
+    auto inserted = profile.passIndex.try_emplace(passName_, profile.passes.size());
+    if (inserted.second) {
+        profile.passes.emplace_back();
+        profile.passes.back().name = passName_.str();
+    }
+    PassProfile &pass = profile.passes[inserted.first->second];
+    pass.runs++;
+    pass.seconds += seconds;
+    pass.before.instructions += sizeBefore_.instructions;
+    pass.before.values += sizeBefore_.values;
+    pass.after.instructions += sizeAfter.instructions;
+    pass.after.values += sizeAfter.values;
+    accumulate(pass.allocations, allocations);
+    pass.heapGrowthBytes += heapGrowth;
+    pass.rssGrowthBytes += rssGrowth;
+    pass.peakRssBytes = std::max(pass.peakRssBytes, peakRss);
+    
+    if (!function_ || ProfileFunctions == 0) {
+        return;
+    }
+    auto bySize = [](const FunctionProfile &a, const FunctionProfile &b) {
+        return a.after.instructions > b.after.instructions;
+    };
+    std::vector<FunctionProfile> &largest = pass.largestFunctions;
+    if (largest.size() == ProfileFunctions &&
+        largest.back().after.instructions >= sizeAfter.instructions) {
+        return;
+    }
+    FunctionProfile function;
+    function.name = function_->getName().str();
+    function.before = sizeBefore_;
+    function.after = sizeAfter;
+    function.allocations = allocations;
+    function.seconds = seconds;
+    largest.insert(std::upper_bound(largest.begin(), largest.end(), function, bySize),
+                   std::move(function));
+    if (largest.size() > ProfileFunctions) {
+        largest.pop_back();
+    }
+}
+
+} // namespace obfuscator
@@ -0,0 +1,312 @@
+/**
+ * @file pipeline_verifier.cpp
+ * @brief Tiered IR Verifier
+ *
+ * Worker threads never touch the module being transformed: each check
+ * reads a bitcode snapshot into its own LLVMContext, so the next pass
+ * can run while the previous result is verified.
+ */
+
+#include "utils/pipeline_verifier.h"
+#include "utils/llvm_utils.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static cl::opt<obfuscator::VerifyLevel> VerifyLevelOption(
+    "obfuscation-verify", cl::init(obfuscator::VerifyLevel::Final),
+    cl::desc("IR verification after each obfuscation pass"),
+    cl::values(clEnumValN(obfuscator::VerifyLevel::Off, "off", "No verification"),
+               clEnumValN(obfuscator::VerifyLevel::Structural, "structural",
+                          "Cheap structural checks of every function"),
+               clEnumValN(obfuscator::VerifyLevel::Final, "final",
+                          "Structural checks, full verifier on the final module"),
+               clEnumValN(obfuscator::VerifyLevel::Sampled, "sampled",
+                          "Structural checks, full verifier on a sample of functions"),
+               clEnumValN(obfuscator::VerifyLevel::Full, "full",
+                          "Structural checks, full verifier on every function")));
+
+static cl::opt<unsigned> VerifySamplePercent(
+    "obfuscation-verify-sample", cl::init(10),
+    cl::desc("Percentage of functions fully verified by -obfuscation-verify=sampled"));
+
+static cl::opt<unsigned> VerifyThreads(
+    "obfuscation-verify-threads", cl::init(1),
+    cl::desc("Worker threads running the full verifier (0 = one per core)"));
+
+namespace obfuscator {
+
+namespace {
+
+/**
+ * @brief Describe a block for an error message
+ * @param BB Block to describe
+ * @return Block name, or its slot number if it has none
+ */
+std::string describeBlock(const BasicBlock &BB) {
+    std::string name;
+    raw_string_ostream OS(name);
+    BB.printAsOperand(OS, false);
+    return OS.str();
+}
+
+/**
+ * @brief Get the function a value operand belongs to
+ * @param V Operand
+ * @param local Set to true if V is function-local
+ * @return Owning function; nullptr for constants, globals and detached instructions
+ */
+const Function *getOwningFunction(const Value *V, bool &local) {
+    local = true;
+    if (auto *inst = dyn_cast<Instruction>(V)) {
+        return inst->getParent() ? inst->getParent()->getParent() : nullptr;
+    }
+    if (auto *arg = dyn_cast<Argument>(V)) {
+        return arg->getParent();
+    }
+    if (auto *block = dyn_cast<BasicBlock>(V)) {
+        return block->getParent();
+    }
+    local = false;
+    return nullptr;
+}
+
+/**
+ * @brief Get the worker threads every verifier queues full checks on
+ * @return Pool of -obfuscation-verify-threads workers, created on first use
+ */
+ThreadPool &getVerifierPool() {
+    static ThreadPool pool(VerifyThreads ? hardware_concurrency(VerifyThreads)
+                                         : hardware_concurrency());
+    return pool;
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Get the verification level selected on the command line
+ * @return Value of -obfuscation-verify
+ */
+VerifyLevel getVerifyLevel() {
+    return VerifyLevelOption;
+}
+
+/**
+ * @brief Run the cheap structural checks on a function
+ * @param F Function to check
+ * @param errorMessage Set to a description of the first problem found
+ * @return true if no problem was found
+ */
+bool checkFunctionStructure(const Function &F, std::string &errorMessage) {
+    auto fail = [&](const BasicBlock &BB, const Twine &problem) {
+        errorMessage = ("function '" + F.getName() + "', block " + describeBlock(BB) +
+                        ": " + problem).str();
+        return false;
+    };
+
+    for (const BasicBlock &BB : F) {
+        const Instruction *terminator = BB.getTerminator();
+        if (!terminator) {
+            return fail(BB, "does not end in a terminator");
+        }
+        if (BB.isEntryBlock() && !pred_empty(&BB)) {
+            return fail(BB, "is the entry block but has predecessors");
+        }
+
+        // Edges, not distinct blocks: a switch may reach BB more than once
+        unsigned edges = pred_size(&BB);
+        SmallPtrSet<const BasicBlock*, 8> predecessors(pred_begin(&BB), pred_end(&BB));
+        bool pastPHIs = false;
+        for (const Instruction &I : BB) {
+            if (I.isTerminator() && &I != terminator) {
+                return fail(BB, "has a terminator before its end");
+            }
+            if (auto *phi = dyn_cast<PHINode>(&I)) {
+                if (pastPHIs) {
+                    return fail(BB, "has a PHI node after other instructions");
+                }
+                if (phi->getNumIncomingValues() != edges) {
+                    return fail(BB, "has a PHI node with " + Twine(phi->getNumIncomingValues()) +
+                                    " incoming values for " + Twine(edges) + " predecessor edges");
+                }
+                for (const BasicBlock *incoming : phi->blocks()) {
+                    if (!predecessors.count(incoming)) {
+                        return fail(BB, "has a PHI node with incoming block " +
+                                        describeBlock(*incoming) + ", which is not a predecessor");
+                    }
+                }
+            } else {
+                pastPHIs = true;
+            }
+
+            for (const Use &operand : I.operands()) {
+                bool local;
+                const Function *owner = getOwningFunction(operand.get(), local);
+                if (local && owner != &F) {
+                    return fail(BB, "uses a value that is not in the function");
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Create a verifier
+ * @param level Verification level
+ */
+PipelineVerifier::PipelineVerifier(VerifyLevel level) : level_(level) {}
+
+PipelineVerifier::~PipelineVerifier() {
+    // Queued tasks report through this verifier; wait for them, not the
+    // whole shared pool
+    for (std::shared_future<void> &task : queued_) {
+        task.wait();
+    }
+}
+
+/**
+ * @brief Record a failure, keeping the one after the earliest pass
+ * @param checkIndex Position of the check in the pipeline
+ * @param message Description of the failure
+ */
+void PipelineVerifier::fail(unsigned checkIndex, std::string message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (checkIndex < failedCheck_) {
+        failedCheck_ = checkIndex;
+        failure_ = std::move(message);
+    }
+}
+
+/**
+ * @brief Check a module after a pass ran on it
+ * @param M Module the pass transformed
+ * @param passName Registered name of the pass
+ * @param errorMessage Set to a description of the failure, if any
+ * @return false if the structural checks failed
+ */
+bool PipelineVerifier::check(const Module &M, StringRef passName, std::string &errorMessage) {
+    unsigned checkIndex = checks_++;
+    lastPass_ = passName.str();
+    if (level_ == VerifyLevel::Off) {
+        return true;
+    }
+
+    std::string prefix = "module '" + M.getModuleIdentifier() +
+                         "' failed verification after '" + passName.str() + "': ";
+    std::vector<unsigned> sample;
+    unsigned index = 0;
+    for (const Function &F : M) {
+        if (!F.isDeclaration()) {
+            std::string problem;
+            if (!checkFunctionStructure(F, problem)) {
+                errorMessage = prefix + problem;
+                return false;
+            }
+            if (level_ == VerifyLevel::Sampled &&
+                getRandomGenerator(F, "verify-after-" + passName.str())() % 100 < VerifySamplePercent) {
+                sample.push_back(index);
+            }
+        }
+        index++;
+    }
+    if (level_ <= VerifyLevel::Final || (level_ == VerifyLevel::Sampled && sample.empty())) {
+        return true;
+    }
+
+    // Structurally sound IR is safe to write; the rest happens off this thread
+    auto bitcode = std::make_shared<SmallVector<char, 0>>();
+    raw_svector_ostream OS(*bitcode);
+    WriteBitcodeToFile(M, OS);
+
+    bool full = level_ == VerifyLevel::Full;
+    queued_.push_back(getVerifierPool().async([this, bitcode, sample, full, checkIndex, prefix] {
+        LLVMContext context;
+        MemoryBufferRef buffer(StringRef(bitcode->data(), bitcode->size()), "snapshot");
+        Expected<std::unique_ptr<Module>> snapshot = getLazyBitcodeModule(buffer, context);
+        if (!snapshot) {
+            fail(checkIndex, prefix + "snapshot unreadable: " + toString(snapshot.takeError()));
+            return;
+        }
+
+        std::string output;
+        raw_string_ostream verifierStream(output);
+        if (full) {
+            if (Error error = (*snapshot)->materializeAll()) {
+                fail(checkIndex, prefix + toString(std::move(error)));
+            } else if (verifyModule(**snapshot, &verifierStream)) {
+                fail(checkIndex, prefix + verifierStream.str());
+            }
+            return;
+        }
+
+        // Bitcode keeps the function order, so sample indices carry over
+        auto next = sample.begin();
+        unsigned position = 0;
+        for (Function &F : **snapshot) {
+            if (next == sample.end()) {
+                break;
+            }
+            if (position++ != *next) {
+                continue;
+            }
+            ++next;
+            if (Error error = F.materialize()) {
+                fail(checkIndex, prefix + toString(std::move(error)));
+                return;
+            }
+            if (verifyFunction(F, &verifierStream)) {
+                fail(checkIndex, prefix + "function '" + F.getName().str() + "': " +
+                                 verifierStream.str());
+                return;
+            }
+        }
+    }));
+    return true;
+}
+
+/**
+ * @brief Wait for the queued verification
+ * @param errorMessage Set to the failure after the earliest pass, if any
+ * @param M Module after the last pass; nullptr when a check failed
+ * @return true if every check passed
+ */
+bool PipelineVerifier::finish(std::string &errorMessage, const Module *M) {
+    for (std::shared_future<void> &task : queued_) {
+        task.wait();
+    }
+    queued_.clear();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failedCheck_ != ~0u) {
+            errorMessage = failure_;
+            return false;
+        }
+    }
+
+    // The final tier verifies once, on this thread: nothing runs after it
+    std::string output;
+    raw_string_ostream verifierStream(output);
+    if (level_ == VerifyLevel::Final && M && verifyModule(*M, &verifierStream)) {
+        errorMessage = "module '" + M->getModuleIdentifier() +
+                       "' failed verification after '" + lastPass_ + "': " + verifierStream.str();
+        return false;
+    }
+    return true;
+}
+
+} // namespace obfuscator
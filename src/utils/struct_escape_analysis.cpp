@@ -0,0 +1,561 @@
+/**
+ * @file struct_escape_analysis.cpp
+ * @brief Struct Escape Analysis
+ * 
+ * Finds struct types whose layout is private to the module, so that
+ * layout-changing passes can rewrite every access consistently.
+ */
+
+#include "utils/struct_escape_analysis.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/TypeFinder.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace obfuscator {
+
+namespace {
+
+/**
+ * @brief Check if a call allocates a fresh heap object
+ * @param call Call to check
+ * @return true for malloc-style allocation functions
+ */
+bool isAllocationCall(const CallBase *call) {
+    const Function *callee = call->getCalledFunction();
+    if (!callee) {
+        return false;
+    }
+    StringRef name = callee->getName();
+    return name == "malloc" || name == "calloc" || name == "realloc" ||
+           name == "aligned_alloc" || name == "_Znwm" || name == "_Znam";
+}
+
+/**
+ * @brief Check if a call releases a heap object
+ * @param call Call to check
+ * @return true for free-style deallocation functions
+ */
+bool isDeallocationCall(const CallBase *call) {
+    const Function *callee = call->getCalledFunction();
+    if (!callee) {
+        return false;
+    }
+    StringRef name = callee->getName();
+    return name == "free" || name == "realloc" || name == "_ZdlPv" ||
+           name == "_ZdaPv" || name == "_ZdlPvm" || name == "_ZdaPvm";
+}
+
+} // anonymous namespace
+
+/**
+ * @brief Analyze a module
+ * @param M Module to analyze; should be the whole program (LTO)
+ */
+StructEscapeAnalysis::StructEscapeAnalysis(Module &M) : DL_(M.getDataLayout()) {
+    findCandidates(M);
+    if (M.getContext().supportsTypedPointers()) {
+        // Pointer types would carry the struct type everywhere
+        for (StructType *S : candidates_) {
+            reject(S, "module uses typed pointers");
+        }
+        return;
+    }
+    
+    rejectNestedAndSignatureUses(M);
+    collectAccesses(M);
+    
+    // Rejecting one struct can reject others whose pointers it holds,
+    // and tracking can discover new slot traffic; iterate to a fixpoint
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        size_t slotAccesses = countSlotAccesses();
+        for (StructType *S : candidates_) {
+            if (!escapeReasons_.count(S) && !trackObjectPointers(S)) {
+                changed = true;
+            }
+        }
+        changed |= countSlotAccesses() != slotAccesses;
+    }
+    
+    for (StructType *S : candidates_) {
+        if (!escapeReasons_.count(S)) {
+            nonEscaping_.push_back(S);
+        }
+    }
+}
+
+/**
+ * @brief Check if a struct's layout never escapes the module
+ * @param S Struct type
+ * @return true if S can be rewritten
+ */
+bool StructEscapeAnalysis::isNonEscaping(StructType *S) const {
+    return candidates_.count(S) && !escapeReasons_.count(S);
+}
+
+/**
+ * @brief Get the accesses that depend on a non-escaping struct's layout
+ * @param S Non-escaping struct type
+ * @return Accesses to rewrite if the layout of S changes
+ */
+const StructAccesses &StructEscapeAnalysis::getAccesses(StructType *S) const {
+    static const StructAccesses empty;
+    auto it = accesses_.find(S);
+    return it != accesses_.end() ? it->second : empty;
+}
+
+/**
+ * @brief Get why a struct escapes
+ * @param S Struct type
+ * @return Human-readable reason, empty if S does not escape
+ */
+std::string StructEscapeAnalysis::getEscapeReason(StructType *S) const {
+    auto it = escapeReasons_.find(S);
+    return it != escapeReasons_.end() ? it->second : "";
+}
+
+/**
+ * @brief Collect named, non-packed structs with at least two fields
+ * @param M Module to scan
+ */
+void StructEscapeAnalysis::findCandidates(Module &M) {
+    TypeFinder finder;
+    finder.run(M, /*onlyNamed=*/false);
+    for (StructType *S : finder) {
+        if (!S->isLiteral() && !S->isOpaque() && !S->isPacked() &&
+            S->getNumElements() >= 2) {
+            candidates_.insert(S);
+        }
+    }
+}
+
+/**
+ * @brief Reject structs nested in aggregates or used in signatures and globals
+ * @param M Module to scan
+ */
+void StructEscapeAnalysis::rejectNestedAndSignatureUses(Module &M) {
+    TypeFinder finder;
+    finder.run(M, /*onlyNamed=*/false);
+    for (StructType *T : finder) {
+        for (Type *element : T->elements()) {
+            rejectTypesIn(element, "nested in " + (T->hasName() ? T->getName().str() : "literal struct"));
+        }
+    }
+    
+    for (GlobalVariable &G : M.globals()) {
+        rejectTypesIn(G.getValueType(), "type of global " + G.getName().str());
+    }
+    
+    for (Function &F : M) {
+        rejectTypesIn(F.getFunctionType(), "signature of " + F.getName().str());
+        for (unsigned i = 0; i < F.arg_size(); i++) {
+            for (Attribute A : F.getAttributes().getParamAttrs(i)) {
+                if (A.isTypeAttribute() && A.getValueAsType()) {
+                    rejectTypesIn(A.getValueAsType(), "parameter attribute of " + F.getName().str());
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Record struct accesses and pointer slot traffic
+ * @param M Module to scan
+ */
+void StructEscapeAnalysis::collectAccesses(Module &M) {
+    for (Function &F : M) {
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                // Struct values in registers mean by-value copies
+                rejectTypesIn(I.getType(), "value in " + F.getName().str());
+                
+                // Constant GEPs index into globals, which are not rewritten
+                for (Value *operand : I.operands()) {
+                    if (auto *expr = dyn_cast<ConstantExpr>(operand)) {
+                        if (auto *gep = dyn_cast<GEPOperator>(expr)) {
+                            rejectTypesIn(gep->getSourceElementType(), "constant expression");
+                        }
+                    }
+                }
+                
+                if (auto *alloca = dyn_cast<AllocaInst>(&I)) {
+                    auto *S = dyn_cast<StructType>(alloca->getAllocatedType());
+                    if (S && candidates_.count(S) && !alloca->isArrayAllocation()) {
+                        accesses_[S].allocas.push_back(alloca);
+                    } else {
+                        rejectTypesIn(alloca->getAllocatedType(), "array alloca in " + F.getName().str());
+                    }
+                } else if (auto *gep = dyn_cast<GetElementPtrInst>(&I)) {
+                    auto *S = dyn_cast<StructType>(gep->getSourceElementType());
+                    if (S && candidates_.count(S)) {
+                        accesses_[S].geps.push_back(gep);
+                    } else {
+                        rejectTypesIn(gep->getSourceElementType(), "array GEP in " + F.getName().str());
+                    }
+                } else if (auto *load = dyn_cast<LoadInst>(&I)) {
+                    PointerSlot slot;
+                    if (load->getType()->isPointerTy() &&
+                        getPointerSlot(load->getPointerOperand(), slot)) {
+                        slotLoads_[slot].push_back(load);
+                    }
+                } else if (auto *store = dyn_cast<StoreInst>(&I)) {
+                    Type *valueType = store->getValueOperand()->getType();
+                    rejectTypesIn(valueType, "stored by value in " + F.getName().str());
+                    PointerSlot slot;
+                    if (valueType->isPointerTy() &&
+                        getPointerSlot(store->getPointerOperand(), slot)) {
+                        slotStores_[slot].push_back(store);
+                    }
+                } else if (auto *call = dyn_cast<CallBase>(&I)) {
+                    rejectTypesIn(call->getFunctionType(), "call in " + F.getName().str());
+                    for (unsigned i = 0; i < call->arg_size(); i++) {
+                        for (Attribute A : call->getAttributes().getParamAttrs(i)) {
+                            if (A.isTypeAttribute() && A.getValueAsType()) {
+                                rejectTypesIn(A.getValueAsType(), "call attribute in " + F.getName().str());
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Follow every pointer to objects of a struct
+ * @param S Struct type
+ * @return false if S was rejected
+ */
+bool StructEscapeAnalysis::trackObjectPointers(StructType *S) {
+    StructAccesses &access = accesses_[S];
+    access.fieldZeroAccesses.clear();
+    access.fills.clear();
+    
+    // Seeds: stack objects and every base pointer of a field access
+    std::vector<Value*> worklist(access.allocas.begin(), access.allocas.end());
+    for (GetElementPtrInst *gep : access.geps) {
+        worklist.push_back(gep->getPointerOperand());
+    }
+    
+    std::set<Value*> visited;
+    while (!worklist.empty()) {
+        Value *P = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(P).second) {
+            continue;
+        }
+        
+        if (!checkOrigin(S, P, worklist)) {
+            return false;
+        }
+        if (isa<Constant>(P)) {
+            // Uses of null and undef elsewhere are not uses of our objects
+            continue;
+        }
+        for (User *U : P->users()) {
+            if (!checkUse(S, P, U, worklist)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check where an object pointer comes from
+ * @param S Struct type of the object
+ * @param P Object pointer
+ * @param worklist Pointers still to check; related pointers are added
+ * @return false if S was rejected
+ */
+bool StructEscapeAnalysis::checkOrigin(StructType *S, Value *P, std::vector<Value*> &worklist) {
+    if (isa<ConstantPointerNull>(P) || isa<UndefValue>(P)) {
+        return true;
+    }
+    if (auto *alloca = dyn_cast<AllocaInst>(P)) {
+        if (alloca->getAllocatedType() == S) {
+            return true;
+        }
+    } else if (auto *call = dyn_cast<CallBase>(P)) {
+        if (isAllocationCall(call)) {
+            if (call->getCalledFunction()->getName() == "calloc") {
+                accesses_[S].fills.push_back(call);
+            }
+            return true;
+        }
+    } else if (auto *phi = dyn_cast<PHINode>(P)) {
+        for (Value *incoming : phi->incoming_values()) {
+            worklist.push_back(incoming);
+        }
+        return true;
+    } else if (auto *select = dyn_cast<SelectInst>(P)) {
+        worklist.push_back(select->getTrueValue());
+        worklist.push_back(select->getFalseValue());
+        return true;
+    } else if (auto *gep = dyn_cast<GetElementPtrInst>(P)) {
+        // Stepping over an array of objects still points at an object
+        if (gep->getSourceElementType() == S && gep->getNumIndices() == 1) {
+            worklist.push_back(gep->getPointerOperand());
+            return true;
+        }
+    } else if (auto *arg = dyn_cast<Argument>(P)) {
+        // Internal functions: every caller is visible
+        Function *F = arg->getParent();
+        if (F->hasLocalLinkage()) {
+            for (Use &use : F->uses()) {
+                auto *call = dyn_cast<CallBase>(use.getUser());
+                if (!call || !call->isCallee(&use)) {
+                    reject(S, "address of " + F->getName().str() + " taken");
+                    return false;
+                }
+                worklist.push_back(call->getArgOperand(arg->getArgNo()));
+            }
+            return true;
+        }
+    } else if (auto *load = dyn_cast<LoadInst>(P)) {
+        // Pointers round-tripped through a known slot: everything stored
+        // there must be an object pointer too
+        PointerSlot slot;
+        if (getPointerSlot(load->getPointerOperand(), slot) && isTrackedSlot(slot)) {
+            for (StoreInst *store : slotStores_[slot]) {
+                worklist.push_back(store->getValueOperand());
+            }
+            for (LoadInst *other : slotLoads_[slot]) {
+                worklist.push_back(other);
+            }
+            return true;
+        }
+    }
+    
+    reject(S, "object pointer of unknown origin");
+    return false;
+}
+
+/**
+ * @brief Check one use of an object pointer
+ * @param S Struct type of the object
+ * @param P Object pointer
+ * @param U User of P
+ * @param worklist Pointers still to check; related pointers are added
+ * @return false if S was rejected
+ */
+bool StructEscapeAnalysis::checkUse(StructType *S, Value *P, User *U,
+                                    std::vector<Value*> &worklist) {
+    if (auto *gep = dyn_cast<GetElementPtrInst>(U)) {
+        if (gep->getSourceElementType() == S && gep->getPointerOperand() == P) {
+            if (gep->getNumIndices() == 1) {
+                worklist.push_back(gep);
+            }
+            return true;
+        }
+    } else if (auto *load = dyn_cast<LoadInst>(U)) {
+        // Loading through the object pointer reads field 0, if it loads
+        // a field 0; anything else reads bytes of the old layout
+        if (load->getType() != S->getElementType(0)) {
+            reject(S, "load of another type than field 0 through object pointer");
+            return false;
+        }
+        accesses_[S].fieldZeroAccesses.push_back(load);
+        if (load->getType()->isPointerTy()) {
+            auto &loads = slotLoads_[{S, 0}];
+            if (std::find(loads.begin(), loads.end(), load) == loads.end()) {
+                loads.push_back(load);
+            }
+        }
+        return true;
+    } else if (auto *store = dyn_cast<StoreInst>(U)) {
+        if (store->getPointerOperand() == P && store->getValueOperand() != P) {
+            // Storing through the object pointer writes field 0
+            if (store->getValueOperand()->getType() != S->getElementType(0)) {
+                reject(S, "store of another type than field 0 through object pointer");
+                return false;
+            }
+            accesses_[S].fieldZeroAccesses.push_back(store);
+            if (store->getValueOperand()->getType()->isPointerTy()) {
+                auto &stores = slotStores_[{S, 0}];
+                if (std::find(stores.begin(), stores.end(), store) == stores.end()) {
+                    stores.push_back(store);
+                }
+            }
+            return true;
+        }
+        
+        // The pointer itself is stored; it must land in a tracked slot
+        PointerSlot slot;
+        if (store->getValueOperand() == P && store->getPointerOperand() != P &&
+            getPointerSlot(store->getPointerOperand(), slot) && isTrackedSlot(slot)) {
+            for (LoadInst *load : slotLoads_[slot]) {
+                worklist.push_back(load);
+            }
+            return true;
+        }
+        reject(S, "object pointer stored to untracked memory");
+        return false;
+    } else if (isa<ICmpInst>(U)) {
+        return true;
+    } else if (isa<PHINode>(U) || isa<SelectInst>(U)) {
+        worklist.push_back(U);
+        return true;
+    } else if (auto *call = dyn_cast<CallBase>(U)) {
+        if (auto *intrinsic = dyn_cast<IntrinsicInst>(call)) {
+            switch (intrinsic->getIntrinsicID()) {
+            case Intrinsic::lifetime_start:
+            case Intrinsic::lifetime_end:
+                return true;
+            case Intrinsic::memset: {
+                // Uniform fill of whole objects: same bytes whatever the
+                // field order, once the length follows the new size
+                auto *fill = cast<MemSetInst>(intrinsic);
+                auto *length = dyn_cast<ConstantInt>(fill->getLength());
+                uint64_t size = DL_.getTypeAllocSize(S);
+                if (fill->getDest() != P) {
+                    reject(S, "object pointer is not the memset destination");
+                    return false;
+                }
+                if (!length || length->getZExtValue() % size != 0) {
+                    reject(S, "memset of part of an object");
+                    return false;
+                }
+                accesses_[S].fills.push_back(intrinsic);
+                return true;
+            }
+            default:
+                break;
+            }
+        } else if (isDeallocationCall(call)) {
+            return true;
+        } else if (Function *callee = call->getCalledFunction()) {
+            if (!callee->isDeclaration() && callee->hasLocalLinkage() &&
+                call->getCalledOperand() != P) {
+                // Parameters of internal callees become object pointers
+                for (unsigned i = 0; i < call->arg_size(); i++) {
+                    if (call->getArgOperand(i) == P) {
+                        if (i >= callee->arg_size()) {
+                            reject(S, "object pointer passed as variadic argument");
+                            return false;
+                        }
+                        worklist.push_back(callee->getArg(i));
+                    }
+                }
+                return true;
+            }
+        }
+        reject(S, "object pointer passed to " +
+                  (call->getCalledFunction() ? call->getCalledFunction()->getName().str()
+                                             : std::string("indirect call")));
+        return false;
+    }
+    
+    reject(S, std::string("object pointer used by ") + cast<Instruction>(U)->getOpcodeName());
+    return false;
+}
+
+/**
+ * @brief Identify the memory slot an address refers to
+ * @param address Address of a pointer-sized load or store
+ * @param slot Set to the slot, if known
+ * @return true if the address is a pointer field of a candidate struct
+ *         or a local pointer alloca that does not escape
+ */
+bool StructEscapeAnalysis::getPointerSlot(Value *address, PointerSlot &slot) const {
+    if (auto *gep = dyn_cast<GetElementPtrInst>(address)) {
+        auto *S = dyn_cast<StructType>(gep->getSourceElementType());
+        if (S && candidates_.count(S) && gep->getNumIndices() == 2) {
+            if (auto *field = dyn_cast<ConstantInt>(gep->getOperand(2))) {
+                slot = {S, static_cast<unsigned>(field->getZExtValue())};
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Field 0 accessed straight through an object pointer; the pointer
+    // is recognized by the field accesses made through it
+    for (User *U : address->users()) {
+        auto *gep = dyn_cast<GetElementPtrInst>(U);
+        if (gep && gep->getPointerOperand() == address && gep->getNumIndices() >= 2) {
+            auto *S = dyn_cast<StructType>(gep->getSourceElementType());
+            if (S && candidates_.count(S) && S->getElementType(0)->isPointerTy()) {
+                slot = {S, 0};
+                return true;
+            }
+        }
+    }
+    
+    if (auto *alloca = dyn_cast<AllocaInst>(address)) {
+        if (alloca->getAllocatedType()->isPointerTy() && !alloca->isArrayAllocation()) {
+            for (User *U : alloca->users()) {
+                bool isAccess = (isa<LoadInst>(U)) ||
+                                (isa<StoreInst>(U) && cast<StoreInst>(U)->getValueOperand() != alloca);
+                if (!isAccess) {
+                    return false;
+                }
+            }
+            slot = {alloca, ~0u};
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Check if every access to a pointer slot is visible
+ * @param slot Pointer slot
+ * @return true for local allocas and fields of structs that do not escape
+ */
+bool StructEscapeAnalysis::isTrackedSlot(const PointerSlot &slot) const {
+    if (slot.second == ~0u) {
+        return true;
+    }
+    return !escapeReasons_.count(static_cast<StructType*>(const_cast<void*>(slot.first)));
+}
+
+/**
+ * @brief Count the loads and stores recorded for pointer slots
+ * @return Number of recorded slot accesses
+ */
+size_t StructEscapeAnalysis::countSlotAccesses() const {
+    size_t count = 0;
+    for (auto &entry : slotLoads_) {
+        count += entry.second.size();
+    }
+    for (auto &entry : slotStores_) {
+        count += entry.second.size();
+    }
+    return count;
+}
+
+/**
+ * @brief Reject every candidate struct contained in a type
+ * @param T Type whose layout is fixed by its use
+ * @param reason Why the layout is fixed
+ */
+void StructEscapeAnalysis::rejectTypesIn(Type *T, const std::string &reason) {
+    if (auto *S = dyn_cast<StructType>(T)) {
+        if (candidates_.count(S)) {
+            reject(S, reason);
+        }
+    }
+    for (Type *contained : T->subtypes()) {
+        rejectTypesIn(contained, reason);
+    }
+}
+
+/**
+ * @brief Mark a struct as escaping
+ * @param S Struct type
+ * @param reason Why the layout escapes; the first reason is kept
+ */
+void StructEscapeAnalysis::reject(StructType *S, const std::string &reason) {
+    escapeReasons_.emplace(S, reason);
+}
+
+} // namespace obfuscator
@@ -0,0 +1,214 @@
+/**
+ * @file test_exception_handling.cpp
+ * @brief Integration tests for C++ exception handling across the control flow passes
+ * 
+ * Runs the control flow passes on invokes with catching and cleanup
+ * landing pads, including an invoke whose result feeds a PHI, then
+ * compiles the result for x86-64: the functions must be transformed
+ * rather than skipped, landing pads must stay reachable only through
+ * unwind edges, and the code must keep zero-cost unwind tables.
+ */
+
+#include <gtest/gtest.h>
+#include "utils/pass_pipeline.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/// A catching loop and a cleanup that rethrows, as a C++ front end emits them
+const char *const kExceptionModule = R"(
+target triple = "x86_64-unknown-linux-gnu"
+
+@_ZTIi = external constant i8*
+@cfmt = private constant [12 x i8] c"cleanup %d\0A\00"
+
+declare i8* @__cxa_allocate_exception(i64)
+declare void @__cxa_throw(i8*, i8*, i8*)
+declare i32 @__gxx_personality_v0(...)
+declare i8* @__cxa_begin_catch(i8*)
+declare void @__cxa_end_catch()
+declare i32 @printf(i8*, ...)
+
+define i32 @may_throw(i32 %x) {
+entry:
+  %c = icmp sgt i32 %x, 5
+  br i1 %c, label %throw, label %ok
+throw:
+  %e = call i8* @__cxa_allocate_exception(i64 4)
+  %p = bitcast i8* %e to i32*
+  store i32 %x, i32* %p
+  call void @__cxa_throw(i8* %e, i8* bitcast (i8** @_ZTIi to i8*), i8* null)
+  unreachable
+ok:
+  %r = mul i32 %x, 2
+  ret i32 %r
+}
+
+define i32 @work(i32 %n) personality i8* bitcast (i32 (...)* @__gxx_personality_v0 to i8*) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i1, %next ]
+  %acc = phi i32 [ 0, %entry ], [ %acc1, %next ]
+  %odd = and i32 %i, 1
+  %isodd = icmp ne i32 %odd, 0
+  br i1 %isodd, label %skip, label %call
+call:
+  %r = invoke i32 @may_throw(i32 %i) to label %next unwind label %lpad
+skip:
+  %s = add i32 %i, 0
+  br label %next
+lpad:
+  %lp = landingpad { i8*, i32 } catch i8* bitcast (i8** @_ZTIi to i8*)
+  %exn = extractvalue { i8*, i32 } %lp, 0
+  %b = call i8* @__cxa_begin_catch(i8* %exn)
+  %bp = bitcast i8* %b to i32*
+  %v = load i32, i32* %bp
+  call void @__cxa_end_catch()
+  br label %next
+next:
+  %val = phi i32 [ %r, %call ], [ %s, %skip ], [ %v, %lpad ]
+  %acc1 = add i32 %acc, %val
+  %i1 = add i32 %i, 1
+  %done = icmp eq i32 %i1, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret i32 %acc1
+}
+
+define i32 @guard(i32 %x) personality i8* bitcast (i32 (...)* @__gxx_personality_v0 to i8*) {
+entry:
+  %y = add i32 %x, 1
+  %r = invoke i32 @may_throw(i32 %y) to label %ok unwind label %cleanup
+ok:
+  %q = add i32 %r, %y
+  ret i32 %q
+cleanup:
+  %lp = landingpad { i8*, i32 } cleanup
+  %pc = call i32 (i8*, ...) @printf(i8* getelementptr ([12 x i8], [12 x i8]* @cfmt, i32 0, i32 0), i32 %y)
+  resume { i8*, i32 } %lp
+}
+)";
+
+/**
+ * @class ExceptionHandlingTest
+ * @brief Test fixture running pass lists on the exception handling module
+ */
+class ExceptionHandlingTest : public ::testing::TestWithParam<std::vector<std::string>> {
+protected:
+    void SetUp() override {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmPrinters();
+        
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kExceptionModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Compile the module to x86-64 assembly
+     * @param assembly Set to the assembly text
+     * @return false if no x86-64 target is built in
+     */
+    bool compile(std::string &assembly) {
+        std::string error;
+        const Target *target = TargetRegistry::lookupTarget(module->getTargetTriple(), error);
+        if (!target) {
+            return false;
+        }
+        std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+            module->getTargetTriple(), "x86-64", "", TargetOptions(), Reloc::PIC_));
+        module->setDataLayout(machine->createDataLayout());
+        
+        SmallString<0> buffer;
+        raw_svector_ostream OS(buffer);
+        legacy::PassManager PM;
+        if (machine->addPassesToEmitFile(PM, OS, nullptr, CGFT_AssemblyFile)) {
+            return false;
+        }
+        PM.run(*module);
+        assembly = buffer.str().str();
+        return true;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief Functions with invokes are transformed, and landing pads are
+ *        only entered by unwinding
+ */
+TEST_P(ExceptionHandlingTest, LandingPadsStayOnUnwindEdges) {
+    std::string error;
+    ASSERT_TRUE(obfuscator::runObfuscationPasses(*module, GetParam(), error)) << error;
+    ASSERT_FALSE(verifyModule(*module, &errs()));
+    
+    unsigned landingPads = 0;
+    for (const char *name : {"work", "guard"}) {
+        Function *F = module->getFunction(name);
+        ASSERT_TRUE(F);
+        EXPECT_GT(F->size(), 3u) << name << " was not transformed";
+        for (BasicBlock &BB : *F) {
+            if (!BB.isLandingPad()) {
+                continue;
+            }
+            landingPads++;
+            for (BasicBlock *pred : predecessors(&BB)) {
+                auto *invoke = dyn_cast<InvokeInst>(pred->getTerminator());
+                EXPECT_TRUE(invoke && invoke->getUnwindDest() == &BB)
+                    << "landing pad in " << name << " entered from a normal edge";
+            }
+        }
+    }
+    EXPECT_EQ(landingPads, 2u);
+}
+
+/**
+ * @brief The code generator still emits table-driven unwinding
+ */
+TEST_P(ExceptionHandlingTest, UnwindTablesSurvive) {
+    std::string error;
+    ASSERT_TRUE(obfuscator::runObfuscationPasses(*module, GetParam(), error)) << error;
+    
+    std::string assembly;
+    if (!compile(assembly)) {
+        GTEST_SKIP() << "x86-64 code generator not available";
+    }
+    EXPECT_NE(assembly.find(".cfi_personality"), std::string::npos) << assembly;
+    EXPECT_NE(assembly.find("GCC_except_table"), std::string::npos) << assembly;
+    EXPECT_EQ(assembly.find("SjLj"), std::string::npos) << assembly;
+}
+
+INSTANTIATE_TEST_SUITE_P(ControlFlowPasses, ExceptionHandlingTest, ::testing::Values(
+    std::vector<std::string>{"flattening"},
+    std::vector<std::string>{"bogus-control-flow", "flattening"},
+    obfuscator::getDefaultPassPipeline()));
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,240 @@
+/**
+ * @file test_tail_calls.cpp
+ * @brief Integration tests for tail calls across the control flow passes
+ * 
+ * Runs the control flow passes on sibling calls, continuation-passing
+ * musttail calls and tail calls that share one return block, then
+ * compiles the result for x86-64: every tail call must still end in
+ * its own ret in the IR and come out as a jump in the machine code.
+ */
+
+#include <gtest/gtest.h>
+#include "utils/llvm_utils.h"
+#include "utils/pass_pipeline.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/// Four tail calls: two into a shared return, one sibling call, one musttail
+const char *const kTailCallModule = R"(
+target triple = "x86_64-unknown-linux-gnu"
+
+declare i32 @odd(i32)
+declare void @sink(i32)
+
+define i32 @even(i32 %n) {
+entry:
+  %c = icmp eq i32 %n, 0
+  br i1 %c, label %yes, label %rec
+rec:
+  %m = sub i32 %n, 1
+  %k = mul i32 %m, 3
+  %r = tail call i32 @odd(i32 %k)
+  br label %done
+yes:
+  %z = add i32 %n, 7
+  %y = mul i32 %z, 5
+  br label %done
+done:
+  %p = phi i32 [ %y, %yes ], [ %r, %rec ]
+  ret i32 %p
+}
+
+define i32 @cps(i32 %n, i32 %acc) {
+entry:
+  %c = icmp eq i32 %n, 0
+  br i1 %c, label %out, label %more
+more:
+  %m = sub i32 %n, 1
+  %a = add i32 %acc, %n
+  %a2 = mul i32 %a, 3
+  %r = musttail call i32 @cps(i32 %m, i32 %a2)
+  ret i32 %r
+out:
+  %o = add i32 %acc, 1
+  %o2 = mul i32 %o, 7
+  ret i32 %o2
+}
+
+define void @report(i32 %n) {
+entry:
+  %c = icmp sgt i32 %n, 10
+  br i1 %c, label %big, label %small
+big:
+  %b = mul i32 %n, 2
+  %b2 = add i32 %b, 1
+  tail call void @sink(i32 %b2)
+  br label %done
+small:
+  %s = add i32 %n, 3
+  %s2 = mul i32 %s, 5
+  tail call void @sink(i32 %s2)
+  br label %done
+done:
+  ret void
+}
+)";
+
+/**
+ * @class TailCallTest
+ * @brief Test fixture running pass lists on the tail call module
+ */
+class TailCallTest : public ::testing::TestWithParam<std::vector<std::string>> {
+protected:
+    void SetUp() override {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmPrinters();
+        
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kTailCallModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Compile the module to x86-64 assembly
+     * @param assembly Set to the assembly text
+     * @return false if no x86-64 target is built in
+     */
+    bool compile(std::string &assembly) {
+        std::string error;
+        const Target *target = TargetRegistry::lookupTarget(module->getTargetTriple(), error);
+        if (!target) {
+            return false;
+        }
+        std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+            module->getTargetTriple(), "x86-64", "", TargetOptions(), Reloc::PIC_));
+        module->setDataLayout(machine->createDataLayout());
+        
+        SmallString<0> buffer;
+        raw_svector_ostream OS(buffer);
+        legacy::PassManager PM;
+        if (machine->addPassesToEmitFile(PM, OS, nullptr, CGFT_AssemblyFile)) {
+            return false;
+        }
+        PM.run(*module);
+        assembly = buffer.str().str();
+        return true;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief Count the occurrences of a string
+ * @param text Text to search
+ * @param needle String to count
+ * @return Number of non-overlapping occurrences
+ */
+unsigned countOccurrences(const std::string &text, const std::string &needle) {
+    unsigned count = 0;
+    for (size_t pos = text.find(needle); pos != std::string::npos;
+         pos = text.find(needle, pos + needle.size())) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Tail calls stay directly in front of their return
+ */
+TEST_P(TailCallTest, ReturnFollowsTailCall) {
+    std::string error;
+    ASSERT_TRUE(obfuscator::runObfuscationPasses(*module, GetParam(), error)) << error;
+    ASSERT_FALSE(verifyModule(*module, &errs()));
+    
+    unsigned tailCalls = 0;
+    for (Function &F : *module) {
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                auto *call = dyn_cast<CallInst>(&I);
+                if (call && call->isTailCall()) {
+                    tailCalls++;
+                    EXPECT_TRUE(isa<ReturnInst>(call->getNextNonDebugInstruction()))
+                        << "tail call in " << F.getName().str() << " no longer returns directly";
+                }
+            }
+        }
+    }
+    EXPECT_EQ(tailCalls, 4u);
+}
+
+/**
+ * @brief Tail calls come out of the code generator as jumps
+ */
+TEST_P(TailCallTest, TailCallsReachMachineCode) {
+    std::string error;
+    ASSERT_TRUE(obfuscator::runObfuscationPasses(*module, GetParam(), error)) << error;
+    
+    std::string assembly;
+    if (!compile(assembly)) {
+        GTEST_SKIP() << "x86-64 code generator not available";
+    }
+    EXPECT_EQ(countOccurrences(assembly, "\tjmp\todd@PLT"), 1u) << assembly;
+    EXPECT_EQ(countOccurrences(assembly, "\tjmp\tcps@PLT"), 1u) << assembly;
+    EXPECT_EQ(countOccurrences(assembly, "\tjmp\tsink@PLT"), 2u) << assembly;
+    EXPECT_EQ(countOccurrences(assembly, "call"), 0u) << assembly;
+}
+
+/**
+ * @brief Return blocks that were dead before are kept and not counted
+ */
+TEST(TailCallReturnTest, KeepsReturnsItDidNotEmpty) {
+    LLVMContext context;
+    SMDiagnostic diagnostic;
+    std::unique_ptr<Module> module = parseAssemblyString(R"(
+declare void @sink(i32)
+
+define void @once(i32 %n) {
+entry:
+  tail call void @sink(i32 %n)
+  br label %done
+done:
+  ret void
+dead:
+  ret void
+}
+)", diagnostic, context);
+    ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    
+    Function *F = module->getFunction("once");
+    EXPECT_EQ(obfuscator::duplicateReturnsForTailCalls(*F), 1u);
+    EXPECT_EQ(F->size(), 2u);
+    EXPECT_TRUE(isa<ReturnInst>(F->getEntryBlock().getTerminator()));
+    EXPECT_EQ(F->back().getName(), "dead");
+    EXPECT_FALSE(verifyFunction(*F, &errs()));
+}
+
+INSTANTIATE_TEST_SUITE_P(ControlFlowPasses, TailCallTest, ::testing::Values(
+    std::vector<std::string>{"flattening"},
+    std::vector<std::string>{"bogus-control-flow"},
+    std::vector<std::string>{"opaque-predicates"},
+    obfuscator::getDefaultPassPipeline()));
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
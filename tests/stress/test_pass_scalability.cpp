@@ -0,0 +1,434 @@
+/**
+ * @file test_pass_scalability.cpp
+ * @brief Scalability stress tests for the obfuscation passes
+ * 
+ * Runs each pass on generated functions of the shapes generated code
+ * produces: 100k-block functions, 10k-case switches, deeply nested
+ * loops and modules with 1M string literals. Every case is measured
+ * at 1/8, 1/4, 1/2 and full size; the fitted log-log slope of time
+ * and allocated bytes against input size must stay linear, and the
+ * full size must stay inside the recorded budget.
+ * 
+ * OBFUSCATOR_STRESS_SCALE=N divides every size by N for quick runs.
+ * Link with allocation_hook.cpp to check memory as well as time.
+ */
+
+#include <gtest/gtest.h>
+#include "utils/pass_profiler.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/// Largest fitted log-log slope accepted for allocated bytes, which are exact
+const double kMaxMemorySlope = 1.15;
+
+/// Largest fitted log-log slope accepted for time, which is noisy
+const double kMaxTimeSlope = 1.35;
+
+/// Below this the timings are too noisy to fit
+const double kMinFittedSeconds = 0.05;
+
+using Generator = std::function<std::unique_ptr<Module>(LLVMContext&, unsigned)>;
+
+/**
+ * @brief Generate a function of n blocks with diamonds and cross-block values
+ * @param context Context to create the module in
+ * @param n Number of blocks
+ * @return Module with one function
+ * 
+ * Block i branches to i+1 and i+2, so every block from the third on
+ * starts with a two-input PHI; the last one falls through to the exit.
+ */
+std::unique_ptr<Module> makeBlockChain(LLVMContext &context, unsigned n) {
+    auto M = std::make_unique<Module>("block_chain", context);
+    IRBuilder<> builder(context);
+    Type *i32 = builder.getInt32Ty();
+    Function *F = Function::Create(FunctionType::get(i32, {i32}, false),
+                                   GlobalValue::ExternalLinkage, "chain", *M);
+    Value *x = F->getArg(0);
+    
+    BasicBlock *entry = BasicBlock::Create(context, "entry", F);
+    std::vector<BasicBlock*> blocks;
+    for (unsigned i = 0; i < n; i++) {
+        blocks.push_back(BasicBlock::Create(context, "b" + std::to_string(i), F));
+    }
+    BasicBlock *exit = BasicBlock::Create(context, "exit", F);
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(blocks[0]);
+    
+    std::vector<PHINode*> phis(n, nullptr);
+    std::vector<Value*> values(n);
+    for (unsigned i = 0; i < n; i++) {
+        builder.SetInsertPoint(blocks[i]);
+        Value *in = x;
+        if (i >= 2) {
+            phis[i] = builder.CreatePHI(i32, 2, "in");
+            in = phis[i];
+        } else if (i == 1) {
+            in = values[0];
+        }
+        Value *sum = builder.CreateAdd(in, builder.getInt32(i), "sum");
+        Value *product = builder.CreateMul(sum, x, "product");
+        values[i] = builder.CreateXor(product, builder.getInt32(i * 7), "value");
+        if (i + 1 == n) {
+            builder.CreateBr(exit);
+            continue;
+        }
+        Value *condition = builder.CreateICmpSLT(values[i], x, "cond");
+        BasicBlock *skip = i + 2 < n ? blocks[i + 2] : exit;
+        builder.CreateCondBr(condition, blocks[i + 1], skip);
+    }
+    for (unsigned i = 2; i < n; i++) {
+        phis[i]->addIncoming(values[i - 1], blocks[i - 1]);
+        phis[i]->addIncoming(values[i - 2], blocks[i - 2]);
+    }
+    
+    builder.SetInsertPoint(exit);
+    PHINode *result = builder.CreatePHI(i32, 2, "result");
+    result->addIncoming(values[n - 1], blocks[n - 1]);
+    if (n >= 2) {
+        result->addIncoming(values[n - 2], blocks[n - 2]);
+    }
+    builder.CreateRet(result);
+    return M;
+}
+
+/**
+ * @brief Generate a switch with n cases joined by one PHI
+ * @param context Context to create the module in
+ * @param n Number of cases
+ * @return Module with one function
+ */
+std::unique_ptr<Module> makeSwitch(LLVMContext &context, unsigned n) {
+    auto M = std::make_unique<Module>("switch", context);
+    IRBuilder<> builder(context);
+    Type *i32 = builder.getInt32Ty();
+    Function *F = Function::Create(FunctionType::get(i32, {i32}, false),
+                                   GlobalValue::ExternalLinkage, "dispatch", *M);
+    Value *x = F->getArg(0);
+    
+    BasicBlock *entry = BasicBlock::Create(context, "entry", F);
+    BasicBlock *fallback = BasicBlock::Create(context, "default", F);
+    BasicBlock *exit = BasicBlock::Create(context, "exit", F);
+    builder.SetInsertPoint(entry);
+    SwitchInst *switchInst = builder.CreateSwitch(x, fallback, n);
+    
+    builder.SetInsertPoint(exit);
+    PHINode *result = builder.CreatePHI(i32, n + 1, "result");
+    builder.CreateRet(result);
+    
+    builder.SetInsertPoint(fallback);
+    result->addIncoming(builder.CreateSub(x, builder.getInt32(1), "none"), fallback);
+    builder.CreateBr(exit);
+    
+    for (unsigned i = 0; i < n; i++) {
+        BasicBlock *caseBlock = BasicBlock::Create(context, "case" + std::to_string(i), F, exit);
+        switchInst->addCase(builder.getInt32(i), caseBlock);
+        builder.SetInsertPoint(caseBlock);
+        Value *scaled = builder.CreateMul(x, builder.getInt32(i + 3), "scaled");
+        Value *value = builder.CreateAdd(scaled, builder.getInt32(i), "value");
+        result->addIncoming(value, caseBlock);
+        builder.CreateBr(exit);
+    }
+    return M;
+}
+
+/**
+ * @brief Generate loops nested n deep around an accumulator update
+ * @param context Context to create the module in
+ * @param n Nesting depth
+ * @return Module with one function
+ * 
+ * Each level has a header with an induction PHI, a latch and an exit,
+ * and the accumulator is carried through every level by PHIs.
+ */
+std::unique_ptr<Module> makeNestedLoops(LLVMContext &context, unsigned n) {
+    auto M = std::make_unique<Module>("nested_loops", context);
+    IRBuilder<> builder(context);
+    Type *i32 = builder.getInt32Ty();
+    Function *F = Function::Create(FunctionType::get(i32, {i32}, false),
+                                   GlobalValue::ExternalLinkage, "nest", *M);
+    Value *bound = F->getArg(0);
+    
+    BasicBlock *entry = BasicBlock::Create(context, "entry", F);
+    builder.SetInsertPoint(entry);
+    
+    // Open the loops outside in
+    struct Level {
+        BasicBlock *preheader, *header, *latch, *exit;
+        PHINode *induction, *accumulator;
+    };
+    std::vector<Level> levels(n);
+    BasicBlock *outside = entry;
+    Value *accumulator = builder.getInt32(0);
+    for (unsigned d = 0; d < n; d++) {
+        Level &level = levels[d];
+        std::string suffix = std::to_string(d);
+        level.preheader = outside;
+        level.header = BasicBlock::Create(context, "header" + suffix, F);
+        level.latch = BasicBlock::Create(context, "latch" + suffix, F);
+        level.exit = BasicBlock::Create(context, "exit" + suffix, F);
+        builder.CreateBr(level.header);
+        
+        builder.SetInsertPoint(level.header);
+        level.induction = builder.CreatePHI(i32, 2, "i" + suffix);
+        level.accumulator = builder.CreatePHI(i32, 2, "acc" + suffix);
+        level.induction->addIncoming(builder.getInt32(0), outside);
+        level.accumulator->addIncoming(accumulator, outside);
+        Value *more = builder.CreateICmpSLT(level.induction, bound, "more" + suffix);
+        BasicBlock *body = BasicBlock::Create(context, "body" + suffix, F);
+        builder.CreateCondBr(more, body, level.exit);
+        
+        builder.SetInsertPoint(body);
+        accumulator = level.accumulator;
+        outside = body;
+    }
+    
+    // Innermost body, then close the loops inside out
+    Value *step = builder.CreateAdd(accumulator, levels[n - 1].induction, "step");
+    accumulator = builder.CreateMul(step, builder.getInt32(3), "update");
+    for (unsigned d = n; d-- > 0;) {
+        Level &level = levels[d];
+        builder.CreateBr(level.latch);
+        builder.SetInsertPoint(level.latch);
+        Value *next = builder.CreateAdd(level.induction, builder.getInt32(1), "next");
+        level.induction->addIncoming(next, level.latch);
+        level.accumulator->addIncoming(accumulator, level.latch);
+        builder.CreateBr(level.header);
+        
+        builder.SetInsertPoint(level.exit);
+        accumulator = level.accumulator;
+    }
+    builder.CreateRet(accumulator);
+    return M;
+}
+
+/**
+ * @brief Generate n short private string literals, each passed to puts
+ * @param context Context to create the module in
+ * @param n Number of literals
+ * @return Module with one function per 1000 literals
+ */
+std::unique_ptr<Module> makeStringLiterals(LLVMContext &context, unsigned n) {
+    auto M = std::make_unique<Module>("string_literals", context);
+    IRBuilder<> builder(context);
+    Type *i8Ptr = builder.getInt8PtrTy();
+    FunctionCallee puts = M->getOrInsertFunction(
+        "puts", FunctionType::get(builder.getInt32Ty(), {i8Ptr}, false));
+    
+    const unsigned perFunction = 1000;
+    for (unsigned first = 0; first < n; first += perFunction) {
+        Function *F = Function::Create(FunctionType::get(builder.getVoidTy(), false),
+                                       GlobalValue::ExternalLinkage,
+                                       "print" + std::to_string(first / perFunction), *M);
+        builder.SetInsertPoint(BasicBlock::Create(context, "entry", F));
+        for (unsigned i = first; i < n && i < first + perFunction; i++) {
+            Constant *text = ConstantDataArray::getString(context, "literal " + std::to_string(i));
+            auto *literal = new GlobalVariable(*M, text->getType(), true,
+                                               GlobalValue::PrivateLinkage, text, ".str");
+            
+            // An instruction, as the frontend emits at -O0; IRBuilder would fold it
+            Value *zero = builder.getInt64(0);
+            Instruction *address = GetElementPtrInst::CreateInBounds(
+                text->getType(), literal, {zero, zero}, "text");
+            builder.Insert(address);
+            builder.CreateCall(puts, {builder.CreatePointerCast(address, i8Ptr)});
+        }
+        builder.CreateRetVoid();
+    }
+    return M;
+}
+
+/**
+ * @struct StressCase
+ * @brief One pass on one input shape, with its recorded budget
+ */
+struct StressCase {
+    const char *pass;         ///< Registered pass name
+    const char *shape;        ///< Input shape
+    Generator generate;       ///< Builds the input at a given size
+    unsigned fullSize;        ///< Size of the full-size input
+    double secondsBudget;     ///< Time allowed at full size
+    double bytesPerUnit;      ///< Heap allocations allowed per unit of size
+};
+
+/**
+ * @brief Print a case name for gtest
+ */
+std::ostream &operator<<(std::ostream &OS, const StressCase &stressCase) {
+    return OS << stressCase.pass << "/" << stressCase.shape;
+}
+
+/**
+ * @struct Measurement
+ * @brief Cost of one pass run
+ */
+struct Measurement {
+    double seconds = 0;
+    uint64_t allocatedBytes = 0;
+};
+
+/**
+ * @brief Run one registered pass on a module and measure it
+ * @param M Module to transform
+ * @param passName Registered pass name
+ * @return Time and bytes allocated by the run
+ */
+Measurement runPass(Module &M, const char *passName) {
+    const PassInfo *info = PassRegistry::getPassRegistry()->getPassInfo(StringRef(passName));
+    EXPECT_NE(info, nullptr) << "pass " << passName << " is not linked in";
+    Measurement measurement;
+    if (!info) {
+        return measurement;
+    }
+    
+    legacy::PassManager PM;
+    PM.add(info->createPass());
+    obfuscator::AllocationCounters before = obfuscator::getThreadAllocationCounters();
+    auto start = std::chrono::steady_clock::now();
+    PM.run(M);
+    measurement.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    measurement.allocatedBytes = obfuscator::getThreadAllocationCounters().allocatedBytes -
+                                 before.allocatedBytes;
+    return measurement;
+}
+
+/**
+ * @brief Fit y = a * x^k by least squares in log-log space
+ * @param x Input sizes
+ * @param y Costs
+ * @return The exponent k: 1 is linear, 2 quadratic
+ */
+double fitSlope(const std::vector<double> &x, const std::vector<double> &y) {
+    double meanX = 0, meanY = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        meanX += std::log(x[i]) / x.size();
+        meanY += std::log(std::max(y[i], 1e-9)) / y.size();
+    }
+    double covariance = 0, variance = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        double dx = std::log(x[i]) - meanX;
+        covariance += dx * (std::log(std::max(y[i], 1e-9)) - meanY);
+        variance += dx * dx;
+    }
+    return covariance / variance;
+}
+
+/**
+ * @brief Get the divisor applied to every size
+ * @return OBFUSCATOR_STRESS_SCALE, or 1
+ */
+unsigned getScaleDivisor() {
+    const char *scale = std::getenv("OBFUSCATOR_STRESS_SCALE");
+    int divisor = scale ? std::atoi(scale) : 1;
+    return divisor > 0 ? divisor : 1;
+}
+
+/**
+ * @class PassScalabilityTest
+ * @brief Test fixture: one pass on one input shape
+ */
+class PassScalabilityTest : public ::testing::TestWithParam<StressCase> {};
+
+/**
+ * @brief Test that cost grows linearly and stays inside the budget
+ */
+TEST_P(PassScalabilityTest, ScalesLinearlyWithinBudget) {
+    const StressCase &stressCase = GetParam();
+    unsigned divisor = getScaleDivisor();
+    unsigned fullSize = std::max(16u, stressCase.fullSize / divisor);
+    bool countsAllocations = obfuscator::getThreadAllocationCounters().allocations > 0;
+    
+    std::vector<double> sizes, seconds, bytes;
+    for (unsigned step = 0; step < 4; step++) {
+        unsigned size = fullSize >> (3 - step);
+        LLVMContext context;
+        std::unique_ptr<Module> M = stressCase.generate(context, size);
+        ASSERT_FALSE(verifyModule(*M, &errs())) << "generator produced broken IR";
+        
+        Measurement measurement = runPass(*M, stressCase.pass);
+        EXPECT_FALSE(verifyModule(*M, &errs())) << "pass broke the IR at size " << size;
+        
+        sizes.push_back(size);
+        seconds.push_back(measurement.seconds);
+        bytes.push_back(static_cast<double>(measurement.allocatedBytes));
+        RecordProperty("size" + std::to_string(step), std::to_string(size));
+        RecordProperty("seconds" + std::to_string(step), std::to_string(measurement.seconds));
+        RecordProperty("bytes" + std::to_string(step), std::to_string(measurement.allocatedBytes));
+    }
+    
+    // Budgets are for full size; scaled-down runs get a proportional share
+    double budgetShare = static_cast<double>(fullSize) / stressCase.fullSize;
+    EXPECT_LE(seconds.back(), stressCase.secondsBudget * std::max(budgetShare, 0.1))
+        << "over the time budget at size " << fullSize;
+    if (seconds.back() >= kMinFittedSeconds) {
+        EXPECT_LE(fitSlope(sizes, seconds), kMaxTimeSlope) << "time grows superlinearly";
+    }
+    if (countsAllocations) {
+        EXPECT_LE(bytes.back(), stressCase.bytesPerUnit * fullSize)
+            << "over the memory budget at size " << fullSize;
+        EXPECT_LE(fitSlope(sizes, bytes), kMaxMemorySlope) << "memory grows superlinearly";
+    }
+}
+
+// Budgets: measured full-size cost with roughly 4x headroom
+INSTANTIATE_TEST_SUITE_P(
+    BlockChain, PassScalabilityTest,
+    ::testing::Values(
+        StressCase{"flattening", "100k-blocks", makeBlockChain, 100000, 4.0, 5120},
+        StressCase{"bogus-control-flow", "100k-blocks", makeBlockChain, 100000, 1.0, 1024},
+        StressCase{"opaque-predicates", "100k-blocks", makeBlockChain, 100000, 1.0, 640},
+        StressCase{"block-splitting", "100k-blocks", makeBlockChain, 100000, 1.0, 1024},
+        StressCase{"instruction-substitution", "100k-blocks", makeBlockChain, 100000, 1.0, 1024}));
+
+INSTANTIATE_TEST_SUITE_P(
+    Switch, PassScalabilityTest,
+    ::testing::Values(
+        StressCase{"flattening", "10k-case-switch", makeSwitch, 10000, 0.25, 2560},
+        StressCase{"bogus-control-flow", "10k-case-switch", makeSwitch, 10000, 0.25, 1024},
+        StressCase{"opaque-predicates", "10k-case-switch", makeSwitch, 10000, 0.25, 640}));
+
+INSTANTIATE_TEST_SUITE_P(
+    NestedLoops, PassScalabilityTest,
+    ::testing::Values(
+        StressCase{"flattening", "1k-deep-loops", makeNestedLoops, 1000, 0.25, 20480},
+        StressCase{"bogus-control-flow", "1k-deep-loops", makeNestedLoops, 1000, 0.25, 1024},
+        StressCase{"opaque-predicates", "1k-deep-loops", makeNestedLoops, 1000, 0.25, 1280}));
+
+INSTANTIATE_TEST_SUITE_P(
+    StringLiterals, PassScalabilityTest,
+    ::testing::Values(
+        // Measured 5.5 s and 928 B per literal (-O1 -g, allocation hook,
+        // usable sizes): page layout and a guard per function; 2x headroom
+        StressCase{"string-encryption", "1M-literals", makeStringLiterals, 1000000, 11.0, 1856},
+        StressCase{"stack-strings", "1M-literals", makeStringLiterals, 1000000, 60.0, 8192}));
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
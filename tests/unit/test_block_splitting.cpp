@@ -0,0 +1,263 @@
+/**
+ * @file test_block_splitting.cpp
+ * @brief Unit tests for the block splitting pass
+ * 
+ * Runs the pass on a function with long cold blocks and a hot loop,
+ * checks where it cuts, and counts the dispatcher states flattening
+ * builds with and without it.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <memory>
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+/// A long straight-line prologue, a hot loop with a long body and a
+/// long epilogue ending in a compare
+const char *const kSplittingModule = R"(
+define i64 @mix(ptr %values, i64 %n, i64 %a, i64 %b) {
+entry:
+  %x0 = add i64 %a, %b
+  %x1 = mul i64 %x0, 3
+  %x2 = xor i64 %x1, %a
+  %x3 = sub i64 %x2, %b
+  %x4 = or i64 %x3, 17
+  %x5 = and i64 %x4, 4095
+  %x6 = mul i64 %x5, %x0
+  %x7 = xor i64 %x6, 12345
+  %x8 = add i64 %x7, %x2
+  %x9 = lshr i64 %x8, 3
+  %x10 = add i64 %x9, 99
+  %x11 = mul i64 %x10, 7
+  %x12 = xor i64 %x11, %x9
+  %x13 = sub i64 %x12, 5
+  %x14 = add i64 %x13, %x0
+  %x15 = mul i64 %x14, 11
+  %empty = icmp eq i64 %n, 0
+  br i1 %empty, label %done, label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ %x15, %entry ], [ %acc.next, %loop ]
+  %p = getelementptr inbounds i64, ptr %values, i64 %i
+  %v = load i64, ptr %p
+  %l1 = mul i64 %v, 3
+  %l2 = add i64 %l1, %acc
+  %l3 = xor i64 %l2, %i
+  %l4 = lshr i64 %l3, 1
+  %l5 = add i64 %l4, %v
+  %l6 = mul i64 %l5, 5
+  %l7 = xor i64 %l6, %l1
+  %l8 = sub i64 %l7, %i
+  %l9 = or i64 %l8, 1
+  %acc.next = add i64 %acc, %l9
+  %i.next = add i64 %i, 1
+  %more = icmp ult i64 %i.next, %n
+  br i1 %more, label %loop, label %done
+done:
+  %r = phi i64 [ %x15, %entry ], [ %acc.next, %loop ]
+  %y0 = mul i64 %r, 31
+  %y1 = add i64 %y0, %a
+  %y2 = xor i64 %y1, %b
+  %y3 = lshr i64 %y2, 7
+  %y4 = add i64 %y3, %y0
+  %y5 = mul i64 %y4, 13
+  %y6 = xor i64 %y5, %y1
+  %y7 = sub i64 %y6, %y2
+  %y8 = and i64 %y7, 65535
+  %y9 = add i64 %y8, %x15
+  %big = icmp ugt i64 %y9, 1000
+  br i1 %big, label %clamp, label %exit
+clamp:
+  br label %exit
+exit:
+  %s = phi i64 [ 1000, %clamp ], [ %y9, %done ]
+  ret i64 %s
+}
+)";
+
+/**
+ * @class BlockSplittingTest
+ * @brief Test fixture running block splitting and flattening on the module
+ */
+class BlockSplittingTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        parseModule();
+    }
+    
+    void TearDown() override {
+        setGranularity(nullptr);
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the module
+     */
+    void parseModule() {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kSplittingModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Override the granularity as -block-splitting-granularity would
+     * @param value Granularity, or null to drop the override
+     */
+    void setGranularity(const char *value) {
+        auto *option = static_cast<cl::opt<unsigned>*>(
+            cl::getRegisteredOptions().lookup("block-splitting-granularity"));
+        ASSERT_NE(option, nullptr);
+        if (value) {
+            ASSERT_FALSE(option->addOccurrence(0, "block-splitting-granularity", value));
+        } else {
+            option->reset();
+        }
+    }
+    
+    /**
+     * @brief Run a pipeline through the new pass manager
+     * @param pipeline Textual pass pipeline
+     */
+    void run(StringRef pipeline) {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, pipeline);
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+    }
+    
+    /**
+     * @brief Count the blocks split off a block
+     * @param name Name of the original block
+     * @return Pieces after the first
+     */
+    unsigned countPieces(StringRef name) {
+        unsigned pieces = 0;
+        for (BasicBlock &BB : *module->getFunction("mix")) {
+            pieces += BB.getName().startswith((name + ".split").str());
+        }
+        return pieces;
+    }
+    
+    /**
+     * @brief Count the states of the flattened function's dispatcher
+     * @return Cases of the largest switch
+     */
+    unsigned countStates() {
+        unsigned states = 0;
+        for (BasicBlock &BB : *module->getFunction("mix")) {
+            if (auto *dispatch = dyn_cast<SwitchInst>(BB.getTerminator())) {
+                states = std::max(states, dispatch->getNumCases());
+            }
+        }
+        return states;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief The blocks running once per call are split
+ */
+TEST_F(BlockSplittingTest, SplitsColdBlocks) {
+    run("block-splitting");
+    EXPECT_GT(countPieces("entry"), 0u);
+    EXPECT_GT(countPieces("done"), 0u);
+    for (BasicBlock &BB : *module->getFunction("mix")) {
+        EXPECT_FALSE(BB.empty()) << BB.getName().str();
+    }
+}
+
+/**
+ * @brief The loop body runs too often to pay for a dispatch
+ */
+TEST_F(BlockSplittingTest, KeepsHotLoopsWhole) {
+    unsigned loopSize = 0;
+    for (BasicBlock &BB : *module->getFunction("mix")) {
+        if (BB.getName() == "loop") {
+            loopSize = BB.size();
+        }
+    }
+    run("block-splitting");
+    EXPECT_EQ(countPieces("loop"), 0u);
+    for (BasicBlock &BB : *module->getFunction("mix")) {
+        if (BB.getName() == "loop") {
+            EXPECT_EQ(BB.size(), loopSize);
+        }
+    }
+}
+
+/**
+ * @brief Compares stay in the block of the branch that uses them
+ */
+TEST_F(BlockSplittingTest, KeepsComparesWithBranches) {
+    setGranularity("2");
+    run("block-splitting");
+    EXPECT_GT(countPieces("done"), 0u);
+    for (BasicBlock &BB : *module->getFunction("mix")) {
+        auto *branch = dyn_cast<BranchInst>(BB.getTerminator());
+        if (branch && branch->isConditional()) {
+            auto *compare = dyn_cast<CmpInst>(branch->getCondition());
+            ASSERT_NE(compare, nullptr);
+            EXPECT_EQ(compare->getParent(), &BB) << BB.getName().str();
+        }
+    }
+}
+
+/**
+ * @brief Splitting gives flattening more states, and a finer
+ * granularity more still
+ */
+TEST_F(BlockSplittingTest, AddsFlatteningStates) {
+    run("flattening");
+    unsigned flattened = countStates();
+    
+    parseModule();
+    run("block-splitting,flattening");
+    unsigned split = countStates();
+    EXPECT_GT(split, flattened);
+    
+    parseModule();
+    setGranularity("3");
+    run("block-splitting,flattening");
+    EXPECT_GT(countStates(), split);
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
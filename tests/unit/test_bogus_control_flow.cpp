@@ -11,9 +11,9 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/IRBuilder.h"
-
-// TODO: Include the actual pass header when implemented
-// #include "passes/control_flow/bogus_control_flow.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "passes/pass_plugin.h"
 
 using namespace llvm;
 
@@ -61,10 +61,46 @@ TEST_F(BogusControlFlowTest, BasicFunctionCreation) {
 
 /**
  * @brief Test pass application
+ */
 TEST_F(BogusControlFlowTest, PassApplication) {
-    // TODO: Implement test for pass application
-    // This will be implemented when the actual pass is ready
-    SUCCEED();
+    // int f(int x) { return x > 0 ? x * 2 + 1 : (x - 1) ^ 5; }
+    FunctionType *funcType = FunctionType::get(Type::getInt32Ty(*context),
+                                               {Type::getInt32Ty(*context)}, false);
+    Function *func = Function::Create(funcType, GlobalValue::ExternalLinkage, "test_func", *module);
+    BasicBlock *entry = BasicBlock::Create(*context, "entry", func);
+    BasicBlock *positive = BasicBlock::Create(*context, "positive", func);
+    BasicBlock *other = BasicBlock::Create(*context, "other", func);
+    IRBuilder<> builder(entry);
+    Value *x = func->getArg(0);
+    builder.CreateCondBr(builder.CreateICmpSGT(x, builder.getInt32(0)), positive, other);
+    builder.SetInsertPoint(positive);
+    Value *doubled = builder.CreateMul(x, builder.getInt32(2));
+    builder.CreateRet(builder.CreateAdd(doubled, builder.getInt32(1)));
+    builder.SetInsertPoint(other);
+    Value *decremented = builder.CreateSub(x, builder.getInt32(1));
+    builder.CreateRet(builder.CreateXor(decremented, builder.getInt32(5)));
+    size_t blocksBefore = func->size();
+    
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    obfuscator::registerObfuscationPasses(PB);
+    
+    ModulePassManager MPM;
+    Error error = PB.parsePassPipeline(MPM, "bogus-control-flow");
+    ASSERT_FALSE(error) << toString(std::move(error));
+    MPM.run(*module, MAM);
+    
+    // Bogus blocks were added and the function is still valid
+    EXPECT_GT(func->size(), blocksBefore);
+    EXPECT_FALSE(verifyFunction(*func, &errs()));
 }
 
 } // anonymous namespace
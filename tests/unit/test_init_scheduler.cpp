@@ -0,0 +1,194 @@
+/**
+ * @file test_init_scheduler.cpp
+ * @brief Unit tests for the obfuscation runtime's init scheduler
+ * 
+ * Places one task of each mode in the "obf_init" section, as the
+ * passes do, and checks when each runs, that concurrent first uses
+ * run a task once, and what the report prints. The report is asked
+ * for before the runtime's constructor reads the environment.
+ */
+
+#include <gtest/gtest.h>
+#include "runtime/obfuscation_runtime.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<int> eagerRuns{0};
+std::atomic<int> lazyRuns{0};
+std::atomic<int> backgroundRuns{0};
+std::atomic<int> contendedRuns{0};
+std::atomic<int> measuredRuns{0};
+std::atomic<int> pagedRuns{0};
+int eagerRunsAtMain = -1;
+
+/// Written by the contended task, read by every thread waiting for it
+uint64_t contendedResult = 0;
+
+/**
+ * @brief Task body counting its runs
+ * @param arg Counter
+ */
+void countRun(void *arg) {
+    static_cast<std::atomic<int>*>(arg)->fetch_add(1);
+}
+
+/**
+ * @brief Task body slow enough for other threads to find it running
+ * @param arg Counter
+ */
+void slowRun(void *arg) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    contendedResult = 42;
+    countRun(arg);
+}
+
+#define OBF_INIT_TASK __attribute__((section("obf_init"), used, aligned(8)))
+
+OBF_INIT_TASK obf_init_task eagerTask = {countRun, &eagerRuns, "eager-test", OBF_INIT_EAGER,
+                                         OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task lazyTask = {countRun, &lazyRuns, "lazy-test", OBF_INIT_LAZY,
+                                        OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task backgroundTask = {countRun, &backgroundRuns, "background-test",
+                                              OBF_INIT_BACKGROUND, OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task contendedTask = {slowRun, &contendedRuns, "contended-test", OBF_INIT_LAZY,
+                                             OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task measuredTask = {countRun, &measuredRuns, "measured-test", OBF_INIT_LAZY,
+                                            OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task firstPageTask = {countRun, &pagedRuns, "paged-test", OBF_INIT_LAZY,
+                                             OBF_INIT_PENDING, 0, 0, 0};
+OBF_INIT_TASK obf_init_task secondPageTask = {countRun, &pagedRuns, "paged-test", OBF_INIT_LAZY,
+                                              OBF_INIT_PENDING, 0, 0, 0};
+
+/**
+ * @brief Ask for the report ahead of the runtime's constructor, which
+ * has the default priority
+ */
+__attribute__((constructor(101))) void requestReport() {
+    setenv("OBF_INIT_REPORT", "1", 1);
+}
+
+/**
+ * @brief Read the state of a task as the guards do
+ * @param task Task
+ * @return Its state
+ */
+uint32_t stateOf(obf_init_task &task) {
+    return __atomic_load_n(&task.state, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Eager tasks run in the constructor
+ */
+TEST(InitSchedulerTest, RunsEagerTasksBeforeMain) {
+    EXPECT_EQ(eagerRunsAtMain, 1);
+    EXPECT_EQ(stateOf(eagerTask), static_cast<uint32_t>(OBF_INIT_DONE));
+    __obf_init_run(&eagerTask);
+    EXPECT_EQ(eagerRuns, 1);
+}
+
+/**
+ * @brief Lazy tasks run on first use, once
+ */
+TEST(InitSchedulerTest, RunsLazyTasksOnFirstUse) {
+    EXPECT_EQ(lazyRuns, 0);
+    EXPECT_EQ(stateOf(lazyTask), static_cast<uint32_t>(OBF_INIT_PENDING));
+    __obf_init_run(&lazyTask);
+    __obf_init_run(&lazyTask);
+    EXPECT_EQ(lazyRuns, 1);
+    EXPECT_EQ(stateOf(lazyTask), static_cast<uint32_t>(OBF_INIT_DONE));
+}
+
+/**
+ * @brief Background tasks finish without any use
+ */
+TEST(InitSchedulerTest, RunsBackgroundTasks) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (stateOf(backgroundTask) != OBF_INIT_DONE && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(stateOf(backgroundTask), static_cast<uint32_t>(OBF_INIT_DONE));
+    __obf_init_run(&backgroundTask);
+    EXPECT_EQ(backgroundRuns, 1);
+}
+
+/**
+ * @brief Threads using a task at once run it once, and all see its work
+ */
+TEST(InitSchedulerTest, RunsOnceUnderContention) {
+    std::vector<std::thread> threads;
+    std::atomic<int> sawResult{0};
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&] {
+            __obf_init_run(&contendedTask);
+            sawResult += contendedResult == 42;
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(contendedRuns, 1);
+    EXPECT_EQ(sawResult, 8);
+    EXPECT_GE(contendedTask.nanoseconds, 20000000u);
+}
+
+/**
+ * @brief The report sums each component's tasks on one line, with the
+ * time spent before main and the resident set the tasks added
+ */
+TEST(InitSchedulerTest, ReportsTimePerComponent) {
+    while (stateOf(backgroundTask) != OBF_INIT_DONE) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // Read once at startup: unsetting it now changes nothing
+    unsetenv("OBF_INIT_REPORT");
+    __obf_init_run(&measuredTask);
+    __obf_init_run(&firstPageTask);
+    EXPECT_GT(measuredTask.rss_before, 0u);
+    EXPECT_GT(measuredTask.rss_after, 0u);
+    
+    testing::internal::CaptureStderr();
+    __obf_init_report();
+    std::string report = testing::internal::GetCapturedStderr();
+    auto lineOf = [&](const std::string &component) {
+        size_t start = report.find("obf_init: " + component + " ");
+        return start == std::string::npos ? std::string()
+                                          : report.substr(start, report.find('\n', start) - start);
+    };
+    for (const char *component : {"eager-test", "lazy-test", "background-test", "contended-test",
+                                  "measured-test"}) {
+        EXPECT_NE(lineOf(component).find(" 1/1 "), std::string::npos) << report;
+    }
+    // Absolute readings, and the sum of a lazy component as approximate
+    std::string measured = lineOf("measured-test");
+    EXPECT_NE(measured.find(" -> "), std::string::npos) << report;
+    EXPECT_NE(measured.find(" kB, "), std::string::npos) << report;
+    EXPECT_NE(measured.find("approx."), std::string::npos) << report;
+    EXPECT_EQ(lineOf("eager-test").find("approx."), std::string::npos) << report;
+    EXPECT_NE(report.find(" kB at the first task, "), std::string::npos) << report;
+    
+    // Two tasks of one component, one of them run: one line
+    EXPECT_EQ(report.find("paged-test"), report.rfind("paged-test")) << report;
+    EXPECT_NE(lineOf("paged-test").find(" 1/2 "), std::string::npos) << report;
+    
+    // The batch before main stays under a millisecond
+    size_t before = report.find(" us before main");
+    ASSERT_NE(before, std::string::npos) << report;
+    double microseconds = std::stod(report.substr(report.find(' ') + 1, before));
+    EXPECT_LT(microseconds, 1000.0) << report;
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    eagerRunsAtMain = eagerRuns;
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,199 @@
+/**
+ * @file test_machine_substitution.cpp
+ * @brief Unit tests for the machine instruction substitution pass
+ * 
+ * Compiles a module of ALU chains to x86-64 object files with and
+ * without -machine-substitution, then loads the code of each into
+ * executable memory and checks that the substituted functions are
+ * longer and still compute the same results.
+ */
+
+#include <gtest/gtest.h>
+#include "utils/codegen_utils.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+
+#include <sys/mman.h>
+
+using namespace llvm;
+
+namespace {
+
+/// Chains of every substituted operation, on 32 and 64 bits
+const char *const kAluModule = R"(
+target triple = "x86_64-unknown-linux-gnu"
+
+define i32 @alu32(i32 %a, i32 %b, i32 %c) {
+  %1 = add i32 %a, %b
+  %2 = sub i32 %1, %c
+  %3 = and i32 %2, %a
+  %4 = or i32 %3, %b
+  %5 = xor i32 %4, %c
+  %6 = mul i32 %5, %1
+  %7 = sub i32 %6, %b
+  %8 = xor i32 %7, %a
+  ret i32 %8
+}
+
+define i64 @alu64(i64 %a, i64 %b, i64 %c) {
+  %1 = add i64 %a, %b
+  %2 = sub i64 %1, %c
+  %3 = and i64 %2, %a
+  %4 = or i64 %3, %b
+  %5 = xor i64 %4, %c
+  %6 = mul i64 %5, %1
+  %7 = sub i64 %6, %b
+  %8 = xor i64 %7, %a
+  ret i64 %8
+}
+)";
+
+template <typename T>
+T referenceAlu(T a, T b, T c) {
+    T v1 = a + b;
+    T v5 = ((((v1 - c) & a) | b) ^ c);
+    return ((v5 * v1) - b) ^ a;
+}
+
+/**
+ * @class MachineSubstitutionTest
+ * @brief Test fixture compiling the ALU module
+ */
+class MachineSubstitutionTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+#if !defined(__x86_64__)
+        GTEST_SKIP() << "runs x86-64 code";
+#endif
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmPrinters();
+    }
+    
+    void TearDown() override {
+        setMachineSubstitution(false);
+        for (auto &code : loaded) {
+            munmap(code.first, code.second);
+        }
+    }
+    
+    /**
+     * @brief Set -machine-substitution
+     * @param enabled Whether codegen runs the pass
+     */
+    void setMachineSubstitution(bool enabled) {
+        auto *option = static_cast<cl::opt<bool>*>(
+            cl::getRegisteredOptions().lookup("machine-substitution"));
+        ASSERT_TRUE(option);
+        *option = enabled;
+    }
+    
+    /**
+     * @brief Compile the module and load its code
+     * @param substitute Whether to run the pass
+     * @param functions Set to the entry point and size of each function
+     */
+    void compile(bool substitute, std::map<std::string, std::pair<void*, uint64_t>> &functions) {
+        setMachineSubstitution(substitute);
+        LLVMContext context;
+        SMDiagnostic diagnostic;
+        std::unique_ptr<Module> module = parseAssemblyString(kAluModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+        
+        SmallString<128> path;
+        ASSERT_FALSE(sys::fs::createTemporaryFile("machine-substitution", "o", path));
+        std::string error;
+        bool emitted = obfuscator::emitObjectFile(*module, path, error);
+        auto buffer = MemoryBuffer::getFile(path);
+        sys::fs::remove(path);
+        ASSERT_TRUE(emitted) << error;
+        ASSERT_TRUE(buffer);
+        
+        auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+        ASSERT_TRUE(static_cast<bool>(object)) << toString(object.takeError());
+        for (const object::SectionRef &section : (*object)->sections()) {
+            if (!section.isText()) {
+                continue;
+            }
+            Expected<StringRef> contents = section.getContents();
+            ASSERT_TRUE(static_cast<bool>(contents));
+            
+            // The functions are leaves without relocations; their bytes
+            // run as they are
+            size_t size = std::max<size_t>(contents->size(), 1);
+            void *code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            ASSERT_NE(code, MAP_FAILED);
+            memcpy(code, contents->data(), contents->size());
+            ASSERT_EQ(mprotect(code, size, PROT_READ | PROT_EXEC), 0);
+            loaded.push_back({code, size});
+            
+            for (const object::SymbolRef &symbol : (*object)->symbols()) {
+                Expected<object::section_iterator> symbolSection = symbol.getSection();
+                Expected<StringRef> name = symbol.getName();
+                Expected<uint64_t> address = symbol.getAddress();
+                ASSERT_TRUE(symbolSection && name && address);
+                if (*symbolSection == (*object)->section_end() || **symbolSection != section) {
+                    continue;
+                }
+                uint64_t symbolSize = object::ELFSymbolRef(symbol).getSize();
+                functions[name->str()] = {static_cast<char*>(code) + (*address - section.getAddress()),
+                                          symbolSize};
+            }
+        }
+        ASSERT_TRUE(functions.count("alu32") && functions.count("alu64"));
+    }
+    
+    std::vector<std::pair<void*, size_t>> loaded;
+};
+
+/**
+ * @brief The pass adds code to the functions
+ */
+TEST_F(MachineSubstitutionTest, SubstitutedCodeIsLonger) {
+    std::map<std::string, std::pair<void*, uint64_t>> plain, substituted;
+    compile(false, plain);
+    compile(true, substituted);
+    
+    EXPECT_GT(substituted["alu32"].second, plain["alu32"].second);
+    EXPECT_GT(substituted["alu64"].second, plain["alu64"].second);
+}
+
+/**
+ * @brief The substituted functions compute the same results
+ */
+TEST_F(MachineSubstitutionTest, SubstitutedCodeComputesSameResults) {
+    std::map<std::string, std::pair<void*, uint64_t>> substituted;
+    compile(true, substituted);
+    auto *alu32 = reinterpret_cast<uint32_t (*)(uint32_t, uint32_t, uint32_t)>(substituted["alu32"].first);
+    auto *alu64 = reinterpret_cast<uint64_t (*)(uint64_t, uint64_t, uint64_t)>(substituted["alu64"].first);
+    
+    std::mt19937_64 random(42);
+    for (int i = 0; i < 10000; i++) {
+        uint64_t a = random(), b = random(), c = random();
+        ASSERT_EQ(alu32(a, b, c), referenceAlu<uint32_t>(a, b, c));
+        ASSERT_EQ(alu64(a, b, c), referenceAlu<uint64_t>(a, b, c));
+    }
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
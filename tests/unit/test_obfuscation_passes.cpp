@@ -0,0 +1,665 @@
+/**
+ * @file test_obfuscation_passes.cpp
+ * @brief Unit tests for the obfuscation passes
+ * 
+ * Runs every pass through the new pass manager on a module with
+ * branches, arithmetic, string literals, structs and a loop the
+ * profile marks hot, then checks the output and the cost of the
+ * transformation: the instructions and the target's code size
+ * estimate it adds stay within the growth budget, and no store is
+ * added to the hot loop. Flattening is also run on a loop with hints,
+ * and under a plan that reuses states.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+#include "utils/llvm_utils.h"
+#include "utils/obfuscation_plan.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/// Branches and arithmetic, literals passed to puts, non-escaping
+/// structs (one linking to another), and a loop in @scan that the
+/// profile marks hot
+const char *const kPassModule = R"(
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.Record = type { i8, i64, i32, i16 }
+%struct.Link = type { ptr, i64 }
+
+@.greeting = private unnamed_addr constant [14 x i8] c"hello, world!\00"
+@.tick = private unnamed_addr constant [5 x i8] c"tick\00"
+@.status = private unnamed_addr constant [11 x i8] c"status: ok\00"
+
+declare i32 @puts(ptr)
+
+define i32 @compute(i32 %a, i32 %b) {
+entry:
+  %c = icmp sgt i32 %a, %b
+  br i1 %c, label %greater, label %other
+greater:
+  %s = sub i32 %a, %b
+  %m = mul i32 %s, 3
+  br label %merge
+other:
+  %t = add i32 %a, %b
+  %u = add i32 %t, 7
+  br label %merge
+merge:
+  %r = phi i32 [ %m, %greater ], [ %u, %other ]
+  %p = call i32 @puts(ptr @.greeting)
+  %detail = getelementptr inbounds [11 x i8], ptr @.status, i64 0, i64 8
+  %d = call i32 @puts(ptr %detail)
+  %pd = add i32 %p, %d
+  %x = add i32 %r, %pd
+  ret i32 %x
+}
+
+define i32 @mix(i32 %a, i32 %b, i32 %c) {
+entry:
+  %a1 = add i32 %a, %b
+  %a2 = sub i32 %a1, %c
+  %a3 = xor i32 %a2, %a
+  %a4 = mul i32 %a3, 3
+  %k = icmp ult i32 %a4, %b
+  br i1 %k, label %left, label %right
+left:
+  %l1 = add i32 %a4, 11
+  %l2 = and i32 %l1, %c
+  %l3 = or i32 %l2, %b
+  %l4 = sub i32 %l3, %a1
+  %l5 = xor i32 %l4, 85
+  br label %join
+right:
+  %r1 = sub i32 %a4, 13
+  %r2 = or i32 %r1, %a
+  %r3 = and i32 %r2, %a2
+  %r4 = add i32 %r3, %c
+  %r5 = mul i32 %r4, 5
+  br label %join
+join:
+  %j = phi i32 [ %l5, %left ], [ %r5, %right ]
+  %j1 = add i32 %j, %a3
+  %j2 = xor i32 %j1, %b
+  %j3 = sub i32 %j2, %c
+  %j4 = and i32 %j3, 65535
+  %j5 = add i32 %j4, %a1
+  %m = icmp sgt i32 %j5, 100
+  br i1 %m, label %big, label %small
+big:
+  %b1 = sub i32 %j5, 100
+  %b2 = or i32 %b1, %j1
+  %b3 = add i32 %b2, %j2
+  br label %done
+small:
+  %s1 = add i32 %j5, 100
+  %s2 = xor i32 %s1, %j3
+  %s3 = sub i32 %s2, %j4
+  br label %done
+done:
+  %v = phi i32 [ %b3, %big ], [ %s3, %small ]
+  %v1 = add i32 %v, %j
+  ret i32 %v1
+}
+
+define i64 @record(i64 %v) {
+entry:
+  %rec = alloca %struct.Record
+  %f1 = getelementptr inbounds %struct.Record, ptr %rec, i32 0, i32 1
+  store i64 %v, ptr %f1
+  %f2 = getelementptr inbounds %struct.Record, ptr %rec, i32 0, i32 2
+  store i32 5, ptr %f2
+  %l1 = load i64, ptr %f1
+  %l2 = load i32, ptr %f2
+  %w = zext i32 %l2 to i64
+  %sum = add i64 %l1, %w
+  ret i64 %sum
+}
+
+define i64 @link(i64 %v) {
+entry:
+  %a = alloca %struct.Link
+  %b = alloca %struct.Link
+  %an = getelementptr inbounds %struct.Link, ptr %a, i32 0, i32 0
+  store ptr %b, ptr %an
+  %bv = getelementptr inbounds %struct.Link, ptr %b, i32 0, i32 1
+  store i64 %v, ptr %bv
+  %next = load ptr, ptr %an
+  %nv = getelementptr inbounds %struct.Link, ptr %next, i32 0, i32 1
+  %r = load i64, ptr %nv
+  ret i64 %r
+}
+
+define i32 @scan(ptr %data, i32 %n) !prof !20 {
+entry:
+  %empty = icmp sle i32 %n, 0
+  br i1 %empty, label %exit, label %loop, !prof !21
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %ptr = getelementptr inbounds i32, ptr %data, i32 %i
+  %val = load i32, ptr %ptr
+  %odd = and i32 %val, 1
+  %isodd = icmp ne i32 %odd, 0
+  br i1 %isodd, label %report, label %latch, !prof !22
+report:
+  %q = call i32 @puts(ptr @.tick)
+  br label %latch
+latch:
+  %doubled = mul i32 %val, 3
+  %acc.next = add i32 %acc, %doubled
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop, !prof !23
+exit:
+  %res = phi i32 [ 0, %entry ], [ %acc.next, %latch ]
+  %final = sub i32 %res, 1
+  ret i32 %final
+}
+
+!llvm.module.flags = !{!0}
+!0 = !{i32 1, !"ProfileSummary", !1}
+!1 = !{!2, !3, !4, !5, !6, !7, !8, !9}
+!2 = !{!"ProfileFormat", !"InstrProf"}
+!3 = !{!"TotalCount", i64 200000}
+!4 = !{!"MaxCount", i64 100000}
+!5 = !{!"MaxInternalCount", i64 100000}
+!6 = !{!"MaxFunctionCount", i64 100}
+!7 = !{!"NumCounts", i64 6}
+!8 = !{!"NumFunctions", i64 5}
+!9 = !{!"DetailedSummary", !10}
+!10 = !{!11, !12}
+!11 = !{i32 990000, i64 1000, i32 2}
+!12 = !{i32 999999, i64 100, i32 4}
+!20 = !{!"function_entry_count", i64 100}
+!21 = !{!"branch_weights", i32 1, i32 100}
+!22 = !{!"branch_weights", i32 1, i32 1}
+!23 = !{!"branch_weights", i32 100, i32 100000}
+)";
+
+/**
+ * @struct FunctionCost
+ * @brief Size of a function by two measures
+ */
+struct FunctionCost {
+    uint64_t instructions = 0;  ///< IR instructions
+    int64_t codeSize = 0;       ///< Target's code size estimate
+};
+
+/**
+ * @class ObfuscationPassTest
+ * @brief Test fixture running one pass on the test module
+ */
+class ObfuscationPassTest : public ::testing::TestWithParam<std::string> {
+protected:
+    void SetUp() override {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        parseModule();
+        
+        std::string error;
+        const Target *target = TargetRegistry::lookupTarget(module->getTargetTriple(), error);
+        if (target) {
+            machine.reset(target->createTargetMachine(module->getTargetTriple(), "x86-64", "",
+                                                      TargetOptions(), None));
+        }
+    }
+    
+    void TearDown() override {
+        setMaxGrowth(0);
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the test module
+     */
+    void parseModule() {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kPassModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Set -obfuscation-max-growth
+     * @param percent Growth limit; 0 for none
+     */
+    void setMaxGrowth(unsigned percent) {
+        auto *option = static_cast<cl::opt<unsigned>*>(
+            cl::getRegisteredOptions().lookup("obfuscation-max-growth"));
+        ASSERT_TRUE(option);
+        *option = percent;
+    }
+    
+    /**
+     * @brief Run a pass through the new pass manager
+     * @param passName Registered pass name
+     */
+    void runPass(const std::string &passName) {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB(machine.get());
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, passName);
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+    }
+    
+    /**
+     * @brief Measure every defined function
+     * @return Cost per function name
+     */
+    std::map<std::string, FunctionCost> measure() {
+        std::map<std::string, FunctionCost> costs;
+        for (Function &F : *module) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+            TargetTransformInfo TTI = machine ? machine->getTargetTransformInfo(F)
+                                              : TargetTransformInfo(module->getDataLayout());
+            FunctionCost &cost = costs[F.getName().str()];
+            for (Instruction &I : instructions(F)) {
+                cost.instructions++;
+                InstructionCost size = TTI.getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize);
+                if (size.isValid()) {
+                    cost.codeSize += *size.getValue();
+                }
+            }
+        }
+        return costs;
+    }
+    
+    /**
+     * @brief Find the loops the profile marks hot
+     * @return Names of their headers
+     */
+    std::set<std::string> findHotLoopHeaders() {
+        std::set<std::string> headers;
+        for (Function &F : *module) {
+            std::set<const BasicBlock*> hot = obfuscator::findHotLoopBlocks(F);
+            if (hot.empty()) {
+                continue;
+            }
+            DominatorTree DT(F);
+            LoopInfo LI(DT);
+            for (const BasicBlock *BB : hot) {
+                if (LI.isLoopHeader(BB)) {
+                    headers.insert(BB->getName().str());
+                }
+            }
+        }
+        return headers;
+    }
+    
+    /**
+     * @brief Count the stores in loops
+     * 
+     * Loops are found by header rather than by profile: a flattened
+     * function's dispatcher forms a loop of its own, which the
+     * estimated frequencies may well call hot too.
+     * 
+     * @param headers Names of the loop headers
+     * @return Stores in those loops, or -1 if one is no longer a loop
+     */
+    int countLoopStores(const std::set<std::string> &headers) {
+        int stores = 0;
+        for (Function &F : *module) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+            DominatorTree DT(F);
+            LoopInfo LI(DT);
+            for (BasicBlock &header : F) {
+                if (!headers.count(header.getName().str())) {
+                    continue;
+                }
+                if (!LI.isLoopHeader(&header)) {
+                    return -1;
+                }
+                for (BasicBlock *BB : LI.getLoopFor(&header)->blocks()) {
+                    stores += std::count_if(BB->begin(), BB->end(),
+                                            [](const Instruction &I) { return isa<StoreInst>(I); });
+                }
+            }
+        }
+        return stores;
+    }
+    
+    /**
+     * @brief Print the module
+     * @return Textual IR
+     */
+    std::string print() {
+        std::string text;
+        raw_string_ostream(text) << *module;
+        return text;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+    std::unique_ptr<TargetMachine> machine;
+};
+
+/**
+ * @brief The pass transforms the module and leaves valid IR
+ */
+TEST_P(ObfuscationPassTest, TransformsModule) {
+    std::string before = print();
+    runPass(GetParam());
+    
+    std::string errors;
+    raw_string_ostream errorStream(errors);
+    EXPECT_FALSE(verifyModule(*module, &errorStream)) << errorStream.str();
+    EXPECT_NE(print(), before) << GetParam() << " left the module unchanged";
+}
+
+/**
+ * @brief Added instructions and code size stay within the growth budget
+ */
+TEST_P(ObfuscationPassTest, GrowthWithinBudget) {
+    for (unsigned percent : {10u, 50u}) {
+        SCOPED_TRACE("-obfuscation-max-growth=" + std::to_string(percent));
+        parseModule();
+        std::map<std::string, FunctionCost> before = measure();
+        setMaxGrowth(percent);
+        runPass(GetParam());
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+        
+        for (auto &entry : measure()) {
+            const FunctionCost &original = before[entry.first];
+            // The limit of GrowthBudget: a share of the function, at least 16
+            uint64_t budget = std::max<uint64_t>(16, original.instructions * percent / 100);
+            EXPECT_LE(entry.second.instructions, original.instructions + budget)
+                << GetParam() << " grew " << entry.first << " past its budget";
+            EXPECT_LE(entry.second.codeSize, original.codeSize + static_cast<int64_t>(budget))
+                << GetParam() << " grew the code size of " << entry.first << " past its budget";
+        }
+    }
+}
+
+/**
+ * @brief Loops the profile marks hot get no stores
+ */
+TEST_P(ObfuscationPassTest, NoStoresInHotLoops) {
+    std::set<std::string> hotHeaders = findHotLoopHeaders();
+    ASSERT_EQ(hotHeaders, std::set<std::string>{"loop"});
+    int before = countLoopStores(hotHeaders);
+    runPass(GetParam());
+    
+    EXPECT_EQ(countLoopStores(hotHeaders), before) << GetParam() << " added stores to a hot loop";
+}
+
+/**
+ * @brief The adaptor keeps cached analyses unless the pass changed the module
+ */
+TEST_P(ObfuscationPassTest, PreservesAnalysesOfUnchangedModules) {
+    ModuleAnalysisManager MAM;
+    obfuscator::ObfuscationPassAdaptor adaptor(GetParam());
+    EXPECT_FALSE(adaptor.run(*module, MAM).areAllPreserved()) << GetParam();
+    
+    // Nothing to transform: declarations only
+    SMDiagnostic diagnostic;
+    std::unique_ptr<Module> declarations =
+        parseAssemblyString("declare i32 @puts(ptr)\n", diagnostic, context);
+    ASSERT_TRUE(declarations) << diagnostic.getMessage().str();
+    std::string before;
+    raw_string_ostream(before) << *declarations;
+    EXPECT_TRUE(adaptor.run(*declarations, MAM).areAllPreserved()) << GetParam();
+    std::string after;
+    raw_string_ostream(after) << *declarations;
+    EXPECT_EQ(after, before) << GetParam();
+}
+
+INSTANTIATE_TEST_SUITE_P(Passes, ObfuscationPassTest, ::testing::Values(
+    "bogus-control-flow",
+    "flattening",
+    "block-splitting",
+    "opaque-predicates",
+    "instruction-substitution",
+    "string-encryption",
+    "stack-strings",
+    "struct-layout",
+    "pointer-encoding"));
+
+/// A loop with vectorizer hints, and branches after it to flatten
+const char *const kHintedLoopModule = R"(
+define i32 @sum(ptr %data, i32 %n) {
+entry:
+  %empty = icmp sle i32 %n, 0
+  br i1 %empty, label %exit, label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %ptr = getelementptr inbounds i32, ptr %data, i32 %i
+  %val = load i32, ptr %ptr
+  %acc.next = add i32 %acc, %val
+  %next = add i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop, !llvm.loop !0
+exit:
+  %res = phi i32 [ 0, %entry ], [ %acc.next, %loop ]
+  %big = icmp sgt i32 %res, 100
+  br i1 %big, label %clamp, label %negate
+clamp:
+  br label %done.all
+negate:
+  %neg = sub i32 0, %res
+  br label %done.all
+done.all:
+  %r = phi i32 [ 100, %clamp ], [ %neg, %negate ]
+  ret i32 %r
+}
+
+!0 = distinct !{!0, !1, !2}
+!1 = !{!"llvm.loop.mustprogress"}
+!2 = !{!"llvm.loop.vectorize.enable", i1 true}
+)";
+
+/**
+ * @struct RemarkCollector
+ * @brief Diagnostic handler keeping every optimization remark
+ */
+struct RemarkCollector : public DiagnosticHandler {
+    /**
+     * @struct Remark
+     * @brief What a test checks of a remark
+     */
+    struct Remark {
+        std::string pass;                           ///< Emitting pass
+        std::string name;                           ///< Remark name
+        std::map<std::string, std::string> args;    ///< Named arguments
+    };
+    
+    bool handleDiagnostics(const DiagnosticInfo &info) override {
+        if (auto *remark = dyn_cast<DiagnosticInfoOptimizationBase>(&info)) {
+            Remark &kept = remarks.emplace_back();
+            kept.pass = remark->getPassName().str();
+            kept.name = remark->getRemarkName().str();
+            for (const DiagnosticInfoOptimizationBase::Argument &arg : remark->getArgs()) {
+                kept.args[arg.Key] = arg.Val;
+            }
+        }
+        return true;
+    }
+    bool isAnalysisRemarkEnabled(StringRef) const override { return true; }
+    bool isMissedOptRemarkEnabled(StringRef) const override { return true; }
+    bool isPassedOptRemarkEnabled(StringRef) const override { return true; }
+    bool isAnyRemarkEnabled() const override { return true; }
+    
+    /**
+     * @brief Count the remarks of a name
+     * @param name Remark name
+     * @return Remarks of that name
+     */
+    size_t count(StringRef name) const {
+        return std::count_if(remarks.begin(), remarks.end(),
+                             [&](const Remark &remark) { return remark.name == name; });
+    }
+    
+    std::vector<Remark> remarks;
+};
+
+/**
+ * @class FlatteningTest
+ * @brief Test fixture running passes on a loop with hints, keeping the remarks
+ */
+class FlatteningTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        auto handler = std::make_unique<RemarkCollector>();
+        collector = handler.get();
+        context.setDiagnosticHandler(std::move(handler));
+        parseModule();
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the module, forgetting earlier remarks
+     */
+    void parseModule() {
+        collector->remarks.clear();
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kHintedLoopModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Run a pipeline through the new pass manager
+     * @param pipeline Pass names, comma separated
+     */
+    void runPipeline(const std::string &pipeline) {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, pipeline);
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+    }
+    
+    LLVMContext context;
+    RemarkCollector *collector = nullptr;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief A loop with vectorizer hints keeps its loop ID through flattening and bogus control flow
+ */
+TEST_F(FlatteningTest, KeepsHintedLoops) {
+    Function *F = module->getFunction("sum");
+    MDNode *loopID = F->getEntryBlock().getNextNode()->getTerminator()->getMetadata(LLVMContext::MD_loop);
+    ASSERT_TRUE(loopID);
+    runPipeline("flattening,bogus-control-flow");
+    
+    std::string errors;
+    raw_string_ostream errorStream(errors);
+    ASSERT_FALSE(verifyFunction(*F, &errorStream)) << errorStream.str();
+    EXPECT_EQ(collector->count("Flattened"), 1u);
+    EXPECT_EQ(collector->count("LoopKept"), 1u);
+    
+    // Still a loop whose latch carries the hints
+    DominatorTree DT(*F);
+    LoopInfo LI(DT);
+    unsigned hinted = 0;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        if (L->getLoopID() == loopID) {
+            hinted++;
+            BasicBlock *latch = L->getLoopLatch();
+            ASSERT_TRUE(latch);
+            EXPECT_EQ(latch->getTerminator()->getMetadata(LLVMContext::MD_loop), loopID);
+        }
+    }
+    EXPECT_EQ(hinted, 1u);
+}
+
+/**
+ * @brief A replayed plan giving two blocks one state still yields distinct cases
+ */
+TEST_F(FlatteningTest, RedrawsReusedPlanStates) {
+    Function *F = module->getFunction("sum");
+    uint64_t hash = obfuscator::getFunctionHash(*F);
+    obfuscator::ObfuscationPlan recorded;
+    obfuscator::attachPlan(*module, recorded, obfuscator::PlanMode::Record);
+    runPipeline("flattening");
+    obfuscator::detachPlan(*module);
+    const std::vector<uint64_t> *states = recorded.find("flattening", "sum", hash);
+    ASSERT_TRUE(states);
+    ASSERT_GT(states->size(), 1u);
+    
+    // Same structure, so the hash still matches; every state alike
+    obfuscator::ObfuscationPlan corrupt;
+    corrupt.record({"flattening", "sum", hash, std::vector<uint64_t>(states->size(), states->front())});
+    parseModule();
+    obfuscator::attachPlan(*module, corrupt, obfuscator::PlanMode::Replay);
+    runPipeline("flattening");
+    obfuscator::detachPlan(*module);
+    
+    std::string errors;
+    raw_string_ostream errorStream(errors);
+    EXPECT_FALSE(verifyFunction(*module->getFunction("sum"), &errorStream)) << errorStream.str();
+    EXPECT_EQ(collector->count("PlanStateReused"), states->size() - 1);
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
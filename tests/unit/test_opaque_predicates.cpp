@@ -0,0 +1,411 @@
+/**
+ * @file test_opaque_predicates.cpp
+ * @brief Unit tests for the opaque predicates pass
+ * 
+ * Runs the pass on leaf functions seeded by an integer argument, a
+ * pointer argument and a stack slot, checks that the predicates read
+ * no memory and that -O2 keeps them, then compiles the optimized
+ * functions to x86-64 with and without the pass and runs both on the
+ * same inputs. A recorded plan rebuilds the same predicates under
+ * another seed.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+#include "utils/codegen_utils.h"
+#include "utils/llvm_utils.h"
+#include "utils/obfuscation_plan.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+using namespace llvm;
+
+namespace {
+
+/// A chain of arithmetic blocks, a loop over an array and a function
+/// without arguments
+const char *const kPredicateModule = R"(
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+define i64 @chain(i64 %a, i64 %b) {
+entry:
+  %x0 = add i64 %a, %b
+  br label %b1
+b1:
+  %x1 = mul i64 %x0, 3
+  %y1 = xor i64 %x1, %a
+  %c1 = icmp ugt i64 %y1, %b
+  br i1 %c1, label %b2, label %b3
+b2:
+  %x2 = sub i64 %y1, %b
+  %y2 = or i64 %x2, 17
+  br label %b4
+b3:
+  %x3 = add i64 %y1, %a
+  %y3 = and i64 %x3, 4095
+  br label %b4
+b4:
+  %x4 = phi i64 [ %y2, %b2 ], [ %y3, %b3 ]
+  %y4 = mul i64 %x4, %a
+  %z4 = xor i64 %y4, 12345
+  br label %b5
+b5:
+  %x5 = add i64 %z4, %b
+  %y5 = lshr i64 %x5, 3
+  %c5 = icmp eq i64 %y5, 0
+  br i1 %c5, label %b6, label %b7
+b6:
+  %x6 = add i64 %x5, 99
+  %y6 = mul i64 %x6, 7
+  br label %b8
+b7:
+  %x7 = xor i64 %y5, %a
+  %y7 = sub i64 %x7, 5
+  br label %b8
+b8:
+  %x8 = phi i64 [ %y6, %b6 ], [ %y7, %b7 ]
+  %y8 = add i64 %x8, %x0
+  %z8 = mul i64 %y8, 11
+  ret i64 %z8
+}
+
+define i64 @walk(ptr %values, i64 %n) {
+entry:
+  %empty = icmp eq i64 %n, 0
+  br i1 %empty, label %done, label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %next ]
+  %acc = phi i64 [ 0, %entry ], [ %acc.next, %next ]
+  %p = getelementptr inbounds i64, ptr %values, i64 %i
+  %v = load i64, ptr %p
+  %odd = and i64 %v, 1
+  %isodd = icmp ne i64 %odd, 0
+  br i1 %isodd, label %triple, label %half
+triple:
+  %t = mul i64 %v, 3
+  %t1 = add i64 %t, 1
+  br label %next
+half:
+  %h = lshr i64 %v, 1
+  %h1 = add i64 %h, %i
+  br label %next
+next:
+  %w = phi i64 [ %t1, %triple ], [ %h1, %half ]
+  %acc.next = add i64 %acc, %w
+  %i.next = add i64 %i, 1
+  %more = icmp ult i64 %i.next, %n
+  br i1 %more, label %loop, label %done
+done:
+  %r = phi i64 [ 0, %entry ], [ %acc.next, %next ]
+  ret i64 %r
+}
+
+define i32 @fixed() {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %step ]
+  %acc = phi i32 [ 1, %entry ], [ %acc.next, %step ]
+  %m = mul i32 %acc, 31
+  %k = add i32 %m, %i
+  br label %step
+step:
+  %acc.next = xor i32 %k, 7
+  %i.next = add i32 %i, 1
+  %more = icmp ult i32 %i.next, 10
+  br i1 %more, label %loop, label %scale
+scale:
+  %s = mul i32 %acc.next, 5
+  %s1 = add i32 %s, 9
+  br label %mask
+mask:
+  %q = and i32 %s1, 65535
+  %q1 = xor i32 %q, 21845
+  br label %shift
+shift:
+  %h = lshr i32 %q1, 3
+  %h1 = or i32 %h, 64
+  br label %mix
+mix:
+  %x = mul i32 %h1, %q1
+  %x1 = sub i32 %x, 77
+  br label %done
+done:
+  %r = add i32 %x1, 1
+  %r1 = mul i32 %r, 3
+  ret i32 %r1
+}
+)";
+
+/**
+ * @class OpaquePredicatesTest
+ * @brief Test fixture running the pass and -O2 on the module
+ */
+class OpaquePredicatesTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmPrinters();
+
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        parseModule();
+    }
+    
+    void TearDown() override {
+        for (auto &code : loaded) {
+            munmap(code.first, code.second);
+        }
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the module
+     */
+    void parseModule() {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kPredicateModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Run the pass and optionally -O2 through the new pass manager
+     * @param obfuscate Whether to run the pass
+     * @param optimize Whether to run the -O2 pipeline afterwards
+     */
+    void run(bool obfuscate, bool optimize) {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        if (obfuscate) {
+            Error error = PB.parsePassPipeline(MPM, "opaque-predicates");
+            ASSERT_FALSE(error) << toString(std::move(error));
+        }
+        if (optimize) {
+            MPM.addPass(PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2));
+        }
+        MPM.run(*module, MAM);
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+    }
+    
+    /**
+     * @brief Count the conditional branches of a function
+     * @param name Function name
+     * @return Conditional branches
+     */
+    unsigned countConditionalBranches(StringRef name) {
+        unsigned branches = 0;
+        for (BasicBlock &BB : *module->getFunction(name)) {
+            auto *branch = dyn_cast<BranchInst>(BB.getTerminator());
+            branches += branch && branch->isConditional();
+        }
+        return branches;
+    }
+    
+    /**
+     * @brief Compile the module and load its code
+     * 
+     * The functions are leaves without relocations; their bytes run
+     * as they are.
+     * 
+     * @return Entry point of each function
+     */
+    std::map<std::string, void*> compile() {
+        std::map<std::string, void*> functions;
+        SmallString<128> path;
+        EXPECT_FALSE(sys::fs::createTemporaryFile("opaque-predicates", "o", path));
+        std::string error;
+        bool emitted = obfuscator::emitObjectFile(*module, path, error);
+        auto buffer = MemoryBuffer::getFile(path);
+        sys::fs::remove(path);
+        EXPECT_TRUE(emitted) << error;
+        if (!emitted || !buffer) {
+            return functions;
+        }
+        
+        auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+        if (!object) {
+            ADD_FAILURE() << toString(object.takeError());
+            return functions;
+        }
+        for (const object::SectionRef &section : (*object)->sections()) {
+            Expected<StringRef> contents = section.getContents();
+            if (!section.isText() || !contents) {
+                continue;
+            }
+            size_t size = std::max<size_t>(contents->size(), 1);
+            void *code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            EXPECT_NE(code, MAP_FAILED);
+            memcpy(code, contents->data(), contents->size());
+            EXPECT_EQ(mprotect(code, size, PROT_READ | PROT_EXEC), 0);
+            loaded.push_back({code, size});
+            
+            for (const object::SymbolRef &symbol : (*object)->symbols()) {
+                Expected<object::section_iterator> symbolSection = symbol.getSection();
+                Expected<StringRef> name = symbol.getName();
+                Expected<uint64_t> address = symbol.getAddress();
+                if (symbolSection && name && address && *symbolSection != (*object)->section_end() &&
+                    **symbolSection == section) {
+                    functions[name->str()] = static_cast<char*>(code) + (*address - section.getAddress());
+                }
+            }
+        }
+        EXPECT_TRUE(functions.count("chain") && functions.count("walk") && functions.count("fixed"));
+        return functions;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+    std::vector<std::pair<void*, size_t>> loaded;
+};
+
+/**
+ * @brief Predicates add blocks but no memory access
+ */
+TEST_F(OpaquePredicatesTest, EvaluatesWithoutMemory) {
+    std::map<std::string, std::pair<size_t, unsigned>> before;
+    for (Function &F : *module) {
+        unsigned accesses = 0;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                accesses += I.mayReadOrWriteMemory();
+            }
+        }
+        before[F.getName().str()] = {F.size(), accesses};
+    }
+    run(true, false);
+    
+    for (Function &F : *module) {
+        unsigned accesses = 0;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                accesses += I.mayReadOrWriteMemory();
+            }
+        }
+        EXPECT_GT(F.size(), before[F.getName().str()].first) << "no predicate in " << F.getName().str();
+        EXPECT_EQ(accesses, before[F.getName().str()].second) << "memory access in " << F.getName().str();
+    }
+}
+
+/**
+ * @brief -O2 proves none of the predicates
+ */
+TEST_F(OpaquePredicatesTest, SurvivesOptimization) {
+    run(false, true);
+    std::map<std::string, unsigned> optimized;
+    for (Function &F : *module) {
+        optimized[F.getName().str()] = countConditionalBranches(F.getName());
+    }
+    
+    parseModule();
+    run(true, true);
+    for (auto &entry : optimized) {
+        EXPECT_GT(countConditionalBranches(entry.first), entry.second)
+            << "-O2 folded the predicates of " << entry.first;
+    }
+}
+
+/**
+ * @brief The optimized functions compute the same results
+ */
+TEST_F(OpaquePredicatesTest, ComputesSameResults) {
+#if !defined(__x86_64__)
+    GTEST_SKIP() << "runs x86-64 code";
+#endif
+    run(false, true);
+    std::map<std::string, void*> plain = compile();
+    parseModule();
+    run(true, true);
+    std::map<std::string, void*> guarded = compile();
+    ASSERT_EQ(plain.size(), 3u);
+    ASSERT_EQ(guarded.size(), 3u);
+    
+    using Chain = uint64_t (*)(uint64_t, uint64_t);
+    using Walk = uint64_t (*)(const uint64_t*, uint64_t);
+    using Fixed = uint32_t (*)();
+    EXPECT_EQ(reinterpret_cast<Fixed>(guarded["fixed"])(), reinterpret_cast<Fixed>(plain["fixed"])());
+    
+    std::mt19937_64 random(42);
+    std::vector<uint64_t> values(64);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t a = random(), b = random() % 4 ? random() : a;
+        ASSERT_EQ(reinterpret_cast<Chain>(guarded["chain"])(a, b), reinterpret_cast<Chain>(plain["chain"])(a, b));
+        
+        for (uint64_t &value : values) {
+            value = random();
+        }
+        uint64_t n = random() % (values.size() + 1);
+        ASSERT_EQ(reinterpret_cast<Walk>(guarded["walk"])(values.data(), n),
+                  reinterpret_cast<Walk>(plain["walk"])(values.data(), n));
+    }
+}
+
+/**
+ * @brief Replaying a plan rebuilds the same predicates under another seed
+ */
+TEST_F(OpaquePredicatesTest, ReplaysPlan) {
+    auto obfuscate = [&](uint64_t seed, obfuscator::ObfuscationPlan &plan, obfuscator::PlanMode mode) {
+        parseModule();
+        obfuscator::setRandomSeed(*module, seed);
+        obfuscator::attachPlan(*module, plan, mode);
+        run(true, false);
+        obfuscator::detachPlan(*module);
+        // The seed itself is in the module flags; compare the code
+        std::string text;
+        for (Function &F : *module) {
+            raw_string_ostream(text) << F;
+        }
+        return text;
+    };
+    
+    // Kinds, inversions, invariant constants and junk returns all come
+    // from the plan; any left to the generator would differ
+    obfuscator::ObfuscationPlan plan;
+    std::string recorded = obfuscate(1, plan, obfuscator::PlanMode::Record);
+    obfuscator::ObfuscationPlan empty;
+    ASSERT_NE(obfuscate(2, empty, obfuscator::PlanMode::Record), recorded);
+    EXPECT_EQ(obfuscate(2, plan, obfuscator::PlanMode::Replay), recorded);
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
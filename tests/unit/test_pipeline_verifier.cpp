@@ -0,0 +1,184 @@
+/**
+ * @file test_pipeline_verifier.cpp
+ * @brief Unit tests for the tiered IR verifier
+ * 
+ * Breaks a function on purpose, once in a way the structural checks
+ * see and once in a way only the full verifier sees, and checks what
+ * each tier reports and when.
+ */
+
+#include <gtest/gtest.h>
+#include "utils/pipeline_verifier.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <memory>
+#include <string>
+
+using namespace llvm;
+using obfuscator::PipelineVerifier;
+using obfuscator::VerifyLevel;
+
+namespace {
+
+/// Two well-formed functions the tests break
+const char *const kVerifierModule = R"(
+define i32 @select(i1 %c) {
+entry:
+  br i1 %c, label %then, label %join
+then:
+  br label %join
+join:
+  %v = phi i32 [ 1, %entry ], [ 2, %then ]
+  ret i32 %v
+}
+
+define void @leaf() {
+entry:
+  ret void
+}
+)";
+
+/**
+ * @class PipelineVerifierTest
+ * @brief Test fixture parsing the module
+ */
+class PipelineVerifierTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kVerifierModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Give the PHI node of @select an incoming block that is not a predecessor
+     */
+    void breakStructure() {
+        Function *F = module->getFunction("select");
+        auto *phi = cast<PHINode>(&F->back().front());
+        BasicBlock *other = BasicBlock::Create(context, "other", F);
+        ReturnInst::Create(context, ConstantInt::get(Type::getInt32Ty(context), 0), other);
+        phi->setIncomingBlock(0, other);
+    }
+    
+    /**
+     * @brief Make @leaf return a value, which only the full verifier rejects
+     */
+    void breakTypes() {
+        Function *F = module->getFunction("leaf");
+        F->getEntryBlock().getTerminator()->eraseFromParent();
+        IRBuilder<> builder(&F->getEntryBlock());
+        builder.CreateRet(builder.getInt32(0));
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief Well-formed functions pass the structural checks
+ */
+TEST_F(PipelineVerifierTest, AcceptsWellFormedFunctions) {
+    std::string problem;
+    EXPECT_TRUE(obfuscator::checkFunctionStructure(*module->getFunction("select"), problem)) << problem;
+    EXPECT_TRUE(obfuscator::checkFunctionStructure(*module->getFunction("leaf"), problem)) << problem;
+}
+
+/**
+ * @brief A block without a terminator, a PHI node naming a non-predecessor are found
+ */
+TEST_F(PipelineVerifierTest, FindsStructuralProblems) {
+    std::string problem;
+    breakStructure();
+    EXPECT_FALSE(obfuscator::checkFunctionStructure(*module->getFunction("select"), problem));
+    EXPECT_NE(problem.find("not a predecessor"), std::string::npos) << problem;
+    
+    Function *leaf = module->getFunction("leaf");
+    leaf->getEntryBlock().getTerminator()->eraseFromParent();
+    EXPECT_FALSE(obfuscator::checkFunctionStructure(*leaf, problem));
+    EXPECT_NE(problem.find("does not end in a terminator"), std::string::npos) << problem;
+}
+
+/**
+ * @brief Structural problems stop the pipeline at the pass that caused them
+ */
+TEST_F(PipelineVerifierTest, StopsAfterStructurallyBrokenPass) {
+    PipelineVerifier verifier(VerifyLevel::Structural);
+    std::string errorMessage;
+    EXPECT_TRUE(verifier.check(*module, "first", errorMessage));
+    breakStructure();
+    EXPECT_FALSE(verifier.check(*module, "second", errorMessage));
+    EXPECT_NE(errorMessage.find("after 'second'"), std::string::npos) << errorMessage;
+}
+
+/**
+ * @brief The final tier verifies fully once, on the module the last pass left
+ */
+TEST_F(PipelineVerifierTest, FinalTierVerifiesLastModule) {
+    PipelineVerifier verifier(VerifyLevel::Final);
+    std::string errorMessage;
+    breakTypes();
+    EXPECT_TRUE(verifier.check(*module, "first", errorMessage));
+    EXPECT_TRUE(verifier.check(*module, "second", errorMessage));
+    EXPECT_FALSE(verifier.finish(errorMessage, module.get()));
+    EXPECT_NE(errorMessage.find("after 'second'"), std::string::npos) << errorMessage;
+    
+    // Without the module, as after a failed check, only queued checks count
+    PipelineVerifier stopped(VerifyLevel::Final);
+    EXPECT_TRUE(stopped.finish(errorMessage));
+}
+
+/**
+ * @brief The full tier reports the earliest pass whose result failed
+ */
+TEST_F(PipelineVerifierTest, FullTierReportsEarliestFailure) {
+    PipelineVerifier verifier(VerifyLevel::Full);
+    std::string errorMessage;
+    EXPECT_TRUE(verifier.check(*module, "first", errorMessage));
+    breakTypes();
+    EXPECT_TRUE(verifier.check(*module, "second", errorMessage));
+    EXPECT_TRUE(verifier.check(*module, "third", errorMessage));
+    EXPECT_FALSE(verifier.finish(errorMessage));
+    EXPECT_NE(errorMessage.find("after 'second'"), std::string::npos) << errorMessage;
+}
+
+/**
+ * @brief Verifiers of modules obfuscated in parallel share the worker pool
+ */
+TEST_F(PipelineVerifierTest, VerifiersShareWorkers) {
+    std::string errorMessage;
+    {
+        PipelineVerifier passing(VerifyLevel::Full);
+        PipelineVerifier failing(VerifyLevel::Full);
+        EXPECT_TRUE(passing.check(*module, "first", errorMessage));
+        breakTypes();
+        EXPECT_TRUE(failing.check(*module, "first", errorMessage));
+        EXPECT_TRUE(passing.finish(errorMessage)) << errorMessage;
+        EXPECT_FALSE(failing.finish(errorMessage));
+    }
+    
+    // Destroying a verifier with queued checks waits for its own
+    PipelineVerifier abandoned(VerifyLevel::Full);
+    EXPECT_TRUE(abandoned.check(*module, "first", errorMessage));
+}
+
+/**
+ * @brief The default level is the final tier
+ */
+TEST(PipelineVerifierLevelTest, DefaultsToFinalTier) {
+    EXPECT_EQ(obfuscator::getVerifyLevel(), VerifyLevel::Final);
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
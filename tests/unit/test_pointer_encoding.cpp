@@ -0,0 +1,356 @@
+/**
+ * @file test_pointer_encoding.cpp
+ * @brief Unit tests for the pointer encoding pass
+ * 
+ * Runs the pass on a small linked list, checks that no pointer reaches
+ * its links in the clear and that the walk decodes each link once,
+ * then compiles the list to x86-64 with and without the pass and runs
+ * both on the same inputs.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+#include "utils/codegen_utils.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+using namespace llvm;
+
+namespace {
+
+/// A list walk that reloads its head and each link, the code building
+/// the list on the stack, a calloc'd node, and an internal pointer global
+const char *const kListModule = R"(
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.Node = type { i64, ptr }
+%struct.List = type { ptr, i64 }
+
+@last = internal global ptr null
+
+declare ptr @calloc(i64, i64)
+
+define internal i64 @sum(ptr %list) {
+entry:
+  %head = load ptr, ptr %list
+  %countp = getelementptr inbounds %struct.List, ptr %list, i32 0, i32 1
+  %count = load i64, ptr %countp
+  %empty = icmp eq ptr %head, null
+  br i1 %empty, label %done, label %preheader
+preheader:
+  br label %loop
+loop:
+  %p = phi ptr [ %head, %preheader ], [ %again, %loop ]
+  %acc = phi i64 [ %count, %preheader ], [ %acc.next, %loop ]
+  %first = load ptr, ptr %list
+  %isfirst = icmp eq ptr %p, %first
+  %bonus = select i1 %isfirst, i64 100, i64 0
+  %vp = getelementptr inbounds %struct.Node, ptr %p, i32 0, i32 0
+  %v = load i64, ptr %vp
+  %np = getelementptr inbounds %struct.Node, ptr %p, i32 0, i32 1
+  %next = load ptr, ptr %np
+  %again = load ptr, ptr %np
+  %acc.v = add i64 %acc, %v
+  %acc.next = add i64 %acc.v, %bonus
+  %end = icmp eq ptr %next, null
+  br i1 %end, label %done, label %loop
+done:
+  %r = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  ret i64 %r
+}
+
+define i64 @run(i64 %a, i64 %b, i64 %c) {
+entry:
+  %list = alloca %struct.List
+  %n1 = alloca %struct.Node
+  %n2 = alloca %struct.Node
+  %n3 = alloca %struct.Node
+  %v1 = getelementptr inbounds %struct.Node, ptr %n1, i32 0, i32 0
+  store i64 %a, ptr %v1
+  %v2 = getelementptr inbounds %struct.Node, ptr %n2, i32 0, i32 0
+  store i64 %b, ptr %v2
+  %v3 = getelementptr inbounds %struct.Node, ptr %n3, i32 0, i32 0
+  store i64 %c, ptr %v3
+  %l1 = getelementptr inbounds %struct.Node, ptr %n1, i32 0, i32 1
+  store ptr %n2, ptr %l1
+  %l2 = getelementptr inbounds %struct.Node, ptr %n2, i32 0, i32 1
+  store ptr %n3, ptr %l2
+  %l3 = getelementptr inbounds %struct.Node, ptr %n3, i32 0, i32 1
+  store ptr null, ptr %l3
+  store ptr %n1, ptr %list
+  %cp = getelementptr inbounds %struct.List, ptr %list, i32 0, i32 1
+  store i64 3, ptr %cp
+  %s = call i64 @sum(ptr %list)
+  ret i64 %s
+}
+
+define i64 @fresh(i64 %v) {
+entry:
+  %node = call ptr @calloc(i64 1, i64 16)
+  %vp = getelementptr inbounds %struct.Node, ptr %node, i32 0, i32 0
+  store i64 %v, ptr %vp
+  %list = alloca %struct.List
+  store ptr %node, ptr %list
+  %cp = getelementptr inbounds %struct.List, ptr %list, i32 0, i32 1
+  store i64 1, ptr %cp
+  %s = call i64 @sum(ptr %list)
+  ret i64 %s
+}
+
+define ptr @remember(ptr %p) {
+entry:
+  %old = load ptr, ptr @last
+  store ptr %p, ptr @last
+  ret ptr %old
+}
+)";
+
+uint64_t referenceRun(uint64_t a, uint64_t b, uint64_t c) {
+    return 3 + a + b + c + 100;
+}
+
+/**
+ * @class PointerEncodingTest
+ * @brief Test fixture running the pass on the list module
+ */
+class PointerEncodingTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmPrinters();
+
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        parseModule();
+    }
+    
+    void TearDown() override {
+        for (auto &code : loaded) {
+            munmap(code.first, code.second);
+        }
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the list module
+     */
+    void parseModule() {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kListModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Run the pass through the new pass manager
+     */
+    void runPass() {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, "pointer-encoding");
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+    }
+    
+    /**
+     * @brief Compile the module and load the code of @run
+     * 
+     * Code generation rewrites the module in place; parse it again
+     * before running the pass on it.
+     * 
+     * @return Entry point of @run
+     */
+    uint64_t (*compileRun())(uint64_t, uint64_t, uint64_t) {
+        SmallString<128> path;
+        EXPECT_FALSE(sys::fs::createTemporaryFile("pointer-encoding", "o", path));
+        std::string error;
+        bool emitted = obfuscator::emitObjectFile(*module, path, error);
+        auto buffer = MemoryBuffer::getFile(path);
+        sys::fs::remove(path);
+        EXPECT_TRUE(emitted) << error;
+        if (!emitted || !buffer) {
+            return nullptr;
+        }
+        
+        auto object = object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+        if (!object) {
+            ADD_FAILURE() << toString(object.takeError());
+            return nullptr;
+        }
+        for (const object::SectionRef &section : (*object)->sections()) {
+            Expected<StringRef> contents = section.getContents();
+            if (!section.isText() || !contents) {
+                continue;
+            }
+            
+            // @run and @sum use only the stack; the relocations of
+            // @fresh and @remember are left unresolved and never run
+            size_t size = std::max<size_t>(contents->size(), 1);
+            void *code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            EXPECT_NE(code, MAP_FAILED);
+            memcpy(code, contents->data(), contents->size());
+            EXPECT_EQ(mprotect(code, size, PROT_READ | PROT_EXEC), 0);
+            loaded.push_back({code, size});
+            
+            for (const object::SymbolRef &symbol : (*object)->symbols()) {
+                Expected<StringRef> name = symbol.getName();
+                Expected<uint64_t> address = symbol.getAddress();
+                if (name && address && *name == "run") {
+                    return reinterpret_cast<uint64_t (*)(uint64_t, uint64_t, uint64_t)>(
+                        static_cast<char*>(code) + (*address - section.getAddress()));
+                }
+            }
+        }
+        ADD_FAILURE() << "no code for @run";
+        return nullptr;
+    }
+    
+    LLVMContext context;
+    std::unique_ptr<Module> module;
+    std::vector<std::pair<void*, size_t>> loaded;
+};
+
+/**
+ * @brief Links, the list head and the global hold no plain pointers
+ */
+TEST_F(PointerEncodingTest, NoPlainPointersInMemory) {
+    runPass();
+    
+    for (Function &F : *module) {
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                Type *accessType = nullptr;
+                if (auto *load = dyn_cast<LoadInst>(&I)) {
+                    accessType = load->getType();
+                } else if (auto *store = dyn_cast<StoreInst>(&I)) {
+                    accessType = store->getValueOperand()->getType();
+                }
+                EXPECT_FALSE(accessType && accessType->isPointerTy())
+                    << "plain pointer access in " << F.getName().str();
+            }
+        }
+    }
+    GlobalVariable *last = module->getGlobalVariable("last", true);
+    ASSERT_TRUE(last);
+    EXPECT_FALSE(last->getInitializer()->isNullValue()) << "null must be stored encoded too";
+}
+
+/**
+ * @brief The walk decodes each link once and its head before the loop
+ */
+TEST_F(PointerEncodingTest, DecodesOncePerValue) {
+    runPass();
+    
+    Function *sum = module->getFunction("sum");
+    DominatorTree DT(*sum);
+    LoopInfo LI(DT);
+    ASSERT_EQ(LI.getTopLevelLoops().size(), 1u);
+    unsigned loads = 0, decodes = 0;
+    for (BasicBlock *BB : LI.getTopLevelLoops().front()->blocks()) {
+        for (Instruction &I : *BB) {
+            loads += isa<LoadInst>(I);
+            if (auto *intrinsic = dyn_cast<IntrinsicInst>(&I)) {
+                decodes += intrinsic->getIntrinsicID() == Intrinsic::fshr;
+            }
+        }
+    }
+    // The value and the link; the head reload is hoisted and the
+    // second link load merged
+    EXPECT_EQ(loads, 2u);
+    EXPECT_EQ(decodes, 1u);
+}
+
+/**
+ * @brief A calloc'd link reads back as null without a check on every load
+ */
+TEST_F(PointerEncodingTest, ZeroFilledLinksReadAsNull) {
+    runPass();
+    
+    for (Function &F : *module) {
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                EXPECT_FALSE(isa<SelectInst>(I) && I.getType()->isPointerTy())
+                    << "decode in " << F.getName().str() << " checks for null";
+            }
+        }
+    }
+    
+    // calloc is followed by a store of the encoded null link
+    Function *fresh = module->getFunction("fresh");
+    bool storesNull = false;
+    for (BasicBlock &BB : *fresh) {
+        for (Instruction &I : BB) {
+            auto *store = dyn_cast<StoreInst>(&I);
+            storesNull |= store && isa<ConstantInt>(store->getValueOperand()) &&
+                          !cast<ConstantInt>(store->getValueOperand())->isZero() &&
+                          isa<GetElementPtrInst>(store->getPointerOperand());
+        }
+    }
+    EXPECT_TRUE(storesNull);
+}
+
+/**
+ * @brief The encoded list computes the same results
+ */
+TEST_F(PointerEncodingTest, ComputesSameResults) {
+#if !defined(__x86_64__)
+    GTEST_SKIP() << "runs x86-64 code";
+#endif
+    auto *plain = compileRun();
+    parseModule();
+    runPass();
+    auto *encoded = compileRun();
+    ASSERT_TRUE(plain && encoded);
+    
+    std::mt19937_64 random(42);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t a = random(), b = random(), c = random();
+        ASSERT_EQ(plain(a, b, c), referenceRun(a, b, c));
+        ASSERT_EQ(encoded(a, b, c), referenceRun(a, b, c));
+    }
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,389 @@
+/**
+ * @file test_string_encryption.cpp
+ * @brief Unit tests for the string encryption pass
+ * 
+ * Runs the pass on a module using literals in straight-line code, a
+ * loop and two functions, checks that no literal is left in plain text,
+ * where the checks before the uses go and how the literals are laid out
+ * in pages, then runs the functions in a JIT linked against the runtime.
+ * Uses in blocks the entry does not reach get no check.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+#include "runtime/obfuscation_runtime.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+/// A literal compared once, one counted in a loop, one shared by two
+/// functions, and a function using two
+const char *const kStringModule = R"(
+@.greeting = private unnamed_addr constant [14 x i8] c"hello, world!\00"
+@.word = private unnamed_addr constant [5 x i8] c"tick\00"
+@.shared = private unnamed_addr constant [7 x i8] c"shared\00"
+
+declare i32 @strcmp(ptr, ptr)
+declare i64 @strlen(ptr)
+
+define i32 @greet(ptr %s) {
+entry:
+  %r = call i32 @strcmp(ptr @.greeting, ptr %s)
+  ret i32 %r
+}
+
+define i64 @count(i64 %n) {
+entry:
+  %empty = icmp eq i64 %n, 0
+  br i1 %empty, label %done, label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  %len = call i64 @strlen(ptr @.word)
+  %acc.next = add i64 %acc, %len
+  %i.next = add i64 %i, 1
+  %more = icmp ult i64 %i.next, %n
+  br i1 %more, label %loop, label %done
+done:
+  %r = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  ret i64 %r
+}
+
+define i32 @same(ptr %s) {
+entry:
+  %r = call i32 @strcmp(ptr %s, ptr @.shared)
+  ret i32 %r
+}
+
+define i64 @length() {
+entry:
+  %tail = getelementptr inbounds [7 x i8], ptr @.shared, i64 0, i64 2
+  %r = call i64 @strlen(ptr %tail)
+  ret i64 %r
+}
+
+define i64 @both() {
+entry:
+  %a = call i64 @strlen(ptr @.greeting)
+  %b = call i64 @strlen(ptr @.word)
+  %r = add i64 %a, %b
+  ret i64 %r
+}
+)";
+
+/// Literals passed to puts from blocks the entry does not reach
+const char *const kUnreachableModule = R"(
+@.orphan = private unnamed_addr constant [7 x i8] c"orphan\00"
+@.mixed = private unnamed_addr constant [6 x i8] c"mixed\00"
+
+declare i32 @puts(ptr)
+
+define void @dead() {
+entry:
+  ret void
+never:
+  %r = call i32 @puts(ptr @.orphan)
+  ret void
+}
+
+define void @partly(i1 %c) {
+entry:
+  br i1 %c, label %live, label %exit
+live:
+  %r = call i32 @puts(ptr @.mixed)
+  br label %exit
+never:
+  %s = call i32 @puts(ptr @.mixed)
+  br label %exit
+exit:
+  ret void
+}
+)";
+
+/**
+ * @class StringEncryptionTest
+ * @brief Test fixture running the pass on the module
+ */
+class StringEncryptionTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        
+        context = std::make_unique<LLVMContext>();
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context->enableOpaquePointers();
+#endif
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kStringModule, diagnostic, *context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    void TearDown() override {
+        setPageSize(nullptr);
+    }
+    
+    /**
+     * @brief Override the page size as -string-encryption-page-size would
+     * @param value Page size, or null to drop the override
+     */
+    void setPageSize(const char *value) {
+        auto *option = static_cast<cl::opt<unsigned>*>(
+            cl::getRegisteredOptions().lookup("string-encryption-page-size"));
+        ASSERT_NE(option, nullptr);
+        if (value) {
+            ASSERT_FALSE(option->addOccurrence(0, "string-encryption-page-size", value));
+        } else {
+            option->reset();
+        }
+    }
+    
+    /**
+     * @brief Run the pass through the new pass manager
+     */
+    void run() {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, "string-encryption");
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+    }
+    
+    /**
+     * @brief Find the calls to the runtime's __obf_init_run in a function
+     * @param name Function name
+     * @return The calls
+     */
+    std::vector<CallInst*> findInitCalls(StringRef name) {
+        std::vector<CallInst*> calls;
+        for (BasicBlock &BB : *module->getFunction(name)) {
+            for (Instruction &I : BB) {
+                auto *call = dyn_cast<CallInst>(&I);
+                if (call && call->getCalledFunction() &&
+                    call->getCalledFunction()->getName() == "__obf_init_run") {
+                    calls.push_back(call);
+                }
+            }
+        }
+        return calls;
+    }
+    
+    /**
+     * @brief Run the functions in a JIT linked against the runtime
+     */
+    void checkInJit() {
+        auto jit = orc::LLJITBuilder().create();
+        ASSERT_TRUE(!!jit) << toString(jit.takeError());
+        orc::JITDylib &library = (*jit)->getMainJITDylib();
+        library.addGenerator(cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            (*jit)->getDataLayout().getGlobalPrefix())));
+        orc::SymbolMap runtime;
+        runtime[(*jit)->mangleAndIntern("__obf_init_run")] = JITEvaluatedSymbol::fromPointer(&__obf_init_run);
+        runtime[(*jit)->mangleAndIntern("__obf_decrypt_strings")] =
+            JITEvaluatedSymbol::fromPointer(&__obf_decrypt_strings);
+        ASSERT_FALSE(library.define(orc::absoluteSymbols(runtime)));
+        ASSERT_FALSE((*jit)->addIRModule(orc::ThreadSafeModule(std::move(module), std::move(context))));
+        
+        auto lookup = [&](StringRef name) -> void* {
+            auto symbol = (*jit)->lookup(name);
+            if (!symbol) {
+                ADD_FAILURE() << toString(symbol.takeError());
+                return nullptr;
+            }
+#if LLVM_VERSION_MAJOR >= 15
+            return symbol->toPtr<void*>();
+#else
+            return reinterpret_cast<void*>(symbol->getAddress());
+#endif
+        };
+        auto greet = reinterpret_cast<int (*)(const char*)>(lookup("greet"));
+        auto count = reinterpret_cast<uint64_t (*)(uint64_t)>(lookup("count"));
+        auto same = reinterpret_cast<int (*)(const char*)>(lookup("same"));
+        auto length = reinterpret_cast<uint64_t (*)()>(lookup("length"));
+        auto both = reinterpret_cast<uint64_t (*)()>(lookup("both"));
+        ASSERT_TRUE(greet && count && same && length && both);
+        
+        EXPECT_EQ(count(3), 12u);
+        EXPECT_EQ(greet("hello, world!"), 0);
+        EXPECT_NE(greet("hello"), 0);
+        EXPECT_EQ(same("shared"), 0);
+        EXPECT_EQ(length(), 4u);
+        EXPECT_EQ(count(0), 0u);
+        EXPECT_EQ(both(), 17u);
+    }
+    
+    std::unique_ptr<LLVMContext> context;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief No literal is left in plain text, and the task is registered
+ */
+TEST_F(StringEncryptionTest, EncryptsLiterals) {
+    run();
+    for (const char *name : {".greeting", ".word", ".shared"}) {
+        GlobalVariable *gv = module->getNamedGlobal(name);
+        ASSERT_NE(gv, nullptr) << name;
+        EXPECT_FALSE(gv->isConstant()) << name;
+    }
+    std::string text;
+    raw_string_ostream(text) << *module;
+    for (const char *plain : {"c\"hello, world!", "c\"tick", "c\"shared"}) {
+        EXPECT_EQ(text.find(plain), std::string::npos) << plain << " left in plain text";
+    }
+    
+    GlobalVariable *task = module->getNamedGlobal("obf.strings.init");
+    ASSERT_NE(task, nullptr);
+    EXPECT_EQ(task->getSection(), "obf_init");
+    auto *init = cast<ConstantStruct>(task->getInitializer());
+    EXPECT_EQ(cast<ConstantInt>(init->getOperand(3))->getZExtValue(), static_cast<uint64_t>(OBF_INIT_LAZY));
+    EXPECT_EQ(cast<ConstantInt>(init->getOperand(4))->getZExtValue(), static_cast<uint64_t>(OBF_INIT_PENDING));
+}
+
+/**
+ * @brief Each function checks once, ahead of its uses and outside loops
+ */
+TEST_F(StringEncryptionTest, ChecksOncePerFunction) {
+    run();
+    for (const char *name : {"greet", "count", "same", "length", "both"}) {
+        std::vector<CallInst*> calls = findInitCalls(name);
+        ASSERT_EQ(calls.size(), 1u) << name;
+        
+        Function &F = *module->getFunction(name);
+        DominatorTree DT(F);
+        LoopInfo LI(DT);
+        BasicBlock *check = calls.front()->getParent()->getSinglePredecessor();
+        ASSERT_NE(check, nullptr) << name;
+        EXPECT_EQ(LI.getLoopFor(check), nullptr) << name;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                auto *call = dyn_cast<CallInst>(&I);
+                if (call && call != calls.front() && call->getCalledFunction()->getName().startswith("str")) {
+                    EXPECT_TRUE(DT.dominates(check, call->getParent())) << name;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Literals fill pages in the string section, a task each, and a
+ * function checks the task of every page it uses
+ */
+TEST_F(StringEncryptionTest, PlacesCiphertextInPages) {
+    // .greeting (14 bytes) fills a page; .word (5) and .shared (7) share the next
+    setPageSize("16");
+    module->setTargetTriple("x86_64-unknown-linux-gnu");
+    run();
+    
+    GlobalVariable *greeting = module->getNamedGlobal(".greeting");
+    GlobalVariable *word = module->getNamedGlobal(".word");
+    GlobalVariable *shared = module->getNamedGlobal(".shared");
+    for (GlobalVariable *gv : {greeting, word, shared}) {
+        EXPECT_EQ(gv->getSection(), "obf_strings") << gv->getName().str();
+    }
+    EXPECT_EQ(greeting->getAlign().valueOrOne().value(), 16u);
+    EXPECT_EQ(word->getAlign().valueOrOne().value(), 16u);
+    EXPECT_EQ(std::next(word->getIterator()), shared->getIterator());
+    
+    unsigned tasks = 0;
+    for (GlobalVariable &gv : module->globals()) {
+        tasks += gv.getSection() == "obf_init";
+    }
+    EXPECT_EQ(tasks, 2u);
+    
+    auto taskOf = [&](StringRef name) -> Value* {
+        std::vector<CallInst*> calls = findInitCalls(name);
+        return calls.size() == 1 ? calls.front()->getArgOperand(0)->stripPointerCasts() : nullptr;
+    };
+    ASSERT_NE(taskOf("greet"), nullptr);
+    ASSERT_NE(taskOf("count"), nullptr);
+    EXPECT_NE(taskOf("greet"), taskOf("count"));
+    EXPECT_EQ(taskOf("same"), taskOf("count"));
+    EXPECT_EQ(taskOf("length"), taskOf("count"));
+    
+    std::vector<CallInst*> both = findInitCalls("both");
+    ASSERT_EQ(both.size(), 2u);
+    EXPECT_NE(both[0]->getArgOperand(0)->stripPointerCasts(), both[1]->getArgOperand(0)->stripPointerCasts());
+}
+
+/**
+ * @brief The functions see the decrypted literals
+ */
+TEST_F(StringEncryptionTest, DecryptsBeforeFirstUse) {
+    run();
+    checkInJit();
+}
+
+/**
+ * @brief Each page is decrypted by its own task, whichever function runs first
+ */
+TEST_F(StringEncryptionTest, DecryptsPagesSeparately) {
+    setPageSize("16");
+    run();
+    checkInJit();
+}
+
+/**
+ * @brief Uses in unreachable blocks need no check and do not place one
+ */
+TEST_F(StringEncryptionTest, SkipsUnreachableUses) {
+    SMDiagnostic diagnostic;
+    module = parseAssemblyString(kUnreachableModule, diagnostic, *context);
+    ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    run();
+    
+    EXPECT_TRUE(findInitCalls("dead").empty());
+    std::vector<CallInst*> calls = findInitCalls("partly");
+    ASSERT_EQ(calls.size(), 1u);
+    Function &F = *module->getFunction("partly");
+    DominatorTree DT(F);
+    BasicBlock *check = calls.front()->getParent()->getSinglePredecessor();
+    ASSERT_NE(check, nullptr);
+    for (BasicBlock &BB : F) {
+        if (BB.getName() == "live") {
+            EXPECT_TRUE(DT.dominates(check, &BB));
+        }
+    }
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,273 @@
+/**
+ * @file test_struct_layout.cpp
+ * @brief Unit tests for the struct layout pass and its escape analysis
+ * 
+ * Checks that accesses through an object pointer of another type than
+ * field 0, and memsets of part of an object, keep a struct's layout,
+ * and that memsets of whole objects follow the new size. The remark of
+ * a reordered struct reports its cache lines before and after.
+ */
+
+#include <gtest/gtest.h>
+#include "passes/pass_plugin.h"
+#include "utils/obfuscation_plan.h"
+#include "utils/struct_escape_analysis.h"
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <map>
+#include <memory>
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+/// %wide is read as an i64 through its object pointer, %narrow as its
+/// field 0; %whole is cleared by a memset, %part half of it
+const char *const kLayoutModule = R"(
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+%wide = type { i32, i32, i64 }
+%narrow = type { i32, i32, i64 }
+%whole = type { i8, i64, i8 }
+%part = type { i8, i64, i8 }
+
+declare void @llvm.memset.p0.i64(ptr, i8, i64, i1)
+
+define i64 @readWide() {
+entry:
+  %p = alloca %wide
+  %f1 = getelementptr inbounds %wide, ptr %p, i32 0, i32 1
+  store i32 3, ptr %f1
+  %f2 = getelementptr inbounds %wide, ptr %p, i32 0, i32 2
+  store i64 7, ptr %f2
+  %v = load i64, ptr %p
+  ret i64 %v
+}
+
+define i32 @readNarrow() {
+entry:
+  %p = alloca %narrow
+  %f1 = getelementptr inbounds %narrow, ptr %p, i32 0, i32 1
+  store i32 3, ptr %f1
+  %f2 = getelementptr inbounds %narrow, ptr %p, i32 0, i32 2
+  store i64 7, ptr %f2
+  store i32 5, ptr %p
+  %v = load i32, ptr %p
+  ret i32 %v
+}
+
+define i8 @clearWhole() {
+entry:
+  %p = alloca %whole
+  call void @llvm.memset.p0.i64(ptr %p, i8 0, i64 24, i1 false)
+  %f2 = getelementptr inbounds %whole, ptr %p, i32 0, i32 2
+  %v = load i8, ptr %f2
+  ret i8 %v
+}
+
+define i8 @clearPart() {
+entry:
+  %p = alloca %part
+  call void @llvm.memset.p0.i64(ptr %p, i8 0, i64 12, i1 false)
+  %f2 = getelementptr inbounds %part, ptr %p, i32 0, i32 2
+  %v = load i8, ptr %f2
+  ret i8 %v
+}
+)";
+
+/**
+ * @struct ReorderedRemarks
+ * @brief Diagnostic handler keeping the arguments of the Reordered remarks
+ */
+struct ReorderedRemarks : public DiagnosticHandler {
+    bool handleDiagnostics(const DiagnosticInfo &info) override {
+        auto *remark = dyn_cast<DiagnosticInfoOptimizationBase>(&info);
+        if (remark && remark->getRemarkName() == "Reordered") {
+            std::map<std::string, std::string> args;
+            for (const DiagnosticInfoOptimizationBase::Argument &arg : remark->getArgs()) {
+                args[arg.Key] = arg.Val;
+            }
+            byStruct[args["Struct"]] = args;
+        }
+        return true;
+    }
+    bool isPassedOptRemarkEnabled(StringRef) const override { return true; }
+    bool isAnyRemarkEnabled() const override { return true; }
+    
+    /// Arguments of the remark, by struct name
+    std::map<std::string, std::map<std::string, std::string>> byStruct;
+};
+
+/**
+ * @class StructLayoutTest
+ * @brief Test fixture parsing the module
+ */
+class StructLayoutTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+#if LLVM_VERSION_MAJOR < 15
+        // The module is written with opaque pointers, the default since 15
+        context.enableOpaquePointers();
+#endif
+        auto handler = std::make_unique<ReorderedRemarks>();
+        remarks = handler.get();
+        context.setDiagnosticHandler(std::move(handler));
+        parseModule();
+    }
+    
+    /**
+     * @brief Parse a fresh copy of the module
+     */
+    void parseModule() {
+        SMDiagnostic diagnostic;
+        module = parseAssemblyString(kLayoutModule, diagnostic, context);
+        ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    }
+    
+    /**
+     * @brief Run the pass through the new pass manager
+     */
+    void run() {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        obfuscator::registerObfuscationPasses(PB);
+        
+        ModulePassManager MPM;
+        Error error = PB.parsePassPipeline(MPM, "struct-layout");
+        ASSERT_FALSE(error) << toString(std::move(error));
+        MPM.run(*module, MAM);
+        ASSERT_FALSE(verifyModule(*module, &errs()));
+    }
+    
+    /**
+     * @brief Check if the pass gave a struct a new layout
+     * @param name Struct name
+     * @return true if the old type was renamed
+     */
+    bool reordered(StringRef name) {
+        return StructType::getTypeByName(context, (name + ".orig").str()) != nullptr;
+    }
+    
+    LLVMContext context;
+    ReorderedRemarks *remarks = nullptr;
+    std::unique_ptr<Module> module;
+};
+
+/**
+ * @brief A load through the object pointer of another type than field 0 keeps the layout
+ */
+TEST_F(StructLayoutTest, KeepsStructsReadWiderThanFieldZero) {
+    obfuscator::StructEscapeAnalysis analysis(*module);
+    EXPECT_FALSE(analysis.isNonEscaping(StructType::getTypeByName(context, "wide")));
+    EXPECT_TRUE(analysis.isNonEscaping(StructType::getTypeByName(context, "narrow")));
+    
+    run();
+    EXPECT_FALSE(reordered("wide"));
+    ASSERT_TRUE(reordered("narrow"));
+    
+    // Field 0 of %narrow is still what the i32 accesses reach
+    StructType *narrow = StructType::getTypeByName(context, "narrow");
+    for (Instruction &I : module->getFunction("readNarrow")->getEntryBlock()) {
+        if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+            Value *pointer = getLoadStorePointerOperand(&I);
+            auto *gep = dyn_cast<GetElementPtrInst>(pointer);
+            if (!gep) {
+                EXPECT_EQ(narrow->getElementType(0), Type::getInt32Ty(context));
+                continue;
+            }
+            unsigned field = cast<ConstantInt>(gep->getOperand(2))->getZExtValue();
+            EXPECT_EQ(narrow->getElementType(field), getLoadStoreType(&I));
+        }
+    }
+}
+
+/**
+ * @brief memsets of whole objects take the new size; of part, keep the layout
+ */
+TEST_F(StructLayoutTest, ResizesWholeObjectFills) {
+    obfuscator::StructEscapeAnalysis analysis(*module);
+    EXPECT_TRUE(analysis.isNonEscaping(StructType::getTypeByName(context, "whole")));
+    EXPECT_FALSE(analysis.isNonEscaping(StructType::getTypeByName(context, "part")));
+    
+    run();
+    EXPECT_FALSE(reordered("part"));
+    ASSERT_TRUE(reordered("whole"));
+    
+    uint64_t size = module->getDataLayout().getTypeAllocSize(StructType::getTypeByName(context, "whole"));
+    for (Instruction &I : module->getFunction("clearWhole")->getEntryBlock()) {
+        if (auto *fill = dyn_cast<MemSetInst>(&I)) {
+            EXPECT_EQ(cast<ConstantInt>(fill->getLength())->getZExtValue(), size);
+        }
+    }
+    for (Instruction &I : module->getFunction("clearPart")->getEntryBlock()) {
+        if (auto *fill = dyn_cast<MemSetInst>(&I)) {
+            EXPECT_EQ(cast<ConstantInt>(fill->getLength())->getZExtValue(), 12u);
+        }
+    }
+}
+
+/**
+ * @brief The remark reports the cache lines of the struct and of its hot fields
+ */
+TEST_F(StructLayoutTest, ReportsCacheLines) {
+    obfuscator::ObfuscationPlan plan;
+    obfuscator::attachPlan(*module, plan, obfuscator::PlanMode::Record);
+    run();
+    obfuscator::detachPlan(*module);
+    ASSERT_TRUE(remarks->byStruct.count("narrow"));
+    std::map<std::string, std::string> &recorded = remarks->byStruct["narrow"];
+    for (const char *key : {"OldLines", "NewLines", "HotFields", "OldHotLines", "NewHotLines"}) {
+        EXPECT_TRUE(recorded.count(key)) << key;
+    }
+    EXPECT_EQ(recorded["OldLines"], "1");
+    EXPECT_EQ(recorded["NewLines"], "1");
+    
+    // A replayed order has no profile behind it: only the totals. In a
+    // context of its own, where the structs still have their names
+    LLVMContext replayContext;
+#if LLVM_VERSION_MAJOR < 15
+    replayContext.enableOpaquePointers();
+#endif
+    auto handler = std::make_unique<ReorderedRemarks>();
+    ReorderedRemarks *replayRemarks = handler.get();
+    replayContext.setDiagnosticHandler(std::move(handler));
+    SMDiagnostic diagnostic;
+    module = parseAssemblyString(kLayoutModule, diagnostic, replayContext);
+    ASSERT_TRUE(module) << diagnostic.getMessage().str();
+    obfuscator::attachPlan(*module, plan, obfuscator::PlanMode::Replay);
+    run();
+    obfuscator::detachPlan(*module);
+    module.reset();
+    ASSERT_TRUE(replayRemarks->byStruct.count("narrow"));
+    std::map<std::string, std::string> &replayed = replayRemarks->byStruct["narrow"];
+    EXPECT_EQ(replayed["OldLines"], "1");
+    EXPECT_EQ(replayed["NewLines"], "1");
+    EXPECT_FALSE(replayed.count("OldHotLines"));
+}
+
+} // anonymous namespace
+
+// Test main function
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}